@@ -4,567 +4,4492 @@
 #include <ncurses.h>
 #include <math.h>
 #include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
-typedef struct Node {
-    char token[32];       // store token (operand or operator) as string
-    struct Node* next;
-} Node;
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
-typedef struct Stack {
-    Node* top;
-    int size;
-} Stack;
+#define STACK_INITIAL_CAPACITY 16
 
-void init_stack(Stack* s) {
-    s->top = NULL;
-    s->size = 0;
-}
+// Set once initscr() has run; headless modes never touch ncurses
+int tui_active = 0;
 
-int is_empty(Stack* s) {
-    return s->top == NULL;
-}
+// Per-thread count of checked_realloc calls and bytes requested, read by
+// the benchmarks to report allocations per operation
+_Thread_local unsigned long long alloc_calls = 0;
+_Thread_local unsigned long long alloc_bytes = 0;
 
-void push(Stack* s, const char* token) {
-    Node* node = (Node*)malloc(sizeof(Node));
-    if (node == NULL) {
+void* checked_realloc(void* ptr, size_t size) {
+    alloc_calls++;
+    alloc_bytes += size;
+    void* p = realloc(ptr, size);
+    if (p == NULL) {
+        if (tui_active) endwin();
         fprintf(stderr, "Memory allocation error\n");
-        endwin();
         exit(EXIT_FAILURE);
     }
-    strncpy(node->token, token, 31);
-    node->token[31] = '\0';
-    node->next = s->top;
-    s->top = node;
-    s->size++;
+    return p;
 }
 
-char* pop(Stack* s, int* error) {
-    if (is_empty(s)) {
-        *error = 1;
-        return NULL;
+// Bump allocator over a chain of blocks. arena_alloc is a pointer bump;
+// arena_reset and arena_rewind release everything (or everything since a
+// mark) in O(1) and keep the blocks for reuse, so a warmed-up arena never
+// calls malloc. Not thread-safe: each thread or owner has its own.
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;            // usable bytes after the header
+    size_t used;
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock* first;
+    ArenaBlock* cur;        // blocks after cur are free
+    size_t min_block;       // 0 means ARENA_DEFAULT_BLOCK
+    unsigned long long allocs;
+    unsigned long long bytes;
+    unsigned long long blocks;
+} Arena;
+
+typedef struct ArenaMark {
+    ArenaBlock* block;
+    size_t used;
+} ArenaMark;
+
+#define ARENA_DEFAULT_BLOCK 4096
+#define ARENA_HEADER ((sizeof(ArenaBlock) + 15) & ~(size_t)15)
+
+// Scratch arena of the calling thread for temporaries that outgrow the
+// fixed local buffers; users take a mark and rewind to it when done
+_Thread_local Arena thread_arena;
+
+void* arena_alloc(Arena* a, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    a->allocs++;
+    a->bytes += size;
+    if (a->cur && a->cur->size - a->cur->used >= size) {
+        void* p = (char*)a->cur + ARENA_HEADER + a->cur->used;
+        a->cur->used += size;
+        return p;
     }
-    Node* temp = s->top;
-    char* val = strdup(temp->token);
-    s->top = temp->next;
-    free(temp);
-    s->size--;
-    *error = 0;
-    return val;
-}
 
-char* peek(Stack* s, int* error) {
-    if (is_empty(s)) {
-        *error = 1;
-        return NULL;
+    ArenaBlock* next = a->cur ? a->cur->next : a->first;
+    if (next == NULL || next->size < size) {
+        size_t block = a->min_block ? a->min_block : ARENA_DEFAULT_BLOCK;
+        if (a->cur && a->cur->size * 2 > block) block = a->cur->size * 2;
+        if (block < size) block = size;
+        ArenaBlock* b = (ArenaBlock*)checked_realloc(NULL, ARENA_HEADER + block);
+        b->size = block;
+        b->next = next;
+        if (a->cur) a->cur->next = b;
+        else a->first = b;
+        a->blocks++;
+        next = b;
     }
-    *error = 0;
-    return s->top->token;
+    a->cur = next;
+    a->cur->used = size;
+    return (char*)a->cur + ARENA_HEADER;
 }
 
-int is_operator_char(char c) {
-    return (c == '+' || c == '-' || c == '*' || c == '/' || c == '^');
+ArenaMark arena_mark(const Arena* a) {
+    ArenaMark m;
+    m.block = a->cur;
+    m.used = a->cur ? a->cur->used : 0;
+    return m;
 }
 
-int precedence(char c) {
-    if (c == '^') return 3;
-    if (c == '*' || c == '/') return 2;
-    if (c == '+' || c == '-') return 1;
-    return 0;
+void arena_rewind(Arena* a, ArenaMark m) {
+    a->cur = m.block;
+    if (a->cur) a->cur->used = m.used;
 }
 
-// Append a token to postfix with space, ensuring no overflow
-void append_postfix(char* postfix, const char* token, int max_len) {
-    if (strlen(postfix) + strlen(token) + 2 < (size_t)max_len) {
-        strcat(postfix, token);
-        strcat(postfix, " ");
-    }
+void arena_reset(Arena* a) {
+    a->cur = NULL;
 }
 
-// Helper to print stack contents as space-separated tokens for infix->postfix trace display
-void print_stack_content(Stack* s, char* buffer, int max_len) {
-    buffer[0] = '\0';
-    Node* curr = s->top;
-    // Collect tokens from bottom to top for display to show stack bottom first
-    // So first push tokens onto array
-    #define MAX_STACK_DISPLAY 64
-    char* tokens[MAX_STACK_DISPLAY];
-    int count = 0;
-    while (curr && count < MAX_STACK_DISPLAY) {
-        tokens[count++] = curr->token;
-        curr = curr->next;
-    }
-    // Print in reverse (bottom to top)
-    for (int i = count - 1; i >= 0; i--) {
-        if (strlen(buffer) + strlen(tokens[i]) + 2 > (size_t)max_len) break;
-        strcat(buffer, tokens[i]);
-        strcat(buffer, " ");
-    }
+// Bytes held in blocks (used or not)
+size_t arena_capacity(const Arena* a) {
+    size_t total = 0;
+    for (ArenaBlock* b = a->first; b; b = b->next) total += ARENA_HEADER + b->size;
+    return total;
 }
 
-// Display infix to postfix conversion stepwise in message window.
-// User presses a key to proceed through each step.
-void infix_to_postfix_stepwise(const char* infix, WINDOW* msg_win) {
-    Stack op_stack;
-    init_stack(&op_stack);
-
-    char postfix[256] = "";
-    int i = 0;
-    int len = strlen(infix);
-
-    char stackbuf[128];
+void arena_free(Arena* a) {
+    ArenaBlock* b = a->first;
+    while (b) {
+        ArenaBlock* next = b->next;
+        free(b);
+        b = next;
+    }
+    a->first = NULL;
+    a->cur = NULL;
+}
 
-    werase(msg_win);
-    box(msg_win, 0, 0);
-    wattron(msg_win, COLOR_PAIR(5) | A_BOLD);
-    int width = getmaxx(msg_win);
-    mvwprintw(msg_win, 0, (width - 24)/2, " Infix to Postfix Trace ");
-    wattroff(msg_win, COLOR_PAIR(5) | A_BOLD);
 
-    mvwprintw(msg_win, 1, 2, "Input infix: %s", infix);
-    mvwprintw(msg_win, 3, 2, "Press any key to step through conversion.");
-    wrefresh(msg_win);
-    wgetch(msg_win);
+// Growable byte buffer; when fp is set, text_flush writes it out
+typedef struct TextBuf {
+    char* data;
+    size_t len;
+    size_t cap;
+    FILE* fp;
+} TextBuf;
 
-    while (i < len) {
-        // skip spaces
-        while (i < len && isspace(infix[i])) i++;
-        if (i >= len) break;
+void text_reserve(TextBuf* t, size_t extra) {
+    if (t->len + extra > t->cap) {
+        size_t cap = t->cap ? t->cap : 256;
+        while (cap < t->len + extra) cap *= 2;
+        t->data = (char*)checked_realloc(t->data, cap);
+        t->cap = cap;
+    }
+}
 
-        // Determine token: operand (multi-char variable or number) or operator / parenthesis
-        char token[32];
-        int tlen = 0;
+void text_append(TextBuf* t, const char* s, size_t n) {
+    if (n == 0) return;         // s and t->data may both be NULL
+    text_reserve(t, n);
+    memcpy(t->data + t->len, s, n);
+    t->len += n;
+}
 
-        if (isalpha(infix[i]) || isdigit(infix[i])) {
-            // operand: accumulate letters/digits/dot (for float support)
-            while (i < len && (isalnum(infix[i]) || infix[i] == '.')) {
-                if (tlen < 31) token[tlen++] = infix[i];
-                i++;
-            }
-            token[tlen] = '\0';
-            // Append operand to postfix
-            append_postfix(postfix, token, 255);
+void text_putc(TextBuf* t, char c) {
+    text_reserve(t, 1);
+    t->data[t->len++] = c;
+}
 
-            // Update display
-            werase(msg_win);
-            box(msg_win, 0, 0);
-            wattron(msg_win, COLOR_PAIR(5) | A_BOLD);
-            mvwprintw(msg_win, 0, (width - 24)/2, " Infix to Postfix Trace ");
-            wattroff(msg_win, COLOR_PAIR(5) | A_BOLD);
-
-            mvwprintw(msg_win, 1, 2, "Read operand: %s", token);
-            mvwprintw(msg_win, 2, 2, "Current postfix: %s", postfix);
-            print_stack_content(&op_stack, stackbuf, sizeof(stackbuf));
-            mvwprintw(msg_win, 3, 2, "Operator stack top-> %s", stackbuf);
-            mvwprintw(msg_win, 5, 2, "Press any key to continue...");
-            wrefresh(msg_win);
-            wgetch(msg_win);
-        } else {
-            // operator or parenthesis
-            char op = infix[i];
-            i++;
-            token[0] = op;
-            token[1] = '\0';
+void text_flush(TextBuf* t) {
+    if (t->fp && t->len) fwrite(t->data, 1, t->len, t->fp);
+    t->len = 0;
+}
 
-            if (op == '(') {
-                push(&op_stack, token);
+// Append a constant in the same format the UI displays numbers ("%.15g").
+// Integral values below 1e15 print identically as plain integers, which
+// avoids snprintf for the common case.
+void text_number(TextBuf* t, double num) {
+    char buf[32];
+    int n;
+    if (num > -1e15 && num < 1e15 && num == (double)(long long)num && !(num == 0 && signbit(num))) {
+        long long v = (long long)num;
+        unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+        n = sizeof(buf);
+        do {
+            buf[--n] = (char)('0' + u % 10);
+            u /= 10;
+        } while (u);
+        if (v < 0) buf[--n] = '-';
+        text_append(t, buf + n, sizeof(buf) - (size_t)n);
+        return;
+    }
+    n = snprintf(buf, sizeof(buf), "%.15g", num);
+    text_append(t, buf, (size_t)n);
+}
 
-                werase(msg_win);
-                box(msg_win, 0, 0);
-                wattron(msg_win, COLOR_PAIR(5) | A_BOLD);
-                mvwprintw(msg_win, 0, (width - 24)/2, " Infix to Postfix Trace ");
-                wattroff(msg_win, COLOR_PAIR(5) | A_BOLD);
-                mvwprintw(msg_win, 1, 2, "Push '(' onto operator stack.");
-                print_stack_content(&op_stack, stackbuf, sizeof(stackbuf));
-                mvwprintw(msg_win, 2, 2, "Operator stack top-> %s", stackbuf);
-                mvwprintw(msg_win, 3, 2, "Current postfix: %s", postfix);
-                mvwprintw(msg_win, 5, 2, "Press any key to continue...");
-                wrefresh(msg_win);
-                wgetch(msg_win);
-            } else if (op == ')') {
-                // Pop till '('
-                int error;
-                char* top_op = peek(&op_stack, &error);
-                while (!error && top_op[0] != '(') {
-                    char* popped = pop(&op_stack, &error);
-                    append_postfix(postfix, popped, 255);
-                    free(popped);
-                    top_op = peek(&op_stack, &error);
-                }
+// Read all of in into one heap buffer
+char* read_all(FILE* in, size_t* len_out) {
+    size_t len = 0, cap = 1 << 20;
+    char* buf = (char*)checked_realloc(NULL, cap);
+    size_t n;
+    while ((n = fread(buf + len, 1, cap - len, in)) > 0) {
+        len += n;
+        if (len == cap) {
+            cap *= 2;
+            buf = (char*)checked_realloc(buf, cap);
+        }
+    }
+    *len_out = len;
+    return buf;
+}
 
-                if (!error && top_op[0] == '(') {
-                    char* discarded = pop(&op_stack, &error);
-                    free(discarded);
-                } else {
-                    // mismatch error
-                    werase(msg_win);
-                    box(msg_win, 0, 0);
-                    wattron(msg_win, COLOR_PAIR(4) | A_BOLD);
-                    mvwprintw(msg_win, 1, 2, "Error: mismatched parentheses detected.");
-                    wattroff(msg_win, COLOR_PAIR(4) | A_BOLD);
-                    wrefresh(msg_win);
-                    wgetch(msg_win);
-                    return;
-                }
+// Interned names (variables, operands kept verbatim, operator tokens).
+// Equal names share one id, so symbols compare and copy as plain ints.
+typedef struct SymbolTable {
+    char** names;
+    int count;
+    int capacity;
+    int* index;       // open-addressing hash of id + 1, 0 marks an empty bucket
+    int index_size;
+} SymbolTable;
 
-                werase(msg_win);
-                box(msg_win, 0, 0);
-                wattron(msg_win, COLOR_PAIR(5) | A_BOLD);
-                mvwprintw(msg_win, 0, (width - 24)/2, " Infix to Postfix Trace ");
-                wattroff(msg_win, COLOR_PAIR(5) | A_BOLD);
-                mvwprintw(msg_win, 1, 2, "Pop operators until '(' found and discard it.");
-                print_stack_content(&op_stack, stackbuf, sizeof(stackbuf));
-                mvwprintw(msg_win, 2, 2, "Operator stack top-> %s", stackbuf);
-                mvwprintw(msg_win, 3, 2, "Current postfix: %s", postfix);
-                mvwprintw(msg_win, 5, 2, "Press any key to continue...");
-                wrefresh(msg_win);
-                wgetch(msg_win);
-            } else if (is_operator_char(op)) {
-                int error;
-                char* top_op = peek(&op_stack, &error);
-                while (!error && top_op[0] != '(' &&
-                      ((precedence(top_op[0]) > precedence(op)) ||
-                      (precedence(top_op[0]) == precedence(op) && op != '^'))) {
-                    char* popped = pop(&op_stack, &error);
-                    append_postfix(postfix, popped, 255);
-                    free(popped);
-                    top_op = peek(&op_stack, &error);
-                }
-                push(&op_stack, token);
+SymbolTable symbols;
 
-                werase(msg_win);
-                box(msg_win, 0, 0);
-                wattron(msg_win, COLOR_PAIR(5) | A_BOLD);
-                mvwprintw(msg_win, 0, (width - 24)/2, " Infix to Postfix Trace ");
-                wattroff(msg_win, COLOR_PAIR(5) | A_BOLD);
-                mvwprintw(msg_win, 1, 2, "Push operator '%c' onto stack.", op);
-                print_stack_content(&op_stack, stackbuf, sizeof(stackbuf));
-                mvwprintw(msg_win, 2, 2, "Operator stack top-> %s", stackbuf);
-                mvwprintw(msg_win, 3, 2, "Current postfix: %s", postfix);
-                mvwprintw(msg_win, 5, 2, "Press any key to continue...");
-                wrefresh(msg_win);
-                wgetch(msg_win);
-            } else {
-                // Unknown token
-                werase(msg_win);
-                box(msg_win, 0, 0);
-                wattron(msg_win, COLOR_PAIR(4) | A_BOLD);
-                mvwprintw(msg_win, 1, 2, "Unknown token encountered: %c", op);
-                wattroff(msg_win, COLOR_PAIR(4) | A_BOLD);
-                wrefresh(msg_win);
-                wgetch(msg_win);
-            }
-        }
+unsigned int hash_text(const char* text, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)text[i];
+        h *= 16777619u;
     }
+    return h;
+}
 
-    // Pop remaining operators
-    int error;
-    while (!is_empty(&op_stack)) {
-        char* popped = pop(&op_stack, &error);
-        if (popped[0] == '(' || popped[0] == ')') {
-            werase(msg_win);
-            box(msg_win, 0, 0);
-            wattron(msg_win, COLOR_PAIR(4) | A_BOLD);
-            mvwprintw(msg_win, 1, 2, "Error: mismatched parentheses detected.");
-            wattroff(msg_win, COLOR_PAIR(4) | A_BOLD);
-            wrefresh(msg_win);
-            free(popped);
-            wgetch(msg_win);
-            return;
+// Id of the name spelled by text[0..len), which need not be NUL-terminated;
+// only the first sighting of a name is copied
+int intern_symbol(const char* name, size_t name_len) {
+    if (symbols.count * 2 >= symbols.index_size) {
+        int new_size = symbols.index_size ? symbols.index_size * 2 : 64;
+        int* index = (int*)checked_realloc(NULL, (size_t)new_size * sizeof(int));
+        memset(index, 0, (size_t)new_size * sizeof(int));
+        for (int id = 0; id < symbols.count; id++) {
+            unsigned int b = hash_text(symbols.names[id], strlen(symbols.names[id])) & (new_size - 1);
+            while (index[b]) b = (b + 1) & (new_size - 1);
+            index[b] = id + 1;
         }
-        append_postfix(postfix, popped, 255);
-        free(popped);
+        free(symbols.index);
+        symbols.index = index;
+        symbols.index_size = new_size;
+    }
 
-        werase(msg_win);
-        box(msg_win, 0, 0);
-        wattron(msg_win, COLOR_PAIR(5) | A_BOLD);
-        mvwprintw(msg_win, 0, (width - 24)/2, " Infix to Postfix Trace ");
-        wattroff(msg_win, COLOR_PAIR(5) | A_BOLD);
-        mvwprintw(msg_win, 1, 2, "Pop remaining operators:");
-        print_stack_content(&op_stack, stackbuf, sizeof(stackbuf));
-        mvwprintw(msg_win, 2, 2, "Operator stack top-> %s", stackbuf);
-        mvwprintw(msg_win, 3, 2, "Current postfix: %s", postfix);
-        mvwprintw(msg_win, 5, 2, "Press any key to continue...");
-        wrefresh(msg_win);
-        wgetch(msg_win);
+    unsigned int b = hash_text(name, name_len) & (symbols.index_size - 1);
+    while (symbols.index[b]) {
+        int id = symbols.index[b] - 1;
+        if (strncmp(symbols.names[id], name, name_len) == 0 && symbols.names[id][name_len] == '\0') return id;
+        b = (b + 1) & (symbols.index_size - 1);
     }
 
-    // Final postfix expression display
-    werase(msg_win);
-    box(msg_win, 0, 0);
-    wattron(msg_win, COLOR_PAIR(3) | A_BOLD);
-    mvwprintw(msg_win, 2, 2, "Final Postfix Expression:");
-    wattroff(msg_win, COLOR_PAIR(3) | A_BOLD);
-    mvwprintw(msg_win, 3, 2, "%s", postfix);
-    mvwprintw(msg_win, 5, 2, "Press any key to return to menu...");
-    wrefresh(msg_win);
-    wgetch(msg_win);
+    if (symbols.count == symbols.capacity) {
+        symbols.capacity = symbols.capacity ? symbols.capacity * 2 : 64;
+        symbols.names = (char**)checked_realloc(symbols.names, (size_t)symbols.capacity * sizeof(char*));
+    }
+    char* copy = (char*)checked_realloc(NULL, name_len + 1);
+    memcpy(copy, name, name_len);
+    copy[name_len] = '\0';
+    symbols.names[symbols.count] = copy;
+    symbols.index[b] = symbols.count + 1;
+    return symbols.count++;
 }
 
-// Converts postfix to infix with stepwise display in msg_win
-void postfix_to_infix_stepwise(WINDOW *msg_win) {
-    Stack s;
-    init_stack(&s);
-
-    char input[256];
-    char token[32];
-    char stackbuf[128];
-    int error;
-    int i = 0, len;
-
-    // Clear and prompt input
-    werase(msg_win);
-    box(msg_win, 0, 0);
-    wattron(msg_win, COLOR_PAIR(3));
-    mvwprintw(msg_win, 1, 2, "Enter postfix expression (tokens separated by spaces): ");
-    wattroff(msg_win, COLOR_PAIR(3));
-    wrefresh(msg_win);
-
-    echo();
-    wmove(msg_win, 2, 2);
-    wclrtoeol(msg_win);
-    wrefresh(msg_win);
-    wgetnstr(msg_win, input, 255);
-    noecho();
+const char* symbol_name(int id) {
+    return symbols.names[id];
+}
 
-    len = strlen(input);
+typedef enum ValueType {
+    VAL_NUM,    // native double, never formatted until displayed
+    VAL_SYM,    // interned symbol id
+    VAL_EXPR    // expression DAG node id
+} ValueType;
 
-    i = 0;
-    int step = 0;
+typedef struct Value {
+    ValueType type;
+    union {
+        double num;
+        int sym;
+        int expr;
+    } as;
+} Value;
 
-    while (i < len) {
-        // skip spaces
-        while (i < len && isspace(input[i])) i++;
-        if (i >= len) break;
+Value make_number(double num) {
+    Value v;
+    v.type = VAL_NUM;
+    v.as.num = num;
+    return v;
+}
 
-        int tlen = 0;
-        // read token (operand or operator)
-        if (isalnum(input[i]) || input[i] == '.') {
-            // operand token (letters/digits/dot)
-            while (i < len && (isalnum(input[i]) || input[i] == '.')) {
-                if (tlen < 31) token[tlen++] = input[i];
-                i++;
-            }
-            token[tlen] = '\0';
+Value make_symbol(const char* name, size_t len) {
+    Value v;
+    v.type = VAL_SYM;
+    v.as.sym = intern_symbol(name, len);
+    return v;
+}
 
-            push(&s, token);
-        } else {
-            // operator token (assumed single char)
-            token[0] = input[i];
-            token[1] = '\0';
-            i++;
+// Contiguous stack of tagged values: slots[0] is the bottom, slots[size - 1]
+// the top. The array grows geometrically, so push/pop are amortized O(1)
+// and never allocate per element. A stack with an arena takes its slots
+// from it and leaves releasing them to the arena's owner.
+typedef struct Stack {
+    Value* slots;
+    int size;
+    int capacity;
+    Arena* arena;
+} Stack;
 
-            if (s.size < 2) {
-                werase(msg_win);
-                box(msg_win, 0, 0);
-                wattron(msg_win, COLOR_PAIR(4) | A_BOLD);
-                mvwprintw(msg_win, 1, 2, "Error: insufficient operands for operator '%s'", token);
-                wattroff(msg_win, COLOR_PAIR(4) | A_BOLD);
-                wrefresh(msg_win);
-                wgetch(msg_win);
-                // Clear stack and return
-                while (!is_empty(&s)) { char* p = pop(&s, &error); if(p) free(p);}
-                return;
-            }
+void init_stack_in(Stack* s, Arena* arena) {
+    s->slots = NULL;
+    s->size = 0;
+    s->capacity = 0;
+    s->arena = arena;
+}
 
-            // Pop two operands
-            char* op2 = pop(&s, &error);
-            char* op1 = pop(&s, &error);
+void init_stack(Stack* s) {
+    init_stack_in(s, NULL);
+}
 
-            // Form new infix string "(op1 operator op2)"
-            char newexpr[128];
-            snprintf(newexpr, sizeof(newexpr), "(%s %s %s)", op1, token, op2);
+void free_stack(Stack* s) {
+    if (s->arena == NULL) free(s->slots);
+    init_stack_in(s, s->arena);
+}
 
-            free(op1);
-            free(op2);
+int is_empty(Stack* s) {
+    return s->size == 0;
+}
 
-            push(&s, newexpr);
+void push(Stack* s, Value v) {
+    if (s->size == s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : STACK_INITIAL_CAPACITY;
+        if (s->arena) {
+            Value* slots = (Value*)arena_alloc(s->arena, (size_t)s->capacity * sizeof(Value));
+            if (s->size) memcpy(slots, s->slots, (size_t)s->size * sizeof(Value));
+            s->slots = slots;
+        } else {
+            s->slots = (Value*)checked_realloc(s->slots, (size_t)s->capacity * sizeof(Value));
         }
+    }
+    s->slots[s->size++] = v;
+}
 
-        step++;
-
-        // Display step info
-        werase(msg_win);
-        box(msg_win, 0, 0);
-        wattron(msg_win, COLOR_PAIR(5) | A_BOLD);
-        int width = getmaxx(msg_win);
-        mvwprintw(msg_win, 0, (width - 19)/2, " Postfix to Infix Trace ");
-        wattroff(msg_win, COLOR_PAIR(5) | A_BOLD);
-
-        mvwprintw(msg_win, 1, 2, "Step %d: Processed token '%s'", step, token);
-        print_stack_content(&s, stackbuf, sizeof(stackbuf));
-        mvwprintw(msg_win, 2, 2, "Stack top-> %s", stackbuf);
-        mvwprintw(msg_win, 4, 2, "Press any key to continue...");
-        wrefresh(msg_win);
-        wgetch(msg_win);
+Value pop(Stack* s, int* error) {
+    if (is_empty(s)) {
+        *error = 1;
+        return make_number(0);
     }
+    *error = 0;
+    return s->slots[--s->size];
+}
 
-    if (s.size != 1) {
-        werase(msg_win);
-        box(msg_win, 0, 0);
-        wattron(msg_win, COLOR_PAIR(4) | A_BOLD);
-        mvwprintw(msg_win, 1, 2, "Error: invalid postfix expression, stack size not 1");
-        wattroff(msg_win, COLOR_PAIR(4) | A_BOLD);
-        wrefresh(msg_win);
-        wgetch(msg_win);
-        while (!is_empty(&s)) { char* p = pop(&s, &error); if(p) free(p);}
-        return;
+Value peek(Stack* s, int* error) {
+    if (is_empty(s)) {
+        *error = 1;
+        return make_number(0);
     }
+    *error = 0;
+    return s->slots[s->size - 1];
+}
 
-    char* infix = pop(&s, &error);
+// First character of a symbol on the operator stack, e.g. '(' or '+'
+char peek_operator(Stack* s, int* error) {
+    Value v = peek(s, error);
+    return *error ? '\0' : symbol_name(v.as.sym)[0];
+}
 
-    werase(msg_win);
-    box(msg_win, 0, 0);
-    wattron(msg_win, COLOR_PAIR(3) | A_BOLD);
-    mvwprintw(msg_win, 1, 2, "Postfix to Infix Conversion Complete");
-    mvwprintw(msg_win, 3, 2, "Infix expression: %s", infix);
-    wattroff(msg_win, COLOR_PAIR(3) | A_BOLD);
-    mvwprintw(msg_win, 5, 2, "Press any key to return to menu...");
-    wrefresh(msg_win);
-    wgetch(msg_win);
-    free(infix);
+int is_operator_char(char c) {
+    return (c == '+' || c == '-' || c == '*' || c == '/' || c == '^');
 }
 
-// Evaluate postfix expression with numeric tokens only
-// return 1 on success, result filled, else 0
-int evaluate_postfix_numeric(const char* postfix, double* result) {
-    Stack s;
-    init_stack(&s);
+int precedence(char c) {
+    if (c == '^') return 3;
+    if (c == '*' || c == '/') return 2;
+    if (c == '+' || c == '-') return 1;
+    return 0;
+}
 
-    int error;
-    int len = strlen(postfix);
-    int i = 0;
+// Shunting-yard rule: pop the stacked operator top before pushing op when it
+// binds tighter, or equally tight and op is left-associative (all but '^')
+int should_pop_operator(char top, char op) {
+    return top != '(' &&
+           (precedence(top) > precedence(op) ||
+           (precedence(top) == precedence(op) && op != '^'));
+}
 
-    while (i < len) {
-        // skip spaces
-        while (i < len && postfix[i] == ' ')
-            i++;
-        if (i >= len)
-            break;
+// Symbolic results ("A+2", "(A+B)*C") are nodes of a DAG over Values.
+// Nodes are hash-consed: building a node equal to an existing one returns
+// the existing id, so identical subtrees are stored once and compare as
+// ints. Nodes sit in one growable arena; dag_reset empties it in time
+// proportional to what was used. Text is produced only by render_value.
+typedef struct ExprNode {
+    Value lhs;
+    Value rhs;              // unused for 's' (square root)
+    char op;                // '+', '-', '*', '/', '^' or 's'
+} ExprNode;
 
-        char token[32];
-        int tlen = 0;
+typedef struct ExprDag {
+    ExprNode* nodes;
+    int count;
+    int capacity;
+    int* index;             // open-addressing hash of id + 1, 0 marks an empty bucket
+    int index_size;
+} ExprDag;
 
-        // read operand (number)
-        if (isdigit(postfix[i]) || postfix[i] == '.') {
-            while (i < len && (isdigit(postfix[i]) || postfix[i] == '.')) {
-                if (tlen < 31) token[tlen++] = postfix[i];
-                i++;
-            }
-            token[tlen] = '\0';
-            push(&s, token);
-        } else {
-            // operator
-            char op = postfix[i];
-            i++;
+// The interactive session's DAG (stack values refer into it)
+ExprDag expressions;
 
-            if (s.size < 2) {
-                // insufficient operands
-                return 0;
-            }
+void dag_reset(ExprDag* d) {
+    if (d->count) memset(d->index, 0, (size_t)d->index_size * sizeof(int));
+    d->count = 0;
+}
 
-            char* val2_s = pop(&s, &error);
-            char* val1_s = pop(&s, &error);
+void dag_free(ExprDag* d) {
+    free(d->nodes);
+    free(d->index);
+    memset(d, 0, sizeof(*d));
+}
 
-            if (error) {
-                free(val2_s);
-                free(val1_s);
-                return 0;
-            }
+unsigned long long hash_value(unsigned long long h, Value v) {
+    unsigned long long bits = 0;
+    if (v.type == VAL_NUM) memcpy(&bits, &v.as.num, sizeof(double));
+    else bits = (unsigned long long)(unsigned int)(v.type == VAL_SYM ? v.as.sym : v.as.expr);
+    h = (h ^ (bits + (unsigned long long)v.type)) * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 31);
+}
 
-            double val1 = atof(val1_s);
-            double val2 = atof(val2_s);
-            free(val1_s);
-            free(val2_s);
+unsigned int hash_node(const ExprNode* n) {
+    unsigned long long h = hash_value(hash_value((unsigned char)n->op, n->lhs), n->rhs);
+    return (unsigned int)(h ^ (h >> 32));
+}
 
-            double res = 0;
-            switch (op) {
-                case '+': res = val1 + val2; break;
-                case '-': res = val1 - val2; break;
-                case '*': res = val1 * val2; break;
-                case '/': if(val2 == 0) return 0; res = val1 / val2; break;
-                case '^': res = pow(val1, val2); break;
-                default: return 0;
-            }
+int same_value(Value a, Value b) {
+    if (a.type != b.type) return 0;
+    if (a.type == VAL_NUM) return memcmp(&a.as.num, &b.as.num, sizeof(double)) == 0;
+    return a.type == VAL_SYM ? a.as.sym == b.as.sym : a.as.expr == b.as.expr;
+}
 
-            char buffer[32];
-            snprintf(buffer, 32, "%lf", res);
-            push(&s, buffer);
+// Id of the node "lhs op rhs", adding it unless an equal node exists
+int dag_intern(ExprDag* d, Value lhs, char op, Value rhs) {
+    if (d->count * 2 >= d->index_size) {
+        int new_size = d->index_size ? d->index_size * 2 : 64;
+        int* index = (int*)checked_realloc(NULL, (size_t)new_size * sizeof(int));
+        memset(index, 0, (size_t)new_size * sizeof(int));
+        for (int id = 0; id < d->count; id++) {
+            unsigned int b = hash_node(&d->nodes[id]) & (new_size - 1);
+            while (index[b]) b = (b + 1) & (new_size - 1);
+            index[b] = id + 1;
         }
+        free(d->index);
+        d->index = index;
+        d->index_size = new_size;
     }
 
-    if (s.size != 1) return 0;
+    ExprNode node;
+    node.lhs = lhs;
+    node.rhs = rhs;
+    node.op = op;
+    unsigned int b = hash_node(&node) & (d->index_size - 1);
+    while (d->index[b]) {
+        const ExprNode* n = &d->nodes[d->index[b] - 1];
+        if (n->op == op && same_value(n->lhs, lhs) && same_value(n->rhs, rhs)) return d->index[b] - 1;
+        b = (b + 1) & (d->index_size - 1);
+    }
 
-    char* res_s = pop(&s, &error);
-    *result = atof(res_s);
-    free(res_s);
-    return 1;
+    if (d->count == d->capacity) {
+        d->capacity = d->capacity ? d->capacity * 2 : 64;
+        d->nodes = (ExprNode*)checked_realloc(d->nodes, (size_t)d->capacity * sizeof(ExprNode));
+    }
+    d->nodes[d->count] = node;
+    d->index[b] = d->count + 1;
+    return d->count++;
 }
 
-// Display stack contents in UI stack window, supports tokens (strings)
-void display_stack(Stack* s, WINDOW* win, int y_start, int x_start) {
-    werase(win);
-    box(win, 0, 0);
-    wattron(win, COLOR_PAIR(5) | A_BOLD);
-    mvwprintw(win, 0, 2, " Stack Contents ");
-    wattroff(win, COLOR_PAIR(5) | A_BOLD);
+Value make_node(ExprDag* d, Value lhs, char op, Value rhs) {
+    Value v;
+    v.type = VAL_EXPR;
+    v.as.expr = dag_intern(d, lhs, op, rhs);
+    return v;
+}
+
+// "lhs op rhs" as a symbolic value in the session DAG
+Value make_binary_expr(Value lhs, char op, Value rhs) {
+    return make_node(&expressions, lhs, op, rhs);
+}
 
-    Node* curr = s->top;
-    int y = y_start;
-    int index = s->size;
+int node_precedence(char op) {
+    return op == 's' ? 4 : precedence(op);
+}
 
-    while(curr != NULL && y < getmaxy(win) - 1) {
-        if ((index % 2) == 0) {
-            wattron(win, COLOR_PAIR(8));
-        } else {
-            wattron(win, COLOR_PAIR(3));
+// Whether a child with root operator op needs parentheses under parent
+// (on its right side if right). Equal precedence needs them on the right
+// of a left-associative operator and on the left of '^', so the text
+// parses back to the same tree.
+int needs_parens(char parent, char op, int right) {
+    if (parent == 0 || parent == 's' || op == 's') return 0;
+    int outer = precedence(parent), inner = precedence(op);
+    return inner < outer || (inner == outer && (parent == '^' ? !right : right));
+}
+
+// Render actions for render_value's explicit stack
+typedef struct RenderItem {
+    Value v;
+    char kind;              // 0 render v, 1 emit " op ", 2 emit ')'
+    char parent;            // operator v sits under (kind 0), or op (kind 1)
+    char right;
+} RenderItem;
+
+// Append v as infix with the fewest parentheses that keep its structure,
+// in one pass over the rendered text (iteratively, so depth is unbounded).
+// Symbol ids name entries of names when given, else interned symbols.
+// Output beyond limit characters is cut off and marked with "...".
+void render_value(const ExprDag* d, Value v, char* const* names, TextBuf* out, size_t limit) {
+    RenderItem local[64];
+    RenderItem* stack = local;
+    int cap = 64, sp = 0;
+    size_t start = out->len;
+    ArenaMark mark = arena_mark(&thread_arena);
+
+    stack[sp].v = v;
+    stack[sp].kind = 0;
+    stack[sp].parent = 0;
+    stack[sp].right = 0;
+    sp++;
+    while (sp > 0) {
+        if (out->len - start > limit) {
+            out->len = start + limit;
+            text_append(out, "...", 3);
+            break;
         }
-        if (index == s->size) {
-            wattron(win, A_BOLD | A_UNDERLINE);
-            mvwprintw(win, y, x_start, "#%d: %s  <- Top", index, curr->token);
-            wattroff(win, A_BOLD | A_UNDERLINE);
-        } else {
-            mvwprintw(win, y, x_start, "#%d: %s", index, curr->token);
+        RenderItem item = stack[--sp];
+        if (item.kind == 1) {
+            char op_text[3] = { ' ', item.parent, ' ' };
+            text_append(out, op_text, 3);
+            continue;
+        }
+        if (item.kind == 2) {
+            text_putc(out, ')');
+            continue;
+        }
+        if (item.v.type == VAL_NUM) {
+            text_number(out, item.v.as.num);
+            continue;
         }
-        wattroff(win, COLOR_PAIR(8) | COLOR_PAIR(3));
-        y++;
-        curr = curr->next;
-        index--;
+        if (item.v.type == VAL_SYM) {
+            const char* name = names ? names[item.v.as.sym] : symbol_name(item.v.as.sym);
+            text_append(out, name, strlen(name));
+            continue;
+        }
+
+        const ExprNode* n = &d->nodes[item.v.as.expr];
+        if (sp + 5 > cap) {
+            RenderItem* grown = (RenderItem*)arena_alloc(&thread_arena, (size_t)cap * 2 * sizeof(RenderItem));
+            memcpy(grown, stack, (size_t)sp * sizeof(RenderItem));
+            stack = grown;
+            cap *= 2;
+        }
+        int parens = n->op == 's' || needs_parens(item.parent, n->op, item.right);
+        if (n->op == 's') text_append(out, "sqrt", 4);
+        if (parens) {
+            text_putc(out, '(');
+            stack[sp].kind = 2;
+            sp++;
+        }
+        // Pushed in reverse: lhs renders first
+        if (n->op != 's') {
+            stack[sp].v = n->rhs;
+            stack[sp].kind = 0;
+            stack[sp].parent = n->op;
+            stack[sp].right = 1;
+            sp++;
+            stack[sp].kind = 1;
+            stack[sp].parent = n->op;
+            sp++;
+        }
+        stack[sp].v = n->lhs;
+        stack[sp].kind = 0;
+        stack[sp].parent = n->op;
+        stack[sp].right = 0;
+        sp++;
     }
-    wrefresh(win);
+    arena_rewind(&thread_arena, mark);
 }
 
-void draw_menu(WINDOW* win) {
-    werase(win);
-    box(win, 0, 0);
-    int width = getmaxx(win);
-    wattron(win, COLOR_PAIR(1) | A_BOLD | A_UNDERLINE);
-    mvwprintw(win, 1, (width - 24) / 2, " Stack Machine Menu ");
-    wattroff(win, COLOR_PAIR(1) | A_BOLD | A_UNDERLINE);
+// Longest expression value_text renders (displays cut off far earlier)
+#define VALUE_TEXT_LIMIT 4096
 
-    wattron(win, COLOR_PAIR(2));
-    mvwprintw(win, 3, 2, "1. Push Token (Number or Char)");
-    mvwprintw(win, 4, 2, "2. Pop Token");
-    mvwprintw(win, 5, 2, "3. Add (Top two)");
-    mvwprintw(win, 6, 2, "4. Subtract (Top two)");
-    mvwprintw(win, 7, 2, "5. Multiply (Top two)");
-    mvwprintw(win, 8, 2, "6. Divide (Top two)");
-    mvwprintw(win, 9, 2, "7. Infix to Postfix Conversion (Stepwise)");
-    mvwprintw(win, 10, 2, "8. Evaluate Postfix (numeric only)");
-    mvwprintw(win, 11, 2, "9. Postfix to Infix Conversion (Stepwise)");
-    mvwprintw(win, 12, 2, "10. Exit");
-    wattroff(win, COLOR_PAIR(2));
+// Shared by value_text for rendered expressions
+TextBuf value_text_buf;
 
-    wattron(win, A_BOLD | COLOR_PAIR(4));
-    mvwhline(win, 14, 1, 0, width - 2);
-    wattroff(win, A_BOLD | COLOR_PAIR(4));
+// Text form of a value. Numbers are formatted into buf and symbols return
+// their interned name. Expressions are rendered from the session DAG into
+// a shared buffer, valid until the next call.
+const char* value_text(Value v, char* buf, size_t buf_len) {
+    switch (v.type) {
+        case VAL_NUM: snprintf(buf, buf_len, "%.15g", v.as.num); return buf;
+        case VAL_SYM: return symbol_name(v.as.sym);
+        case VAL_EXPR:
+            value_text_buf.len = 0;
+            render_value(&expressions, v, NULL, &value_text_buf, VALUE_TEXT_LIMIT);
+            text_putc(&value_text_buf, '\0');
+            return value_text_buf.data;
+    }
+    return "";
+}
 
-    wattron(win, A_BOLD);
-    mvwprintw(win, 15, 2, "Choose option (1-10): ");
-    wclrtoeol(win);
-    wattroff(win, A_BOLD);
+// Why shunting_yard stopped; pos in InfixError locates the token
+typedef enum InfixStatus {
+    INFIX_OK,
+    INFIX_UNKNOWN_TOKEN,
+    INFIX_MISMATCHED_PAREN,
+    INFIX_BAD_OPERAND,
+    INFIX_MISSING_OPERAND,  // an operator or ')' (or the end) where an operand belongs
+    INFIX_MISSING_OPERATOR, // an operand or '(' right after an operand or ')'
+    INFIX_EMPTY_PARENS,
+} InfixStatus;
 
-    wrefresh(win);
-}
+typedef struct InfixError {
+    InfixStatus status;
+    size_t pos;             // byte offset of the offending character
+} InfixError;
+
+const char* infix_status_text(InfixStatus status) {
+    switch (status) {
+        case INFIX_OK: return "ok";
+        case INFIX_UNKNOWN_TOKEN: return "unknown token";
+        case INFIX_MISMATCHED_PAREN: return "mismatched parentheses";
+        case INFIX_BAD_OPERAND: return "malformed number";
+        case INFIX_MISSING_OPERAND: return "missing operand";
+        case INFIX_MISSING_OPERATOR: return "missing operator";
+        case INFIX_EMPTY_PARENS: return "empty parentheses";
+    }
+    return "error";
+}
+
+// What shunting_yard just did, reported to an observer
+typedef enum InfixStep {
+    STEP_OPERAND,           // copied an operand to the output
+    STEP_OPEN_PAREN,        // pushed '('
+    STEP_CLOSE_PAREN,       // popped operators down to '(' and discarded it
+    STEP_OPERATOR,          // popped tighter operators, then pushed this one
+    STEP_DRAIN,             // popped one of the operators left at the end
+} InfixStep;
+
+// Receives the postfix token stream from shunting_yard. operand is given a
+// span of the input (not NUL-terminated) and returns 0 to reject it.
+// step, if set, observes the conversion after each token with the operator
+// stack's depth; the operators themselves are the ones it has seen pushed.
+typedef struct InfixSink {
+    int (*operand)(void* ctx, const char* text, size_t len);
+    void (*op)(void* ctx, char op);
+    void* ctx;
+    void (*step)(void* step_ctx, InfixStep step, const char* token, size_t token_len, size_t nops);
+    void* step_ctx;
+} InfixSink;
+
+// Tokenizer support shared by the parsers: the source is classified 64
+// bytes at a time into bit masks, so skipping blanks and finding the end
+// of an operand take one count-trailing-zeros each instead of a ctype call
+// per byte. Operand bytes are the ASCII letters, digits and '.'; blanks
+// are the C-locale whitespace characters.
+enum { LEX_OPERAND = 1, LEX_BLANK = 2 };
+
+unsigned char lex_class[256];
+
+// Fills *operand and *blank with one bit per byte of src[0..n), n <= 64;
+// bits at and above n are clear
+typedef void (*LexClassifier)(const char* src, size_t n, unsigned long long* operand,
+                              unsigned long long* blank);
+
+void lex_classify_scalar(const char* src, size_t n, unsigned long long* operand, unsigned long long* blank) {
+    unsigned long long o = 0, b = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = lex_class[(unsigned char)src[i]];
+        o |= (unsigned long long)(c & LEX_OPERAND) << i;
+        b |= (unsigned long long)(c >> 1) << i;
+    }
+    *operand = o;
+    *blank = b;
+}
+
+#ifdef HAVE_X86_SIMD
+// Range tests use signed compares, so bytes >= 0x80 (negative) are in no
+// class; OR-ing 0x20 folds upper-case letters onto lower-case
+__attribute__((target("sse2")))
+void lex_classify_sse2(const char* src, size_t n, unsigned long long* operand, unsigned long long* blank) {
+    const __m128i below_0 = _mm_set1_epi8('0' - 1), above_9 = _mm_set1_epi8('9' + 1);
+    const __m128i below_a = _mm_set1_epi8('a' - 1), above_z = _mm_set1_epi8('z' + 1);
+    const __m128i below_tab = _mm_set1_epi8('\t' - 1), above_cr = _mm_set1_epi8('\r' + 1);
+    const __m128i case_bit = _mm_set1_epi8(0x20), dot = _mm_set1_epi8('.'), space = _mm_set1_epi8(' ');
+    unsigned long long o = 0, b = 0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i lower = _mm_or_si128(c, case_bit);
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, below_0), _mm_cmplt_epi8(c, above_9));
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, below_a), _mm_cmplt_epi8(lower, above_z));
+        __m128i ws = _mm_and_si128(_mm_cmpgt_epi8(c, below_tab), _mm_cmplt_epi8(c, above_cr));
+        o |= (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(digit, alpha),
+                                                                          _mm_cmpeq_epi8(c, dot))) << i;
+        b |= (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_or_si128(ws, _mm_cmpeq_epi8(c, space))) << i;
+    }
+    if (i < n) {
+        unsigned long long to, tb;
+        lex_classify_scalar(src + i, n - i, &to, &tb);
+        o |= to << i;
+        b |= tb << i;
+    }
+    *operand = o;
+    *blank = b;
+}
+
+__attribute__((target("avx2")))
+void lex_classify_avx2(const char* src, size_t n, unsigned long long* operand, unsigned long long* blank) {
+    const __m256i below_0 = _mm256_set1_epi8('0' - 1), above_9 = _mm256_set1_epi8('9' + 1);
+    const __m256i below_a = _mm256_set1_epi8('a' - 1), above_z = _mm256_set1_epi8('z' + 1);
+    const __m256i below_tab = _mm256_set1_epi8('\t' - 1), above_cr = _mm256_set1_epi8('\r' + 1);
+    const __m256i case_bit = _mm256_set1_epi8(0x20), dot = _mm256_set1_epi8('.'), space = _mm256_set1_epi8(' ');
+    unsigned long long o = 0, b = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i lower = _mm256_or_si256(c, case_bit);
+        __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, below_0), _mm256_cmpgt_epi8(above_9, c));
+        __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, below_a), _mm256_cmpgt_epi8(above_z, lower));
+        __m256i ws = _mm256_and_si256(_mm256_cmpgt_epi8(c, below_tab), _mm256_cmpgt_epi8(above_cr, c));
+        o |= (unsigned long long)(unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(digit, alpha),
+                                                                                _mm256_cmpeq_epi8(c, dot))) << i;
+        b |= (unsigned long long)(unsigned)_mm256_movemask_epi8(_mm256_or_si256(ws, _mm256_cmpeq_epi8(c, space)))
+             << i;
+    }
+    if (i < n) {
+        unsigned long long to, tb;
+        lex_classify_sse2(src + i, n - i, &to, &tb);
+        o |= to << i;
+        b |= tb << i;
+    }
+    *operand = o;
+    *blank = b;
+}
+#endif
+
+LexClassifier lex_classify = lex_classify_scalar;
+const char* lexer_isa = NULL;
+
+// Fill lex_class and pick the widest classifier the CPU has; force_scalar
+// keeps the table version (for comparison)
+void select_lexer(int force_scalar) {
+    for (int c = 0; c < 256; c++) {
+        lex_class[c] = (unsigned char)((isalnum(c) && c < 0x80) || c == '.' ? LEX_OPERAND
+                                       : c == ' ' || (c >= '\t' && c <= '\r') ? LEX_BLANK : 0);
+    }
+    lex_classify = lex_classify_scalar;
+    lexer_isa = "scalar";
+#ifdef HAVE_X86_SIMD
+    if (force_scalar) return;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        lex_classify = lex_classify_avx2;
+        lexer_isa = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        lex_classify = lex_classify_sse2;
+        lexer_isa = "sse2";
+    }
+#else
+    (void)force_scalar;
+#endif
+}
+
+// Scanning state over src[0..len). Each 64-byte block is turned into a
+// mask of token starts (the first byte of every operand run, plus every
+// byte that is neither operand nor blank), so the next token is one
+// count-trailing-zeros away however many blanks precede it.
+typedef struct Lexer {
+    const char* src;
+    size_t len;
+    size_t base;                // src offset of the current block
+    unsigned long long operand; // operand bytes of the block
+    unsigned long long starts;  // token starts in the block not yet returned
+} Lexer;
+
+enum { TOKEN_END, TOKEN_OPERAND, TOKEN_OTHER };
+
+// Classify the block at base; continues says src[base - 1] was an operand
+// byte, so an operand run at bit 0 is not a new token
+void lex_load(Lexer* lx, size_t base, int continues) {
+    size_t n = lx->len - base < 64 ? lx->len - base : 64;
+    unsigned long long blank;
+    lx->base = base;
+    lex_classify(lx->src + base, n, &lx->operand, &blank);
+    unsigned long long valid = n == 64 ? ~0ULL : (1ULL << n) - 1;
+    lx->starts = (lx->operand & ~((lx->operand << 1) | (unsigned long long)continues)) |
+                 (valid & ~lx->operand & ~blank);
+}
+
+void lex_init(Lexer* lx, const char* src, size_t len) {
+    lx->src = src;
+    lx->len = len;
+    lex_load(lx, 0, 0);
+}
+
+// End of an operand run that reaches the end of the current block,
+// classifying the blocks it spans
+size_t lex_run_end(Lexer* lx) {
+    for (size_t pos = lx->base + 64; pos < lx->len; pos += 64) {
+        lex_load(lx, pos, 1);
+        if (~lx->operand) {
+            pos += (size_t)__builtin_ctzll(~lx->operand);
+            return pos < lx->len ? pos : lx->len;
+        }
+    }
+    return lx->len;
+}
+
+// Next token as [*start, *end): TOKEN_OPERAND for a run of operand bytes,
+// TOKEN_OTHER for any other single non-blank byte, TOKEN_END when done.
+// Expressions hold a token every byte or two, so this per-token step, not
+// classification, bounds the lexer: it is inlined into the parsers (the
+// call alone cost more than classifying the bytes with AVX2).
+static inline int lex_next(Lexer* lx, size_t* start, size_t* end) {
+    while (lx->starts == 0) {
+        if (lx->base + 64 >= lx->len) return TOKEN_END;
+        lex_load(lx, lx->base + 64, (int)(lx->operand >> 63));
+    }
+    int bit = __builtin_ctzll(lx->starts);
+    lx->starts &= lx->starts - 1;
+    *start = lx->base + (size_t)bit;
+    // Operand or not is a coin flip in dense text, so it is computed
+    // rather than branched on: rest starts with a 1 exactly for a
+    // non-operand byte, and otherwise counts the run of operand bytes
+    unsigned long long rest = ~lx->operand >> bit;
+    if (rest == 0) {
+        *end = lex_run_end(lx);
+        return TOKEN_OPERAND;
+    }
+    size_t n = (size_t)__builtin_ctzll(rest);
+    *end = *start + n + (n == 0);
+    return n ? TOKEN_OPERAND : TOKEN_OTHER;
+}
+
+// Shunting-yard over src[0..len) in one pass: operands are runs of letters,
+// digits and '.', of any length. The operator stack holds at most len
+// entries, so the whole conversion is O(len). Returns 1 on success, else 0
+// with *err describing the first error (sink output is then partial).
+int shunting_yard(const char* src, size_t len, const InfixSink* sink, InfixError* err) {
+    char local_ops[256];
+    size_t local_opens[64];
+    char* ops = local_ops;
+    size_t* opens = local_opens;            // positions of the unmatched '('s
+    size_t nops = 0, nopens = 0;
+    size_t start, end;
+    int kind, any = 0;
+    int want_operand = 1;                   // at the start, after an operator or '('
+    ArenaMark mark = arena_mark(&thread_arena);
+
+    if (len > sizeof(local_ops)) ops = (char*)arena_alloc(&thread_arena, len);
+    if (len > sizeof(local_opens) / sizeof(local_opens[0])) {
+        opens = (size_t*)arena_alloc(&thread_arena, len * sizeof(size_t));
+    }
+    err->status = INFIX_OK;
+    err->pos = 0;
+
+    Lexer lx;
+    lex_init(&lx, src, len);
+    while (err->status == INFIX_OK && (kind = lex_next(&lx, &start, &end)) != TOKEN_END) {
+        char c = src[start];
+        any = 1;
+        if ((kind == TOKEN_OPERAND || c == '(') && !want_operand) {
+            err->status = INFIX_MISSING_OPERATOR;
+            err->pos = start;
+            break;
+        }
+        if (kind == TOKEN_OPERAND) {
+            want_operand = 0;
+            if (!sink->operand(sink->ctx, src + start, end - start)) {
+                err->status = INFIX_BAD_OPERAND;
+                err->pos = start;
+                break;
+            }
+            if (sink->step) sink->step(sink->step_ctx, STEP_OPERAND, src + start, end - start, nops);
+        } else if (c == '(') {
+            ops[nops++] = c;
+            opens[nopens++] = start;
+            if (sink->step) sink->step(sink->step_ctx, STEP_OPEN_PAREN, src + start, 1, nops);
+        } else if (c == ')') {
+            if (nopens == 0) {
+                err->status = INFIX_MISMATCHED_PAREN;
+                err->pos = start;
+                break;
+            }
+            if (want_operand) {
+                err->status = ops[nops - 1] == '(' ? INFIX_EMPTY_PARENS : INFIX_MISSING_OPERAND;
+                err->pos = ops[nops - 1] == '(' ? opens[nopens - 1] : start;
+                break;
+            }
+            while (ops[nops - 1] != '(') sink->op(sink->ctx, ops[--nops]);
+            nops--;
+            nopens--;
+            if (sink->step) sink->step(sink->step_ctx, STEP_CLOSE_PAREN, src + start, 1, nops);
+        } else if (is_operator_char(c)) {
+            if (want_operand) {
+                err->status = INFIX_MISSING_OPERAND;
+                err->pos = start;
+                break;
+            }
+            want_operand = 1;
+            while (nops > 0 && should_pop_operator(ops[nops - 1], c)) sink->op(sink->ctx, ops[--nops]);
+            ops[nops++] = c;
+            if (sink->step) sink->step(sink->step_ctx, STEP_OPERATOR, src + start, 1, nops);
+        } else {
+            err->status = INFIX_UNKNOWN_TOKEN;
+            err->pos = start;
+        }
+    }
+    if (err->status == INFIX_OK && any && want_operand) {
+        err->status = INFIX_MISSING_OPERAND;
+        err->pos = len;
+    }
+    if (err->status == INFIX_OK && nopens > 0) {
+        err->status = INFIX_MISMATCHED_PAREN;
+        err->pos = opens[nopens - 1];
+    }
+    while (err->status == INFIX_OK && nops > 0) {
+        char op = ops[--nops];
+        sink->op(sink->ctx, op);
+        if (sink->step) sink->step(sink->step_ctx, STEP_DRAIN, &op, 1, nops);
+    }
+
+    arena_rewind(&thread_arena, mark);
+    return err->status == INFIX_OK;
+}
+
+#define POW10_MIN_EXP (-342)
+#define POW10_MAX_EXP 308
+
+// 10^q for q in [POW10_MIN_EXP, POW10_MAX_EXP] as 128-bit mantissas
+// scaled into [2^127, 2^128) and rounded down, { low, high } halves.
+// Generated offline with exact integer arithmetic: m = 10^q << s for
+// q >= 0, m = floor(2^s / 10^-q) for q < 0, s chosen to land in range.
+const unsigned long long pow10_mantissas[POW10_MAX_EXP - POW10_MIN_EXP + 1][2] = {
+    { 0x113FAA2906A13B3F, 0xEEF453D6923BD65A }, { 0x4AC7CA59A424C507, 0x9558B4661B6565F8 }, // 1e-342
+    { 0x5D79BCF00D2DF649, 0xBAAEE17FA23EBF76 }, { 0xF4D82C2C107973DC, 0xE95A99DF8ACE6F53 }, // 1e-340
+    { 0x79071B9B8A4BE869, 0x91D8A02BB6C10594 }, { 0x9748E2826CDEE284, 0xB64EC836A47146F9 }, // 1e-338
+    { 0xFD1B1B2308169B25, 0xE3E27A444D8D98B7 }, { 0xFE30F0F5E50E20F7, 0x8E6D8C6AB0787F72 }, // 1e-336
+    { 0xBDBD2D335E51A935, 0xB208EF855C969F4F }, { 0xAD2C788035E61382, 0xDE8B2B66B3BC4723 }, // 1e-334
+    { 0x4C3BCB5021AFCC31, 0x8B16FB203055AC76 }, { 0xDF4ABE242A1BBF3D, 0xADDCB9E83C6B1793 }, // 1e-332
+    { 0xD71D6DAD34A2AF0D, 0xD953E8624B85DD78 }, { 0x8672648C40E5AD68, 0x87D4713D6F33AA6B }, // 1e-330
+    { 0x680EFDAF511F18C2, 0xA9C98D8CCB009506 }, { 0x0212BD1B2566DEF2, 0xD43BF0EFFDC0BA48 }, // 1e-328
+    { 0x014BB630F7604B57, 0x84A57695FE98746D }, { 0x419EA3BD35385E2D, 0xA5CED43B7E3E9188 }, // 1e-326
+    { 0x52064CAC828675B9, 0xCF42894A5DCE35EA }, { 0x7343EFEBD1940993, 0x818995CE7AA0E1B2 }, // 1e-324
+    { 0x1014EBE6C5F90BF8, 0xA1EBFB4219491A1F }, { 0xD41A26E077774EF6, 0xCA66FA129F9B60A6 }, // 1e-322
+    { 0x8920B098955522B4, 0xFD00B897478238D0 }, { 0x55B46E5F5D5535B0, 0x9E20735E8CB16382 }, // 1e-320
+    { 0xEB2189F734AA831D, 0xC5A890362FDDBC62 }, { 0xA5E9EC7501D523E4, 0xF712B443BBD52B7B }, // 1e-318
+    { 0x47B233C92125366E, 0x9A6BB0AA55653B2D }, { 0x999EC0BB696E840A, 0xC1069CD4EABE89F8 }, // 1e-316
+    { 0xC00670EA43CA250D, 0xF148440A256E2C76 }, { 0x380406926A5E5728, 0x96CD2A865764DBCA }, // 1e-314
+    { 0xC605083704F5ECF2, 0xBC807527ED3E12BC }, { 0xF7864A44C633682E, 0xEBA09271E88D976B }, // 1e-312
+    { 0x7AB3EE6AFBE0211D, 0x93445B8731587EA3 }, { 0x5960EA05BAD82964, 0xB8157268FDAE9E4C }, // 1e-310
+    { 0x6FB92487298E33BD, 0xE61ACF033D1A45DF }, { 0xA5D3B6D479F8E056, 0x8FD0C16206306BAB }, // 1e-308
+    { 0x8F48A4899877186C, 0xB3C4F1BA87BC8696 }, { 0x331ACDABFE94DE87, 0xE0B62E2929ABA83C }, // 1e-306
+    { 0x9FF0C08B7F1D0B14, 0x8C71DCD9BA0B4925 }, { 0x07ECF0AE5EE44DD9, 0xAF8E5410288E1B6F }, // 1e-304
+    { 0xC9E82CD9F69D6150, 0xDB71E91432B1A24A }, { 0xBE311C083A225CD2, 0x892731AC9FAF056E }, // 1e-302
+    { 0x6DBD630A48AAF406, 0xAB70FE17C79AC6CA }, { 0x092CBBCCDAD5B108, 0xD64D3D9DB981787D }, // 1e-300
+    { 0x25BBF56008C58EA5, 0x85F0468293F0EB4E }, { 0xAF2AF2B80AF6F24E, 0xA76C582338ED2621 }, // 1e-298
+    { 0x1AF5AF660DB4AEE1, 0xD1476E2C07286FAA }, { 0x50D98D9FC890ED4D, 0x82CCA4DB847945CA }, // 1e-296
+    { 0xE50FF107BAB528A0, 0xA37FCE126597973C }, { 0x1E53ED49A96272C8, 0xCC5FC196FEFD7D0C }, // 1e-294
+    { 0x25E8E89C13BB0F7A, 0xFF77B1FCBEBCDC4F }, { 0x77B191618C54E9AC, 0x9FAACF3DF73609B1 }, // 1e-292
+    { 0xD59DF5B9EF6A2417, 0xC795830D75038C1D }, { 0x4B0573286B44AD1D, 0xF97AE3D0D2446F25 }, // 1e-290
+    { 0x4EE367F9430AEC32, 0x9BECCE62836AC577 }, { 0x229C41F793CDA73F, 0xC2E801FB244576D5 }, // 1e-288
+    { 0x6B43527578C1110F, 0xF3A20279ED56D48A }, { 0x830A13896B78AAA9, 0x9845418C345644D6 }, // 1e-286
+    { 0x23CC986BC656D553, 0xBE5691EF416BD60C }, { 0x2CBFBE86B7EC8AA8, 0xEDEC366B11C6CB8F }, // 1e-284
+    { 0x7BF7D71432F3D6A9, 0x94B3A202EB1C3F39 }, { 0xDAF5CCD93FB0CC53, 0xB9E08A83A5E34F07 }, // 1e-282
+    { 0xD1B3400F8F9CFF68, 0xE858AD248F5C22C9 }, { 0x23100809B9C21FA1, 0x91376C36D99995BE }, // 1e-280
+    { 0xABD40A0C2832A78A, 0xB58547448FFFFB2D }, { 0x16C90C8F323F516C, 0xE2E69915B3FFF9F9 }, // 1e-278
+    { 0xAE3DA7D97F6792E3, 0x8DD01FAD907FFC3B }, { 0x99CD11CFDF41779C, 0xB1442798F49FFB4A }, // 1e-276
+    { 0x40405643D711D583, 0xDD95317F31C7FA1D }, { 0x482835EA666B2572, 0x8A7D3EEF7F1CFC52 }, // 1e-274
+    { 0xDA3243650005EECF, 0xAD1C8EAB5EE43B66 }, { 0x90BED43E40076A82, 0xD863B256369D4A40 }, // 1e-272
+    { 0x5A7744A6E804A291, 0x873E4F75E2224E68 }, { 0x711515D0A205CB36, 0xA90DE3535AAAE202 }, // 1e-270
+    { 0x0D5A5B44CA873E03, 0xD3515C2831559A83 }, { 0xE858790AFE9486C2, 0x8412D9991ED58091 }, // 1e-268
+    { 0x626E974DBE39A872, 0xA5178FFF668AE0B6 }, { 0xFB0A3D212DC8128F, 0xCE5D73FF402D98E3 }, // 1e-266
+    { 0x7CE66634BC9D0B99, 0x80FA687F881C7F8E }, { 0x1C1FFFC1EBC44E80, 0xA139029F6A239F72 }, // 1e-264
+    { 0xA327FFB266B56220, 0xC987434744AC874E }, { 0x4BF1FF9F0062BAA8, 0xFBE9141915D7A922 }, // 1e-262
+    { 0x6F773FC3603DB4A9, 0x9D71AC8FADA6C9B5 }, { 0xCB550FB4384D21D3, 0xC4CE17B399107C22 }, // 1e-260
+    { 0x7E2A53A146606A48, 0xF6019DA07F549B2B }, { 0x2EDA7444CBFC426D, 0x99C102844F94E0FB }, // 1e-258
+    { 0xFA911155FEFB5308, 0xC0314325637A1939 }, { 0x793555AB7EBA27CA, 0xF03D93EEBC589F88 }, // 1e-256
+    { 0x4BC1558B2F3458DE, 0x96267C7535B763B5 }, { 0x9EB1AAEDFB016F16, 0xBBB01B9283253CA2 }, // 1e-254
+    { 0x465E15A979C1CADC, 0xEA9C227723EE8BCB }, { 0x0BFACD89EC191EC9, 0x92A1958A7675175F }, // 1e-252
+    { 0xCEF980EC671F667B, 0xB749FAED14125D36 }, { 0x82B7E12780E7401A, 0xE51C79A85916F484 }, // 1e-250
+    { 0xD1B2ECB8B0908810, 0x8F31CC0937AE58D2 }, { 0x861FA7E6DCB4AA15, 0xB2FE3F0B8599EF07 }, // 1e-248
+    { 0x67A791E093E1D49A, 0xDFBDCECE67006AC9 }, { 0xE0C8BB2C5C6D24E0, 0x8BD6A141006042BD }, // 1e-246
+    { 0x58FAE9F773886E18, 0xAECC49914078536D }, { 0xAF39A475506A899E, 0xDA7F5BF590966848 }, // 1e-244
+    { 0x6D8406C952429603, 0x888F99797A5E012D }, { 0xC8E5087BA6D33B83, 0xAAB37FD7D8F58178 }, // 1e-242
+    { 0xFB1E4A9A90880A64, 0xD5605FCDCF32E1D6 }, { 0x5CF2EEA09A55067F, 0x855C3BE0A17FCD26 }, // 1e-240
+    { 0xF42FAA48C0EA481E, 0xA6B34AD8C9DFC06F }, { 0xF13B94DAF124DA26, 0xD0601D8EFC57B08B }, // 1e-238
+    { 0x76C53D08D6B70858, 0x823C12795DB6CE57 }, { 0x54768C4B0C64CA6E, 0xA2CB1717B52481ED }, // 1e-236
+    { 0xA9942F5DCF7DFD09, 0xCB7DDCDDA26DA268 }, { 0xD3F93B35435D7C4C, 0xFE5D54150B090B02 }, // 1e-234
+    { 0xC47BC5014A1A6DAF, 0x9EFA548D26E5A6E1 }, { 0x359AB6419CA1091B, 0xC6B8E9B0709F109A }, // 1e-232
+    { 0xC30163D203C94B62, 0xF867241C8CC6D4C0 }, { 0x79E0DE63425DCF1D, 0x9B407691D7FC44F8 }, // 1e-230
+    { 0x985915FC12F542E4, 0xC21094364DFB5636 }, { 0x3E6F5B7B17B2939D, 0xF294B943E17A2BC4 }, // 1e-228
+    { 0xA705992CEECF9C42, 0x979CF3CA6CEC5B5A }, { 0x50C6FF782A838353, 0xBD8430BD08277231 }, // 1e-226
+    { 0xA4F8BF5635246428, 0xECE53CEC4A314EBD }, { 0x871B7795E136BE99, 0x940F4613AE5ED136 }, // 1e-224
+    { 0x28E2557B59846E3F, 0xB913179899F68584 }, { 0x331AEADA2FE589CF, 0xE757DD7EC07426E5 }, // 1e-222
+    { 0x3FF0D2C85DEF7621, 0x9096EA6F3848984F }, { 0x0FED077A756B53A9, 0xB4BCA50B065ABE63 }, // 1e-220
+    { 0xD3E8495912C62894, 0xE1EBCE4DC7F16DFB }, { 0x64712DD7ABBBD95C, 0x8D3360F09CF6E4BD }, // 1e-218
+    { 0xBD8D794D96AACFB3, 0xB080392CC4349DEC }, { 0xECF0D7A0FC5583A0, 0xDCA04777F541C567 }, // 1e-216
+    { 0xF41686C49DB57244, 0x89E42CAAF9491B60 }, { 0x311C2875C522CED5, 0xAC5D37D5B79B6239 }, // 1e-214
+    { 0x7D633293366B828B, 0xD77485CB25823AC7 }, { 0xAE5DFF9C02033197, 0x86A8D39EF77164BC }, // 1e-212
+    { 0xD9F57F830283FDFC, 0xA8530886B54DBDEB }, { 0xD072DF63C324FD7B, 0xD267CAA862A12D66 }, // 1e-210
+    { 0x4247CB9E59F71E6D, 0x8380DEA93DA4BC60 }, { 0x52D9BE85F074E608, 0xA46116538D0DEB78 }, // 1e-208
+    { 0x67902E276C921F8B, 0xCD795BE870516656 }, { 0x00BA1CD8A3DB53B6, 0x806BD9714632DFF6 }, // 1e-206
+    { 0x80E8A40ECCD228A4, 0xA086CFCD97BF97F3 }, { 0x6122CD128006B2CD, 0xC8A883C0FDAF7DF0 }, // 1e-204
+    { 0x796B805720085F81, 0xFAD2A4B13D1B5D6C }, { 0xCBE3303674053BB0, 0x9CC3A6EEC6311A63 }, // 1e-202
+    { 0xBEDBFC4411068A9C, 0xC3F490AA77BD60FC }, { 0xEE92FB5515482D44, 0xF4F1B4D515ACB93B }, // 1e-200
+    { 0x751BDD152D4D1C4A, 0x991711052D8BF3C5 }, { 0xD262D45A78A0635D, 0xBF5CD54678EEF0B6 }, // 1e-198
+    { 0x86FB897116C87C34, 0xEF340A98172AACE4 }, { 0xD45D35E6AE3D4DA0, 0x9580869F0E7AAC0E }, // 1e-196
+    { 0x8974836059CCA109, 0xBAE0A846D2195712 }, { 0x2BD1A438703FC94B, 0xE998D258869FACD7 }, // 1e-194
+    { 0x7B6306A34627DDCF, 0x91FF83775423CC06 }, { 0x1A3BC84C17B1D542, 0xB67F6455292CBF08 }, // 1e-192
+    { 0x20CABA5F1D9E4A93, 0xE41F3D6A7377EECA }, { 0x547EB47B7282EE9C, 0x8E938662882AF53E }, // 1e-190
+    { 0xE99E619A4F23AA43, 0xB23867FB2A35B28D }, { 0x6405FA00E2EC94D4, 0xDEC681F9F4C31F31 }, // 1e-188
+    { 0xDE83BC408DD3DD04, 0x8B3C113C38F9F37E }, { 0x9624AB50B148D445, 0xAE0B158B4738705E }, // 1e-186
+    { 0x3BADD624DD9B0957, 0xD98DDAEE19068C76 }, { 0xE54CA5D70A80E5D6, 0x87F8A8D4CFA417C9 }, // 1e-184
+    { 0x5E9FCF4CCD211F4C, 0xA9F6D30A038D1DBC }, { 0x7647C3200069671F, 0xD47487CC8470652B }, // 1e-182
+    { 0x29ECD9F40041E073, 0x84C8D4DFD2C63F3B }, { 0xF468107100525890, 0xA5FB0A17C777CF09 }, // 1e-180
+    { 0x7182148D4066EEB4, 0xCF79CC9DB955C2CC }, { 0xC6F14CD848405530, 0x81AC1FE293D599BF }, // 1e-178
+    { 0xB8ADA00E5A506A7C, 0xA21727DB38CB002F }, { 0xA6D90811F0E4851C, 0xCA9CF1D206FDC03B }, // 1e-176
+    { 0x908F4A166D1DA663, 0xFD442E4688BD304A }, { 0x9A598E4E043287FE, 0x9E4A9CEC15763E2E }, // 1e-174
+    { 0x40EFF1E1853F29FD, 0xC5DD44271AD3CDBA }, { 0xD12BEE59E68EF47C, 0xF7549530E188C128 }, // 1e-172
+    { 0x82BB74F8301958CE, 0x9A94DD3E8CF578B9 }, { 0xE36A52363C1FAF01, 0xC13A148E3032D6E7 }, // 1e-170
+    { 0xDC44E6C3CB279AC1, 0xF18899B1BC3F8CA1 }, { 0x29AB103A5EF8C0B9, 0x96F5600F15A7B7E5 }, // 1e-168
+    { 0x7415D448F6B6F0E7, 0xBCB2B812DB11A5DE }, { 0x111B495B3464AD21, 0xEBDF661791D60F56 }, // 1e-166
+    { 0xCAB10DD900BEEC34, 0x936B9FCEBB25C995 }, { 0x3D5D514F40EEA742, 0xB84687C269EF3BFB }, // 1e-164
+    { 0x0CB4A5A3112A5112, 0xE65829B3046B0AFA }, { 0x47F0E785EABA72AB, 0x8FF71A0FE2C2E6DC }, // 1e-162
+    { 0x59ED216765690F56, 0xB3F4E093DB73A093 }, { 0x306869C13EC3532C, 0xE0F218B8D25088B8 }, // 1e-160
+    { 0x1E414218C73A13FB, 0x8C974F7383725573 }, { 0xE5D1929EF90898FA, 0xAFBD2350644EEACF }, // 1e-158
+    { 0xDF45F746B74ABF39, 0xDBAC6C247D62A583 }, { 0x6B8BBA8C328EB783, 0x894BC396CE5DA772 }, // 1e-156
+    { 0x066EA92F3F326564, 0xAB9EB47C81F5114F }, { 0xC80A537B0EFEFEBD, 0xD686619BA27255A2 }, // 1e-154
+    { 0xBD06742CE95F5F36, 0x8613FD0145877585 }, { 0x2C48113823B73704, 0xA798FC4196E952E7 }, // 1e-152
+    { 0xF75A15862CA504C5, 0xD17F3B51FCA3A7A0 }, { 0x9A984D73DBE722FB, 0x82EF85133DE648C4 }, // 1e-150
+    { 0xC13E60D0D2E0EBBA, 0xA3AB66580D5FDAF5 }, { 0x318DF905079926A8, 0xCC963FEE10B7D1B3 }, // 1e-148
+    { 0xFDF17746497F7052, 0xFFBBCFE994E5C61F }, { 0xFEB6EA8BEDEFA633, 0x9FD561F1FD0F9BD3 }, // 1e-146
+    { 0xFE64A52EE96B8FC0, 0xC7CABA6E7C5382C8 }, { 0x3DFDCE7AA3C673B0, 0xF9BD690A1B68637B }, // 1e-144
+    { 0x06BEA10CA65C084E, 0x9C1661A651213E2D }, { 0x486E494FCFF30A62, 0xC31BFA0FE5698DB8 }, // 1e-142
+    { 0x5A89DBA3C3EFCCFA, 0xF3E2F893DEC3F126 }, { 0xF89629465A75E01C, 0x986DDB5C6B3A76B7 }, // 1e-140
+    { 0xF6BBB397F1135823, 0xBE89523386091465 }, { 0x746AA07DED582E2C, 0xEE2BA6C0678B597F }, // 1e-138
+    { 0xA8C2A44EB4571CDC, 0x94DB483840B717EF }, { 0x92F34D62616CE413, 0xBA121A4650E4DDEB }, // 1e-136
+    { 0x77B020BAF9C81D17, 0xE896A0D7E51E1566 }, { 0x0ACE1474DC1D122E, 0x915E2486EF32CD60 }, // 1e-134
+    { 0x0D819992132456BA, 0xB5B5ADA8AAFF80B8 }, { 0x10E1FFF697ED6C69, 0xE3231912D5BF60E6 }, // 1e-132
+    { 0xCA8D3FFA1EF463C1, 0x8DF5EFABC5979C8F }, { 0xBD308FF8A6B17CB2, 0xB1736B96B6FD83B3 }, // 1e-130
+    { 0xAC7CB3F6D05DDBDE, 0xDDD0467C64BCE4A0 }, { 0x6BCDF07A423AA96B, 0x8AA22C0DBEF60EE4 }, // 1e-128
+    { 0x86C16C98D2C953C6, 0xAD4AB7112EB3929D }, { 0xE871C7BF077BA8B7, 0xD89D64D57A607744 }, // 1e-126
+    { 0x11471CD764AD4972, 0x87625F056C7C4A8B }, { 0xD598E40D3DD89BCF, 0xA93AF6C6C79B5D2D }, // 1e-124
+    { 0x4AFF1D108D4EC2C3, 0xD389B47879823479 }, { 0xCEDF722A585139BA, 0x843610CB4BF160CB }, // 1e-122
+    { 0xC2974EB4EE658828, 0xA54394FE1EEDB8FE }, { 0x733D226229FEEA32, 0xCE947A3DA6A9273E }, // 1e-120
+    { 0x0806357D5A3F525F, 0x811CCC668829B887 }, { 0xCA07C2DCB0CF26F7, 0xA163FF802A3426A8 }, // 1e-118
+    { 0xFC89B393DD02F0B5, 0xC9BCFF6034C13052 }, { 0xBBAC2078D443ACE2, 0xFC2C3F3841F17C67 }, // 1e-116
+    { 0xD54B944B84AA4C0D, 0x9D9BA7832936EDC0 }, { 0x0A9E795E65D4DF11, 0xC5029163F384A931 }, // 1e-114
+    { 0x4D4617B5FF4A16D5, 0xF64335BCF065D37D }, { 0x504BCED1BF8E4E45, 0x99EA0196163FA42E }, // 1e-112
+    { 0xE45EC2862F71E1D6, 0xC06481FB9BCF8D39 }, { 0x5D767327BB4E5A4C, 0xF07DA27A82C37088 }, // 1e-110
+    { 0x3A6A07F8D510F86F, 0x964E858C91BA2655 }, { 0x890489F70A55368B, 0xBBE226EFB628AFEA }, // 1e-108
+    { 0x2B45AC74CCEA842E, 0xEADAB0ABA3B2DBE5 }, { 0x3B0B8BC90012929D, 0x92C8AE6B464FC96F }, // 1e-106
+    { 0x09CE6EBB40173744, 0xB77ADA0617E3BBCB }, { 0xCC420A6A101D0515, 0xE55990879DDCAABD }, // 1e-104
+    { 0x9FA946824A12232D, 0x8F57FA54C2A9EAB6 }, { 0x47939822DC96ABF9, 0xB32DF8E9F3546564 }, // 1e-102
+    { 0x59787E2B93BC56F7, 0xDFF9772470297EBD }, { 0x57EB4EDB3C55B65A, 0x8BFBEA76C619EF36 }, // 1e-100
+    { 0xEDE622920B6B23F1, 0xAEFAE51477A06B03 }, { 0xE95FAB368E45ECED, 0xDAB99E59958885C4 }, // 1e-98
+    { 0x11DBCB0218EBB414, 0x88B402F7FD75539B }, { 0xD652BDC29F26A119, 0xAAE103B5FCD2A881 }, // 1e-96
+    { 0x4BE76D3346F0495F, 0xD59944A37C0752A2 }, { 0x6F70A4400C562DDB, 0x857FCAE62D8493A5 }, // 1e-94
+    { 0xCB4CCD500F6BB952, 0xA6DFBD9FB8E5B88E }, { 0x7E2000A41346A7A7, 0xD097AD07A71F26B2 }, // 1e-92
+    { 0x8ED400668C0C28C8, 0x825ECC24C873782F }, { 0x728900802F0F32FA, 0xA2F67F2DFA90563B }, // 1e-90
+    { 0x4F2B40A03AD2FFB9, 0xCBB41EF979346BCA }, { 0xE2F610C84987BFA8, 0xFEA126B7D78186BC }, // 1e-88
+    { 0x0DD9CA7D2DF4D7C9, 0x9F24B832E6B0F436 }, { 0x91503D1C79720DBB, 0xC6EDE63FA05D3143 }, // 1e-86
+    { 0x75A44C6397CE912A, 0xF8A95FCF88747D94 }, { 0xC986AFBE3EE11ABA, 0x9B69DBE1B548CE7C }, // 1e-84
+    { 0xFBE85BADCE996168, 0xC24452DA229B021B }, { 0xFAE27299423FB9C3, 0xF2D56790AB41C2A2 }, // 1e-82
+    { 0xDCCD879FC967D41A, 0x97C560BA6B0919A5 }, { 0x5400E987BBC1C920, 0xBDB6B8E905CB600F }, // 1e-80
+    { 0x290123E9AAB23B68, 0xED246723473E3813 }, { 0xF9A0B6720AAF6521, 0x9436C0760C86E30B }, // 1e-78
+    { 0xF808E40E8D5B3E69, 0xB94470938FA89BCE }, { 0xB60B1D1230B20E04, 0xE7958CB87392C2C2 }, // 1e-76
+    { 0xB1C6F22B5E6F48C2, 0x90BD77F3483BB9B9 }, { 0x1E38AEB6360B1AF3, 0xB4ECD5F01A4AA828 }, // 1e-74
+    { 0x25C6DA63C38DE1B0, 0xE2280B6C20DD5232 }, { 0x579C487E5A38AD0E, 0x8D590723948A535F }, // 1e-72
+    { 0x2D835A9DF0C6D851, 0xB0AF48EC79ACE837 }, { 0xF8E431456CF88E65, 0xDCDB1B2798182244 }, // 1e-70
+    { 0x1B8E9ECB641B58FF, 0x8A08F0F8BF0F156B }, { 0xE272467E3D222F3F, 0xAC8B2D36EED2DAC5 }, // 1e-68
+    { 0x5B0ED81DCC6ABB0F, 0xD7ADF884AA879177 }, { 0x98E947129FC2B4E9, 0x86CCBB52EA94BAEA }, // 1e-66
+    { 0x3F2398D747B36224, 0xA87FEA27A539E9A5 }, { 0x8EEC7F0D19A03AAD, 0xD29FE4B18E88640E }, // 1e-64
+    { 0x1953CF68300424AC, 0x83A3EEEEF9153E89 }, { 0x5FA8C3423C052DD7, 0xA48CEAAAB75A8E2B }, // 1e-62
+    { 0x3792F412CB06794D, 0xCDB02555653131B6 }, { 0xE2BBD88BBEE40BD0, 0x808E17555F3EBF11 }, // 1e-60
+    { 0x5B6ACEAEAE9D0EC4, 0xA0B19D2AB70E6ED6 }, { 0xF245825A5A445275, 0xC8DE047564D20A8B }, // 1e-58
+    { 0xEED6E2F0F0D56712, 0xFB158592BE068D2E }, { 0x55464DD69685606B, 0x9CED737BB6C4183D }, // 1e-56
+    { 0xAA97E14C3C26B886, 0xC428D05AA4751E4C }, { 0xD53DD99F4B3066A8, 0xF53304714D9265DF }, // 1e-54
+    { 0xE546A8038EFE4029, 0x993FE2C6D07B7FAB }, { 0xDE98520472BDD033, 0xBF8FDB78849A5F96 }, // 1e-52
+    { 0x963E66858F6D4440, 0xEF73D256A5C0F77C }, { 0xDDE7001379A44AA8, 0x95A8637627989AAD }, // 1e-50
+    { 0x5560C018580D5D52, 0xBB127C53B17EC159 }, { 0xAAB8F01E6E10B4A6, 0xE9D71B689DDE71AF }, // 1e-48
+    { 0xCAB3961304CA70E8, 0x9226712162AB070D }, { 0x3D607B97C5FD0D22, 0xB6B00D69BB55C8D1 }, // 1e-46
+    { 0x8CB89A7DB77C506A, 0xE45C10C42A2B3B05 }, { 0x77F3608E92ADB242, 0x8EB98A7A9A5B04E3 }, // 1e-44
+    { 0x55F038B237591ED3, 0xB267ED1940F1C61C }, { 0x6B6C46DEC52F6688, 0xDF01E85F912E37A3 }, // 1e-42
+    { 0x2323AC4B3B3DA015, 0x8B61313BBABCE2C6 }, { 0xABEC975E0A0D081A, 0xAE397D8AA96C1B77 }, // 1e-40
+    { 0x96E7BD358C904A21, 0xD9C7DCED53C72255 }, { 0x7E50D64177DA2E54, 0x881CEA14545C7575 }, // 1e-38
+    { 0xDDE50BD1D5D0B9E9, 0xAA242499697392D2 }, { 0x955E4EC64B44E864, 0xD4AD2DBFC3D07787 }, // 1e-36
+    { 0xBD5AF13BEF0B113E, 0x84EC3C97DA624AB4 }, { 0xECB1AD8AEACDD58E, 0xA6274BBDD0FADD61 }, // 1e-34
+    { 0x67DE18EDA5814AF2, 0xCFB11EAD453994BA }, { 0x80EACF948770CED7, 0x81CEB32C4B43FCF4 }, // 1e-32
+    { 0xA1258379A94D028D, 0xA2425FF75E14FC31 }, { 0x096EE45813A04330, 0xCAD2F7F5359A3B3E }, // 1e-30
+    { 0x8BCA9D6E188853FC, 0xFD87B5F28300CA0D }, { 0x775EA264CF55347D, 0x9E74D1B791E07E48 }, // 1e-28
+    { 0x95364AFE032A819D, 0xC612062576589DDA }, { 0x3A83DDBD83F52204, 0xF79687AED3EEC551 }, // 1e-26
+    { 0xC4926A9672793542, 0x9ABE14CD44753B52 }, { 0x75B7053C0F178293, 0xC16D9A0095928A27 }, // 1e-24
+    { 0x5324C68B12DD6338, 0xF1C90080BAF72CB1 }, { 0xD3F6FC16EBCA5E03, 0x971DA05074DA7BEE }, // 1e-22
+    { 0x88F4BB1CA6BCF584, 0xBCE5086492111AEA }, { 0x2B31E9E3D06C32E5, 0xEC1E4A7DB69561A5 }, // 1e-20
+    { 0x3AFF322E62439FCF, 0x9392EE8E921D5D07 }, { 0x09BEFEB9FAD487C2, 0xB877AA3236A4B449 }, // 1e-18
+    { 0x4C2EBE687989A9B3, 0xE69594BEC44DE15B }, { 0x0F9D37014BF60A10, 0x901D7CF73AB0ACD9 }, // 1e-16
+    { 0x538484C19EF38C94, 0xB424DC35095CD80F }, { 0x2865A5F206B06FB9, 0xE12E13424BB40E13 }, // 1e-14
+    { 0xF93F87B7442E45D3, 0x8CBCCC096F5088CB }, { 0xF78F69A51539D748, 0xAFEBFF0BCB24AAFE }, // 1e-12
+    { 0xB573440E5A884D1B, 0xDBE6FECEBDEDD5BE }, { 0x31680A88F8953030, 0x89705F4136B4A597 }, // 1e-10
+    { 0xFDC20D2B36BA7C3D, 0xABCC77118461CEFC }, { 0x3D32907604691B4C, 0xD6BF94D5E57A42BC }, // 1e-8
+    { 0xA63F9A49C2C1B10F, 0x8637BD05AF6C69B5 }, { 0x0FCF80DC33721D53, 0xA7C5AC471B478423 }, // 1e-6
+    { 0xD3C36113404EA4A8, 0xD1B71758E219652B }, { 0x645A1CAC083126E9, 0x83126E978D4FDF3B }, // 1e-4
+    { 0x3D70A3D70A3D70A3, 0xA3D70A3D70A3D70A }, { 0xCCCCCCCCCCCCCCCC, 0xCCCCCCCCCCCCCCCC }, // 1e-2
+    { 0x0000000000000000, 0x8000000000000000 }, { 0x0000000000000000, 0xA000000000000000 }, // 1e0
+    { 0x0000000000000000, 0xC800000000000000 }, { 0x0000000000000000, 0xFA00000000000000 }, // 1e2
+    { 0x0000000000000000, 0x9C40000000000000 }, { 0x0000000000000000, 0xC350000000000000 }, // 1e4
+    { 0x0000000000000000, 0xF424000000000000 }, { 0x0000000000000000, 0x9896800000000000 }, // 1e6
+    { 0x0000000000000000, 0xBEBC200000000000 }, { 0x0000000000000000, 0xEE6B280000000000 }, // 1e8
+    { 0x0000000000000000, 0x9502F90000000000 }, { 0x0000000000000000, 0xBA43B74000000000 }, // 1e10
+    { 0x0000000000000000, 0xE8D4A51000000000 }, { 0x0000000000000000, 0x9184E72A00000000 }, // 1e12
+    { 0x0000000000000000, 0xB5E620F480000000 }, { 0x0000000000000000, 0xE35FA931A0000000 }, // 1e14
+    { 0x0000000000000000, 0x8E1BC9BF04000000 }, { 0x0000000000000000, 0xB1A2BC2EC5000000 }, // 1e16
+    { 0x0000000000000000, 0xDE0B6B3A76400000 }, { 0x0000000000000000, 0x8AC7230489E80000 }, // 1e18
+    { 0x0000000000000000, 0xAD78EBC5AC620000 }, { 0x0000000000000000, 0xD8D726B7177A8000 }, // 1e20
+    { 0x0000000000000000, 0x878678326EAC9000 }, { 0x0000000000000000, 0xA968163F0A57B400 }, // 1e22
+    { 0x0000000000000000, 0xD3C21BCECCEDA100 }, { 0x0000000000000000, 0x84595161401484A0 }, // 1e24
+    { 0x0000000000000000, 0xA56FA5B99019A5C8 }, { 0x0000000000000000, 0xCECB8F27F4200F3A }, // 1e26
+    { 0x4000000000000000, 0x813F3978F8940984 }, { 0x5000000000000000, 0xA18F07D736B90BE5 }, // 1e28
+    { 0xA400000000000000, 0xC9F2C9CD04674EDE }, { 0x4D00000000000000, 0xFC6F7C4045812296 }, // 1e30
+    { 0xF020000000000000, 0x9DC5ADA82B70B59D }, { 0x6C28000000000000, 0xC5371912364CE305 }, // 1e32
+    { 0xC732000000000000, 0xF684DF56C3E01BC6 }, { 0x3C7F400000000000, 0x9A130B963A6C115C }, // 1e34
+    { 0x4B9F100000000000, 0xC097CE7BC90715B3 }, { 0x1E86D40000000000, 0xF0BDC21ABB48DB20 }, // 1e36
+    { 0x1314448000000000, 0x96769950B50D88F4 }, { 0x17D955A000000000, 0xBC143FA4E250EB31 }, // 1e38
+    { 0x5DCFAB0800000000, 0xEB194F8E1AE525FD }, { 0x5AA1CAE500000000, 0x92EFD1B8D0CF37BE }, // 1e40
+    { 0xF14A3D9E40000000, 0xB7ABC627050305AD }, { 0x6D9CCD05D0000000, 0xE596B7B0C643C719 }, // 1e42
+    { 0xE4820023A2000000, 0x8F7E32CE7BEA5C6F }, { 0xDDA2802C8A800000, 0xB35DBF821AE4F38B }, // 1e44
+    { 0xD50B2037AD200000, 0xE0352F62A19E306E }, { 0x4526F422CC340000, 0x8C213D9DA502DE45 }, // 1e46
+    { 0x9670B12B7F410000, 0xAF298D050E4395D6 }, { 0x3C0CDD765F114000, 0xDAF3F04651D47B4C }, // 1e48
+    { 0xA5880A69FB6AC800, 0x88D8762BF324CD0F }, { 0x8EEA0D047A457A00, 0xAB0E93B6EFEE0053 }, // 1e50
+    { 0x72A4904598D6D880, 0xD5D238A4ABE98068 }, { 0x47A6DA2B7F864750, 0x85A36366EB71F041 }, // 1e52
+    { 0x999090B65F67D924, 0xA70C3C40A64E6C51 }, { 0xFFF4B4E3F741CF6D, 0xD0CF4B50CFE20765 }, // 1e54
+    { 0xBFF8F10E7A8921A4, 0x82818F1281ED449F }, { 0xAFF72D52192B6A0D, 0xA321F2D7226895C7 }, // 1e56
+    { 0x9BF4F8A69F764490, 0xCBEA6F8CEB02BB39 }, { 0x02F236D04753D5B4, 0xFEE50B7025C36A08 }, // 1e58
+    { 0x01D762422C946590, 0x9F4F2726179A2245 }, { 0x424D3AD2B7B97EF5, 0xC722F0EF9D80AAD6 }, // 1e60
+    { 0xD2E0898765A7DEB2, 0xF8EBAD2B84E0D58B }, { 0x63CC55F49F88EB2F, 0x9B934C3B330C8577 }, // 1e62
+    { 0x3CBF6B71C76B25FB, 0xC2781F49FFCFA6D5 }, { 0x8BEF464E3945EF7A, 0xF316271C7FC3908A }, // 1e64
+    { 0x97758BF0E3CBB5AC, 0x97EDD871CFDA3A56 }, { 0x3D52EEED1CBEA317, 0xBDE94E8E43D0C8EC }, // 1e66
+    { 0x4CA7AAA863EE4BDD, 0xED63A231D4C4FB27 }, { 0x8FE8CAA93E74EF6A, 0x945E455F24FB1CF8 }, // 1e68
+    { 0xB3E2FD538E122B44, 0xB975D6B6EE39E436 }, { 0x60DBBCA87196B616, 0xE7D34C64A9C85D44 }, // 1e70
+    { 0xBC8955E946FE31CD, 0x90E40FBEEA1D3A4A }, { 0x6BABAB6398BDBE41, 0xB51D13AEA4A488DD }, // 1e72
+    { 0xC696963C7EED2DD1, 0xE264589A4DCDAB14 }, { 0xFC1E1DE5CF543CA2, 0x8D7EB76070A08AEC }, // 1e74
+    { 0x3B25A55F43294BCB, 0xB0DE65388CC8ADA8 }, { 0x49EF0EB713F39EBE, 0xDD15FE86AFFAD912 }, // 1e76
+    { 0x6E3569326C784337, 0x8A2DBF142DFCC7AB }, { 0x49C2C37F07965404, 0xACB92ED9397BF996 }, // 1e78
+    { 0xDC33745EC97BE906, 0xD7E77A8F87DAF7FB }, { 0x69A028BB3DED71A3, 0x86F0AC99B4E8DAFD }, // 1e80
+    { 0xC40832EA0D68CE0C, 0xA8ACD7C0222311BC }, { 0xF50A3FA490C30190, 0xD2D80DB02AABD62B }, // 1e82
+    { 0x792667C6DA79E0FA, 0x83C7088E1AAB65DB }, { 0x577001B891185938, 0xA4B8CAB1A1563F52 }, // 1e84
+    { 0xED4C0226B55E6F86, 0xCDE6FD5E09ABCF26 }, { 0x544F8158315B05B4, 0x80B05E5AC60B6178 }, // 1e86
+    { 0x696361AE3DB1C721, 0xA0DC75F1778E39D6 }, { 0x03BC3A19CD1E38E9, 0xC913936DD571C84C }, // 1e88
+    { 0x04AB48A04065C723, 0xFB5878494ACE3A5F }, { 0x62EB0D64283F9C76, 0x9D174B2DCEC0E47B }, // 1e90
+    { 0x3BA5D0BD324F8394, 0xC45D1DF942711D9A }, { 0xCA8F44EC7EE36479, 0xF5746577930D6500 }, // 1e92
+    { 0x7E998B13CF4E1ECB, 0x9968BF6ABBE85F20 }, { 0x9E3FEDD8C321A67E, 0xBFC2EF456AE276E8 }, // 1e94
+    { 0xC5CFE94EF3EA101E, 0xEFB3AB16C59B14A2 }, { 0xBBA1F1D158724A12, 0x95D04AEE3B80ECE5 }, // 1e96
+    { 0x2A8A6E45AE8EDC97, 0xBB445DA9CA61281F }, { 0xF52D09D71A3293BD, 0xEA1575143CF97226 }, // 1e98
+    { 0x593C2626705F9C56, 0x924D692CA61BE758 }, { 0x6F8B2FB00C77836C, 0xB6E0C377CFA2E12E }, // 1e100
+    { 0x0B6DFB9C0F956447, 0xE498F455C38B997A }, { 0x4724BD4189BD5EAC, 0x8EDF98B59A373FEC }, // 1e102
+    { 0x58EDEC91EC2CB657, 0xB2977EE300C50FE7 }, { 0x2F2967B66737E3ED, 0xDF3D5E9BC0F653E1 }, // 1e104
+    { 0xBD79E0D20082EE74, 0x8B865B215899F46C }, { 0xECD8590680A3AA11, 0xAE67F1E9AEC07187 }, // 1e106
+    { 0xE80E6F4820CC9495, 0xDA01EE641A708DE9 }, { 0x3109058D147FDCDD, 0x884134FE908658B2 }, // 1e108
+    { 0xBD4B46F0599FD415, 0xAA51823E34A7EEDE }, { 0x6C9E18AC7007C91A, 0xD4E5E2CDC1D1EA96 }, // 1e110
+    { 0x03E2CF6BC604DDB0, 0x850FADC09923329E }, { 0x84DB8346B786151C, 0xA6539930BF6BFF45 }, // 1e112
+    { 0xE612641865679A63, 0xCFE87F7CEF46FF16 }, { 0x4FCB7E8F3F60C07E, 0x81F14FAE158C5F6E }, // 1e114
+    { 0xE3BE5E330F38F09D, 0xA26DA3999AEF7749 }, { 0x5CADF5BFD3072CC5, 0xCB090C8001AB551C }, // 1e116
+    { 0x73D9732FC7C8F7F6, 0xFDCB4FA002162A63 }, { 0x2867E7FDDCDD9AFA, 0x9E9F11C4014DDA7E }, // 1e118
+    { 0xB281E1FD541501B8, 0xC646D63501A1511D }, { 0x1F225A7CA91A4226, 0xF7D88BC24209A565 }, // 1e120
+    { 0x3375788DE9B06958, 0x9AE757596946075F }, { 0x0052D6B1641C83AE, 0xC1A12D2FC3978937 }, // 1e122
+    { 0xC0678C5DBD23A49A, 0xF209787BB47D6B84 }, { 0xF840B7BA963646E0, 0x9745EB4D50CE6332 }, // 1e124
+    { 0xB650E5A93BC3D898, 0xBD176620A501FBFF }, { 0xA3E51F138AB4CEBE, 0xEC5D3FA8CE427AFF }, // 1e126
+    { 0xC66F336C36B10137, 0x93BA47C980E98CDF }, { 0xB80B0047445D4184, 0xB8A8D9BBE123F017 }, // 1e128
+    { 0xA60DC059157491E5, 0xE6D3102AD96CEC1D }, { 0x87C89837AD68DB2F, 0x9043EA1AC7E41392 }, // 1e130
+    { 0x29BABE4598C311FB, 0xB454E4A179DD1877 }, { 0xF4296DD6FEF3D67A, 0xE16A1DC9D8545E94 }, // 1e132
+    { 0x1899E4A65F58660C, 0x8CE2529E2734BB1D }, { 0x5EC05DCFF72E7F8F, 0xB01AE745B101E9E4 }, // 1e134
+    { 0x76707543F4FA1F73, 0xDC21A1171D42645D }, { 0x6A06494A791C53A8, 0x899504AE72497EBA }, // 1e136
+    { 0x0487DB9D17636892, 0xABFA45DA0EDBDE69 }, { 0x45A9D2845D3C42B6, 0xD6F8D7509292D603 }, // 1e138
+    { 0x0B8A2392BA45A9B2, 0x865B86925B9BC5C2 }, { 0x8E6CAC7768D7141E, 0xA7F26836F282B732 }, // 1e140
+    { 0x3207D795430CD926, 0xD1EF0244AF2364FF }, { 0x7F44E6BD49E807B8, 0x8335616AED761F1F }, // 1e142
+    { 0x5F16206C9C6209A6, 0xA402B9C5A8D3A6E7 }, { 0x36DBA887C37A8C0F, 0xCD036837130890A1 }, // 1e144
+    { 0xC2494954DA2C9789, 0x802221226BE55A64 }, { 0xF2DB9BAA10B7BD6C, 0xA02AA96B06DEB0FD }, // 1e146
+    { 0x6F92829494E5ACC7, 0xC83553C5C8965D3D }, { 0xCB772339BA1F17F9, 0xFA42A8B73ABBF48C }, // 1e148
+    { 0xFF2A760414536EFB, 0x9C69A97284B578D7 }, { 0xFEF5138519684ABA, 0xC38413CF25E2D70D }, // 1e150
+    { 0x7EB258665FC25D69, 0xF46518C2EF5B8CD1 }, { 0xEF2F773FFBD97A61, 0x98BF2F79D5993802 }, // 1e152
+    { 0xAAFB550FFACFD8FA, 0xBEEEFB584AFF8603 }, { 0x95BA2A53F983CF38, 0xEEAABA2E5DBF6784 }, // 1e154
+    { 0xDD945A747BF26183, 0x952AB45CFA97A0B2 }, { 0x94F971119AEEF9E4, 0xBA756174393D88DF }, // 1e156
+    { 0x7A37CD5601AAB85D, 0xE912B9D1478CEB17 }, { 0xAC62E055C10AB33A, 0x91ABB422CCB812EE }, // 1e158
+    { 0x577B986B314D6009, 0xB616A12B7FE617AA }, { 0xED5A7E85FDA0B80B, 0xE39C49765FDF9D94 }, // 1e160
+    { 0x14588F13BE847307, 0x8E41ADE9FBEBC27D }, { 0x596EB2D8AE258FC8, 0xB1D219647AE6B31C }, // 1e162
+    { 0x6FCA5F8ED9AEF3BB, 0xDE469FBD99A05FE3 }, { 0x25DE7BB9480D5854, 0x8AEC23D680043BEE }, // 1e164
+    { 0xAF561AA79A10AE6A, 0xADA72CCC20054AE9 }, { 0x1B2BA1518094DA04, 0xD910F7FF28069DA4 }, // 1e166
+    { 0x90FB44D2F05D0842, 0x87AA9AFF79042286 }, { 0x353A1607AC744A53, 0xA99541BF57452B28 }, // 1e168
+    { 0x42889B8997915CE8, 0xD3FA922F2D1675F2 }, { 0x69956135FEBADA11, 0x847C9B5D7C2E09B7 }, // 1e170
+    { 0x43FAB9837E699095, 0xA59BC234DB398C25 }, { 0x94F967E45E03F4BB, 0xCF02B2C21207EF2E }, // 1e172
+    { 0x1D1BE0EEBAC278F5, 0x8161AFB94B44F57D }, { 0x6462D92A69731732, 0xA1BA1BA79E1632DC }, // 1e174
+    { 0x7D7B8F7503CFDCFE, 0xCA28A291859BBF93 }, { 0x5CDA735244C3D43E, 0xFCB2CB35E702AF78 }, // 1e176
+    { 0x3A0888136AFA64A7, 0x9DEFBF01B061ADAB }, { 0x088AAA1845B8FDD0, 0xC56BAEC21C7A1916 }, // 1e178
+    { 0x8AAD549E57273D45, 0xF6C69A72A3989F5B }, { 0x36AC54E2F678864B, 0x9A3C2087A63F6399 }, // 1e180
+    { 0x84576A1BB416A7DD, 0xC0CB28A98FCF3C7F }, { 0x656D44A2A11C51D5, 0xF0FDF2D3F3C30B9F }, // 1e182
+    { 0x9F644AE5A4B1B325, 0x969EB7C47859E743 }, { 0x873D5D9F0DDE1FEE, 0xBC4665B596706114 }, // 1e184
+    { 0xA90CB506D155A7EA, 0xEB57FF22FC0C7959 }, { 0x09A7F12442D588F2, 0x9316FF75DD87CBD8 }, // 1e186
+    { 0x0C11ED6D538AEB2F, 0xB7DCBF5354E9BECE }, { 0x8F1668C8A86DA5FA, 0xE5D3EF282A242E81 }, // 1e188
+    { 0xF96E017D694487BC, 0x8FA475791A569D10 }, { 0x37C981DCC395A9AC, 0xB38D92D760EC4455 }, // 1e190
+    { 0x85BBE253F47B1417, 0xE070F78D3927556A }, { 0x93956D7478CCEC8E, 0x8C469AB843B89562 }, // 1e192
+    { 0x387AC8D1970027B2, 0xAF58416654A6BABB }, { 0x06997B05FCC0319E, 0xDB2E51BFE9D0696A }, // 1e194
+    { 0x441FECE3BDF81F03, 0x88FCF317F22241E2 }, { 0xD527E81CAD7626C3, 0xAB3C2FDDEEAAD25A }, // 1e196
+    { 0x8A71E223D8D3B074, 0xD60B3BD56A5586F1 }, { 0xF6872D5667844E49, 0x85C7056562757456 }, // 1e198
+    { 0xB428F8AC016561DB, 0xA738C6BEBB12D16C }, { 0xE13336D701BEBA52, 0xD106F86E69D785C7 }, // 1e200
+    { 0xECC0024661173473, 0x82A45B450226B39C }, { 0x27F002D7F95D0190, 0xA34D721642B06084 }, // 1e202
+    { 0x31EC038DF7B441F4, 0xCC20CE9BD35C78A5 }, { 0x7E67047175A15271, 0xFF290242C83396CE }, // 1e204
+    { 0x0F0062C6E984D386, 0x9F79A169BD203E41 }, { 0x52C07B78A3E60868, 0xC75809C42C684DD1 }, // 1e206
+    { 0xA7709A56CCDF8A82, 0xF92E0C3537826145 }, { 0x88A66076400BB691, 0x9BBCC7A142B17CCB }, // 1e208
+    { 0x6ACFF893D00EA435, 0xC2ABF989935DDBFE }, { 0x0583F6B8C4124D43, 0xF356F7EBF83552FE }, // 1e210
+    { 0xC3727A337A8B704A, 0x98165AF37B2153DE }, { 0x744F18C0592E4C5C, 0xBE1BF1B059E9A8D6 }, // 1e212
+    { 0x1162DEF06F79DF73, 0xEDA2EE1C7064130C }, { 0x8ADDCB5645AC2BA8, 0x9485D4D1C63E8BE7 }, // 1e214
+    { 0x6D953E2BD7173692, 0xB9A74A0637CE2EE1 }, { 0xC8FA8DB6CCDD0437, 0xE8111C87C5C1BA99 }, // 1e216
+    { 0x1D9C9892400A22A2, 0x910AB1D4DB9914A0 }, { 0x2503BEB6D00CAB4B, 0xB54D5E4A127F59C8 }, // 1e218
+    { 0x2E44AE64840FD61D, 0xE2A0B5DC971F303A }, { 0x5CEAECFED289E5D2, 0x8DA471A9DE737E24 }, // 1e220
+    { 0x7425A83E872C5F47, 0xB10D8E1456105DAD }, { 0xD12F124E28F77719, 0xDD50F1996B947518 }, // 1e222
+    { 0x82BD6B70D99AAA6F, 0x8A5296FFE33CC92F }, { 0x636CC64D1001550B, 0xACE73CBFDC0BFB7B }, // 1e224
+    { 0x3C47F7E05401AA4E, 0xD8210BEFD30EFA5A }, { 0x65ACFAEC34810A71, 0x8714A775E3E95C78 }, // 1e226
+    { 0x7F1839A741A14D0D, 0xA8D9D1535CE3B396 }, { 0x1EDE48111209A050, 0xD31045A8341CA07C }, // 1e228
+    { 0x934AED0AAB460432, 0x83EA2B892091E44D }, { 0xF81DA84D5617853F, 0xA4E4B66B68B65D60 }, // 1e230
+    { 0x36251260AB9D668E, 0xCE1DE40642E3F4B9 }, { 0xC1D72B7C6B426019, 0x80D2AE83E9CE78F3 }, // 1e232
+    { 0xB24CF65B8612F81F, 0xA1075A24E4421730 }, { 0xDEE033F26797B627, 0xC94930AE1D529CFC }, // 1e234
+    { 0x169840EF017DA3B1, 0xFB9B7CD9A4A7443C }, { 0x8E1F289560EE864E, 0x9D412E0806E88AA5 }, // 1e236
+    { 0xF1A6F2BAB92A27E2, 0xC491798A08A2AD4E }, { 0xAE10AF696774B1DB, 0xF5B5D7EC8ACB58A2 }, // 1e238
+    { 0xACCA6DA1E0A8EF29, 0x9991A6F3D6BF1765 }, { 0x17FD090A58D32AF3, 0xBFF610B0CC6EDD3F }, // 1e240
+    { 0xDDFC4B4CEF07F5B0, 0xEFF394DCFF8A948E }, { 0x4ABDAF101564F98E, 0x95F83D0A1FB69CD9 }, // 1e242
+    { 0x9D6D1AD41ABE37F1, 0xBB764C4CA7A4440F }, { 0x84C86189216DC5ED, 0xEA53DF5FD18D5513 }, // 1e244
+    { 0x32FD3CF5B4E49BB4, 0x92746B9BE2F8552C }, { 0x3FBC8C33221DC2A1, 0xB7118682DBB66A77 }, // 1e246
+    { 0x0FABAF3FEAA5334A, 0xE4D5E82392A40515 }, { 0x29CB4D87F2A7400E, 0x8F05B1163BA6832D }, // 1e248
+    { 0x743E20E9EF511012, 0xB2C71D5BCA9023F8 }, { 0x914DA9246B255416, 0xDF78E4B2BD342CF6 }, // 1e250
+    { 0x1AD089B6C2F7548E, 0x8BAB8EEFB6409C1A }, { 0xA184AC2473B529B1, 0xAE9672ABA3D0C320 }, // 1e252
+    { 0xC9E5D72D90A2741E, 0xDA3C0F568CC4F3E8 }, { 0x7E2FA67C7A658892, 0x8865899617FB1871 }, // 1e254
+    { 0xDDBB901B98FEEAB7, 0xAA7EEBFB9DF9DE8D }, { 0x552A74227F3EA565, 0xD51EA6FA85785631 }, // 1e256
+    { 0xD53A88958F87275F, 0x8533285C936B35DE }, { 0x8A892ABAF368F137, 0xA67FF273B8460356 }, // 1e258
+    { 0x2D2B7569B0432D85, 0xD01FEF10A657842C }, { 0x9C3B29620E29FC73, 0x8213F56A67F6B29B }, // 1e260
+    { 0x8349F3BA91B47B8F, 0xA298F2C501F45F42 }, { 0x241C70A936219A73, 0xCB3F2F7642717713 }, // 1e262
+    { 0xED238CD383AA0110, 0xFE0EFB53D30DD4D7 }, { 0xF4363804324A40AA, 0x9EC95D1463E8A506 }, // 1e264
+    { 0xB143C6053EDCD0D5, 0xC67BB4597CE2CE48 }, { 0xDD94B7868E94050A, 0xF81AA16FDC1B81DA }, // 1e266
+    { 0xCA7CF2B4191C8326, 0x9B10A4E5E9913128 }, { 0xFD1C2F611F63A3F0, 0xC1D4CE1F63F57D72 }, // 1e268
+    { 0xBC633B39673C8CEC, 0xF24A01A73CF2DCCF }, { 0xD5BE0503E085D813, 0x976E41088617CA01 }, // 1e270
+    { 0x4B2D8644D8A74E18, 0xBD49D14AA79DBC82 }, { 0xDDF8E7D60ED1219E, 0xEC9C459D51852BA2 }, // 1e272
+    { 0xCABB90E5C942B503, 0x93E1AB8252F33B45 }, { 0x3D6A751F3B936243, 0xB8DA1662E7B00A17 }, // 1e274
+    { 0x0CC512670A783AD4, 0xE7109BFBA19C0C9D }, { 0x27FB2B80668B24C5, 0x906A617D450187E2 }, // 1e276
+    { 0xB1F9F660802DEDF6, 0xB484F9DC9641E9DA }, { 0x5E7873F8A0396973, 0xE1A63853BBD26451 }, // 1e278
+    { 0xDB0B487B6423E1E8, 0x8D07E33455637EB2 }, { 0x91CE1A9A3D2CDA62, 0xB049DC016ABC5E5F }, // 1e280
+    { 0x7641A140CC7810FB, 0xDC5C5301C56B75F7 }, { 0xA9E904C87FCB0A9D, 0x89B9B3E11B6329BA }, // 1e282
+    { 0x546345FA9FBDCD44, 0xAC2820D9623BF429 }, { 0xA97C177947AD4095, 0xD732290FBACAF133 }, // 1e284
+    { 0x49ED8EABCCCC485D, 0x867F59A9D4BED6C0 }, { 0x5C68F256BFFF5A74, 0xA81F301449EE8C70 }, // 1e286
+    { 0x73832EEC6FFF3111, 0xD226FC195C6A2F8C }, { 0xC831FD53C5FF7EAB, 0x83585D8FD9C25DB7 }, // 1e288
+    { 0xBA3E7CA8B77F5E55, 0xA42E74F3D032F525 }, { 0x28CE1BD2E55F35EB, 0xCD3A1230C43FB26F }, // 1e290
+    { 0x7980D163CF5B81B3, 0x80444B5E7AA7CF85 }, { 0xD7E105BCC332621F, 0xA0555E361951C366 }, // 1e292
+    { 0x8DD9472BF3FEFAA7, 0xC86AB5C39FA63440 }, { 0xB14F98F6F0FEB951, 0xFA856334878FC150 }, // 1e294
+    { 0x6ED1BF9A569F33D3, 0x9C935E00D4B9D8D2 }, { 0x0A862F80EC4700C8, 0xC3B8358109E84F07 }, // 1e296
+    { 0xCD27BB612758C0FA, 0xF4A642E14C6262C8 }, { 0x8038D51CB897789C, 0x98E7E9CCCFBD7DBD }, // 1e298
+    { 0xE0470A63E6BD56C3, 0xBF21E44003ACDD2C }, { 0x1858CCFCE06CAC74, 0xEEEA5D5004981478 }, // 1e300
+    { 0x0F37801E0C43EBC8, 0x95527A5202DF0CCB }, { 0xD30560258F54E6BA, 0xBAA718E68396CFFD }, // 1e302
+    { 0x47C6B82EF32A2069, 0xE950DF20247C83FD }, { 0x4CDC331D57FA5441, 0x91D28B7416CDD27E }, // 1e304
+    { 0xE0133FE4ADF8E952, 0xB6472E511C81471D }, { 0x58180FDDD97723A6, 0xE3D8F9E563A198E5 }, // 1e306
+    { 0x570F09EAA7EA7648, 0x8E679C2F5E44FF8F },                                         // 1e308
+};
+
+// Powers of ten that are exact doubles
+const double exact_pow10[23] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Full product of a and b; returns the low 64 bits, *hi the high
+unsigned long long mul_64x64(unsigned long long a, unsigned long long b, unsigned long long* hi) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 p = (unsigned __int128)a * b;
+    *hi = (unsigned long long)(p >> 64);
+    return (unsigned long long)p;
+#else
+    unsigned long long a_lo = a & 0xFFFFFFFFULL, a_hi = a >> 32, b_lo = b & 0xFFFFFFFFULL, b_hi = b >> 32;
+    unsigned long long ll = a_lo * b_lo, lh = a_lo * b_hi, hl = a_hi * b_lo, hh = a_hi * b_hi;
+    unsigned long long mid = (ll >> 32) + (lh & 0xFFFFFFFFULL) + (hl & 0xFFFFFFFFULL);
+    *hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+    return (mid << 32) | (ll & 0xFFFFFFFFULL);
+#endif
+}
+
+// Eisel-Lemire: w * 10^q (w != 0) correctly rounded, from the 128-bit
+// product of w with the table entry. Returns 0 when that product cannot
+// settle the rounding, or the result would be subnormal, infinite or out
+// of the table; the caller then falls back to strtod.
+int eisel_lemire(unsigned long long w, int q, double* num) {
+    if (q < POW10_MIN_EXP || q > POW10_MAX_EXP) return 0;
+    const unsigned long long* t = pow10_mantissas[q - POW10_MIN_EXP];
+    int shift = __builtin_clzll(w);
+    w <<= shift;
+    // 217706 / 2^16 approximates log2(10)
+    unsigned long long exp2 = (unsigned long long)(((217706 * q) >> 16) + 64 + 1023 - shift);
+
+    unsigned long long hi, lo = mul_64x64(w, t[1], &hi);
+    if ((hi & 0x1FF) == 0x1FF && lo + w < w) {
+        // The truncated product is too close to a rounding boundary: add
+        // in the low half of the table entry
+        unsigned long long y_hi, y_lo = mul_64x64(w, t[0], &y_hi);
+        unsigned long long merged_hi = hi, merged_lo = lo + y_hi;
+        if (merged_lo < lo) merged_hi++;
+        if ((merged_hi & 0x1FF) == 0x1FF && merged_lo + 1 == 0 && y_lo + w < w) return 0;
+        hi = merged_hi;
+        lo = merged_lo;
+    }
+
+    unsigned long long msb = hi >> 63;
+    unsigned long long mantissa = hi >> (msb + 9);
+    exp2 -= 1 ^ msb;
+    // Exactly halfway between two doubles: needs the exact decimal
+    if (lo == 0 && (hi & 0x1FF) == 0 && (mantissa & 3) == 1) return 0;
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >> 53) {
+        mantissa >>= 1;
+        exp2++;
+    }
+    if (exp2 - 1 >= 0x7FF - 1) return 0;
+    unsigned long long bits = exp2 << 52 | (mantissa & 0x000FFFFFFFFFFFFFULL);
+    memcpy(num, &bits, sizeof(bits));
+    return 1;
+}
+
+// Parse text[0..len) as a number, rounded exactly as strtod would but with
+// no locale lookups and no NUL-terminated copy. A decimal literal (digits,
+// optional fraction, optional e/E exponent) with at most 19 significant
+// digits is read into an integer and scaled by its power of ten: exactly
+// in double arithmetic when both are exact doubles (Clinger's fast path),
+// else by Eisel-Lemire. Longer literals, hex and the cases Eisel-Lemire
+// cannot settle go through strtod. Returns 0 if the span is not entirely
+// a number.
+int parse_number(const char* text, size_t len, double* num) {
+    unsigned long long w = 0;
+    int digits = 0, any = 0;
+    long q = 0;
+    size_t i = 0;
+
+    for (; i < len && text[i] >= '0' && text[i] <= '9'; i++) {
+        any = 1;
+        if (w == 0 && text[i] == '0') continue;
+        if (digits++ == 19) goto slow;
+        w = w * 10 + (unsigned)(text[i] - '0');
+    }
+    if (i < len && text[i] == '.') {
+        for (i++; i < len && text[i] >= '0' && text[i] <= '9'; i++) {
+            any = 1;
+            q--;
+            if (w == 0 && text[i] == '0') continue;
+            if (digits++ == 19) goto slow;
+            w = w * 10 + (unsigned)(text[i] - '0');
+        }
+    }
+    if (!any) return 0;
+    if (i < len && (text[i] == 'e' || text[i] == 'E')) {
+        size_t j = i + 1;
+        int negative = 0;
+        long e = 0;
+        if (j < len && (text[j] == '+' || text[j] == '-')) negative = text[j++] == '-';
+        if (j == len || text[j] < '0' || text[j] > '9') return 0;
+        for (; j < len && text[j] >= '0' && text[j] <= '9'; j++) {
+            if (e < 100000) e = e * 10 + (text[j] - '0');
+        }
+        q += negative ? -e : e;
+        i = j;
+    }
+    if (i < len) {
+        if (text[i] == 'x' || text[i] == 'X') goto slow;
+        return 0;
+    }
+
+    if (w == 0) {
+        *num = 0;
+        return 1;
+    }
+#if FLT_EVAL_METHOD == 0
+    if (w <= 1ULL << 53 && q >= -22 && q <= 22) {
+        *num = q < 0 ? (double)w / exact_pow10[-q] : (double)w * exact_pow10[q];
+        return 1;
+    }
+#endif
+    if (eisel_lemire(w, (int)q, num)) return 1;
+
+slow:;
+    char local[64];
+    ArenaMark mark = arena_mark(&thread_arena);
+    char* copy = len < sizeof(local) ? local : (char*)arena_alloc(&thread_arena, len + 1);
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    char* end;
+    *num = strtod(copy, &end);
+    int ok = len > 0 && end == copy + len;
+    arena_rewind(&thread_arena, mark);
+    return ok;
+}
+
+// Numbers (leading digit or '.', entirely a literal) become native
+// doubles; anything else is interned as a symbol.
+Value parse_value(const char* token) {
+    size_t len = strlen(token);
+    double num;
+    if ((isdigit((unsigned char)token[0]) || token[0] == '.') && parse_number(token, len, &num)) {
+        return make_number(num);
+    }
+    return make_symbol(token, len);
+}
+
+// An operand starting with a digit or '.' must be a whole number
+int operand_is_valid(const char* text, size_t len) {
+    double num;
+    return !(isdigit((unsigned char)text[0]) || text[0] == '.') || parse_number(text, len, &num);
+}
+
+// Sink writing space-separated postfix text after out->len at start
+typedef struct PostfixWriter {
+    TextBuf* out;
+    size_t start;
+} PostfixWriter;
+
+int postfix_writer_operand(void* ctx, const char* text, size_t len) {
+    PostfixWriter* w = (PostfixWriter*)ctx;
+    if (!operand_is_valid(text, len)) return 0;
+    if (w->out->len > w->start) text_putc(w->out, ' ');
+    text_append(w->out, text, len);
+    return 1;
+}
+
+void postfix_writer_op(void* ctx, char op) {
+    PostfixWriter* w = (PostfixWriter*)ctx;
+    if (w->out->len > w->start) text_putc(w->out, ' ');
+    text_putc(w->out, op);
+}
+
+// Append the postfix form of infix[0..len) to out, operands copied as
+// written. step/step_ctx optionally observe each step (see InfixSink).
+// Returns 1 on success, else 0 with *err set and out unchanged.
+int infix_to_postfix(const char* infix, size_t len, TextBuf* out,
+                     void (*step)(void*, InfixStep, const char*, size_t, size_t),
+                     void* step_ctx, InfixError* err) {
+    PostfixWriter w = { out, out->len };
+    InfixSink sink = { postfix_writer_operand, postfix_writer_op, &w, step, step_ctx };
+    if (shunting_yard(infix, len, &sink, err)) return 1;
+    out->len = w.start;
+    return 0;
+}
+
+// Step-trace recorder. Given a Trace, the conversions append one fixed-size
+// event per step to a ring buffer and draw nothing; without one they pay a
+// single pointer test. Viewers (replay_trace, dump_trace) rebuild the state
+// of any step from the events afterwards. Events use InfixStep as their
+// kind; the postfix conversion records only STEP_OPERAND and STEP_OPERATOR.
+typedef struct TraceEvent {
+    unsigned char kind;         // InfixStep
+    char op;                    // operator or parenthesis of the step, 0 for operands
+    unsigned char pushed;       // the step left a new entry on top of the stack
+    unsigned int depth;         // stack depth after the step
+    unsigned int pos, len;      // token span in the source
+    unsigned int cursor;        // infix: postfix length so far; postfix: source offset
+    int ref;                    // postfix: symbol id (operand) or DAG node (operator) pushed
+} TraceEvent;
+
+#define TRACE_DEFAULT_EVENTS (1 << 16)
+
+typedef struct Trace {
+    TraceEvent* events;         // ring holding the last capacity events
+    unsigned int capacity;      // a power of two
+    unsigned long long count;   // events recorded in total
+    TraceEvent* base;           // base[L - 1]: the push that filled level L, once it left the ring
+    unsigned int base_cap;
+    int postfix;                // recorded by the postfix-to-infix conversion
+    const char* src;
+    size_t src_len;
+    const TextBuf* out;         // infix: the postfix output cursors point into
+    const ExprDag* dag;         // postfix: owner of the nodes refs name
+} Trace;
+
+void trace_init(Trace* t, unsigned int capacity, int postfix, const char* src, size_t src_len) {
+    memset(t, 0, sizeof(*t));
+    t->capacity = 1;
+    while (t->capacity < capacity && t->capacity < (1u << 31)) t->capacity *= 2;
+    t->events = (TraceEvent*)checked_realloc(NULL, (size_t)t->capacity * sizeof(TraceEvent));
+    t->postfix = postfix;
+    t->src = src;
+    t->src_len = src_len;
+}
+
+void trace_free(Trace* t) {
+    free(t->events);
+    free(t->base);
+    memset(t, 0, sizeof(*t));
+}
+
+void trace_record(Trace* t, const TraceEvent* e) {
+    TraceEvent* slot = &t->events[t->count & (t->capacity - 1)];
+    if (t->count >= t->capacity && slot->pushed) {
+        // The oldest event leaves the ring; keep what it pushed, since its
+        // level may still be live
+        if (slot->depth > t->base_cap) {
+            unsigned int cap = t->base_cap ? t->base_cap : 64;
+            while (cap < slot->depth) cap *= 2;
+            t->base = (TraceEvent*)checked_realloc(t->base, (size_t)cap * sizeof(TraceEvent));
+            t->base_cap = cap;
+        }
+        t->base[slot->depth - 1] = *slot;
+    }
+    *slot = *e;
+    t->count++;
+}
+
+// Number of the oldest step still in the ring
+unsigned long long trace_first(const Trace* t) {
+    return t->count > t->capacity ? t->count - t->capacity : 0;
+}
+
+const TraceEvent* trace_event(const Trace* t, unsigned long long step) {
+    return &t->events[step & (t->capacity - 1)];
+}
+
+// The pushes holding the top n = min(depth, max) stack levels after step,
+// bottom first, into top[0..n); returns n. A level holds the latest push
+// that reached it, so this walks back only until each level is found.
+unsigned int trace_stack(const Trace* t, unsigned long long step, const TraceEvent** top, unsigned int max) {
+    unsigned int depth = trace_event(t, step)->depth;
+    unsigned int n = depth < max ? depth : max;
+    unsigned int lo = depth - n, missing = n;
+    for (unsigned int k = 0; k < n; k++) top[k] = NULL;
+    unsigned long long first = trace_first(t);
+    for (unsigned long long s = step + 1; missing > 0 && s-- > first;) {
+        const TraceEvent* e = trace_event(t, s);
+        if (e->pushed && e->depth > lo && e->depth <= depth && top[e->depth - lo - 1] == NULL) {
+            top[e->depth - lo - 1] = e;
+            missing--;
+        }
+    }
+    for (unsigned int k = 0; k < n; k++) {
+        if (top[k] == NULL) top[k] = &t->base[lo + k];
+    }
+    return n;
+}
+
+// InfixSink step observer recording into the Trace at ctx
+void trace_infix_step(void* ctx, InfixStep step, const char* token, size_t token_len, size_t nops) {
+    Trace* t = (Trace*)ctx;
+    TraceEvent e;
+    e.kind = (unsigned char)step;
+    e.op = step == STEP_OPERAND ? 0 : token[0];
+    e.pushed = step == STEP_OPEN_PAREN || step == STEP_OPERATOR;
+    e.depth = (unsigned int)nops;
+    // A drained operator comes from the stack, not the source
+    e.pos = (unsigned int)(step == STEP_DRAIN ? t->src_len : (size_t)(token - t->src));
+    e.len = step == STEP_DRAIN ? 0 : (unsigned int)token_len;
+    e.cursor = (unsigned int)t->out->len;
+    e.ref = 0;
+    trace_record(t, &e);
+}
+
+// Stack depth check of postfix text src[0..len) before anything runs:
+// operands are runs of letters, digits and '.', every other non-blank byte
+// is a binary operator. Returns the deepest stack the text reaches, else -1
+// with *err_pos at the first operator that lacks two operands, or len if
+// the text does not leave exactly one value.
+int verify_postfix(const char* src, size_t len, size_t* err_pos) {
+    int sp = 0, depth = 0, kind;
+    size_t start, end;
+    Lexer lx;
+
+    lex_init(&lx, src, len);
+    while ((kind = lex_next(&lx, &start, &end)) != TOKEN_END) {
+        if (kind == TOKEN_OPERAND) {
+            if (++sp > depth) depth = sp;
+        } else if (sp < 2) {
+            *err_pos = start;
+            return -1;
+        } else {
+            sp--;
+        }
+    }
+    if (sp != 1) {
+        *err_pos = len;
+        return -1;
+    }
+    return depth;
+}
+
+// Postfix to infix over src[0..len): operands are interned as symbols and
+// each operator becomes a node of d over the top two values. The text is
+// verified first, so malformed input records no steps. Records one step
+// per token into trace when given one. Returns 1 with *result set, else 0
+// with *err_pos as set by verify_postfix.
+int postfix_to_expr(const char* src, size_t len, ExprDag* d, Trace* trace, Value* result, size_t* err_pos) {
+    int depth = verify_postfix(src, len, err_pos);
+    if (depth < 0) return 0;
+
+    Value local[64];
+    ArenaMark mark = arena_mark(&thread_arena);
+    Value* stack = depth <= 64 ? local : (Value*)arena_alloc(&thread_arena, (size_t)depth * sizeof(Value));
+    int sp = 0, kind;
+    size_t start, end;
+    Lexer lx;
+
+    lex_init(&lx, src, len);
+    while ((kind = lex_next(&lx, &start, &end)) != TOKEN_END) {
+        if (kind == TOKEN_OPERAND) {
+            stack[sp++] = make_symbol(src + start, end - start);
+        } else {
+            stack[sp - 2] = make_node(d, stack[sp - 2], src[start], stack[sp - 1]);
+            sp--;
+        }
+        if (trace) {
+            Value top = stack[sp - 1];
+            TraceEvent e;
+            e.kind = top.type == VAL_EXPR ? STEP_OPERATOR : STEP_OPERAND;
+            e.op = top.type == VAL_EXPR ? src[start] : 0;
+            e.pushed = 1;
+            e.depth = (unsigned int)sp;
+            e.pos = (unsigned int)start;
+            e.len = (unsigned int)(end - start);
+            e.cursor = (unsigned int)end;
+            e.ref = top.type == VAL_EXPR ? top.as.expr : top.as.sym;
+            trace_record(trace, &e);
+        }
+    }
+    *result = stack[0];
+    arena_rewind(&thread_arena, mark);
+    return 1;
+}
+
+// What step did, in the words of the old step-by-step screens
+void trace_step_text(const Trace* t, const TraceEvent* e, char* buf, size_t size) {
+    int tlen = e->len > 40 ? 40 : (int)e->len;
+    const char* more = e->len > 40 ? "..." : "";
+    if (t->postfix) snprintf(buf, size, "Processed token '%.*s%s'", tlen, t->src + e->pos, more);
+    else if (e->kind == STEP_OPERAND) snprintf(buf, size, "Read operand: %.*s%s", tlen, t->src + e->pos, more);
+    else if (e->kind == STEP_OPEN_PAREN) snprintf(buf, size, "Push '(' onto operator stack.");
+    else if (e->kind == STEP_CLOSE_PAREN) snprintf(buf, size, "Pop operators until '(' found and discard it.");
+    else if (e->kind == STEP_OPERATOR) snprintf(buf, size, "Push operator '%c' onto stack.", e->op);
+    else snprintf(buf, size, "Pop remaining operator '%c'.", e->op);
+}
+
+// Show at most the top MAX_STACK_DISPLAY stack entries, bottom first
+#define MAX_STACK_DISPLAY 64
+
+// Append the stack after step, bottom first, each entry cut to
+// entry_limit characters; "..." marks entries below the ones shown.
+// Operators are separated by spaces, expressions by " | ".
+void trace_stack_text(const Trace* t, unsigned long long step, TextBuf* out, size_t entry_limit) {
+    const TraceEvent* top[MAX_STACK_DISPLAY];
+    unsigned int n = trace_stack(t, step, top, MAX_STACK_DISPLAY);
+    if (trace_event(t, step)->depth > n) text_append(out, "...", 3);
+    for (unsigned int k = 0; k < n; k++) {
+        if (out->len > 0) text_append(out, t->postfix ? " | " : " ", t->postfix ? 3 : 1);
+        if (t->postfix) {
+            Value v;
+            v.type = top[k]->kind == STEP_OPERATOR ? VAL_EXPR : VAL_SYM;
+            if (v.type == VAL_EXPR) v.as.expr = top[k]->ref;
+            else v.as.sym = top[k]->ref;
+            render_value(t->dag, v, NULL, out, entry_limit);
+        } else {
+            text_putc(out, top[k]->op);
+        }
+    }
+}
+
+// Text dump of every step still in the ring, one line each
+void dump_trace(const Trace* t, FILE* fp) {
+    unsigned long long first = trace_first(t);
+    static const char* kinds[] = { "operand", "open", "close", "operator", "drain" };
+    TextBuf stack = { NULL, 0, 0, NULL };
+    fprintf(fp, "# %llu steps", t->count);
+    if (first > 0) fprintf(fp, ", first %llu dropped from the ring", first);
+    fprintf(fp, "\n# step\tkind\ttoken\tdepth\t%s\tstack (bottom first)\n", t->postfix ? "input" : "postfix");
+    for (unsigned long long step = first; step < t->count; step++) {
+        const TraceEvent* e = trace_event(t, step);
+        stack.len = 0;
+        trace_stack_text(t, step, &stack, 40);
+        fprintf(fp, "%llu\t%s\t", step + 1, kinds[e->kind]);
+        if (e->len > 0) fprintf(fp, "%.*s", (int)e->len, t->src + e->pos);
+        else fputc(e->op, fp);
+        fprintf(fp, "\t%u\t%u\t%.*s\n", e->depth, e->cursor, (int)stack.len, stack.data);
+    }
+    free(stack.data);
+}
+
+void draw_trace_title(WINDOW* msg_win, const char* title) {
+    int width = getmaxx(msg_win);
+    werase(msg_win);
+    box(msg_win, 0, 0);
+    wattron(msg_win, COLOR_PAIR(5) | A_BOLD);
+    mvwprintw(msg_win, 0, (width - (int)strlen(title)) / 2, "%s", title);
+    wattroff(msg_win, COLOR_PAIR(5) | A_BOLD);
+}
+
+// Redraw at most this often while keys or the engine keep coming
+#define FRAME_MS 33
+#define ROW_TEXT 256
+
+// Rows inside a boxed window that remember what they show, so a frame
+// rewrites only the rows whose text or attributes changed
+typedef struct RowCache {
+    char* text;             // nrows * ROW_TEXT
+    int* attr;
+    int nrows;
+    long written;           // rows rewritten so far
+} RowCache;
+
+void row_cache_init(RowCache* rc, int nrows) {
+    rc->nrows = nrows > 0 ? nrows : 0;
+    rc->text = (char*)checked_realloc(NULL, (size_t)rc->nrows * ROW_TEXT + 1);
+    rc->attr = (int*)checked_realloc(NULL, (size_t)rc->nrows * sizeof(int) + 1);
+    rc->written = 0;
+    for (int r = 0; r < rc->nrows; r++) rc->attr[r] = -1;
+}
+
+// Forget what row y shows (all rows if y < 0), after something else drew there
+void row_cache_invalidate(RowCache* rc, int y) {
+    for (int r = 0; r < rc->nrows; r++) {
+        if (y < 0 || r == y - 1) rc->attr[r] = -1;
+    }
+}
+
+void row_cache_free(RowCache* rc) {
+    free(rc->text);
+    free(rc->attr);
+    memset(rc, 0, sizeof(*rc));
+}
+
+// Show text with attributes attr on row y (1 to nrows, below the top
+// border) of win, clipped to the border, unless the row already shows it
+void draw_row(WINDOW* win, RowCache* rc, int y, int attr, const char* text) {
+    if (y < 1 || y > rc->nrows) return;
+    char* shown = rc->text + (size_t)(y - 1) * ROW_TEXT;
+    int room = getmaxx(win) - 3;
+    if (room > ROW_TEXT - 1) room = ROW_TEXT - 1;
+    if (room < 0) room = 0;
+    if (rc->attr[y - 1] == attr && strncmp(shown, text, (size_t)room) == 0 &&
+        strlen(shown) == strnlen(text, (size_t)room)) return;
+    snprintf(shown, (size_t)room + 1, "%s", text);
+    rc->attr[y - 1] = attr;
+    rc->written++;
+    mvwhline(win, y, 1, ' ', getmaxx(win) - 2);
+    wattron(win, attr);
+    mvwprintw(win, y, 2, "%s", shown);
+    wattroff(win, attr);
+}
+
+// label then text[0..len) in buf, keeping the end of text when it does
+// not fit room columns
+void clip_tail(char* buf, size_t size, int room, const char* label, const char* text, size_t len) {
+    room -= (int)strlen(label);
+    if (room < 4) room = 4;
+    if (len > (size_t)room) snprintf(buf, size, "%s...%.*s", label, room - 3, text + len - (size_t)(room - 3));
+    else snprintf(buf, size, "%s%.*s", label, (int)len, text);
+}
+
+// Step through a recorded trace in win: any key moves forward and leaves
+// after the last step; Left/p goes back, Home/End and PgUp/PgDn jump, g
+// asks for a step number and q leaves. Keys that arrive while a frame is
+// drawn are applied together before the next one, so holding a key moves
+// through a long trace as fast as the terminal can show frames, and only
+// rows that changed are rewritten.
+void replay_trace(const Trace* t, WINDOW* win, const char* title) {
+    if (t->count == 0) return;
+    unsigned long long first = trace_first(t), step = first;
+    TextBuf stack = { NULL, 0, 0, NULL };
+    char text[96], row[ROW_TEXT];
+    int room = getmaxx(win) - 4, quit = 0;
+    RowCache rows;
+    row_cache_init(&rows, getmaxy(win) - 2);
+    keypad(win, TRUE);
+    draw_trace_title(win, title);
+
+    while (!quit) {
+        const TraceEvent* e = trace_event(t, step);
+        trace_step_text(t, e, text, sizeof(text));
+        snprintf(row, sizeof(row), "Step %llu of %llu: %s", step + 1, t->count, text);
+        draw_row(win, &rows, 1, 0, row);
+        stack.len = 0;
+        trace_stack_text(t, step, &stack, 40);
+        clip_tail(row, sizeof(row), room, t->postfix ? "Stack top-> " : "Operator stack top-> ", stack.data, stack.len);
+        draw_row(win, &rows, 2, 0, row);
+        if (t->postfix) clip_tail(row, sizeof(row), room, "Input read: ", t->src, e->cursor);
+        else clip_tail(row, sizeof(row), room, "Current postfix: ", t->out->data, e->cursor);
+        draw_row(win, &rows, 3, 0, row);
+        if (first > 0) {
+            snprintf(row, sizeof(row), "(steps 1-%llu were dropped from the trace ring)", first);
+            draw_row(win, &rows, 4, 0, row);
+        }
+        draw_row(win, &rows, 5, 0, "Any key: next  p/Left: back  Home/End  PgUp/PgDn  g: jump  q: quit");
+        wrefresh(win);
+
+        // Wait for a key, then take whatever else is already queued
+        wtimeout(win, -1);
+        for (int c = wgetch(win); c != ERR && !quit; c = wgetch(win)) {
+            if (c == 'q') quit = 1;
+            else if (c == 'p' || c == KEY_LEFT) {
+                if (step > first) step--;
+            } else if (c == KEY_HOME) {
+                step = first;
+            } else if (c == KEY_END) {
+                step = t->count - 1;
+            } else if (c == KEY_PPAGE) {
+                step = step - first > 100 ? step - 100 : first;
+            } else if (c == KEY_NPAGE) {
+                step = t->count - 1 - step > 100 ? step + 100 : t->count - 1;
+            } else if (c == 'g') {
+                char number[24];
+                wtimeout(win, -1);
+                mvwprintw(win, 5, 2, "Jump to step: ");
+                wclrtoeol(win);
+                echo();
+                wgetnstr(win, number, sizeof(number) - 1);
+                noecho();
+                box(win, 0, 0);
+                draw_trace_title(win, title);
+                row_cache_invalidate(&rows, -1);
+                unsigned long long target = strtoull(number, NULL, 10);
+                if (target > t->count) target = t->count;
+                step = target > first ? target - 1 : first;
+            } else {
+                if (step + 1 >= t->count) quit = 1;
+                else step++;
+            }
+            wtimeout(win, 0);
+        }
+    }
+    wtimeout(win, -1);
+    row_cache_free(&rows);
+    free(stack.data);
+}
+
+// Display infix to postfix conversion stepwise in message window: the
+// conversion runs once, recording a trace, which is then replayed.
+void infix_to_postfix_stepwise(const char* infix, WINDOW* msg_win) {
+    TextBuf postfix = { NULL, 0, 0, NULL };
+    Trace trace;
+    InfixError err;
+    size_t len = strlen(infix);
+
+    trace_init(&trace, TRACE_DEFAULT_EVENTS, 0, infix, len);
+    trace.out = &postfix;
+    int ok = infix_to_postfix(infix, len, &postfix, trace_infix_step, &trace, &err);
+
+    draw_trace_title(msg_win, " Infix to Postfix Trace ");
+    mvwprintw(msg_win, 1, 2, "Input infix: %s", infix);
+    mvwprintw(msg_win, 3, 2, "Press any key to step through conversion.");
+    wrefresh(msg_win);
+    wgetch(msg_win);
+    replay_trace(&trace, msg_win, " Infix to Postfix Trace ");
+
+    werase(msg_win);
+    box(msg_win, 0, 0);
+    if (ok) {
+        wattron(msg_win, COLOR_PAIR(3) | A_BOLD);
+        mvwprintw(msg_win, 2, 2, "Final Postfix Expression:");
+        wattroff(msg_win, COLOR_PAIR(3) | A_BOLD);
+        mvwprintw(msg_win, 3, 2, "%.*s", (int)postfix.len, postfix.data);
+        mvwprintw(msg_win, 5, 2, "Press any key to return to menu...");
+    } else {
+        wattron(msg_win, COLOR_PAIR(4) | A_BOLD);
+        if (err.status == INFIX_UNKNOWN_TOKEN) {
+            mvwprintw(msg_win, 1, 2, "Unknown token encountered: %c (column %zu)", infix[err.pos], err.pos + 1);
+        } else {
+            mvwprintw(msg_win, 1, 2, "Error: %s at column %zu.", infix_status_text(err.status), err.pos + 1);
+        }
+        wattroff(msg_win, COLOR_PAIR(4) | A_BOLD);
+    }
+    wrefresh(msg_win);
+    wgetch(msg_win);
+    trace_free(&trace);
+    free(postfix.data);
+}
+
+// Converts postfix to infix with stepwise display in msg_win
+void postfix_to_infix_stepwise(WINDOW *msg_win) {
+    char input[256];
+
+    // Clear and prompt input
+    werase(msg_win);
+    box(msg_win, 0, 0);
+    wattron(msg_win, COLOR_PAIR(3));
+    mvwprintw(msg_win, 1, 2, "Enter postfix expression (tokens separated by spaces): ");
+    wattroff(msg_win, COLOR_PAIR(3));
+    wrefresh(msg_win);
+
+    echo();
+    wmove(msg_win, 2, 2);
+    wclrtoeol(msg_win);
+    wrefresh(msg_win);
+    wgetnstr(msg_win, input, 255);
+    noecho();
+
+    size_t len = strlen(input), err_pos;
+    Trace trace;
+    Value result;
+    trace_init(&trace, TRACE_DEFAULT_EVENTS, 1, input, len);
+    trace.dag = &expressions;
+    // Malformed input is rejected before any step is recorded
+    int ok = postfix_to_expr(input, len, &expressions, &trace, &result, &err_pos);
+    if (ok) replay_trace(&trace, msg_win, " Postfix to Infix Trace ");
+    trace_free(&trace);
+
+    if (!ok) {
+        werase(msg_win);
+        box(msg_win, 0, 0);
+        wattron(msg_win, COLOR_PAIR(4) | A_BOLD);
+        if (err_pos < len) mvwprintw(msg_win, 1, 2, "Error: insufficient operands for operator '%c' at column %zu",
+                                     input[err_pos], err_pos + 1);
+        else mvwprintw(msg_win, 1, 2, "Error: invalid postfix expression, stack size not 1");
+        wattroff(msg_win, COLOR_PAIR(4) | A_BOLD);
+        wrefresh(msg_win);
+        wgetch(msg_win);
+        return;
+    }
+
+    // The only full rendering of the result
+    TextBuf infix = { NULL, 0, 0, NULL };
+    render_value(&expressions, result, NULL, &infix, (size_t)-1);
+
+    werase(msg_win);
+    box(msg_win, 0, 0);
+    wattron(msg_win, COLOR_PAIR(3) | A_BOLD);
+    mvwprintw(msg_win, 1, 2, "Postfix to Infix Conversion Complete");
+    mvwprintw(msg_win, 3, 2, "Infix expression: %.*s", (int)infix.len, infix.data);
+    wattroff(msg_win, COLOR_PAIR(3) | A_BOLD);
+    mvwprintw(msg_win, 5, 2, "Press any key to return to menu...");
+    wrefresh(msg_win);
+    wgetch(msg_win);
+    free(infix.data);
+}
+
+// Instruction set of the compiled stack machine
+typedef enum OpCode {
+    OP_PUSH,        // push consts[arg]
+    OP_POP,         // discard the top
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_POW,
+    OP_LOAD_VAR,    // push bindings[arg]
+    OP_DUP,         // push a copy of the top (optimizer output only)
+    OP_SQRT,        // replace the top with its square root (optimizer output only)
+    // Superinstructions, only produced by thread_program
+    OP_ADD_CONST,   // PUSH arg; ADD
+    OP_MUL_VAR,     // LOAD_VAR arg; MUL
+    OP_MUL_ADD,     // MUL; ADD
+    OP_HALT,        // end of threaded code
+    // Stack shuffles and control flow, only in assembled kernels (run_kernel)
+    OP_SWAP,        // a b -> b a
+    OP_OVER,        // a b -> a b a
+    OP_ROT,         // a b c -> b c a
+    OP_JMP,         // continue at arg
+    OP_JZ,          // pop; continue at arg if it was zero
+    OP_CALL,        // continue at arg, returning after this instruction
+    OP_RET,         // return from CALL; ends the kernel at the outermost level
+    OP_LOAD_IDX,    // replace the top i with memory[i]
+    OP_COUNT
+} OpCode;
+
+typedef struct Instr {
+    unsigned char op;
+    int arg;
+} Instr;
+
+const char* const opcode_names[OP_COUNT] = {
+    "PUSH", "POP", "ADD", "SUB", "MUL", "DIV", "POW", "LOAD_VAR", "DUP", "SQRT",
+    "ADD_CONST", "MUL_VAR", "MUL_ADD", "HALT",
+    "SWAP", "OVER", "ROT", "JMP", "JZ", "CALL", "RET", "LOAD_IDX"
+};
+
+// OpCode of a binary operator character, or -1
+int operator_opcode(char op) {
+    switch (op) {
+        case '+': return OP_ADD;
+        case '-': return OP_SUB;
+        case '*': return OP_MUL;
+        case '/': return OP_DIV;
+        case '^': return OP_POW;
+        default: return -1;
+    }
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Opt-in instrumentation of the execution paths, built with -DSM_INSTRUMENT:
+// executions and ticks (rdtsc cycles on x86, nanoseconds elsewhere) per
+// opcode, the stack high-water mark, and time spent tokenizing/compiling vs
+// executing (the sum over ops). Each thread counts into its own instrument; instrument_fold
+// adds it to instrument_total. Without SM_INSTRUMENT the INSTRUMENT_*
+// macros expand to nothing.
+#ifdef SM_INSTRUMENT
+typedef struct InstrumentStats {
+    unsigned long long op_count[OP_COUNT];
+    unsigned long long op_ticks[OP_COUNT];
+    unsigned long long tokenize_ticks;
+    unsigned long long execute_ticks;
+    unsigned long long evaluations;
+    unsigned long long allocs;      // checked_realloc calls
+    int peak_depth;
+} InstrumentStats;
+
+_Thread_local InstrumentStats instrument;
+_Thread_local unsigned long long instrument_allocs_seen;
+InstrumentStats instrument_total;
+pthread_mutex_t instrument_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef HAVE_X86_SIMD
+#define INSTRUMENT_TICK_UNIT "cycles"
+unsigned long long instrument_ticks(void) {
+    return __rdtsc();
+}
+#else
+#define INSTRUMENT_TICK_UNIT "ns"
+unsigned long long instrument_ticks(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+#endif
+
+#define INSTRUMENT_START(t) unsigned long long t = instrument_ticks()
+// Counts one op and adds its ticks to the op and to execute_ticks
+#define INSTRUMENT_OP(op, t) do { \
+        unsigned long long ticks_ = instrument_ticks() - (t); \
+        instrument.op_count[op]++; \
+        instrument.op_ticks[op] += ticks_; \
+        instrument.execute_ticks += ticks_; \
+    } while (0)
+#define INSTRUMENT_PHASE(field, t) (instrument.field += instrument_ticks() - (t))
+#define INSTRUMENT_COUNT(field) (instrument.field++)
+#define INSTRUMENT_DEPTH(d) do { if ((d) > instrument.peak_depth) instrument.peak_depth = (d); } while (0)
+
+// Add the calling thread's counters to instrument_total and restart them
+void instrument_fold(void) {
+    pthread_mutex_lock(&instrument_lock);
+    for (int op = 0; op < OP_COUNT; op++) {
+        instrument_total.op_count[op] += instrument.op_count[op];
+        instrument_total.op_ticks[op] += instrument.op_ticks[op];
+    }
+    instrument_total.tokenize_ticks += instrument.tokenize_ticks;
+    instrument_total.execute_ticks += instrument.execute_ticks;
+    instrument_total.evaluations += instrument.evaluations;
+    instrument_total.allocs += alloc_calls - instrument_allocs_seen;
+    if (instrument.peak_depth > instrument_total.peak_depth) instrument_total.peak_depth = instrument.peak_depth;
+    pthread_mutex_unlock(&instrument_lock);
+    memset(&instrument, 0, sizeof(instrument));
+    instrument_allocs_seen = alloc_calls;
+}
+
+// Write instrument_total as one JSON line, or as csv rows
+// "elapsed_s,name,count,ticks" (phases and totals use their own names)
+void instrument_write(FILE* fp, int csv, double elapsed) {
+    pthread_mutex_lock(&instrument_lock);
+    const InstrumentStats* s = &instrument_total;
+    if (csv) {
+        fprintf(fp, "%.3f,evaluations,%llu,0\n", elapsed, s->evaluations);
+        fprintf(fp, "%.3f,peak_depth,%d,0\n", elapsed, s->peak_depth);
+        fprintf(fp, "%.3f,allocs,%llu,0\n", elapsed, s->allocs);
+        fprintf(fp, "%.3f,tokenize,0,%llu\n", elapsed, s->tokenize_ticks);
+        fprintf(fp, "%.3f,execute,0,%llu\n", elapsed, s->execute_ticks);
+        for (int op = 0; op < OP_COUNT; op++) {
+            if (s->op_count[op]) fprintf(fp, "%.3f,%s,%llu,%llu\n", elapsed, opcode_names[op], s->op_count[op], s->op_ticks[op]);
+        }
+    } else {
+        fprintf(fp, "{\"elapsed_s\": %.3f, \"tick_unit\": \"%s\", \"evaluations\": %llu, \"peak_depth\": %d, "
+                "\"allocs\": %llu, \"tokenize_ticks\": %llu, \"execute_ticks\": %llu, \"ops\": {",
+                elapsed, INSTRUMENT_TICK_UNIT, s->evaluations, s->peak_depth, s->allocs,
+                s->tokenize_ticks, s->execute_ticks);
+        const char* sep = "";
+        for (int op = 0; op < OP_COUNT; op++) {
+            if (s->op_count[op] == 0) continue;
+            fprintf(fp, "%s\"%s\": {\"count\": %llu, \"ticks\": %llu}", sep, opcode_names[op], s->op_count[op], s->op_ticks[op]);
+            sep = ", ";
+        }
+        fprintf(fp, "}}\n");
+    }
+    fflush(fp);
+    pthread_mutex_unlock(&instrument_lock);
+}
+
+// Periodic snapshots for batch mode (--stats); fp is NULL when off
+typedef struct InstrumentLog {
+    FILE* fp;
+    int csv;
+    double interval;
+    double start;
+    double last;
+} InstrumentLog;
+
+InstrumentLog instrument_log;
+
+// Write a snapshot if interval seconds have passed since the last, or
+// always when force is set. Only the main thread calls this.
+void instrument_log_tick(int force) {
+    InstrumentLog* log = &instrument_log;
+    if (log->fp == NULL) return;
+    double now = now_seconds();
+    if (!force && now - log->last < log->interval) return;
+    instrument_fold();
+    instrument_write(log->fp, log->csv, now - log->start);
+    log->last = now;
+}
+
+#define INSTRUMENT_FOLD() instrument_fold()
+#define INSTRUMENT_LOG(force) instrument_log_tick(force)
+#else
+// Statements even when off, so `if (...) INSTRUMENT_LOG(0);` keeps a body
+#define INSTRUMENT_START(t) ((void)0)
+#define INSTRUMENT_OP(op, t) ((void)0)
+#define INSTRUMENT_PHASE(field, t) ((void)0)
+#define INSTRUMENT_COUNT(field) ((void)0)
+#define INSTRUMENT_DEPTH(d) ((void)0)
+#define INSTRUMENT_FOLD() ((void)0)
+#define INSTRUMENT_LOG(force) ((void)0)
+#endif
+
+// Exact integer arithmetic. Integers below 2^53 are exact doubles, and so
+// is any power of them that stays below 2^53, so squaring in int64 gives
+// the same bits libm's pow would, in a fraction of the time.
+#define EXACT_LIMIT 9007199254740992.0      // 2^53
+
+// base^exp by squaring; 0 if it overflows int64
+int power_int(long long base, long long exp, long long* out) {
+    long long r = 1;
+    if (base == 1 || exp == 0) {
+        *out = 1;
+        return 1;
+    }
+    if (base == -1) {
+        *out = exp & 1 ? -1 : 1;
+        return 1;
+    }
+    for (;;) {
+        if ((exp & 1) && __builtin_mul_overflow(r, base, &r)) return 0;
+        exp >>= 1;
+        if (exp == 0) break;
+        if (__builtin_mul_overflow(base, base, &base)) return 0;
+    }
+    *out = r;
+    return 1;
+}
+
+// pow with integer operands and an exactly representable result done by
+// squaring. Zero keeps pow, which gives (-0)^3 its sign.
+double power(double a, double b) {
+    long long r;
+    if (a != 0 && fabs(a) < EXACT_LIMIT && a == (double)(long long)a &&
+        b >= 0 && b < EXACT_LIMIT && b == (double)(long long)b &&
+        power_int((long long)a, (long long)b, &r) && r <= (1LL << 53) && r >= -(1LL << 53)) {
+        return (double)r;
+    }
+    return pow(a, b);
+}
+
+// A number as the postfix evaluator carries it: an exact int64 while it
+// can be, else a double
+typedef struct ExactNum {
+    long long i;
+    double d;
+    int is_int;
+} ExactNum;
+
+ExactNum exact_int(long long i) {
+    ExactNum n = { i, (double)i, 1 };
+    return n;
+}
+
+ExactNum exact_double(double d) {
+    ExactNum n = { 0, d, 0 };
+    return n;
+}
+
+// A literal of digits only is read straight into an int64 when it fits;
+// anything else goes through parse_number, and an integral result below
+// 2^53 (2.0, 1e3) is still an integer
+int parse_exact(const char* text, size_t len, ExactNum* num) {
+    long long i = 0;
+    size_t k = 0;
+    while (k < len && text[k] >= '0' && text[k] <= '9' &&
+           !__builtin_mul_overflow(i, 10, &i) && !__builtin_add_overflow(i, text[k] - '0', &i)) k++;
+    if (k == len && len > 0) {
+        *num = exact_int(i);
+        return 1;
+    }
+    double d;
+    if (!parse_number(text, len, &d)) return 0;
+    *num = fabs(d) <= EXACT_LIMIT && d == (double)(long long)d ? exact_int((long long)d) : exact_double(d);
+    return 1;
+}
+
+// a op b. Integers stay exact through checked add, sub and mul, division
+// that leaves no remainder and non-negative powers; overflow, a remainder,
+// a negative power or a double operand make the result a double. Returns
+// 0 on division by zero or an unknown operator.
+int exact_binary(ExactNum a, char op, ExactNum b, ExactNum* r) {
+    long long i;
+    if (a.is_int && b.is_int) {
+        switch (op) {
+            case '+':
+                if (__builtin_add_overflow(a.i, b.i, &i)) break;
+                *r = exact_int(i);
+                return 1;
+            case '-':
+                if (__builtin_sub_overflow(a.i, b.i, &i)) break;
+                *r = exact_int(i);
+                return 1;
+            case '*':
+                if (__builtin_mul_overflow(a.i, b.i, &i)) break;
+                *r = exact_int(i);
+                return 1;
+            case '/':
+                if (b.i == 0) return 0;
+                if (b.i == -1 && a.i == LLONG_MIN) break;
+                if (a.i % b.i != 0) break;
+                *r = exact_int(a.i / b.i);
+                return 1;
+            case '^':
+                if (b.i < 0 || !power_int(a.i, b.i, &i)) break;
+                *r = exact_int(i);
+                return 1;
+        }
+    }
+    switch (op) {
+        case '+': *r = exact_double(a.d + b.d); return 1;
+        case '-': *r = exact_double(a.d - b.d); return 1;
+        case '*': *r = exact_double(a.d * b.d); return 1;
+        case '/':
+            if (b.d == 0) return 0;
+            *r = exact_double(a.d / b.d);
+            return 1;
+        case '^': *r = exact_double(power(a.d, b.d)); return 1;
+    }
+    return 0;
+}
+
+// Evaluate postfix expression with numeric tokens only, in exact integer
+// arithmetic where it can be (see exact_binary). The text is verified
+// first, so the loop runs without underflow checks on a stack of exactly
+// the depth it needs (in arena when deep); return 1 on success, result
+// filled, else 0
+int evaluate_postfix_in(const char* postfix, ExactNum* result, Arena* arena) {
+    size_t len = strlen(postfix), err_pos;
+    INSTRUMENT_START(verify_start);
+    int depth = verify_postfix(postfix, len, &err_pos);
+    INSTRUMENT_PHASE(tokenize_ticks, verify_start);
+    if (depth < 0) return 0;
+
+    ExactNum local[64];
+    ExactNum* stack = depth <= 64 ? local : (ExactNum*)arena_alloc(arena, (size_t)depth * sizeof(ExactNum));
+    int sp = 0, kind;
+    size_t start, end;
+    Lexer lx;
+
+    lex_init(&lx, postfix, len);
+    while ((kind = lex_next(&lx, &start, &end)) != TOKEN_END) {
+        // read operand (number), parsed in place from its span of the text;
+        // variables have no value here
+        if (kind == TOKEN_OPERAND) {
+            INSTRUMENT_START(token_start);
+            ExactNum num;
+            if (!isdigit((unsigned char)postfix[start]) && postfix[start] != '.') return 0;
+            if (!parse_exact(postfix + start, end - start, &num)) return 0;
+            INSTRUMENT_PHASE(tokenize_ticks, token_start);
+            INSTRUMENT_START(push_start);
+            stack[sp++] = num;
+            INSTRUMENT_OP(OP_PUSH, push_start);
+            INSTRUMENT_DEPTH(sp);
+        } else {
+            // operator; verification guarantees two operands
+            char op = postfix[start];
+            INSTRUMENT_START(op_start);
+
+            sp--;
+            if (!exact_binary(stack[sp - 1], op, stack[sp], &stack[sp - 1])) return 0;
+            INSTRUMENT_OP(operator_opcode(op), op_start);
+        }
+    }
+    INSTRUMENT_COUNT(evaluations);
+
+    *result = stack[0];
+    return 1;
+}
+
+int evaluate_postfix_exact(const char* postfix, ExactNum* result) {
+    ArenaMark mark = arena_mark(&thread_arena);
+    int ok = evaluate_postfix_in(postfix, result, &thread_arena);
+    arena_rewind(&thread_arena, mark);
+    return ok;
+}
+
+// The result rounded to a double
+int evaluate_postfix_numeric(const char* postfix, double* result) {
+    ExactNum num;
+    if (!evaluate_postfix_exact(postfix, &num)) return 0;
+    *result = num.d;
+    return 1;
+}
+
+// An expression compiled once and run many times. Variables are numbered
+// in order of first appearance; run_program takes their values in that
+// order.
+typedef struct Program {
+    Instr* code;
+    int len;
+    int code_capacity;
+    double* consts;
+    int nconsts;
+    int consts_capacity;
+    char** vars;
+    int nvars;
+    int vars_capacity;
+    Arena names;            // storage of the vars strings
+    int verified_depth;     // deepest stack, once verify_program accepted code; else 0
+} Program;
+
+#define PROGRAM_NAMES_BLOCK 128
+
+void init_program(Program* p) {
+    memset(p, 0, sizeof(*p));
+    p->names.min_block = PROGRAM_NAMES_BLOCK;
+}
+
+// Empties p but keeps its buffers, so one Program can be recompiled cheaply
+void clear_program(Program* p) {
+    arena_reset(&p->names);
+    p->len = 0;
+    p->nconsts = 0;
+    p->nvars = 0;
+    p->verified_depth = 0;
+}
+
+void free_program(Program* p) {
+    clear_program(p);
+    free(p->code);
+    free(p->consts);
+    free(p->vars);
+    arena_free(&p->names);
+    init_program(p);
+}
+
+void emit(Program* p, OpCode op, int arg) {
+    if (p->len == p->code_capacity) {
+        p->code_capacity = p->code_capacity ? p->code_capacity * 2 : 16;
+        p->code = (Instr*)checked_realloc(p->code, (size_t)p->code_capacity * sizeof(Instr));
+    }
+    p->code[p->len].op = (unsigned char)op;
+    p->code[p->len].arg = arg;
+    p->len++;
+    p->verified_depth = 0;
+}
+
+// Emits PUSH of a new constant num
+void emit_const(Program* p, double num) {
+    if (p->nconsts == p->consts_capacity) {
+        p->consts_capacity = p->consts_capacity ? p->consts_capacity * 2 : 8;
+        p->consts = (double*)checked_realloc(p->consts, (size_t)p->consts_capacity * sizeof(double));
+    }
+    p->consts[p->nconsts] = num;
+    emit(p, OP_PUSH, p->nconsts++);
+}
+
+// Emits PUSH for a numeric literal or LOAD_VAR for a name, given the span
+// text[0..len); 0 if malformed
+int emit_operand(Program* p, const char* text, size_t len) {
+    if (isdigit((unsigned char)text[0]) || text[0] == '.') {
+        double num;
+        if (!parse_number(text, len, &num)) return 0;
+        emit_const(p, num);
+        return 1;
+    }
+
+    int index = -1;
+    for (int v = 0; v < p->nvars && index < 0; v++) {
+        if (strncmp(p->vars[v], text, len) == 0 && p->vars[v][len] == '\0') index = v;
+    }
+    if (index < 0) {
+        if (p->nvars == p->vars_capacity) {
+            p->vars_capacity = p->vars_capacity ? p->vars_capacity * 2 : 8;
+            p->vars = (char**)checked_realloc(p->vars, (size_t)p->vars_capacity * sizeof(char*));
+        }
+        p->vars[p->nvars] = (char*)arena_alloc(&p->names, len + 1);
+        memcpy(p->vars[p->nvars], text, len);
+        p->vars[p->nvars][len] = '\0';
+        index = p->nvars++;
+    }
+    emit(p, OP_LOAD_VAR, index);
+    return 1;
+}
+
+void emit_operator(Program* p, char op) {
+    int code = operator_opcode(op);
+    if (code >= 0) emit(p, (OpCode)code, 0);
+}
+
+// Compute the stack depth at every instruction of p without running it.
+// Returns the deepest stack p reaches, else -1 with *error_pc (if given)
+// at the first instruction that underflows or is unknown, or p->len if p
+// does not end with exactly one value.
+int verify_program(const Program* p, int* error_pc) {
+    int sp = 0, depth = 0;
+    for (int pc = 0; pc < p->len; pc++) {
+        int op = p->code[pc].op;
+        if (op == OP_PUSH || op == OP_LOAD_VAR) sp++;
+        else if (op == OP_POP && sp >= 1) sp--;
+        else if (op >= OP_ADD && op <= OP_POW && sp >= 2) sp--;
+        else if (op == OP_DUP && sp >= 1) sp++;
+        else if (op == OP_SQRT && sp >= 1) continue;
+        else {
+            if (error_pc) *error_pc = pc;
+            return -1;
+        }
+        if (sp > depth) depth = sp;
+    }
+    if (sp != 1) {
+        if (error_pc) *error_pc = p->len;
+        return -1;
+    }
+    return depth;
+}
+
+// Deepest stack p reaches, or -1 if it is malformed; free when p was
+// verified as it was compiled
+int program_max_depth(const Program* p) {
+    return p->verified_depth ? p->verified_depth : verify_program(p, NULL);
+}
+
+// Compile postfix text such as "A 2 * B +" into p, which must have been
+// initialised; any previous contents are replaced. The stack depth is
+// tracked as tokens are read, so an operator without two operands is
+// rejected here rather than when the program runs.
+// Returns 1 on success, else 0 with *error_msg set, *error_pos (if given)
+// at the offending byte (len when values are left over) and p left empty.
+// postfix[0..len) need not be NUL-terminated; operands are read in place.
+int compile_postfix_span(const char* postfix, size_t len, Program* p, const char** error_msg, size_t* error_pos) {
+    size_t start, end;
+    int sp = 0, depth = 0, kind;
+    Lexer lx;
+
+    clear_program(p);
+    lex_init(&lx, postfix, len);
+    while ((kind = lex_next(&lx, &start, &end)) != TOKEN_END) {
+        if (kind == TOKEN_OPERAND) {
+            if (!emit_operand(p, postfix + start, end - start)) {
+                *error_msg = "malformed number";
+                if (error_pos) *error_pos = start;
+                clear_program(p);
+                return 0;
+            }
+            if (++sp > depth) depth = sp;
+        } else if (is_operator_char(postfix[start]) && sp >= 2) {
+            emit_operator(p, postfix[start]);
+            sp--;
+        } else {
+            *error_msg = is_operator_char(postfix[start]) ? "insufficient operands" : "unknown token";
+            if (error_pos) *error_pos = start;
+            clear_program(p);
+            return 0;
+        }
+    }
+    if (p->len > 0 && sp != 1) {
+        *error_msg = "insufficient operands";
+        if (error_pos) *error_pos = len;
+        clear_program(p);
+        return 0;
+    }
+    p->verified_depth = depth;
+    return 1;
+}
+
+int compile_postfix(const char* postfix, Program* p, const char** error_msg, size_t* error_pos) {
+    return compile_postfix_span(postfix, strlen(postfix), p, error_msg, error_pos);
+}
+
+int program_sink_operand(void* ctx, const char* text, size_t len) {
+    return emit_operand((Program*)ctx, text, len);
+}
+
+void program_sink_op(void* ctx, char op) {
+    emit_operator((Program*)ctx, op);
+}
+
+// Compile infix text such as "A+B*C" into p through shunting_yard, so
+// instructions come out in the same order as infix_to_postfix's tokens.
+// p must have been initialised; any previous contents are replaced.
+// Returns 1 on success, else 0 with *error_msg set and p left empty.
+// infix[0..len) need not be NUL-terminated.
+int compile_infix_span(const char* infix, size_t len, Program* p, const char** error_msg) {
+    InfixSink sink = { program_sink_operand, program_sink_op, p, NULL, NULL };
+    InfixError err;
+
+    clear_program(p);
+    *error_msg = NULL;
+    if (!shunting_yard(infix, len, &sink, &err)) {
+        *error_msg = infix_status_text(err.status);
+        clear_program(p);
+        return 0;
+    }
+    int depth = p->len ? verify_program(p, NULL) : 0;
+    if (depth < 0) {
+        *error_msg = "insufficient operands";
+        clear_program(p);
+        return 0;
+    }
+    p->verified_depth = depth;
+    return 1;
+}
+
+int compile_infix(const char* infix, Program* p, const char** error_msg) {
+    return compile_infix_span(infix, strlen(infix), p, error_msg);
+}
+
+// Evaluate a compiled program; bindings[i] is the value of p->vars[i].
+// Division follows IEEE rules (x/0 is inf or nan) so results do not depend
+// on how the program is executed. The stack is sized from the verified
+// depth and the loop has no underflow checks; programs that were not
+// verified when compiled are verified here first.
+// Returns 1 on success, result filled, else 0 (malformed program).
+int run_program(const Program* p, const double* bindings, double* result) {
+    int depth = program_max_depth(p);
+    if (depth < 0) return 0;
+    double local[64];
+    double* stack = local;
+    ArenaMark mark = { NULL, 0 };
+    if (depth > 64) {
+        mark = arena_mark(&thread_arena);
+        stack = (double*)arena_alloc(&thread_arena, (size_t)depth * sizeof(double));
+    }
+    int sp = 0;
+
+    for (int pc = 0; pc < p->len; pc++) {
+        Instr in = p->code[pc];
+        INSTRUMENT_START(op_start);
+        switch (in.op) {
+            case OP_PUSH: stack[sp++] = p->consts[in.arg]; break;
+            case OP_LOAD_VAR: stack[sp++] = bindings[in.arg]; break;
+            case OP_POP: sp--; break;
+            case OP_ADD: stack[sp - 2] = stack[sp - 2] + stack[sp - 1]; sp--; break;
+            case OP_SUB: stack[sp - 2] = stack[sp - 2] - stack[sp - 1]; sp--; break;
+            case OP_MUL: stack[sp - 2] = stack[sp - 2] * stack[sp - 1]; sp--; break;
+            case OP_DIV: stack[sp - 2] = stack[sp - 2] / stack[sp - 1]; sp--; break;
+            case OP_POW: stack[sp - 2] = power(stack[sp - 2], stack[sp - 1]); sp--; break;
+            case OP_DUP: stack[sp] = stack[sp - 1]; sp++; break;
+            case OP_SQRT: stack[sp - 1] = sqrt(stack[sp - 1]); break;
+        }
+        INSTRUMENT_OP(in.op, op_start);
+        INSTRUMENT_DEPTH(sp);
+    }
+    INSTRUMENT_COUNT(evaluations);
+
+    *result = stack[sp - 1];
+    if (stack != local) arena_rewind(&thread_arena, mark);
+    return 1;
+}
+
+// optimize_program levels. OPT_EXACT rewrites never change a result bit:
+// constant folding (with the same operations run_program would perform),
+// x*1, 1*x, x/1, x-0, x+(-0), (-0)+x, x^0, 1^x, and x/c -> x*(1/c) for
+// c a power of two. OPT_RELAXED adds rewrites that can differ for signed
+// zeros, infinities, NaN or in the last bit: x+0, 0+x, x-(-0), x*0, 0*x,
+// 0/x, x^1 (pow clears the sign of a NaN), x^2 -> x*x (glibc pow is not
+// always correctly rounded), x^-1 -> 1/x, and x^0.5 -> sqrt(x) (differs at
+// -0 and -inf).
+enum { OPT_NONE, OPT_EXACT, OPT_RELAXED };
+
+// A value on the optimizer's abstract stack: the instructions code[start..]
+// up to the next entry (or the end) compute it
+typedef struct OptValue {
+    int start;
+    int is_const;           // the code is a single PUSH of value
+    double value;
+} OptValue;
+
+int opt_const_index(Program* p, double value) {
+    for (int c = 0; c < p->nconsts; c++) {
+        if (memcmp(&p->consts[c], &value, sizeof(double)) == 0) return c;
+    }
+    if (p->nconsts == p->consts_capacity) {
+        p->consts_capacity = p->consts_capacity ? p->consts_capacity * 2 : 8;
+        p->consts = (double*)checked_realloc(p->consts, (size_t)p->consts_capacity * sizeof(double));
+    }
+    p->consts[p->nconsts] = value;
+    return p->nconsts++;
+}
+
+// Replace code[at..] with one PUSH of value
+void opt_set_const(Program* p, OptValue* v, int at, double value) {
+    p->len = at;
+    emit(p, OP_PUSH, opt_const_index(p, value));
+    v->start = at;
+    v->is_const = 1;
+    v->value = value;
+}
+
+int is_power_of_two(double c) {
+    int exp;
+    return c != 0 && isfinite(c) && fabs(frexp(c, &exp)) == 0.5 && isfinite(1 / c);
+}
+
+// Simplify p in place at the given level (see OPT_EXACT). Programs that use
+// anything beyond PUSH, LOAD_VAR, POP and the binary operators, or that
+// underflow, are left as they are. Returns the new instruction count.
+int optimize_program(Program* p, int level) {
+    if (level == OPT_NONE || p->len == 0) return p->len;
+    Instr local_code[64];
+    OptValue local_stack[64];
+    ArenaMark mark = arena_mark(&thread_arena);
+    Instr* code = p->len <= 64 ? local_code : (Instr*)arena_alloc(&thread_arena, (size_t)p->len * sizeof(Instr));
+    OptValue* stack = p->len <= 64 ? local_stack : (OptValue*)arena_alloc(&thread_arena, (size_t)p->len * sizeof(OptValue));
+    int relaxed = level >= OPT_RELAXED;
+    int n = p->len;
+    int sp = 0, ok = 1;
+
+    memcpy(code, p->code, (size_t)n * sizeof(Instr));
+    p->len = 0;
+    for (int pc = 0; pc < n && ok; pc++) {
+        Instr in = code[pc];
+        if (in.op == OP_PUSH || in.op == OP_LOAD_VAR) {
+            stack[sp].start = p->len;
+            stack[sp].is_const = in.op == OP_PUSH;
+            stack[sp].value = in.op == OP_PUSH ? p->consts[in.arg] : 0;
+            sp++;
+            emit(p, (OpCode)in.op, in.arg);
+            continue;
+        }
+        if (in.op == OP_POP) {
+            // The discarded value has no effects, so its code goes too
+            if (sp < 1) ok = 0;
+            else p->len = stack[--sp].start;
+            continue;
+        }
+        if (in.op < OP_ADD || in.op > OP_POW || sp < 2) {
+            ok = 0;
+            continue;
+        }
+
+        OptValue* lhs = &stack[sp - 2];
+        OptValue* rhs = &stack[sp - 1];
+        double a = lhs->value, b = rhs->value;
+        int op = in.op;
+        sp--;
+        if (lhs->is_const && rhs->is_const) {
+            double r = op == OP_ADD ? a + b : op == OP_SUB ? a - b : op == OP_MUL ? a * b
+                     : op == OP_DIV ? a / b : power(a, b);
+            opt_set_const(p, lhs, lhs->start, r);
+        } else if (rhs->is_const && ((op == OP_MUL && b == 1) || (op == OP_DIV && b == 1) ||
+                                     (op == OP_POW && b == 1 && relaxed) ||
+                                     (op == OP_SUB && b == 0 && !signbit(b)) ||
+                                     (op == OP_ADD && b == 0 && (signbit(b) || relaxed)) ||
+                                     (op == OP_SUB && b == 0 && relaxed))) {
+            p->len = rhs->start;
+        } else if (lhs->is_const && ((op == OP_MUL && a == 1) ||
+                                     (op == OP_ADD && a == 0 && (signbit(a) || relaxed)))) {
+            // Slide the right operand's code down over the constant
+            memmove(p->code + lhs->start, p->code + rhs->start, (size_t)(p->len - rhs->start) * sizeof(Instr));
+            p->len -= rhs->start - lhs->start;
+            lhs->is_const = 0;
+        } else if ((rhs->is_const && op == OP_POW && b == 0) || (lhs->is_const && op == OP_POW && a == 1)) {
+            opt_set_const(p, lhs, lhs->start, 1);
+        } else if (relaxed && ((rhs->is_const && op == OP_MUL && b == 0) ||
+                               (lhs->is_const && (op == OP_MUL || op == OP_DIV) && a == 0))) {
+            opt_set_const(p, lhs, lhs->start, 0);
+        } else if (rhs->is_const && op == OP_DIV && is_power_of_two(b)) {
+            p->code[rhs->start].arg = opt_const_index(p, 1 / b);
+            emit(p, OP_MUL, 0);
+        } else if (relaxed && rhs->is_const && op == OP_POW && b == 2) {
+            p->code[rhs->start].op = OP_DUP;
+            emit(p, OP_MUL, 0);
+        } else if (relaxed && rhs->is_const && op == OP_POW && b == 0.5) {
+            p->code[rhs->start].op = OP_SQRT;
+        } else if (relaxed && rhs->is_const && op == OP_POW && b == -1) {
+            // x -1 ^  ->  1 x /
+            memmove(p->code + lhs->start + 1, p->code + lhs->start,
+                    (size_t)(rhs->start - lhs->start) * sizeof(Instr));
+            p->code[lhs->start].op = OP_PUSH;
+            p->code[lhs->start].arg = opt_const_index(p, 1);
+            p->len = rhs->start + 1;
+            emit(p, OP_DIV, 0);
+        } else {
+            emit(p, (OpCode)op, 0);
+            lhs->is_const = 0;
+        }
+    }
+
+    if (!ok || sp != 1) {
+        memcpy(p->code, code, (size_t)n * sizeof(Instr));
+        p->len = n;
+    } else {
+        // Drop constants that folding left unused, renumbering in first-use order
+        int* remap = (int*)arena_alloc(&thread_arena, (size_t)(p->nconsts + 1) * sizeof(int));
+        double* consts = (double*)arena_alloc(&thread_arena, (size_t)(p->nconsts + 1) * sizeof(double));
+        int used = 0;
+        for (int c = 0; c < p->nconsts; c++) remap[c] = -1;
+        for (int pc = 0; pc < p->len; pc++) {
+            if (p->code[pc].op != OP_PUSH) continue;
+            int c = p->code[pc].arg;
+            if (remap[c] < 0) {
+                consts[used] = p->consts[c];
+                remap[c] = used++;
+            }
+            p->code[pc].arg = remap[c];
+        }
+        if (used) memcpy(p->consts, consts, (size_t)used * sizeof(double));
+        p->nconsts = used;
+    }
+    arena_rewind(&thread_arena, mark);
+    int depth = verify_program(p, NULL);
+    p->verified_depth = depth > 0 ? depth : 0;
+    return p->len;
+}
+
+// Computed-goto dispatch (a GNU extension) for the interpreter loops
+// below; -DNO_COMPUTED_GOTO builds use a switch instead
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define THREADED_DISPATCH 1
+#endif
+
+// Register form of a Program, the second execution tier. lower_program
+// gives each stack depth its own virtual register, so "LOAD A; LOAD B;
+// ADD" becomes "r0 = A; r1 = B; r0 = r0 + r1"; copy propagation then lets
+// the add read A and B where they live and dead-value elimination drops
+// the moves nobody reads, leaving "r0 = A + B". Operands are slots of one
+// frame laid out as [constants | variables | registers], so constants,
+// variables and registers are all read the same way. Each operation is
+// run_program's, on the same operands in the same order, so results match
+// it bit for bit.
+enum { REG_MOV, REG_ADD, REG_SUB, REG_MUL, REG_DIV, REG_POW, REG_SQRT, REG_RET, REG_COUNT };
+
+typedef struct RegInstr {
+    int op;
+    int dst;                // frame slot written (not used by REG_RET)
+    int a;                  // frame slots read; b by the binary operations only
+    int b;
+} RegInstr;
+
+typedef struct RegProgram {
+    RegInstr* code;         // ends with REG_RET
+    int len;
+    int code_capacity;
+    double* consts;         // copied from the source Program
+    int nconsts;
+    int consts_capacity;
+    int nvars;
+    int frame_size;         // nconsts + nvars + one register per stack slot
+    int stack_len;          // instructions in the source Program
+} RegProgram;
+
+void init_registers(RegProgram* rp) {
+    memset(rp, 0, sizeof(*rp));
+}
+
+void free_registers(RegProgram* rp) {
+    free(rp->code);
+    free(rp->consts);
+    init_registers(rp);
+}
+
+size_t registers_bytes(const RegProgram* rp) {
+    return (size_t)rp->code_capacity * sizeof(RegInstr) + (size_t)rp->consts_capacity * sizeof(double);
+}
+
+int reg_binary(int op) {
+    return op >= REG_ADD && op <= REG_POW;
+}
+
+void reg_emit(RegProgram* rp, int op, int dst, int a, int b) {
+    if (rp->len == rp->code_capacity) {
+        rp->code_capacity = rp->code_capacity ? rp->code_capacity * 2 : 16;
+        rp->code = (RegInstr*)checked_realloc(rp->code, (size_t)rp->code_capacity * sizeof(RegInstr));
+    }
+    RegInstr* in = &rp->code[rp->len++];
+    in->op = op;
+    in->dst = dst;
+    in->a = a;
+    in->b = b;
+}
+
+// Forward pass: an operand naming a register that still holds a copy of
+// another slot reads that slot instead. copy_of has frame_size entries.
+// Registers follow stack depth, so a copy of a register (made by DUP) is
+// only ever held by a register above it.
+void reg_copy_propagate(RegProgram* rp, int* copy_of) {
+    for (int s = 0; s < rp->frame_size; s++) copy_of[s] = -1;
+    for (int i = 0; i < rp->len; i++) {
+        RegInstr* in = &rp->code[i];
+        if (copy_of[in->a] >= 0) in->a = copy_of[in->a];
+        if (reg_binary(in->op) && copy_of[in->b] >= 0) in->b = copy_of[in->b];
+        if (in->op == REG_RET) continue;
+        // Writing dst ends every copy taken from it, and its own
+        for (int s = in->dst + 1; s < rp->frame_size; s++) {
+            if (copy_of[s] == in->dst) copy_of[s] = -1;
+        }
+        copy_of[in->dst] = in->op == REG_MOV && in->a != in->dst ? in->a : -1;
+    }
+}
+
+// Backward pass: drops instructions whose result is never read (every
+// operation is pure) and moves of a slot onto itself. live has
+// frame_size entries.
+void reg_eliminate_dead(RegProgram* rp, unsigned char* live) {
+    memset(live, 0, (size_t)rp->frame_size);
+    int out = rp->len;
+    for (int i = rp->len - 1; i >= 0; i--) {
+        RegInstr in = rp->code[i];
+        if (in.op != REG_RET) {
+            if (!live[in.dst] || (in.op == REG_MOV && in.a == in.dst)) continue;
+            live[in.dst] = 0;
+        }
+        live[in.a] = 1;
+        if (reg_binary(in.op)) live[in.b] = 1;
+        rp->code[--out] = in;
+    }
+    rp->len -= out;
+    memmove(rp->code, rp->code + out, (size_t)rp->len * sizeof(RegInstr));
+}
+
+// Lower the verified stack program p into rp, replacing its contents.
+// Returns 0 if p is empty or malformed.
+int lower_program(const Program* p, RegProgram* rp) {
+    int depth = program_max_depth(p);
+    if (depth <= 0) return 0;
+    rp->len = 0;
+    if (p->nconsts > rp->consts_capacity) {
+        rp->consts_capacity = p->nconsts;
+        rp->consts = (double*)checked_realloc(rp->consts, (size_t)rp->consts_capacity * sizeof(double));
+    }
+    if (p->nconsts) memcpy(rp->consts, p->consts, (size_t)p->nconsts * sizeof(double));
+    rp->nconsts = p->nconsts;
+    rp->nvars = p->nvars;
+    rp->stack_len = p->len;
+    int r = p->nconsts + p->nvars;      // register of stack slot 0
+    rp->frame_size = r + depth;
+
+    int sp = 0;
+    for (int pc = 0; pc < p->len; pc++) {
+        Instr in = p->code[pc];
+        switch (in.op) {
+            case OP_PUSH: reg_emit(rp, REG_MOV, r + sp, in.arg, 0); sp++; break;
+            case OP_LOAD_VAR: reg_emit(rp, REG_MOV, r + sp, p->nconsts + in.arg, 0); sp++; break;
+            case OP_DUP: reg_emit(rp, REG_MOV, r + sp, r + sp - 1, 0); sp++; break;
+            case OP_POP: sp--; break;
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_POW:
+                reg_emit(rp, REG_ADD + (in.op - OP_ADD), r + sp - 2, r + sp - 2, r + sp - 1);
+                sp--;
+                break;
+            case OP_SQRT: reg_emit(rp, REG_SQRT, r + sp - 1, r + sp - 1, 0); break;
+            default: return 0;
+        }
+    }
+    reg_emit(rp, REG_RET, 0, r + sp - 1, 0);
+
+    ArenaMark mark = arena_mark(&thread_arena);
+    int* copy_of = (int*)arena_alloc(&thread_arena, (size_t)rp->frame_size * sizeof(int));
+    unsigned char* live = (unsigned char*)arena_alloc(&thread_arena, (size_t)rp->frame_size);
+    reg_copy_propagate(rp, copy_of);
+    reg_eliminate_dead(rp, live);
+    arena_rewind(&thread_arena, mark);
+    return 1;
+}
+
+// Evaluate a lowered program; bindings[i] is the value of variable i of
+// the Program it came from. Returns 1 with *result filled.
+int run_registers(const RegProgram* rp, const double* bindings, double* result) {
+#ifdef THREADED_DISPATCH
+    static const void* const handlers[REG_COUNT] = {
+        &&do_mov, &&do_add, &&do_sub, &&do_mul, &&do_div, &&do_pow, &&do_sqrt, &&do_ret
+    };
+#define CASE(label, op) label:
+#define NEXT goto *handlers[(++ip)->op]
+#else
+#define CASE(label, op) case op:
+#define NEXT ip++; continue
+#endif
+
+    double local[128];
+    double* frame = local;
+    ArenaMark mark = { NULL, 0 };
+    if (rp->frame_size > 128) {
+        mark = arena_mark(&thread_arena);
+        frame = (double*)arena_alloc(&thread_arena, (size_t)rp->frame_size * sizeof(double));
+    }
+    // Copied a double at a time: memcpy's wide, overlapping stores cannot
+    // forward to the 8-byte loads that follow at once, and the stalls cost
+    // more than the whole evaluation
+    for (int i = 0; i < rp->nconsts; i++) frame[i] = rp->consts[i];
+    for (int i = 0; i < rp->nvars; i++) frame[rp->nconsts + i] = bindings[i];
+    const RegInstr* ip = rp->code;
+
+#ifdef THREADED_DISPATCH
+    goto *handlers[ip->op];
+#else
+    for (;;) {
+        switch (ip->op) {
+#endif
+    CASE(do_mov, REG_MOV)   frame[ip->dst] = frame[ip->a]; NEXT;
+    CASE(do_add, REG_ADD)   frame[ip->dst] = frame[ip->a] + frame[ip->b]; NEXT;
+    CASE(do_sub, REG_SUB)   frame[ip->dst] = frame[ip->a] - frame[ip->b]; NEXT;
+    CASE(do_mul, REG_MUL)   frame[ip->dst] = frame[ip->a] * frame[ip->b]; NEXT;
+    CASE(do_div, REG_DIV)   frame[ip->dst] = frame[ip->a] / frame[ip->b]; NEXT;
+    CASE(do_pow, REG_POW)   frame[ip->dst] = power(frame[ip->a], frame[ip->b]); NEXT;
+    CASE(do_sqrt, REG_SQRT) frame[ip->dst] = sqrt(frame[ip->a]); NEXT;
+    CASE(do_ret, REG_RET)
+        *result = frame[ip->a];
+        if (frame != local) arena_rewind(&thread_arena, mark);
+        return 1;
+#ifndef THREADED_DISPATCH
+        }
+    }
+#endif
+#undef CASE
+#undef NEXT
+}
+
+// Canonical text for cache keys: whitespace dropped except one blank
+// between adjacent operands (postfix needs it), "**" and the Unicode
+// operators x-sign, division sign, middle dot and minus sign rewritten to
+// their ASCII forms, and [] {} to (). The first byte records the syntax
+// ('i' infix, 'p' postfix). src[0..len) need not be NUL-terminated; out is
+// replaced and its text is.
+void normalize_expression(const char* src, size_t len, int postfix, TextBuf* out) {
+    const unsigned char* s = (const unsigned char*)src;
+    const unsigned char* end = s + len;
+    int pending_space = 0;
+    char last = 0;
+
+    // Never longer than the source plus the mode byte and the NUL
+    out->len = 0;
+    text_reserve(out, len + 2);
+    char* d = out->data;
+    *d++ = postfix ? 'p' : 'i';
+    while (s < end) {
+        char c = (char)*s;
+        size_t left = (size_t)(end - s);
+        int used = 1;
+        if (isspace(*s)) {
+            pending_space = 1;
+            s++;
+            continue;
+        }
+        if (left >= 2 && s[0] == '*' && s[1] == '*') { c = '^'; used = 2; }
+        else if (left >= 2 && s[0] == 0xC3 && s[1] == 0x97) { c = '*'; used = 2; }                  // U+00D7
+        else if (left >= 2 && s[0] == 0xC2 && s[1] == 0xB7) { c = '*'; used = 2; }                  // U+00B7
+        else if (left >= 2 && s[0] == 0xC3 && s[1] == 0xB7) { c = '/'; used = 2; }                  // U+00F7
+        else if (left >= 3 && s[0] == 0xE2 && s[1] == 0x88 && s[2] == 0x92) { c = '-'; used = 3; }  // U+2212
+        else if (c == '[' || c == '{') c = '(';
+        else if (c == ']' || c == '}') c = ')';
+
+        int operand = isalnum((unsigned char)c) || c == '.';
+        int last_operand = isalnum((unsigned char)last) || last == '.';
+        if (pending_space && operand && last_operand) *d++ = ' ';
+        *d++ = c;
+        last = c;
+        pending_space = 0;
+        s += used;
+    }
+    *d = '\0';
+    out->len = (size_t)(d - out->data);
+}
+
+// 1 if normalize_expression would rewrite an operator or bracket in
+// src[0..len). Text without one tokenizes the same as its normal form
+// (the tokenizers skip whitespace), so it can be compiled in place.
+int needs_normalizing(const char* src, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)src[i];
+        if (c >= 0x80 || c == '[' || c == ']' || c == '{' || c == '}') return 1;
+        if (c == '*' && i + 1 < len && src[i + 1] == '*') return 1;
+    }
+    return 0;
+}
+
+// 64-bit hash that consumes eight bytes per step
+unsigned long long hash_bytes(const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    unsigned long long h = 0x9E3779B97F4A7C15ULL ^ (len * 0xC2B2AE3D27D4EB4FULL);
+    while (len >= 8) {
+        unsigned long long w;
+        memcpy(&w, p, 8);
+        h = (h ^ (w * 0xC2B2AE3D27D4EB4FULL)) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+        p += 8;
+        len -= 8;
+    }
+    unsigned long long w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ (w * 0xC2B2AE3D27D4EB4FULL)) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 32;
+    h *= 0xD6E8FEB86659FD93ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+typedef struct CacheEntry {
+    char* key;                      // normalized text, NUL-terminated
+    size_t key_len;
+    unsigned long long hash;
+    size_t bytes;                   // charged against the cache capacity
+    int source_len;                 // instructions before optimize_program
+    Program program;
+    int uses;                       // lookups asking for the register form
+    RegProgram registers;           // lowered on the REG_TIER_USES-th of them
+    struct CacheEntry* prev;        // LRU list, most recently used first
+    struct CacheEntry* next;
+    struct CacheEntry* chain;       // hash bucket chain
+} CacheEntry;
+
+// Bounded LRU map from normalized expression text to its compiled Program
+typedef struct ExprCache {
+    CacheEntry** buckets;
+    size_t nbuckets;                // power of two
+    CacheEntry* head;
+    CacheEntry* tail;
+    size_t entries;
+    size_t bytes;
+    size_t capacity_bytes;
+    long hits;
+    long misses;
+    long evictions;
+    int opt_level;                  // applied once to each program compiled
+    long tiered;                    // entries lowered to registers
+    TextBuf key;                    // scratch for normalization
+} ExprCache;
+
+void cache_init(ExprCache* c, size_t capacity_bytes, int opt_level) {
+    memset(c, 0, sizeof(*c));
+    c->capacity_bytes = capacity_bytes;
+    c->opt_level = opt_level;
+    c->nbuckets = 256;
+    c->buckets = (CacheEntry**)checked_realloc(NULL, c->nbuckets * sizeof(CacheEntry*));
+    memset(c->buckets, 0, c->nbuckets * sizeof(CacheEntry*));
+}
+
+void cache_unlink(ExprCache* c, CacheEntry* e) {
+    if (e->prev) e->prev->next = e->next;
+    else c->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else c->tail = e->prev;
+}
+
+void cache_link_front(ExprCache* c, CacheEntry* e) {
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head) c->head->prev = e;
+    c->head = e;
+    if (c->tail == NULL) c->tail = e;
+}
+
+void cache_evict_lru(ExprCache* c) {
+    CacheEntry* e = c->tail;
+    CacheEntry** link = &c->buckets[e->hash & (c->nbuckets - 1)];
+    while (*link != e) link = &(*link)->chain;
+    *link = e->chain;
+    cache_unlink(c, e);
+    c->entries--;
+    c->bytes -= e->bytes;
+    c->evictions++;
+    free_program(&e->program);
+    free_registers(&e->registers);
+    free(e->key);
+    free(e);
+}
+
+void cache_grow_buckets(ExprCache* c) {
+    size_t n = c->nbuckets * 2;
+    CacheEntry** buckets = (CacheEntry**)checked_realloc(NULL, n * sizeof(CacheEntry*));
+    memset(buckets, 0, n * sizeof(CacheEntry*));
+    for (CacheEntry* e = c->head; e; e = e->next) {
+        e->chain = buckets[e->hash & (n - 1)];
+        buckets[e->hash & (n - 1)] = e;
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->nbuckets = n;
+}
+
+// Expressions are lowered to registers only once they are reused. Lowering
+// costs about as much as six stack evaluations of the same expression, so
+// an expression seen a few times is cheaper left on the stack.
+#define REG_TIER_USES 8
+
+// Register form of e, the most recently used entry, once it has been asked
+// for REG_TIER_USES times; NULL before then. Its bytes count against the
+// capacity like the program's.
+const RegProgram* cache_tier_up(ExprCache* c, CacheEntry* e) {
+    if (e->registers.len > 0) return &e->registers;
+    if (++e->uses < REG_TIER_USES || !lower_program(&e->program, &e->registers)) return NULL;
+    size_t bytes = registers_bytes(&e->registers);
+    e->bytes += bytes;
+    c->bytes += bytes;
+    c->tiered++;
+    while (c->tail != e && c->bytes > c->capacity_bytes) cache_evict_lru(c);
+    return &e->registers;
+}
+
+// Compiled (and optimized) form of src[0..len), from the cache when an equivalent
+// text was seen; *source_len, if given, receives the instruction count
+// before optimizing. If registers is given, *registers receives the
+// entry's register form once it has tiered up (see cache_tier_up), else
+// NULL. Both belong to the cache and stay valid until the next
+// cache_compile call. Returns NULL with *error_msg set if src does not
+// compile (failures are not cached).
+const Program* cache_compile(ExprCache* c, const char* src, size_t len, int postfix, const char** error_msg,
+                             int* source_len, const RegProgram** registers) {
+    normalize_expression(src, len, postfix, &c->key);
+    unsigned long long h = hash_bytes(c->key.data, c->key.len);
+    for (CacheEntry* e = c->buckets[h & (c->nbuckets - 1)]; e; e = e->chain) {
+        if (e->hash == h && e->key_len == c->key.len && memcmp(e->key, c->key.data, c->key.len) == 0) {
+            c->hits++;
+            if (c->head != e) {
+                cache_unlink(c, e);
+                cache_link_front(c, e);
+            }
+            if (source_len) *source_len = e->source_len;
+            if (registers) *registers = cache_tier_up(c, e);
+            return &e->program;
+        }
+    }
+
+    c->misses++;
+    CacheEntry* e = (CacheEntry*)checked_realloc(NULL, sizeof(CacheEntry));
+    init_program(&e->program);
+    init_registers(&e->registers);
+    e->uses = 0;
+    const char* text = c->key.data + 1;
+    int ok = postfix ? compile_postfix(text, &e->program, error_msg, NULL)
+                     : compile_infix(text, &e->program, error_msg);
+    if (!ok) {
+        free_program(&e->program);
+        free(e);
+        return NULL;
+    }
+    e->source_len = e->program.len;
+    optimize_program(&e->program, c->opt_level);
+    if (source_len) *source_len = e->source_len;
+
+    e->key = (char*)checked_realloc(NULL, c->key.len + 1);
+    memcpy(e->key, c->key.data, c->key.len + 1);
+    e->key_len = c->key.len;
+    e->hash = h;
+    e->bytes = sizeof(CacheEntry) + e->key_len + 1 +
+               (size_t)e->program.code_capacity * sizeof(Instr) +
+               (size_t)e->program.consts_capacity * sizeof(double) +
+               (size_t)e->program.vars_capacity * sizeof(char*) +
+               arena_capacity(&e->program.names);
+
+    // Evict before linking so the new entry itself is never the victim
+    while (c->head && c->bytes + e->bytes > c->capacity_bytes) cache_evict_lru(c);
+    if (c->entries >= c->nbuckets) cache_grow_buckets(c);
+    e->chain = c->buckets[h & (c->nbuckets - 1)];
+    c->buckets[h & (c->nbuckets - 1)] = e;
+    cache_link_front(c, e);
+    c->entries++;
+    c->bytes += e->bytes;
+    if (registers) *registers = cache_tier_up(c, e);
+    return &e->program;
+}
+
+void cache_free(ExprCache* c) {
+    while (c->head) cache_evict_lru(c);
+    free(c->buckets);
+    free(c->key.data);
+    memset(c, 0, sizeof(*c));
+}
+
+// Direct-threaded form of a Program: each instruction carries the address
+// of its handler, so dispatch is one indirect jump with no bounds check or
+// switch. Common pairs are fused into superinstructions.
+
+typedef struct ThreadedInstr {
+    const void* handler;    // label address (computed goto builds only)
+    int op;
+    int arg;
+} ThreadedInstr;
+
+typedef struct ThreadedProgram {
+    ThreadedInstr* code;    // ends with OP_HALT
+    int len;
+    const double* consts;   // borrowed from the source Program
+    int max_depth;
+    int fused;              // superinstructions formed
+} ThreadedProgram;
+
+// Handler addresses by opcode, exported by run_threaded on its first call
+const void* const* threaded_handlers = NULL;
+
+int run_threaded(const ThreadedProgram* tp, const double* bindings, double* result) {
+#ifdef THREADED_DISPATCH
+    static const void* const handlers[OP_COUNT] = {
+        &&do_push, &&do_pop, &&do_add, &&do_sub, &&do_mul, &&do_div, &&do_pow,
+        &&do_load_var, &&do_dup, &&do_sqrt, &&do_add_const, &&do_mul_var, &&do_mul_add, &&do_halt
+    };
+    if (tp == NULL) {
+        threaded_handlers = handlers;
+        return 0;
+    }
+#define CASE(label, op) label:
+#define NEXT goto *(++ip)->handler
+#else
+    if (tp == NULL) return 0;
+#define CASE(label, op) case op:
+#define NEXT ip++; continue
+#endif
+
+    double local[64];
+    double* stack = local;
+    ArenaMark mark = { NULL, 0 };
+    if (tp->max_depth > 64) {
+        mark = arena_mark(&thread_arena);
+        stack = (double*)arena_alloc(&thread_arena, (size_t)tp->max_depth * sizeof(double));
+    }
+    double* sp = stack;     // one past the top
+    const double* consts = tp->consts;
+    const ThreadedInstr* ip = tp->code;
+
+#ifdef THREADED_DISPATCH
+    goto *ip->handler;
+#else
+    for (;;) {
+        switch (ip->op) {
+#endif
+    CASE(do_push, OP_PUSH)          *sp++ = consts[ip->arg]; NEXT;
+    CASE(do_load_var, OP_LOAD_VAR)  *sp++ = bindings[ip->arg]; NEXT;
+    CASE(do_pop, OP_POP)            sp--; NEXT;
+    CASE(do_add, OP_ADD)            sp[-2] = sp[-2] + sp[-1]; sp--; NEXT;
+    CASE(do_sub, OP_SUB)            sp[-2] = sp[-2] - sp[-1]; sp--; NEXT;
+    CASE(do_mul, OP_MUL)            sp[-2] = sp[-2] * sp[-1]; sp--; NEXT;
+    CASE(do_div, OP_DIV)            sp[-2] = sp[-2] / sp[-1]; sp--; NEXT;
+    CASE(do_pow, OP_POW)            sp[-2] = power(sp[-2], sp[-1]); sp--; NEXT;
+    CASE(do_dup, OP_DUP)            sp[0] = sp[-1]; sp++; NEXT;
+    CASE(do_sqrt, OP_SQRT)          sp[-1] = sqrt(sp[-1]); NEXT;
+    CASE(do_add_const, OP_ADD_CONST) sp[-1] = sp[-1] + consts[ip->arg]; NEXT;
+    CASE(do_mul_var, OP_MUL_VAR)    sp[-1] = sp[-1] * bindings[ip->arg]; NEXT;
+    CASE(do_mul_add, OP_MUL_ADD) {
+        double product = sp[-2] * sp[-1];
+        sp[-3] = sp[-3] + product;
+        sp -= 2;
+        NEXT;
+    }
+    CASE(do_halt, OP_HALT)
+        *result = stack[0];
+        if (stack != local) arena_rewind(&thread_arena, mark);
+        return 1;
+#ifndef THREADED_DISPATCH
+        }
+    }
+#endif
+#undef CASE
+#undef NEXT
+}
+
+// Build the threaded form of p; tp borrows p's constants, so p must outlive
+// it. fuse enables superinstructions. Returns 0 if p is malformed.
+int thread_program(const Program* p, ThreadedProgram* tp, int fuse) {
+    tp->max_depth = program_max_depth(p);
+    if (tp->max_depth < 0) return 0;
+    if (threaded_handlers == NULL) run_threaded(NULL, NULL, NULL);
+
+    tp->code = (ThreadedInstr*)checked_realloc(NULL, (size_t)(p->len + 1) * sizeof(ThreadedInstr));
+    tp->consts = p->consts;
+    tp->len = 0;
+    tp->fused = 0;
+    for (int pc = 0; pc < p->len; pc++) {
+        Instr in = p->code[pc];
+        int next = pc + 1 < p->len ? p->code[pc + 1].op : -1;
+        int op = in.op;
+        if (fuse && op == OP_PUSH && next == OP_ADD) op = OP_ADD_CONST;
+        else if (fuse && op == OP_LOAD_VAR && next == OP_MUL) op = OP_MUL_VAR;
+        else if (fuse && op == OP_MUL && next == OP_ADD) op = OP_MUL_ADD;
+        if (op != in.op) {
+            tp->fused++;
+            pc++;
+        }
+        tp->code[tp->len].op = op;
+        tp->code[tp->len].arg = in.arg;
+        tp->code[tp->len].handler = threaded_handlers ? threaded_handlers[op] : NULL;
+        tp->len++;
+    }
+    tp->code[tp->len].op = OP_HALT;
+    tp->code[tp->len].arg = 0;
+    tp->code[tp->len].handler = threaded_handlers ? threaded_handlers[OP_HALT] : NULL;
+    tp->len++;
+    return 1;
+}
+
+void free_threaded(ThreadedProgram* tp) {
+    free(tp->code);
+    tp->code = NULL;
+    tp->len = 0;
+}
+
+// Native x86-64 JIT for straight-line programs. Stack slot k lives in
+// xmm<k> for k < JIT_REG_SLOTS and in spill[k] beyond that; xmm15 is
+// scratch. Every op is the same SSE2 scalar instruction (or power call)
+// the interpreters execute, so results are bit-identical to run_program.
+// Generated code: double fn(const double* consts, const double* bindings,
+// double* spill), with consts in rbp, bindings in r14 and spill in rbx.
+#if defined(__x86_64__) && !defined(NO_JIT)
+#define HAVE_JIT 1
+#endif
+
+#define JIT_REG_SLOTS 15
+
+typedef double (*JitFn)(const double* consts, const double* bindings, double* spill);
+
+typedef struct JitProgram {
+    unsigned char* code;    // mmap'd, read+execute once finished
+    size_t size;
+    JitFn fn;
+    const double* consts;   // borrowed from the source Program
+    int max_depth;
+} JitProgram;
+
+// Set from STACK_MACHINE_NO_JIT on first use; -1 means not checked yet
+int jit_disabled = -1;
+
+int jit_available(void) {
+#ifdef HAVE_JIT
+    if (jit_disabled < 0) jit_disabled = getenv("STACK_MACHINE_NO_JIT") != NULL;
+    return !jit_disabled;
+#else
+    return 0;
+#endif
+}
+
+#ifdef HAVE_JIT
+enum { JIT_RAX = 0, JIT_RBX = 3, JIT_RBP = 5, JIT_R14 = 14, JIT_XMM_SCRATCH = 15 };
+
+// SSE2 scalar-double opcodes (second byte after 0x0F)
+enum { SSE_LOAD = 0x10, SSE_STORE = 0x11, SSE_SQRT = 0x51, SSE_ADD = 0x58, SSE_MUL = 0x59,
+       SSE_SUB = 0x5C, SSE_DIV = 0x5E };
+
+typedef struct JitBuf {
+    unsigned char* p;
+} JitBuf;
+
+void jit_byte(JitBuf* b, unsigned char byte) {
+    *b->p++ = byte;
+}
+
+// op xmm<reg>, xmm<rm> with a mandatory prefix (0xF2 for scalar double)
+void jit_sse_reg(JitBuf* b, unsigned char prefix, unsigned char opcode, int reg, int rm) {
+    jit_byte(b, prefix);
+    if (reg >= 8 || rm >= 8) jit_byte(b, (unsigned char)(0x40 | ((reg >> 3) << 2) | (rm >> 3)));
+    jit_byte(b, 0x0F);
+    jit_byte(b, opcode);
+    jit_byte(b, (unsigned char)(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// op xmm<reg>, [base + disp32]; base is never rsp/r12, so no SIB byte
+void jit_sse_mem(JitBuf* b, unsigned char opcode, int reg, int base, int disp) {
+    jit_byte(b, 0xF2);
+    if (reg >= 8 || base >= 8) jit_byte(b, (unsigned char)(0x40 | ((reg >> 3) << 2) | (base >> 3)));
+    jit_byte(b, 0x0F);
+    jit_byte(b, opcode);
+    jit_byte(b, (unsigned char)(0x80 | ((reg & 7) << 3) | (base & 7)));
+    memcpy(b->p, &disp, 4);
+    b->p += 4;
+}
+
+// slot[k] = slot[k-1]
+void jit_dup(JitBuf* b, int k) {
+    if (k < JIT_REG_SLOTS) {
+        jit_sse_reg(b, 0xF2, SSE_LOAD, k, k - 1);
+    } else if (k - 1 < JIT_REG_SLOTS) {
+        jit_sse_mem(b, SSE_STORE, k - 1, JIT_RBX, k * 8);
+    } else {
+        jit_sse_mem(b, SSE_LOAD, JIT_XMM_SCRATCH, JIT_RBX, (k - 1) * 8);
+        jit_sse_mem(b, SSE_STORE, JIT_XMM_SCRATCH, JIT_RBX, k * 8);
+    }
+}
+
+// slot[k-1] = sqrt(slot[k-1]); sqrtsd is correctly rounded, like libm sqrt
+void jit_sqrt(JitBuf* b, int k) {
+    if (k - 1 < JIT_REG_SLOTS) {
+        jit_sse_reg(b, 0xF2, SSE_SQRT, k - 1, k - 1);
+    } else {
+        jit_sse_mem(b, SSE_SQRT, JIT_XMM_SCRATCH, JIT_RBX, (k - 1) * 8);
+        jit_sse_mem(b, SSE_STORE, JIT_XMM_SCRATCH, JIT_RBX, (k - 1) * 8);
+    }
+}
+
+// Load a constant or binding into stack slot k
+void jit_push_slot(JitBuf* b, int k, int base, int index) {
+    if (k < JIT_REG_SLOTS) {
+        jit_sse_mem(b, SSE_LOAD, k, base, index * 8);
+    } else {
+        jit_sse_mem(b, SSE_LOAD, JIT_XMM_SCRATCH, base, index * 8);
+        jit_sse_mem(b, SSE_STORE, JIT_XMM_SCRATCH, JIT_RBX, k * 8);
+    }
+}
+
+// slot[k-2] = slot[k-2] op slot[k-1]
+void jit_binary(JitBuf* b, unsigned char opcode, int k) {
+    int dst = k - 2, src = k - 1;
+    if (src < JIT_REG_SLOTS) {
+        jit_sse_reg(b, 0xF2, opcode, dst, src);
+    } else if (dst < JIT_REG_SLOTS) {
+        jit_sse_mem(b, opcode, dst, JIT_RBX, src * 8);
+    } else {
+        jit_sse_mem(b, SSE_LOAD, JIT_XMM_SCRATCH, JIT_RBX, dst * 8);
+        jit_sse_mem(b, opcode, JIT_XMM_SCRATCH, JIT_RBX, src * 8);
+        jit_sse_mem(b, SSE_STORE, JIT_XMM_SCRATCH, JIT_RBX, dst * 8);
+    }
+}
+
+// slot[k-2] = fn(slot[k-2], slot[k-1]) through a C call. All xmm registers
+// are caller-saved, so live register slots go to their spill homes first.
+void jit_call2(JitBuf* b, double (*fn)(double, double), int k) {
+    int live = k < JIT_REG_SLOTS ? k : JIT_REG_SLOTS;
+    for (int i = 0; i < live; i++) jit_sse_mem(b, SSE_STORE, i, JIT_RBX, i * 8);
+    jit_sse_mem(b, SSE_LOAD, 0, JIT_RBX, (k - 2) * 8);
+    jit_sse_mem(b, SSE_LOAD, 1, JIT_RBX, (k - 1) * 8);
+    jit_byte(b, 0x48);                      // mov rax, imm64
+    jit_byte(b, 0xB8);
+    void* target = (void*)fn;
+    memcpy(b->p, &target, 8);
+    b->p += 8;
+    jit_byte(b, 0xFF);                      // call rax
+    jit_byte(b, 0xD0);
+    jit_sse_mem(b, SSE_STORE, 0, JIT_RBX, (k - 2) * 8);
+    live = k - 1 < JIT_REG_SLOTS ? k - 1 : JIT_REG_SLOTS;
+    for (int i = 0; i < live; i++) jit_sse_mem(b, SSE_LOAD, i, JIT_RBX, i * 8);
+}
+#endif
+
+// Translate p to machine code. Returns 0 (and leaves jp unusable) when the
+// JIT is disabled, unsupported on this architecture, or p is malformed;
+// callers then fall back to an interpreter.
+int jit_compile(const Program* p, JitProgram* jp) {
+    memset(jp, 0, sizeof(*jp));
+#ifdef HAVE_JIT
+    if (!jit_available()) return 0;
+    jp->max_depth = program_max_depth(p);
+    if (jp->max_depth < 0) return 0;
+
+    // Worst case per instruction is a power call saving and restoring every
+    // register slot (9 bytes per move)
+    size_t bound = 64 + (size_t)p->len * (32 + 2 * JIT_REG_SLOTS * 9);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    jp->size = (bound + page - 1) / page * page;
+    void* mem = mmap(NULL, jp->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return 0;
+    jp->code = (unsigned char*)mem;
+
+    JitBuf b = { jp->code };
+    static const unsigned char prologue[] = {
+        0x53,                   // push rbx
+        0x55,                   // push rbp
+        0x41, 0x56,             // push r14 (rsp is now 16-byte aligned)
+        0x48, 0x89, 0xFD,       // mov rbp, rdi
+        0x49, 0x89, 0xF6,       // mov r14, rsi
+        0x48, 0x89, 0xD3        // mov rbx, rdx
+    };
+    memcpy(b.p, prologue, sizeof(prologue));
+    b.p += sizeof(prologue);
+
+    int k = 0;
+    for (int pc = 0; pc < p->len; pc++) {
+        Instr in = p->code[pc];
+        switch (in.op) {
+            case OP_PUSH: jit_push_slot(&b, k++, JIT_RBP, in.arg); break;
+            case OP_LOAD_VAR: jit_push_slot(&b, k++, JIT_R14, in.arg); break;
+            case OP_POP: k--; break;
+            case OP_ADD: jit_binary(&b, SSE_ADD, k--); break;
+            case OP_SUB: jit_binary(&b, SSE_SUB, k--); break;
+            case OP_MUL: jit_binary(&b, SSE_MUL, k--); break;
+            case OP_DIV: jit_binary(&b, SSE_DIV, k--); break;
+            case OP_POW: jit_call2(&b, power, k--); break;
+            case OP_DUP: jit_dup(&b, k++); break;
+            case OP_SQRT: jit_sqrt(&b, k); break;
+        }
+    }
+
+    static const unsigned char epilogue[] = {
+        0x41, 0x5E,             // pop r14
+        0x5D,                   // pop rbp
+        0x5B,                   // pop rbx
+        0xC3                    // ret
+    };
+    memcpy(b.p, epilogue, sizeof(epilogue));
+    b.p += sizeof(epilogue);
+
+    if (mprotect(mem, jp->size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, jp->size);
+        memset(jp, 0, sizeof(*jp));
+        return 0;
+    }
+    jp->fn = (JitFn)mem;
+    jp->consts = p->consts;
+    return 1;
+#else
+    (void)p;
+    return 0;
+#endif
+}
+
+int run_jit(const JitProgram* jp, const double* bindings, double* result) {
+    double local[64];
+    double* spill = local;
+    ArenaMark mark = { NULL, 0 };
+    if (jp->max_depth > 64) {
+        mark = arena_mark(&thread_arena);
+        spill = (double*)arena_alloc(&thread_arena, (size_t)jp->max_depth * sizeof(double));
+    }
+    *result = jp->fn(jp->consts, bindings, spill);
+    if (spill != local) arena_rewind(&thread_arena, mark);
+    return 1;
+}
+
+void jit_free(JitProgram* jp) {
+#ifdef HAVE_JIT
+    if (jp->code) munmap(jp->code, jp->size);
+#endif
+    memset(jp, 0, sizeof(*jp));
+}
+
+// Columnar evaluation: one program over many rows, COLUMN_BLOCK rows at a
+// time, so each instruction is dispatched once per block instead of once
+// per row. Stack entries are whole column vectors.
+#define COLUMN_BLOCK 256
+
+typedef void (*ColumnKernel)(double* dst, const double* a, const double* b, size_t n);
+
+#define DEFINE_SCALAR_KERNEL(name, expr) \
+void name(double* dst, const double* a, const double* b, size_t n) { \
+    for (size_t i = 0; i < n; i++) dst[i] = a[i] expr b[i]; \
+}
+
+DEFINE_SCALAR_KERNEL(column_add_scalar, +)
+DEFINE_SCALAR_KERNEL(column_sub_scalar, -)
+DEFINE_SCALAR_KERNEL(column_mul_scalar, *)
+DEFINE_SCALAR_KERNEL(column_div_scalar, /)
+
+#ifdef HAVE_X86_SIMD
+#define DEFINE_SSE2_KERNEL(name, intrin, expr) \
+__attribute__((target("sse2"))) \
+void name(double* dst, const double* a, const double* b, size_t n) { \
+    size_t i = 0; \
+    for (; i + 2 <= n; i += 2) \
+        _mm_storeu_pd(dst + i, intrin(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i))); \
+    for (; i < n; i++) dst[i] = a[i] expr b[i]; \
+}
+
+#define DEFINE_AVX2_KERNEL(name, intrin, expr) \
+__attribute__((target("avx2"))) \
+void name(double* dst, const double* a, const double* b, size_t n) { \
+    size_t i = 0; \
+    for (; i + 4 <= n; i += 4) \
+        _mm256_storeu_pd(dst + i, intrin(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i))); \
+    for (; i < n; i++) dst[i] = a[i] expr b[i]; \
+}
+
+DEFINE_SSE2_KERNEL(column_add_sse2, _mm_add_pd, +)
+DEFINE_SSE2_KERNEL(column_sub_sse2, _mm_sub_pd, -)
+DEFINE_SSE2_KERNEL(column_mul_sse2, _mm_mul_pd, *)
+DEFINE_SSE2_KERNEL(column_div_sse2, _mm_div_pd, /)
+DEFINE_AVX2_KERNEL(column_add_avx2, _mm256_add_pd, +)
+DEFINE_AVX2_KERNEL(column_sub_avx2, _mm256_sub_pd, -)
+DEFINE_AVX2_KERNEL(column_mul_avx2, _mm256_mul_pd, *)
+DEFINE_AVX2_KERNEL(column_div_avx2, _mm256_div_pd, /)
+#endif
+
+// Kernels for OP_ADD..OP_DIV, picked once for the running CPU
+ColumnKernel column_kernels[4];
+const char* column_kernel_isa = NULL;
+
+// force_scalar selects the portable kernels even on x86 (for comparison)
+void select_column_kernels(int force_scalar) {
+    ColumnKernel scalar[4] = { column_add_scalar, column_sub_scalar, column_mul_scalar, column_div_scalar };
+    memcpy(column_kernels, scalar, sizeof(scalar));
+    column_kernel_isa = "scalar";
+#ifdef HAVE_X86_SIMD
+    if (force_scalar) return;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ColumnKernel avx2[4] = { column_add_avx2, column_sub_avx2, column_mul_avx2, column_div_avx2 };
+        memcpy(column_kernels, avx2, sizeof(avx2));
+        column_kernel_isa = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        ColumnKernel sse2[4] = { column_add_sse2, column_sub_sse2, column_mul_sse2, column_div_sse2 };
+        memcpy(column_kernels, sse2, sizeof(sse2));
+        column_kernel_isa = "sse2";
+    }
+#else
+    (void)force_scalar;
+#endif
+}
+
+// Vector pow. A constant exponent of 0 is an exact fill (pow gives 1 for
+// any base, NaN included); anything else goes lane by lane through power,
+// because a polynomial pow would not give the same bits as the scalar
+// interpreter. Not even x^1 is a copy: pow turns -nan into nan.
+void column_pow(double* dst, const double* a, const double* b, size_t n, int b_const) {
+    if (b_const && b[0] == 0) {
+        for (size_t i = 0; i < n; i++) dst[i] = 1.0;
+    } else {
+        for (size_t i = 0; i < n; i++) dst[i] = power(a[i], b[i]);
+    }
+}
+
+// Evaluate p for rows [0, nrows): columns[v][r] is the value of p->vars[v]
+// in row r, and out[r] receives the result. Matches run_program row by row.
+// Returns 1 on success, else 0 (malformed program).
+int run_program_columns(const Program* p, const double* const* columns, size_t nrows, double* out) {
+    int depth = program_max_depth(p);
+    if (depth < 0) return 0;
+    int sp;
+    if (column_kernel_isa == NULL) select_column_kernels(0);
+
+    // Scratch columns for computed entries, plus one broadcast block per constant
+    double* scratch = (double*)checked_realloc(NULL, (size_t)(depth + p->nconsts) * COLUMN_BLOCK * sizeof(double));
+    double* const_blocks = scratch + (size_t)depth * COLUMN_BLOCK;
+    for (int c = 0; c < p->nconsts; c++) {
+        for (int i = 0; i < COLUMN_BLOCK; i++) const_blocks[(size_t)c * COLUMN_BLOCK + i] = p->consts[c];
+    }
+    const double** stack = (const double**)checked_realloc(NULL, (size_t)depth * sizeof(double*));
+    char* is_const = (char*)checked_realloc(NULL, (size_t)depth);
+
+    for (size_t row = 0; row < nrows; row += COLUMN_BLOCK) {
+        size_t n = nrows - row < COLUMN_BLOCK ? nrows - row : COLUMN_BLOCK;
+        sp = 0;
+        for (int pc = 0; pc < p->len; pc++) {
+            Instr in = p->code[pc];
+            if (in.op == OP_PUSH) {
+                is_const[sp] = 1;
+                stack[sp++] = const_blocks + (size_t)in.arg * COLUMN_BLOCK;
+            } else if (in.op == OP_LOAD_VAR) {
+                is_const[sp] = 0;
+                stack[sp++] = columns[in.arg] + row;
+            } else if (in.op == OP_POP) {
+                sp--;
+            } else if (in.op == OP_DUP) {
+                is_const[sp] = is_const[sp - 1];
+                stack[sp] = stack[sp - 1];
+                sp++;
+            } else if (in.op == OP_SQRT) {
+                double* dst = scratch + (size_t)(sp - 1) * COLUMN_BLOCK;
+                for (size_t i = 0; i < n; i++) dst[i] = sqrt(stack[sp - 1][i]);
+                is_const[sp - 1] = 0;
+                stack[sp - 1] = dst;
+            } else {
+                double* dst = scratch + (size_t)(sp - 2) * COLUMN_BLOCK;
+                if (in.op == OP_POW) column_pow(dst, stack[sp - 2], stack[sp - 1], n, is_const[sp - 1]);
+                else column_kernels[in.op - OP_ADD](dst, stack[sp - 2], stack[sp - 1], n);
+                is_const[sp - 2] = 0;
+                stack[sp - 2] = dst;
+                sp--;
+            }
+        }
+        memcpy(out + row, stack[0], n * sizeof(double));
+    }
+
+    free(scratch);
+    free(stack);
+    free(is_const);
+    return 1;
+}
+
+// Append the operand pushed by a PUSH or LOAD_VAR instruction
+void text_operand(TextBuf* t, const Program* p, Instr in) {
+    if (in.op == OP_PUSH) {
+        text_number(t, p->consts[in.arg]);
+    } else {
+        text_append(t, p->vars[in.arg], strlen(p->vars[in.arg]));
+    }
+}
+
+const char opcode_symbols[OP_COUNT] = { 0, 0, '+', '-', '*', '/', '^' };
+
+// Append p as space-separated postfix text
+void program_to_postfix(const Program* p, TextBuf* out) {
+    for (int pc = 0; pc < p->len; pc++) {
+        if (pc > 0) text_putc(out, ' ');
+        Instr in = p->code[pc];
+        if (in.op == OP_PUSH || in.op == OP_LOAD_VAR) text_operand(out, p, in);
+        else if (in.op == OP_POP) text_append(out, "pop", 3);
+        else if (in.op == OP_DUP) text_append(out, "dup", 3);
+        else if (in.op == OP_SQRT) text_append(out, "sqrt", 4);
+        else text_putc(out, opcode_symbols[in.op]);
+    }
+}
+
+// Append p as infix with minimal parentheses. p's values become nodes of
+// dag (reset first; variable leaves are symbols indexing p->vars), and the
+// text is rendered once at the end by render_value.
+// Returns 0 if the program does not leave exactly one value.
+int program_to_infix(const Program* p, TextBuf* out, ExprDag* dag) {
+    int depth = program_max_depth(p);
+    if (depth < 0) return 0;
+    Value local[64];
+    ArenaMark mark = arena_mark(&thread_arena);
+    Value* stack = depth <= 64 ? local : (Value*)arena_alloc(&thread_arena, (size_t)depth * sizeof(Value));
+    int sp = 0;
+
+    dag_reset(dag);
+    for (int pc = 0; pc < p->len; pc++) {
+        Instr in = p->code[pc];
+        if (in.op == OP_PUSH) {
+            stack[sp++] = make_number(p->consts[in.arg]);
+        } else if (in.op == OP_LOAD_VAR) {
+            stack[sp].type = VAL_SYM;
+            stack[sp].as.sym = in.arg;
+            sp++;
+        } else if (in.op == OP_POP) {
+            sp--;
+        } else if (in.op == OP_DUP) {
+            stack[sp] = stack[sp - 1];
+            sp++;
+        } else if (in.op == OP_SQRT) {
+            stack[sp - 1] = make_node(dag, stack[sp - 1], 's', make_number(0));
+        } else {
+            stack[sp - 2] = make_node(dag, stack[sp - 2], opcode_symbols[in.op], stack[sp - 1]);
+            sp--;
+        }
+    }
+    render_value(dag, stack[0], p->vars, out, (size_t)-1);
+    arena_rewind(&thread_arena, mark);
+    return 1;
+}
+
+// Kernels: assembled programs that may also shuffle the stack and branch
+// (SWAP, OVER, ROT, JMP, JZ, CALL, RET, LOAD_IDX), so whole loops run
+// inside the machine. The expression engines never see them: their
+// verify_program rejects these opcodes.
+typedef struct KernelInfo {
+    int max_depth;          // deepest data stack
+    int max_calls;          // deepest return stack
+} KernelInfo;
+
+// What one routine (the kernel itself, or a CALL target) does to the
+// stack, relative to the depth it was entered with
+typedef struct KernelRoutine {
+    int state;              // 0 not reached, 1 on the call-graph walk, 2 ordered
+    int callees;            // its CALL targets: KernelVerifier.callees[callees..
+    int ncallees;           // ..callees + ncallees)
+    int effect;             // depth change at its RET
+    int low;                // lowest depth reached (<= 0: caller values it uses)
+    int high;               // highest depth reached
+    int calls;              // return stack it needs, itself included
+} KernelRoutine;
+
+// Scratch shared by every routine: depth is INT_MIN except at the pcs in
+// touched, which the pass that set them puts back
+typedef struct KernelVerifier {
+    const Program* p;
+    KernelRoutine* routines;    // by entry pc
+    int* depth;
+    int* work;
+    int* touched;
+    int ntouched;
+    int* callees;
+    int ncallees, callees_capacity;
+    int error_pc;
+    const char* error_msg;
+} KernelVerifier;
+
+int kernel_fail(KernelVerifier* v, int pc, const char* msg) {
+    v->error_pc = pc;
+    v->error_msg = msg;
+    return 0;
+}
+
+void kernel_reset(KernelVerifier* v) {
+    for (int k = 0; k < v->ntouched; k++) v->depth[v->touched[k]] = INT_MIN;
+    v->ntouched = 0;
+}
+
+// Record the CALL targets reachable from entry without passing through a
+// CALL. Bad targets and opcodes are skipped here; kernel_routine reports
+// them.
+void kernel_callees(KernelVerifier* v, int entry) {
+    const Program* p = v->p;
+    KernelRoutine* r = &v->routines[entry];
+    int nwork = 0;
+    r->callees = v->ncallees;
+    v->depth[entry] = 0;
+    v->touched[v->ntouched++] = entry;
+    v->work[nwork++] = entry;
+    while (nwork > 0) {
+        int pc = v->work[--nwork];
+        Instr in = p->code[pc];
+        int succ[2] = { pc + 1, INT_MIN };
+        if (in.op == OP_JMP || in.op == OP_RET) succ[0] = INT_MIN;
+        if (in.op == OP_JMP || in.op == OP_JZ) succ[1] = in.arg;
+        if (in.op == OP_CALL && in.arg >= 0 && in.arg < p->len) {
+            if (v->ncallees == v->callees_capacity) {
+                v->callees_capacity = v->callees_capacity ? v->callees_capacity * 2 : 64;
+                v->callees = (int*)checked_realloc(v->callees, (size_t)v->callees_capacity * sizeof(int));
+            }
+            v->callees[v->ncallees++] = in.arg;
+        }
+        for (int s = 0; s < 2; s++) {
+            int t = succ[s];
+            if (t < 0 || t >= p->len || v->depth[t] != INT_MIN) continue;
+            v->depth[t] = 0;
+            v->touched[v->ntouched++] = t;
+            v->work[nwork++] = t;
+        }
+    }
+    r->ncallees = v->ncallees - r->callees;
+    kernel_reset(v);
+}
+
+// Depth-first walk of the call graph from the kernel's entry, on an
+// explicit stack so deep call chains cannot exhaust the C stack. Fills
+// order with every reachable routine, callees before their callers, and
+// rejects recursion so the return stack has a static bound.
+int kernel_order(KernelVerifier* v, int* order, int* norder) {
+    int len = v->p->len;
+    // Pairs of (routine entry, index of its next callee to visit)
+    int* frame = (int*)checked_realloc(NULL, (size_t)len * 2 * sizeof(int));
+    int nframes = 0, ok = 1;
+    *norder = 0;
+    v->routines[0].state = 1;
+    kernel_callees(v, 0);
+    frame[0] = 0;
+    frame[1] = 0;
+    nframes = 1;
+    while (nframes > 0) {
+        int* f = &frame[(nframes - 1) * 2];
+        KernelRoutine* r = &v->routines[f[0]];
+        if (f[1] == r->ncallees) {
+            r->state = 2;
+            order[(*norder)++] = f[0];
+            nframes--;
+            continue;
+        }
+        int callee = v->callees[r->callees + f[1]++];
+        KernelRoutine* c = &v->routines[callee];
+        if (c->state == 1) {
+            ok = kernel_fail(v, callee, "recursive CALL");
+            break;
+        }
+        if (c->state == 0) {
+            c->state = 1;
+            kernel_callees(v, callee);
+            frame[nframes * 2] = callee;
+            frame[nframes * 2 + 1] = 0;
+            nframes++;
+        }
+    }
+    free(frame);
+    return ok;
+}
+
+// Abstract interpretation of the routine entered at entry: the depth at
+// each instruction, which must agree wherever paths join. The kernel
+// itself (entry 0) must not use values it did not push and must RET with
+// exactly one; a CALL target may use its caller's values and must RET at
+// one depth on every path. Every routine it calls has already been
+// analysed (see kernel_order).
+int kernel_routine(KernelVerifier* v, int entry) {
+    const Program* p = v->p;
+    KernelRoutine* r = &v->routines[entry];
+    int* depth = v->depth;
+    int* work = v->work;
+    r->effect = INT_MIN;
+    r->low = r->high = r->calls = 0;
+
+    int nwork = 0, ok = 1;
+    depth[entry] = 0;
+    v->touched[v->ntouched++] = entry;
+    work[nwork++] = entry;
+
+    while (ok && nwork > 0) {
+        int pc = work[--nwork];
+        int d = depth[pc];
+        Instr in = p->code[pc];
+        int need = 0, next = pc + 1, branch = INT_MIN;
+        switch (in.op) {
+            case OP_PUSH:
+                if (in.arg < 0 || in.arg >= p->nconsts) ok = kernel_fail(v, pc, "bad constant");
+                d++;
+                break;
+            case OP_LOAD_VAR:
+                if (in.arg < 0 || in.arg >= p->nvars) ok = kernel_fail(v, pc, "bad variable");
+                d++;
+                break;
+            case OP_POP: need = 1; d--; break;
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_POW: need = 2; d--; break;
+            case OP_DUP: need = 1; d++; break;
+            case OP_SQRT: case OP_LOAD_IDX: need = 1; break;
+            case OP_SWAP: need = 2; break;
+            case OP_OVER: need = 2; d++; break;
+            case OP_ROT: need = 3; break;
+            case OP_JMP: next = INT_MIN; branch = in.arg; break;
+            case OP_JZ: need = 1; d--; branch = in.arg; break;
+            case OP_CALL: {
+                if (in.arg < 0 || in.arg >= p->len) {
+                    ok = kernel_fail(v, pc, "jump out of range");
+                    break;
+                }
+                const KernelRoutine* callee = &v->routines[in.arg];
+                need = -callee->low;
+                if (d + callee->high > r->high) r->high = d + callee->high;
+                if (callee->calls + 1 > r->calls) r->calls = callee->calls + 1;
+                d += callee->effect;
+                break;
+            }
+            case OP_RET:
+                next = INT_MIN;
+                if (entry == 0 && d != 1) ok = kernel_fail(v, pc, d < 1 ? "insufficient operands" : "operands left over");
+                else if (r->effect != INT_MIN && r->effect != d) ok = kernel_fail(v, pc, "RET at different stack depths");
+                r->effect = d;
+                break;
+            default:
+                ok = kernel_fail(v, pc, "unknown instruction");
+        }
+        if (!ok) break;
+        int low = depth[pc] - need;
+        if (low < r->low) {
+            if (entry == 0) {
+                ok = kernel_fail(v, pc, "insufficient operands");
+                break;
+            }
+            r->low = low;
+        }
+        if (d > r->high) r->high = d;
+        int succ[2] = { next, branch };
+        for (int s = 0; s < 2 && ok; s++) {
+            int t = succ[s];
+            if (t == INT_MIN) continue;
+            if (t < 0 || t >= p->len) ok = kernel_fail(v, pc, t == p->len ? "runs off the end" : "jump out of range");
+            else if (depth[t] == INT_MIN) {
+                depth[t] = d;
+                v->touched[v->ntouched++] = t;
+                work[nwork++] = t;
+            } else if (depth[t] != d) {
+                ok = kernel_fail(v, t, "stack depth differs where paths join");
+            }
+        }
+    }
+    kernel_reset(v);
+    if (ok && r->effect == INT_MIN) ok = kernel_fail(v, entry, "routine never returns");
+    return ok;
+}
+
+// Verify kernel p before running it. Returns 1 with *info filled, else 0
+// with *error_msg and *error_pc at the offending instruction.
+int verify_kernel(const Program* p, KernelInfo* info, int* error_pc, const char** error_msg) {
+    if (p->len == 0) {
+        *error_pc = 0;
+        *error_msg = "empty kernel";
+        return 0;
+    }
+    size_t len = (size_t)p->len;
+    KernelVerifier v;
+    memset(&v, 0, sizeof(v));
+    v.p = p;
+    v.routines = (KernelRoutine*)checked_realloc(NULL, len * sizeof(KernelRoutine));
+    memset(v.routines, 0, len * sizeof(KernelRoutine));
+    v.depth = (int*)checked_realloc(NULL, len * sizeof(int));
+    v.work = (int*)checked_realloc(NULL, len * sizeof(int));
+    v.touched = (int*)checked_realloc(NULL, len * sizeof(int));
+    int* order = (int*)checked_realloc(NULL, len * sizeof(int));
+    for (size_t pc = 0; pc < len; pc++) v.depth[pc] = INT_MIN;
+    int norder = 0;
+    int ok = kernel_order(&v, order, &norder);
+    for (int k = 0; ok && k < norder; k++) ok = kernel_routine(&v, order[k]);
+    if (ok) {
+        info->max_depth = v.routines[0].high;
+        info->max_calls = v.routines[0].calls;
+    } else {
+        *error_pc = v.error_pc;
+        *error_msg = v.error_msg;
+    }
+    free(v.routines);
+    free(v.depth);
+    free(v.work);
+    free(v.touched);
+    free(v.callees);
+    free(order);
+    return ok;
+}
+
+// Run a verified kernel. bindings[i] is the value of p->vars[i] and
+// memory[0..nmem) is what LOAD_IDX reads. The top of the stack lives in a
+// local (a register), so pushes store the old top and binary ops load
+// just the second operand; the verifier's bounds mean no depth checks.
+// Only LOAD_IDX indexes and the max_jumps budget of taken jumps and calls
+// are checked as it runs. Returns 1 with *result, else 0 with *error_msg.
+int run_kernel(const Program* p, const KernelInfo* info, const double* bindings, const double* memory,
+               size_t nmem, long max_jumps, double* result, const char** error_msg) {
+#ifdef THREADED_DISPATCH
+    static const void* const handlers[OP_COUNT] = {
+        [OP_PUSH] = &&do_push, [OP_POP] = &&do_pop, [OP_ADD] = &&do_add, [OP_SUB] = &&do_sub,
+        [OP_MUL] = &&do_mul, [OP_DIV] = &&do_div, [OP_POW] = &&do_pow, [OP_LOAD_VAR] = &&do_load_var,
+        [OP_DUP] = &&do_dup, [OP_SQRT] = &&do_sqrt, [OP_SWAP] = &&do_swap, [OP_OVER] = &&do_over,
+        [OP_ROT] = &&do_rot, [OP_JMP] = &&do_jmp, [OP_JZ] = &&do_jz, [OP_CALL] = &&do_call,
+        [OP_RET] = &&do_ret, [OP_LOAD_IDX] = &&do_load_idx,
+    };
+#define CASE(label, op) label:
+#define NEXT { goto *handlers[(++ip)->op]; }
+#define JUMP(target) { ip = code + (target); goto *handlers[ip->op]; }
+#else
+#define CASE(label, op) case op:
+#define NEXT { ip++; continue; }
+#define JUMP(target) { ip = code + (target); continue; }
+#endif
+
+    // One spare slot: the first push stores the (empty) old top
+    double local[64];
+    int local_returns[16];
+    ArenaMark mark = arena_mark(&thread_arena);
+    double* stack = info->max_depth + 1 <= 64 ? local
+                  : (double*)arena_alloc(&thread_arena, (size_t)(info->max_depth + 1) * sizeof(double));
+    int* returns = info->max_calls <= 16 ? local_returns
+                 : (int*)arena_alloc(&thread_arena, (size_t)info->max_calls * sizeof(int));
+    double* sp = stack;     // one past the slot below the top
+    double tos = 0;
+    int* rp = returns;
+    const double* consts = p->consts;
+    const Instr* code = p->code;
+    const Instr* ip = code;
+    int ok = 1;
+
+#ifdef THREADED_DISPATCH
+    goto *handlers[ip->op];
+#else
+    for (;;) {
+        switch (ip->op) {
+#endif
+    CASE(do_push, OP_PUSH)          *sp++ = tos; tos = consts[ip->arg]; NEXT;
+    CASE(do_load_var, OP_LOAD_VAR)  *sp++ = tos; tos = bindings[ip->arg]; NEXT;
+    CASE(do_pop, OP_POP)            tos = *--sp; NEXT;
+    CASE(do_add, OP_ADD)            tos = *--sp + tos; NEXT;
+    CASE(do_sub, OP_SUB)            tos = *--sp - tos; NEXT;
+    CASE(do_mul, OP_MUL)            tos = *--sp * tos; NEXT;
+    CASE(do_div, OP_DIV)            tos = *--sp / tos; NEXT;
+    CASE(do_pow, OP_POW)            sp--; tos = power(*sp, tos); NEXT;
+    CASE(do_dup, OP_DUP)            *sp++ = tos; NEXT;
+    CASE(do_sqrt, OP_SQRT)          tos = sqrt(tos); NEXT;
+    CASE(do_swap, OP_SWAP) {
+        double below = sp[-1];
+        sp[-1] = tos;
+        tos = below;
+        NEXT;
+    }
+    CASE(do_over, OP_OVER) {
+        double below = sp[-1];
+        *sp++ = tos;
+        tos = below;
+        NEXT;
+    }
+    CASE(do_rot, OP_ROT) {
+        double third = sp[-2];
+        sp[-2] = sp[-1];
+        sp[-1] = tos;
+        tos = third;
+        NEXT;
+    }
+    CASE(do_load_idx, OP_LOAD_IDX)
+        if (!(tos >= 0 && tos < (double)nmem)) {
+            *error_msg = "index out of range";
+            ok = 0;
+            goto done;
+        }
+        tos = memory[(size_t)tos];
+        NEXT;
+    CASE(do_jmp, OP_JMP)
+        if (--max_jumps < 0) goto out_of_jumps;
+        JUMP(ip->arg);
+    CASE(do_jz, OP_JZ) {
+        double cond = tos;
+        tos = *--sp;
+        if (cond != 0) NEXT;
+        if (--max_jumps < 0) goto out_of_jumps;
+        JUMP(ip->arg);
+    }
+    CASE(do_call, OP_CALL)
+        if (--max_jumps < 0) goto out_of_jumps;
+        *rp++ = (int)(ip - code) + 1;
+        JUMP(ip->arg);
+    CASE(do_ret, OP_RET)
+        if (rp == returns) goto done;
+        JUMP(*--rp);
+#ifndef THREADED_DISPATCH
+        default:
+            goto done;
+        }
+    }
+#endif
+#undef CASE
+#undef NEXT
+#undef JUMP
+
+out_of_jumps:
+    *error_msg = "jump limit reached";
+    ok = 0;
+done:
+    if (ok) *result = tos;
+    arena_rewind(&thread_arena, mark);
+    return ok;
+}
+
+// The same machine and dispatch with every slot in memory, as run_program
+// keeps it: the baseline that shows what caching the top of the stack buys
+int run_kernel_uncached(const Program* p, const KernelInfo* info, const double* bindings, const double* memory,
+                        size_t nmem, long max_jumps, double* result, const char** error_msg) {
+#ifdef THREADED_DISPATCH
+    static const void* const handlers[OP_COUNT] = {
+        [OP_PUSH] = &&do_push, [OP_POP] = &&do_pop, [OP_ADD] = &&do_add, [OP_SUB] = &&do_sub,
+        [OP_MUL] = &&do_mul, [OP_DIV] = &&do_div, [OP_POW] = &&do_pow, [OP_LOAD_VAR] = &&do_load_var,
+        [OP_DUP] = &&do_dup, [OP_SQRT] = &&do_sqrt, [OP_SWAP] = &&do_swap, [OP_OVER] = &&do_over,
+        [OP_ROT] = &&do_rot, [OP_JMP] = &&do_jmp, [OP_JZ] = &&do_jz, [OP_CALL] = &&do_call,
+        [OP_RET] = &&do_ret, [OP_LOAD_IDX] = &&do_load_idx,
+    };
+#define CASE(label, op) label:
+#define NEXT { goto *handlers[(++ip)->op]; }
+#define JUMP(target) { ip = code + (target); goto *handlers[ip->op]; }
+#else
+#define CASE(label, op) case op:
+#define NEXT { ip++; continue; }
+#define JUMP(target) { ip = code + (target); continue; }
+#endif
+
+    double local[64];
+    int local_returns[16];
+    ArenaMark mark = arena_mark(&thread_arena);
+    double* stack = info->max_depth <= 64 ? local
+                  : (double*)arena_alloc(&thread_arena, (size_t)info->max_depth * sizeof(double));
+    int* returns = info->max_calls <= 16 ? local_returns
+                 : (int*)arena_alloc(&thread_arena, (size_t)info->max_calls * sizeof(int));
+    double* sp = stack;     // one past the top
+    int* rp = returns;
+    const double* consts = p->consts;
+    const Instr* code = p->code;
+    const Instr* ip = code;
+    int ok = 1;
+
+#ifdef THREADED_DISPATCH
+    goto *handlers[ip->op];
+#else
+    for (;;) {
+        switch (ip->op) {
+#endif
+    CASE(do_push, OP_PUSH)          *sp++ = consts[ip->arg]; NEXT;
+    CASE(do_load_var, OP_LOAD_VAR)  *sp++ = bindings[ip->arg]; NEXT;
+    CASE(do_pop, OP_POP)            sp--; NEXT;
+    CASE(do_add, OP_ADD)            sp[-2] = sp[-2] + sp[-1]; sp--; NEXT;
+    CASE(do_sub, OP_SUB)            sp[-2] = sp[-2] - sp[-1]; sp--; NEXT;
+    CASE(do_mul, OP_MUL)            sp[-2] = sp[-2] * sp[-1]; sp--; NEXT;
+    CASE(do_div, OP_DIV)            sp[-2] = sp[-2] / sp[-1]; sp--; NEXT;
+    CASE(do_pow, OP_POW)            sp[-2] = power(sp[-2], sp[-1]); sp--; NEXT;
+    CASE(do_dup, OP_DUP)            sp[0] = sp[-1]; sp++; NEXT;
+    CASE(do_sqrt, OP_SQRT)          sp[-1] = sqrt(sp[-1]); NEXT;
+    CASE(do_swap, OP_SWAP) {
+        double top = sp[-1];
+        sp[-1] = sp[-2];
+        sp[-2] = top;
+        NEXT;
+    }
+    CASE(do_over, OP_OVER)          sp[0] = sp[-2]; sp++; NEXT;
+    CASE(do_rot, OP_ROT) {
+        double third = sp[-3];
+        sp[-3] = sp[-2];
+        sp[-2] = sp[-1];
+        sp[-1] = third;
+        NEXT;
+    }
+    CASE(do_load_idx, OP_LOAD_IDX)
+        if (!(sp[-1] >= 0 && sp[-1] < (double)nmem)) {
+            *error_msg = "index out of range";
+            ok = 0;
+            goto done;
+        }
+        sp[-1] = memory[(size_t)sp[-1]];
+        NEXT;
+    CASE(do_jmp, OP_JMP)
+        if (--max_jumps < 0) goto out_of_jumps;
+        JUMP(ip->arg);
+    CASE(do_jz, OP_JZ)
+        if (*--sp != 0) NEXT;
+        if (--max_jumps < 0) goto out_of_jumps;
+        JUMP(ip->arg);
+    CASE(do_call, OP_CALL)
+        if (--max_jumps < 0) goto out_of_jumps;
+        *rp++ = (int)(ip - code) + 1;
+        JUMP(ip->arg);
+    CASE(do_ret, OP_RET)
+        if (rp == returns) goto done;
+        JUMP(*--rp);
+#ifndef THREADED_DISPATCH
+        default:
+            goto done;
+        }
+    }
+#endif
+#undef CASE
+#undef NEXT
+#undef JUMP
+
+out_of_jumps:
+    *error_msg = "jump limit reached";
+    ok = 0;
+done:
+    if (ok) *result = sp[-1];
+    arena_rewind(&thread_arena, mark);
+    return ok;
+}
+
+// Assemble kernel source into p, one instruction per line:
+//   [label:] [mnemonic [operand]] [; comment]   (or # comment)
+// Mnemonics are the opcode names in any case (PUSH number, LOAD name,
+// LOAD_VAR name, LOAD_IDX, POP, ADD, SUB, MUL, DIV, POW, SQRT, DUP, SWAP,
+// OVER, ROT, JMP/JZ/CALL label-or-index, RET). A final RET is appended,
+// so falling off the end returns. Returns 1 on success, else 0 with
+// *error_msg set, *error_line (1-based) at the offending line and p left
+// empty.
+int assemble_kernel(const char* src, size_t len, Program* p, const char** error_msg, int* error_line) {
+    // Labels and the jumps that name them, as spans of src
+    typedef struct AsmName { const char* text; size_t len; int value; int line; } AsmName;
+    AsmName* labels = NULL;
+    AsmName* fixups = NULL;
+    int nlabels = 0, nfixups = 0, line = 0;
+    *error_msg = NULL;
+    clear_program(p);
+
+    for (size_t pos = 0; pos < len && !*error_msg; ) {
+        const char* s = src + pos;
+        const char* nl = (const char*)memchr(s, '\n', len - pos);
+        size_t n = nl ? (size_t)(nl - s) : len - pos;
+        pos += n + (nl != NULL);
+        line++;
+        for (size_t c = 0; c < n; c++) {
+            if (s[c] == ';' || s[c] == '#') n = c;
+        }
+
+        // Up to three words: label:, mnemonic, operand
+        const char* word[3];
+        size_t wlen[3];
+        int nwords = 0;
+        for (size_t c = 0; c < n; ) {
+            while (c < n && isspace((unsigned char)s[c])) c++;
+            if (c == n) break;
+            size_t start = c;
+            while (c < n && !isspace((unsigned char)s[c])) c++;
+            if (nwords == 3) {
+                *error_msg = "too many operands";
+                break;
+            }
+            word[nwords] = s + start;
+            wlen[nwords++] = c - start;
+        }
+        if (*error_msg) break;
+        int w = 0;
+        if (nwords > 0 && word[0][wlen[0] - 1] == ':') {
+            if (wlen[0] == 1) {
+                *error_msg = "empty label";
+                break;
+            }
+            for (int l = 0; l < nlabels; l++) {
+                if (labels[l].len == wlen[0] - 1 && memcmp(labels[l].text, word[0], wlen[0] - 1) == 0) {
+                    *error_msg = "duplicate label";
+                }
+            }
+            labels = (AsmName*)checked_realloc(labels, (size_t)(nlabels + 1) * sizeof(AsmName));
+            labels[nlabels].text = word[0];
+            labels[nlabels].len = wlen[0] - 1;
+            labels[nlabels].value = p->len;
+            labels[nlabels].line = line;
+            nlabels++;
+            w = 1;
+        }
+        if (w == nwords || *error_msg) continue;
+
+        int op = -1;
+        char name[16];
+        if (wlen[w] < sizeof(name)) {
+            for (size_t c = 0; c <= wlen[w]; c++) name[c] = c < wlen[w] ? (char)toupper((unsigned char)word[w][c]) : '\0';
+            if (strcmp(name, "LOAD") == 0) op = OP_LOAD_VAR;
+            for (int o = 0; o < OP_COUNT && op < 0; o++) {
+                if (strcmp(name, opcode_names[o]) == 0 && (o <= OP_SQRT || o >= OP_SWAP)) op = o;
+            }
+        }
+        int takes_operand = op == OP_PUSH || op == OP_LOAD_VAR || op == OP_JMP || op == OP_JZ || op == OP_CALL;
+        if (op < 0) {
+            *error_msg = "unknown instruction";
+        } else if (nwords - w > 2 || takes_operand != (nwords - w == 2)) {
+            *error_msg = nwords - w > 2 ? "too many operands" : takes_operand ? "missing operand" : "unexpected operand";
+        } else if (op == OP_PUSH) {
+            const char* text = word[w + 1];
+            size_t tlen = wlen[w + 1];
+            int negative = tlen > 1 && text[0] == '-';
+            double num;
+            if (!parse_number(text + negative, tlen - negative, &num)) *error_msg = "malformed number";
+            else emit_const(p, negative ? -num : num);
+        } else if (op == OP_LOAD_VAR) {
+            if (!isalpha((unsigned char)word[w + 1][0])) *error_msg = "malformed variable name";
+            else emit_operand(p, word[w + 1], wlen[w + 1]);
+        } else if (takes_operand) {
+            // Target resolved once every label is known
+            fixups = (AsmName*)checked_realloc(fixups, (size_t)(nfixups + 1) * sizeof(AsmName));
+            fixups[nfixups].text = word[w + 1];
+            fixups[nfixups].len = wlen[w + 1];
+            fixups[nfixups].value = p->len;
+            fixups[nfixups].line = line;
+            nfixups++;
+            emit(p, (OpCode)op, 0);
+        } else {
+            emit(p, (OpCode)op, 0);
+        }
+    }
+    if (!*error_msg) emit(p, OP_RET, 0);
+
+    for (int f = 0; f < nfixups && !*error_msg; f++) {
+        int target = -1;
+        for (int l = 0; l < nlabels && target < 0; l++) {
+            if (labels[l].len == fixups[f].len && memcmp(labels[l].text, fixups[f].text, fixups[f].len) == 0) {
+                target = labels[l].value;
+            }
+        }
+        if (target < 0 && isdigit((unsigned char)fixups[f].text[0])) {
+            char* end;
+            long index = strtol(fixups[f].text, &end, 10);
+            if (end == fixups[f].text + fixups[f].len && index < p->len) target = (int)index;
+        }
+        if (target < 0) {
+            *error_msg = "undefined label";
+            line = fixups[f].line;
+        } else {
+            p->code[fixups[f].value].arg = target;
+        }
+    }
+    free(labels);
+    free(fixups);
+    if (*error_msg) {
+        *error_line = line;
+        clear_program(p);
+        return 0;
+    }
+    return 1;
+}
+
+// Append p as assembler text that assemble_kernel reads back, jump
+// targets as instruction indexes and each index in a comment
+void kernel_to_text(const Program* p, TextBuf* out) {
+    for (int pc = 0; pc < p->len; pc++) {
+        Instr in = p->code[pc];
+        size_t start = out->len;
+        char text[32];
+        text_append(out, "    ", 4);
+        text_append(out, opcode_names[in.op], strlen(opcode_names[in.op]));
+        if (in.op == OP_PUSH || in.op == OP_LOAD_VAR) {
+            text_putc(out, ' ');
+            text_operand(out, p, in);
+        } else if (in.op == OP_JMP || in.op == OP_JZ || in.op == OP_CALL) {
+            text_append(out, text, (size_t)snprintf(text, sizeof(text), " %d", in.arg));
+        }
+        while (out->len < start + 28) text_putc(out, ' ');
+        text_append(out, text, (size_t)snprintf(text, sizeof(text), " ; %d\n", pc));
+    }
+}
+
+// Stack window: a scrollable view of the top of the stack. Only the
+// entries in view are formatted, indexing the slot array directly, so a
+// frame costs the same at depth 10 or 100000, and rows that still show
+// the same entry are not rewritten.
+typedef struct StackView {
+    WINDOW* win;
+    int scroll;             // entries above the first row; 0 shows the top
+    RowCache rows;
+    char title[64];         // the border title last drawn
+} StackView;
+
+void init_stack_view(StackView* v, WINDOW* win) {
+    v->win = win;
+    v->scroll = 0;
+    v->title[0] = '\0';
+    row_cache_init(&v->rows, getmaxy(win) - 2);
+    werase(win);
+    box(win, 0, 0);
+    mvwprintw(win, getmaxy(win) - 1, 2, " PgUp/PgDn ");
+}
+
+void free_stack_view(StackView* v) {
+    row_cache_free(&v->rows);
+}
+
+// Move the view by delta rows toward the bottom of the stack (negative
+// toward the top); clamped when drawn
+void stack_view_scroll(StackView* v, int delta) {
+    v->scroll += delta;
+    if (v->scroll < 0) v->scroll = 0;
+}
+
+// Keys that scroll the view: PgUp/PgDn by a page, Home/End to the top and
+// bottom of the stack. Returns 0 for any other key.
+int stack_view_key(StackView* v, int c) {
+    if (c == KEY_NPAGE) stack_view_scroll(v, v->rows.nrows);
+    else if (c == KEY_PPAGE) stack_view_scroll(v, -v->rows.nrows);
+    else if (c == KEY_HOME) v->scroll = 0;
+    else if (c == KEY_END) v->scroll = INT_MAX / 2;
+    else return 0;
+    return 1;
+}
+
+// Bring the window up to date with s; the caller refreshes the screen
+// (this only stages the window with wnoutrefresh)
+void stack_view_draw(StackView* v, const Stack* s) {
+    int nrows = v->rows.nrows;
+    int max_scroll = s->size > nrows ? s->size - nrows : 0;
+    if (v->scroll > max_scroll) v->scroll = max_scroll;
+
+    char title[64];
+    if (s->size == 0) snprintf(title, sizeof(title), " Stack Contents ");
+    else if (s->size <= nrows) snprintf(title, sizeof(title), " Stack Contents (%d) ", s->size);
+    else snprintf(title, sizeof(title), " Stack %d-%d of %d ", s->size - v->scroll,
+                  s->size - v->scroll - nrows + 1, s->size);
+    if (strcmp(title, v->title) != 0) {
+        mvwhline(v->win, 0, 1, 0, getmaxx(v->win) - 2);
+        wattron(v->win, COLOR_PAIR(5) | A_BOLD);
+        mvwprintw(v->win, 0, 2, "%s", title);
+        wattroff(v->win, COLOR_PAIR(5) | A_BOLD);
+        strcpy(v->title, title);
+    }
+
+    for (int y = 1; y <= nrows; y++) {
+        int index = s->size - v->scroll - (y - 1);
+        char row[ROW_TEXT], numbuf[32];
+        if (index <= 0) {
+            draw_row(v->win, &v->rows, y, 0, "");
+            continue;
+        }
+        const char* token = value_text(s->slots[index - 1], numbuf, sizeof(numbuf));
+        int attr = COLOR_PAIR(index % 2 == 0 ? 8 : 3);
+        if (index == s->size) {
+            attr |= A_BOLD | A_UNDERLINE;
+            snprintf(row, sizeof(row), "#%d: %s  <- Top", index, token);
+        } else {
+            snprintf(row, sizeof(row), "#%d: %s", index, token);
+        }
+        draw_row(v->win, &v->rows, y, attr, row);
+    }
+    wnoutrefresh(v->win);
+}
+
+// Option 13 only exists in instrumented builds
+#ifdef SM_INSTRUMENT
+#define MENU_OPTIONS 13
+#else
+#define MENU_OPTIONS 12
+#endif
+
+void draw_menu(WINDOW* win) {
+    werase(win);
+    box(win, 0, 0);
+    int width = getmaxx(win);
+    wattron(win, COLOR_PAIR(1) | A_BOLD | A_UNDERLINE);
+    mvwprintw(win, 1, (width - 24) / 2, " Stack Machine Menu ");
+    wattroff(win, COLOR_PAIR(1) | A_BOLD | A_UNDERLINE);
+
+    wattron(win, COLOR_PAIR(2));
+    mvwprintw(win, 2, 2, "1. Push Token (Number or Char)");
+    mvwprintw(win, 3, 2, "2. Pop Token");
+    mvwprintw(win, 4, 2, "3. Add (Top two)");
+    mvwprintw(win, 5, 2, "4. Subtract (Top two)");
+    mvwprintw(win, 6, 2, "5. Multiply (Top two)");
+    mvwprintw(win, 7, 2, "6. Divide (Top two)");
+    mvwprintw(win, 8, 2, "7. Infix to Postfix Conversion (Stepwise)");
+    mvwprintw(win, 9, 2, "8. Evaluate Postfix (numeric only)");
+    mvwprintw(win, 10, 2, "9. Postfix to Infix Conversion (Stepwise)");
+    mvwprintw(win, 11, 2, "10. Exit");
+    mvwprintw(win, 12, 2, "11. Evaluate Infix with Variables");
+    mvwprintw(win, 13, 2, "12. Run Postfix File on the Stack");
+#ifdef SM_INSTRUMENT
+    mvwprintw(win, 14, 2, "13. Instrumentation Stats");
+#endif
+    wattroff(win, COLOR_PAIR(2));
+
+    wattron(win, A_BOLD | COLOR_PAIR(4));
+    mvwhline(win, 15, 1, 0, width - 2);
+    wattroff(win, A_BOLD | COLOR_PAIR(4));
+
+    wattron(win, A_BOLD);
+    mvwprintw(win, 16, 2, "Choose option (1-%d): ", MENU_OPTIONS);
+    wclrtoeol(win);
+    wattroff(win, A_BOLD);
+
+    wrefresh(win);
+}
 
 void draw_msg_box(WINDOW* win) {
     werase(win);
@@ -576,230 +4501,3992 @@ void draw_msg_box(WINDOW* win) {
     wrefresh(win);
 }
 
-void print_centered(WINDOW* win, int y, const char* str, int color_pair) {
-    int width = getmaxx(win);
-    int len = strlen(str);
-    int x = (width - len) / 2;
-    wattron(win, COLOR_PAIR(color_pair) | A_BOLD);
-    mvwprintw(win, y, x, "%s", str);
-    wattroff(win, COLOR_PAIR(color_pair) | A_BOLD);
-    wrefresh(win);
+void print_centered(WINDOW* win, int y, const char* str, int color_pair) {
+    int width = getmaxx(win);
+    int len = strlen(str);
+    int x = (width - len) / 2;
+    wattron(win, COLOR_PAIR(color_pair) | A_BOLD);
+    mvwprintw(win, y, x, "%s", str);
+    wattroff(win, COLOR_PAIR(color_pair) | A_BOLD);
+    wrefresh(win);
+}
+
+#ifdef SM_INSTRUMENT
+// Stats panel: instrument_total after folding in this thread's counters,
+// executed opcodes in two columns
+void draw_instrument_stats(WINDOW* win) {
+    instrument_fold();
+    const InstrumentStats* s = &instrument_total;
+    int width = getmaxx(win), rows = getmaxy(win) - 5;
+    werase(win);
+    box(win, 0, 0);
+    wattron(win, COLOR_PAIR(5) | A_BOLD);
+    mvwprintw(win, 0, (width - 13) / 2, " Instruments ");
+    wattroff(win, COLOR_PAIR(5) | A_BOLD);
+    mvwprintw(win, 1, 2, "Evaluations %llu   peak stack depth %d   allocations %llu",
+              s->evaluations, s->peak_depth, s->allocs);
+    mvwprintw(win, 2, 2, "Tokenize/compile %llu %s   execute %llu %s",
+              s->tokenize_ticks, INSTRUMENT_TICK_UNIT, s->execute_ticks, INSTRUMENT_TICK_UNIT);
+    int executed = 0;
+    for (int op = 0; op < OP_COUNT; op++) executed += s->op_count[op] > 0;
+    wattron(win, A_BOLD);
+    mvwprintw(win, 3, 2, "%-9s %10s %9s", "opcode", "count", "avg");
+    if (executed > rows) mvwprintw(win, 3, 2 + width / 2 - 1, "%-9s %10s %9s", "opcode", "count", "avg");
+    wattroff(win, A_BOLD);
+    int shown = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (s->op_count[op] == 0) continue;
+        if (shown >= 2 * rows) break;
+        int x = shown < rows ? 2 : 2 + width / 2 - 1, y = 4 + shown % rows;
+        mvwprintw(win, y, x, "%-9s %10llu %9.1f", opcode_names[op], s->op_count[op],
+                  (double)s->op_ticks[op] / s->op_count[op]);
+        shown++;
+    }
+    if (shown == 0) mvwprintw(win, 4, 2, "Nothing executed yet.");
+    mvwprintw(win, getmaxy(win) - 1, 2, " avg is %s per execution ", INSTRUMENT_TICK_UNIT);
+    wrefresh(win);
+}
+#endif
+
+// Option 12: a postfix file applied to the menu stack token by token, as
+// options 1-6 would apply them, on an engine thread of its own. The engine
+// holds lock while it works through a slice of tokens; the menu takes it
+// only to format the rows in view, then writes to the terminal after
+// letting go, at most once per FRAME_MS. Computation therefore never
+// waits on the terminal, and a 100000-deep stack costs a frame no more
+// than a shallow one.
+typedef struct StackJob {
+    Stack* stack;
+    const char* src;
+    size_t len;
+    pthread_mutex_t lock;
+    int ui_waiting;         // the menu is waiting for lock (atomic)
+    int cancel;             // under lock
+    int done;               // under lock
+    size_t pos;             // under lock: bytes applied so far
+    long tokens;            // under lock: tokens applied so far
+    const char* error;      // under lock: why the engine stopped early
+    size_t error_pos;       // and the offset of the token it stopped at
+    double seconds;         // engine time, set before done
+} StackJob;
+
+// Tokens applied per hold of the lock
+#define STACK_JOB_SLICE 4096
+
+// Apply one token to job->stack; 0 with job->error set if it cannot be
+int stack_job_token(StackJob* job, int kind, size_t start, size_t end) {
+    Stack* s = job->stack;
+    const char* text = job->src + start;
+    if (kind == TOKEN_OPERAND) {
+        double num;
+        if (!(isdigit((unsigned char)text[0]) || text[0] == '.')) push(s, make_symbol(text, end - start));
+        else if (parse_number(text, end - start, &num)) push(s, make_number(num));
+        else {
+            job->error = "bad number";
+            return 0;
+        }
+        return 1;
+    }
+    char op = text[0];
+    if (strchr("+-*/^", op) == NULL || end - start != 1) {
+        job->error = "unknown token";
+        return 0;
+    }
+    if (s->size < 2) {
+        job->error = "insufficient operands";
+        return 0;
+    }
+    Value a = s->slots[s->size - 1], b = s->slots[s->size - 2];
+    if (a.type != VAL_NUM || b.type != VAL_NUM) {
+        s->slots[s->size - 2] = make_binary_expr(b, op, a);
+    } else if (op == '/' && a.as.num == 0) {
+        job->error = "division by zero";
+        return 0;
+    } else {
+        double res = op == '+' ? b.as.num + a.as.num : op == '-' ? b.as.num - a.as.num :
+                     op == '*' ? b.as.num * a.as.num : op == '/' ? b.as.num / a.as.num : power(b.as.num, a.as.num);
+        s->slots[s->size - 2] = make_number(res);
+    }
+    s->size--;
+    return 1;
+}
+
+void* stack_job_main(void* arg) {
+    StackJob* job = (StackJob*)arg;
+    Lexer lx;
+    int kind = TOKEN_OTHER;
+    size_t start, end;
+    double started = now_seconds();
+    lex_init(&lx, job->src, job->len);
+    pthread_mutex_lock(&job->lock);
+    while (!job->cancel) {
+        for (int n = 0; n < STACK_JOB_SLICE; n++) {
+            kind = lex_next(&lx, &start, &end);
+            if (kind == TOKEN_END) break;
+            if (!stack_job_token(job, kind, start, end)) {
+                job->error_pos = start;
+                break;
+            }
+            job->tokens++;
+            job->pos = end;
+        }
+        if (kind == TOKEN_END || job->error) break;
+        // Let a waiting frame in before the next slice
+        pthread_mutex_unlock(&job->lock);
+        while (__atomic_load_n(&job->ui_waiting, __ATOMIC_ACQUIRE)) sched_yield();
+        pthread_mutex_lock(&job->lock);
+    }
+    if (kind == TOKEN_END) job->pos = job->len;
+    job->seconds = now_seconds() - started;
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+void run_stack_job(Stack* stack, WINDOW* msg_win, StackView* view) {
+    char path[256];
+    werase(msg_win);
+    box(msg_win, 0, 0);
+    wattron(msg_win, COLOR_PAIR(3));
+    mvwprintw(msg_win, 1, 2, "Postfix file to run on the stack: ");
+    wattroff(msg_win, COLOR_PAIR(3));
+    wmove(msg_win, 2, 2);
+    wrefresh(msg_win);
+    echo();
+    wgetnstr(msg_win, path, 255);
+    noecho();
+
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        wattron(msg_win, COLOR_PAIR(4));
+        mvwprintw(msg_win, 3, 2, "Cannot open %.60s: %s", path, strerror(errno));
+        wattroff(msg_win, COLOR_PAIR(4));
+        wrefresh(msg_win);
+        return;
+    }
+    StackJob job;
+    memset(&job, 0, sizeof(job));
+    job.stack = stack;
+    job.src = read_all(fp, &job.len);
+    fclose(fp);
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_t engine;
+    pthread_create(&engine, NULL, stack_job_main, &job);
+
+    RowCache rows;
+    row_cache_init(&rows, getmaxy(msg_win) - 2);
+    mvwprintw(msg_win, getmaxy(msg_win) - 1, 2, " c: cancel  PgUp/PgDn/Home/End: scroll stack ");
+    keypad(msg_win, TRUE);
+    wtimeout(msg_win, FRAME_MS);
+    long frames = 0;
+    for (;;) {
+        __atomic_store_n(&job.ui_waiting, 1, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&job.lock);
+        __atomic_store_n(&job.ui_waiting, 0, __ATOMIC_RELEASE);
+        int done = job.done;
+        size_t pos = job.pos;
+        long tokens = job.tokens;
+        stack_view_draw(view, stack);
+        pthread_mutex_unlock(&job.lock);
+
+        char row[ROW_TEXT];
+        snprintf(row, sizeof(row), "%s: %ld tokens, %.0f%% of %zu bytes", done ? "Finished" : "Running",
+                 tokens, job.len ? 100.0 * pos / job.len : 100.0, job.len);
+        draw_row(msg_win, &rows, 4, COLOR_PAIR(2), row);
+        wnoutrefresh(msg_win);
+        doupdate();
+        frames++;
+        if (done) break;
+
+        int c = wgetch(msg_win);
+        if (c == 'c' || c == 'q') {
+            pthread_mutex_lock(&job.lock);
+            job.cancel = 1;
+            pthread_mutex_unlock(&job.lock);
+        } else {
+            stack_view_key(view, c);
+        }
+    }
+    pthread_join(engine, NULL);
+    wtimeout(msg_win, -1);
+
+    char row[ROW_TEXT];
+    if (job.error) {
+        snprintf(row, sizeof(row), "Stopped at byte %zu: %s", job.error_pos + 1, job.error);
+        draw_row(msg_win, &rows, 6, COLOR_PAIR(4), row);
+    } else if (job.cancel) {
+        draw_row(msg_win, &rows, 6, COLOR_PAIR(4), "Cancelled.");
+    }
+    snprintf(row, sizeof(row), "Depth %d after %.1f ms, %ld frames drawn", stack->size, job.seconds * 1e3, frames);
+    draw_row(msg_win, &rows, 7, COLOR_PAIR(3), row);
+    wrefresh(msg_win);
+    row_cache_free(&rows);
+    pthread_mutex_destroy(&job.lock);
+    free((char*)job.src);
+}
+
+void handle_user_option(Stack* stack, int option, WINDOW* msg_win, StackView* view, char* input, char* postfix) {
+    int error;
+
+    draw_msg_box(msg_win);
+
+    switch(option) {
+        case 1: // Push Token (number or char)
+            werase(msg_win);
+            box(msg_win, 0, 0);
+            wattron(msg_win, COLOR_PAIR(3));
+            mvwprintw(msg_win, 1, 2, "Enter number or character token to push: ");
+            wattroff(msg_win, COLOR_PAIR(3));
+            wrefresh(msg_win);
+
+            wmove(msg_win, 2, 2);
+            wclrtoeol(msg_win);
+            wrefresh(msg_win);
+
+            echo();
+            wgetnstr(msg_win, input, 31);
+            noecho();
+
+            if (strlen(input) == 0) {
+                wattron(msg_win, COLOR_PAIR(4));
+                print_centered(msg_win, 3, "Empty input! Nothing pushed.", 4);
+                wattroff(msg_win, COLOR_PAIR(4));
+                wrefresh(msg_win);
+                break;
+            }
+
+            int valid = 1;
+            for (int i = 0; input[i]; i++) {
+                if (!isalnum(input[i]) && input[i] != '.') {
+                    valid = 0;
+                    break;
+                }
+            }
+            if (!valid) {
+                wattron(msg_win, COLOR_PAIR(4));
+                print_centered(msg_win, 3, "Invalid token! Use alphanumeric chars only.", 4);
+                wattroff(msg_win, COLOR_PAIR(4));
+                wrefresh(msg_win);
+                break;
+            }
+
+            push(stack, parse_value(input));
+            INSTRUMENT_DEPTH(stack->size);
+            wattron(msg_win, COLOR_PAIR(3));
+            mvwprintw(msg_win, 3, 2, "Successfully pushed: %s", input);
+            wattroff(msg_win, COLOR_PAIR(3));
+            wrefresh(msg_win);
+            break;
+
+        case 2: // Pop Token
+            {
+                char numbuf[32];
+                Value popped = pop(stack, &error);
+                const char* val = value_text(popped, numbuf, sizeof(numbuf));
+                if (error) {
+                    wattron(msg_win, COLOR_PAIR(4));
+                    print_centered(msg_win, 2, "Stack is empty. Cannot pop.", 4);
+                    wattroff(msg_win, COLOR_PAIR(4));
+                } else {
+                    wattron(msg_win, COLOR_PAIR(3));
+                    mvwprintw(msg_win, 2, 2, "Popped from stack: %s", val);
+                    wattroff(msg_win, COLOR_PAIR(3));
+                }
+                wrefresh(msg_win);
+            }
+            break;
+
+        case 3: // Add (Top two)
+        case 4: // Subtract (Top two)
+        case 5: // Multiply (Top two)
+        case 6: // Divide (Top two)
+            {
+                if (stack->size < 2) {
+                    wattron(msg_win, COLOR_PAIR(4));
+                    print_centered(msg_win, 2, "Need at least 2 elements in stack!", 4);
+                    wattroff(msg_win, COLOR_PAIR(4));
+                    wrefresh(msg_win);
+                    break;
+                }
+                INSTRUMENT_START(op_start);
+                Value a = pop(stack, &error);
+                Value b = pop(stack, &error);
+
+                if (a.type != VAL_NUM || b.type != VAL_NUM) {
+                    static const char ops[] = "+-*/";
+                    Value expr = make_binary_expr(b, ops[option - 3], a);
+                    push(stack, expr);
+                    INSTRUMENT_OP(OP_ADD + option - 3, op_start);
+                    char numbuf[32];
+                    wattron(msg_win, COLOR_PAIR(3));
+                    mvwprintw(msg_win, 2, 2, "Symbolic operation result: %s", value_text(expr, numbuf, sizeof(numbuf)));
+                    wattroff(msg_win, COLOR_PAIR(3));
+                } else {
+                    double valA = a.as.num;
+                    double valB = b.as.num;
+                    double res = 0;
+                    switch(option) {
+                        case 3: res = valB + valA; break;
+                        case 4: res = valB - valA; break;
+                        case 5: res = valB * valA; break;
+                        case 6:
+                            if(valA == 0) {
+                                wattron(msg_win, COLOR_PAIR(4));
+                                print_centered(msg_win, 2, "Error: Division by zero!", 4);
+                                wattroff(msg_win, COLOR_PAIR(4));
+                                push(stack, b);
+                                push(stack, a);
+                                wrefresh(msg_win);
+                                return;
+                            }
+                            res = valB / valA;
+                            break;
+                    }
+                    push(stack, make_number(res));
+                    INSTRUMENT_OP(OP_ADD + option - 3, op_start);
+                    wattron(msg_win, COLOR_PAIR(3));
+                    mvwprintw(msg_win, 2, 2, "Operation result: %.15g", res);
+                    wattroff(msg_win, COLOR_PAIR(3));
+                }
+                wrefresh(msg_win);
+            }
+            break;
+
+        case 7: // Infix to Postfix Conversion with stepwise trace
+            werase(msg_win);
+            box(msg_win, 0, 0);
+            wattron(msg_win, COLOR_PAIR(3));
+            mvwprintw(msg_win, 1, 2, "Enter infix expression (e.g. A+B*C): ");
+            wattroff(msg_win, COLOR_PAIR(3));
+            wrefresh(msg_win);
+
+            wmove(msg_win, 2, 2);
+            wclrtoeol(msg_win);
+            wrefresh(msg_win);
+
+            echo();
+            wgetnstr(msg_win, input, 255);
+            noecho();
+
+            werase(msg_win);
+            wrefresh(msg_win);
+            infix_to_postfix_stepwise(input, msg_win);
+            break;
+
+        case 8: // Evaluate Postfix Numeric Only
+            werase(msg_win);
+            box(msg_win, 0, 0);
+            wattron(msg_win, COLOR_PAIR(3));
+            mvwprintw(msg_win, 1, 2, "Enter postfix expression (numbers only): ");
+            wattroff(msg_win, COLOR_PAIR(3));
+            wrefresh(msg_win);
+
+            wmove(msg_win, 2, 2);
+            wclrtoeol(msg_win);
+            wrefresh(msg_win);
+
+            echo();
+            wgetnstr(msg_win, input, 255);
+            noecho();
+
+            ExactNum eval_res;
+            size_t eval_len = strlen(input), eval_err;
+            if (evaluate_postfix_exact(input, &eval_res)) {
+                wattron(msg_win, COLOR_PAIR(3));
+                if (eval_res.is_int) mvwprintw(msg_win, 3, 2, "Evaluation result: %lld", eval_res.i);
+                else mvwprintw(msg_win, 3, 2, "Evaluation result: %.15g", eval_res.d);
+                wattroff(msg_win, COLOR_PAIR(3));
+            } else if (verify_postfix(input, eval_len, &eval_err) < 0) {
+                wattron(msg_win, COLOR_PAIR(4));
+                if (eval_err < eval_len) mvwprintw(msg_win, 3, 2, "Insufficient operands for '%c' at column %zu.",
+                                                   input[eval_err], eval_err + 1);
+                else mvwprintw(msg_win, 3, 2, "Operands left over: the stack does not end with one value.");
+                wattroff(msg_win, COLOR_PAIR(4));
+            } else {
+                wattron(msg_win, COLOR_PAIR(4));
+                print_centered(msg_win, 3, "Invalid expression or contains variables.", 4);
+                wattroff(msg_win, COLOR_PAIR(4));
+            }
+            wrefresh(msg_win);
+            break;
+
+        case 9: // Postfix to Infix Stepwise
+            postfix_to_infix_stepwise(msg_win);
+            break;
+
+        case 10: // Exit
+            endwin();
+            exit(0);
+
+        case 11: // Compile infix once, then evaluate it with variable values
+            {
+                werase(msg_win);
+                box(msg_win, 0, 0);
+                wattron(msg_win, COLOR_PAIR(3));
+                mvwprintw(msg_win, 1, 2, "Enter infix expression (e.g. A+B*C): ");
+                wattroff(msg_win, COLOR_PAIR(3));
+                wmove(msg_win, 2, 2);
+                wclrtoeol(msg_win);
+                wrefresh(msg_win);
+
+                echo();
+                wgetnstr(msg_win, input, 255);
+                noecho();
+
+                Program program;
+                const char* error_msg;
+                init_program(&program);
+                INSTRUMENT_START(compile_start);
+                int compiled = compile_infix(input, &program, &error_msg);
+                INSTRUMENT_PHASE(tokenize_ticks, compile_start);
+                if (!compiled) {
+                    wattron(msg_win, COLOR_PAIR(4));
+                    mvwprintw(msg_win, 4, 2, "Compile error: %s", error_msg);
+                    wattroff(msg_win, COLOR_PAIR(4));
+                    wrefresh(msg_win);
+                    free_program(&program);
+                    break;
+                }
+
+                int source_len = program.len;
+                optimize_program(&program, OPT_EXACT);
+
+                double* bindings = (double*)checked_realloc(NULL, (size_t)(program.nvars + 1) * sizeof(double));
+                for (int v = 0; v < program.nvars; v++) {
+                    char value[64];
+                    wmove(msg_win, 4, 2);
+                    wclrtoeol(msg_win);
+                    mvwprintw(msg_win, 4, 2, "Value for %s: ", program.vars[v]);
+                    box(msg_win, 0, 0);
+                    wrefresh(msg_win);
+                    echo();
+                    wgetnstr(msg_win, value, 63);
+                    noecho();
+                    bindings[v] = atof(value);
+                }
+
+                double value;
+                if (run_program(&program, bindings, &value)) {
+                    wattron(msg_win, COLOR_PAIR(3));
+                    mvwprintw(msg_win, 6, 2, "Compiled to %d instructions (%d before optimizing), result: %.15g",
+                              program.len, source_len, value);
+                    wattroff(msg_win, COLOR_PAIR(3));
+                } else {
+                    wattron(msg_win, COLOR_PAIR(4));
+                    print_centered(msg_win, 6, "Invalid expression: missing operands.", 4);
+                    wattroff(msg_win, COLOR_PAIR(4));
+                }
+                wrefresh(msg_win);
+                free(bindings);
+                free_program(&program);
+            }
+            break;
+
+        case 12: // Postfix file applied on the engine thread
+            run_stack_job(stack, msg_win, view);
+            break;
+
+#ifdef SM_INSTRUMENT
+        case 13: // Instrumentation counters
+            draw_instrument_stats(msg_win);
+            break;
+#endif
+
+        default:
+            {
+                char text[40];
+                snprintf(text, sizeof(text), "Invalid option! Select (1-%d).", MENU_OPTIONS);
+                wattron(msg_win, COLOR_PAIR(4));
+                print_centered(msg_win, 2, text, 4);
+                wattroff(msg_win, COLOR_PAIR(4));
+                wrefresh(msg_win);
+            }
+            break;
+    }
+    stack_view_draw(view, stack);
+    wnoutrefresh(msg_win);
+    doupdate();
+}
+
+void batch_usage(void) {
+    fprintf(stderr,
+        "usage: stack_machine --batch [--postfix] [--convert] [--threads N] [--cache BYTES]\n"
+        "                             [--optimize] [--relaxed] [--opt-report] [--registers]\n"
+        "                             [--var NAME=VALUE]... [file]\n"
+        "  Reads one expression per line from file (default stdin).\n"
+        "  --postfix  input lines are postfix (default: infix)\n"
+        "  --convert  print the converted form instead of the value\n"
+        "             (postfix for infix input, infix for postfix input)\n"
+        "  --threads  evaluate on N worker threads (output order is preserved)\n"
+        "  --cache    keep up to BYTES of compiled expressions per thread, keyed on\n"
+        "             normalized text, and report hits/misses/evictions on stderr\n"
+        "  --optimize fold constants and apply identities that never change a result\n"
+        "  --relaxed  also x+0, x*0, x^2 -> x*x, x^-1 -> 1/x, x^0.5 -> sqrt(x), which can\n"
+        "             differ for signed zeros, infinities, NaN or in the last bit\n"
+        "  --opt-report  append \"<TAB># ops BEFORE->AFTER\" to each evaluated line\n"
+        "  --registers  run expressions as register code (same results); with --cache,\n"
+        "             an expression is lowered once it has been seen 8 times\n"
+        "  --var      bind a variable used by the expressions\n"
+#ifdef SM_INSTRUMENT
+        "  --stats FILE  write instrumentation snapshots to FILE (- for stderr) every\n"
+        "             --stats-interval seconds (default 1) and at the end, as JSON lines\n"
+        "             or, with --stats-format csv, rows of elapsed_s,name,count,ticks\n"
+#endif
+        "  Failed lines print \"error: <reason>\" in place of the result.\n");
+}
+
+typedef struct BatchOptions {
+    int postfix_input;
+    int convert;
+    int threads;
+    size_t cache_bytes;     // 0 disables the compiled-expression cache
+    int opt_level;          // OPT_NONE, OPT_EXACT or OPT_RELAXED
+    int opt_report;
+    int registers;          // run reused expressions on the register tier
+    const char* path;
+    // --var bindings: names point into argv, the text before '='
+    const char** var_names;
+    size_t* var_name_len;
+    double* var_values;
+    int nvars;
+} BatchOptions;
+
+// Per-thread evaluation state. Every worker owns one, so threads never
+// share a Program, stack or output buffer.
+typedef struct BatchWorker {
+    Program program;
+    double* bindings;
+    int bindings_cap;
+    ExprDag dag;            // for postfix-to-infix conversion
+    TextBuf text;           // normalized input when the cache is off
+    ExprCache cache;
+    int use_cache;
+    RegProgram registers;   // register form of program when the cache is off
+    long ops_before;        // instruction counts over evaluated lines,
+    long ops_after;         // before and after optimize_program
+    long reg_stack_ops;     // instruction counts over lines run on registers,
+    long reg_ops;           // as stack code and as register code
+} BatchWorker;
+
+// Counters summed over all workers for the end-of-run summary
+enum { TOTAL_HITS, TOTAL_MISSES, TOTAL_EVICTIONS, TOTAL_OPS_BEFORE, TOTAL_OPS_AFTER, TOTAL_TIERED,
+       TOTAL_REG_STACK_OPS, TOTAL_REG_OPS, TOTAL_COUNT };
+
+void init_batch_worker(BatchWorker* w, const BatchOptions* opt) {
+    init_program(&w->program);
+    w->bindings = NULL;
+    w->bindings_cap = 0;
+    memset(&w->dag, 0, sizeof(w->dag));
+    memset(&w->text, 0, sizeof(w->text));
+    w->use_cache = opt->cache_bytes > 0;
+    init_registers(&w->registers);
+    w->ops_before = 0;
+    w->ops_after = 0;
+    w->reg_stack_ops = 0;
+    w->reg_ops = 0;
+    // Conversions print the program as written, so it is never optimized
+    if (w->use_cache) cache_init(&w->cache, opt->cache_bytes, opt->convert ? OPT_NONE : opt->opt_level);
+}
+
+// Folds this worker's counters into totals (TOTAL_* indexes)
+void free_batch_worker(BatchWorker* w, long* totals) {
+    if (w->use_cache) {
+        totals[TOTAL_HITS] += w->cache.hits;
+        totals[TOTAL_MISSES] += w->cache.misses;
+        totals[TOTAL_EVICTIONS] += w->cache.evictions;
+        totals[TOTAL_TIERED] += w->cache.tiered;
+        cache_free(&w->cache);
+    }
+    totals[TOTAL_OPS_BEFORE] += w->ops_before;
+    totals[TOTAL_OPS_AFTER] += w->ops_after;
+    totals[TOTAL_REG_STACK_OPS] += w->reg_stack_ops;
+    totals[TOTAL_REG_OPS] += w->reg_ops;
+    free_program(&w->program);
+    free_registers(&w->registers);
+    free(w->bindings);
+    dag_free(&w->dag);
+    free(w->text.data);
+}
+
+// Evaluate or convert one line, line[0..len) without its newline, and
+// append its output line. The line is read in place (it may point into a
+// read-only mapping of the input); it is copied only when it needs
+// normalizing or becomes a cache key. Returns 0 if the line failed.
+int batch_line(const BatchOptions* opt, BatchWorker* w, const char* line, size_t len, TextBuf* out) {
+    const Program* program = &w->program;
+    const RegProgram* registers = NULL;
+    const char* error_msg = NULL;
+    char error_text[64];
+    int ok, source_len = 0;
+    int lower = opt->registers && !opt->convert;
+    INSTRUMENT_START(compile_start);
+    if (opt->convert && !opt->postfix_input) {
+        // Straight text-to-text: no program, operands copied as written
+        InfixError err;
+        const char* text = line;
+        if (needs_normalizing(line, len)) {
+            normalize_expression(line, len, 0, &w->text);
+            text = w->text.data + 1;
+            len = w->text.len - 1;
+        }
+        if (!infix_to_postfix(text, len, out, NULL, NULL, &err)) {
+            snprintf(error_text, sizeof(error_text), "%s at column %zu", infix_status_text(err.status), err.pos + 1);
+            error_msg = error_text;
+        }
+        program = NULL;
+        ok = 1;
+    } else if (w->use_cache) {
+        program = cache_compile(&w->cache, line, len, opt->postfix_input, &error_msg, &source_len,
+                                lower ? &registers : NULL);
+        ok = program != NULL;
+    } else {
+        // Same accepted syntax as the cached path
+        const char* text = line;
+        if (needs_normalizing(line, len)) {
+            normalize_expression(line, len, opt->postfix_input, &w->text);
+            text = w->text.data + 1;
+            len = w->text.len - 1;
+        }
+        ok = opt->postfix_input ? compile_postfix_span(text, len, &w->program, &error_msg, NULL)
+                                : compile_infix_span(text, len, &w->program, &error_msg);
+        source_len = w->program.len;
+        if (ok && !opt->convert) optimize_program(&w->program, opt->opt_level);
+        // Nothing is reused without the cache, so every line is lowered
+        if (ok && lower && lower_program(&w->program, &w->registers)) registers = &w->registers;
+    }
+    INSTRUMENT_PHASE(tokenize_ticks, compile_start);
+    if (program == NULL) {
+        // converted above
+    } else if (ok && program->len == 0) {
+        // blank line stays blank
+    } else if (ok && opt->convert) {
+        if (opt->postfix_input) {
+            if (!program_to_infix(program, out, &w->dag)) error_msg = "insufficient operands";
+        } else {
+            program_to_postfix(program, out);
+        }
+    } else if (ok) {
+        if (program->nvars > w->bindings_cap) {
+            w->bindings_cap = program->nvars;
+            w->bindings = (double*)checked_realloc(w->bindings, (size_t)w->bindings_cap * sizeof(double));
+        }
+        for (int v = 0; v < program->nvars && !error_msg; v++) {
+            int b = 0;
+            while (b < opt->nvars && (strncmp(opt->var_names[b], program->vars[v], opt->var_name_len[b]) != 0 ||
+                                      program->vars[v][opt->var_name_len[b]] != '\0')) b++;
+            if (b == opt->nvars) error_msg = "unbound variable";
+            else w->bindings[v] = opt->var_values[b];
+        }
+        double value;
+        if (error_msg) {
+            // reported below
+        } else if (registers ? run_registers(registers, w->bindings, &value)
+                             : run_program(program, w->bindings, &value)) {
+            text_number(out, value);
+            w->ops_before += source_len;
+            w->ops_after += program->len;
+            if (registers) {
+                w->reg_stack_ops += registers->stack_len;
+                w->reg_ops += registers->len;
+            }
+            if (opt->opt_report) {
+                char report[48];
+                int n = snprintf(report, sizeof(report), "\t# ops %d->%d", source_len, program->len);
+                text_append(out, report, (size_t)n);
+            }
+        } else {
+            error_msg = "insufficient operands";
+        }
+    }
+
+    if (error_msg) {
+        text_append(out, "error: ", 7);
+        text_append(out, error_msg, strlen(error_msg));
+    }
+    text_putc(out, '\n');
+    return error_msg == NULL;
+}
+
+// Batch input: a read-only mapping of the file when it is a regular file,
+// else its contents read into the heap. Lines are handed to batch_line as
+// spans of data, so every worker shares the one buffer and no input byte
+// is copied before it is parsed.
+typedef struct BatchInput {
+    const char* data;
+    size_t len;
+    int mapped;
+    size_t released;        // leading bytes already dropped with madvise
+} BatchInput;
+
+// Map in when it is a regular file. Returns 0 (input untouched) for
+// pipes, terminals and anything else mmap cannot serve.
+int map_batch_input(FILE* in, BatchInput* input) {
+    struct stat st;
+    memset(input, 0, sizeof(*input));
+    if (fstat(fileno(in), &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+    if (st.st_size > 0) {
+        void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+        if (data == MAP_FAILED) return 0;
+        madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+        input->data = (const char*)data;
+    }
+    input->len = (size_t)st.st_size;
+    input->mapped = 1;
+    return 1;
+}
+
+// Drop the mapped pages wholly before offset upto from this process. The
+// page cache keeps them, so RSS stays flat however large the file is.
+void release_batch_input(BatchInput* input, size_t upto) {
+    if (!input->mapped || input->data == NULL) return;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t end = upto / page * page;
+    if (end > input->released) {
+        madvise((char*)input->data + input->released, end - input->released, MADV_DONTNEED);
+        input->released = end;
+    }
+}
+
+void free_batch_input(BatchInput* input) {
+    if (input->mapped) {
+        if (input->data) munmap((void*)input->data, input->len);
+    } else {
+        free((void*)input->data);
+    }
+    memset(input, 0, sizeof(*input));
+}
+
+// End of the chunk starting at pos: pos + size extended to just past the
+// next newline, or len
+size_t chunk_end(const char* buf, size_t len, size_t pos, size_t size) {
+    if (len - pos <= size) return len;
+    const char* nl = (const char*)memchr(buf + pos + size - 1, '\n', len - (pos + size - 1));
+    return nl ? (size_t)(nl - buf) + 1 : len;
+}
+
+// Evaluate every line of [begin, end) in place, appending to out. Returns
+// the number of lines and adds the failures to *failed.
+long batch_span(const BatchOptions* opt, BatchWorker* w, const char* begin, const char* end, TextBuf* out,
+                long* failed) {
+    long lines = 0;
+    for (const char* line = begin; line < end; lines++) {
+        const char* nl = (const char*)memchr(line, '\n', (size_t)(end - line));
+        const char* stop = nl ? nl : end;
+        size_t n = (size_t)(stop - line);
+        while (n > 0 && line[n - 1] == '\r') n--;
+        if (!batch_line(opt, w, line, n, out)) (*failed)++;
+        line = stop + 1;
+    }
+    return lines;
+}
+
+#define BATCH_CHUNK_BYTES (64 * 1024)
+#define BATCH_CHUNKS_PER_THREAD 4
+
+// A run of whole input lines and the output it produced. Chunks are cut
+// from the input only as the writer makes room, into a ring of window
+// slots, so at most window chunks (input pages and output) are in memory.
+typedef struct BatchChunk {
+    const char* begin;
+    const char* end;
+    TextBuf out;
+    long lines;
+    long failed;
+    int done;
+} BatchChunk;
+
+// Ids of the chunks dealt to one worker, a ring of window entries. The
+// owner takes from head (oldest first, so output can be written early);
+// thieves take from tail.
+typedef struct WorkDeque {
+    pthread_mutex_t lock;
+    long* items;
+    long head;
+    long tail;
+} WorkDeque;
+
+typedef struct BatchPool {
+    const BatchOptions* opt;
+    long totals[TOTAL_COUNT];   // summed by workers as they exit, under done_lock
+    const char* buf;
+    size_t len;
+    size_t pos;                 // where the next chunk starts (writer only)
+    BatchChunk* chunks;         // chunk id lives in slot id % window
+    int window;
+    WorkDeque* deques;
+    int nthreads;
+    long dealt;                 // chunks dealt so far, under done_lock
+    int finished;               // whole input dealt, under done_lock
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;   // a chunk finished
+    pthread_cond_t work_cond;   // a chunk was dealt, or the input ran out
+} BatchPool;
+
+typedef struct BatchThread {
+    BatchPool* pool;
+    int id;
+    pthread_t thread;
+} BatchThread;
+
+// Returns a chunk id, or -1 if every deque is empty
+long take_chunk(BatchPool* pool, int id) {
+    for (int k = 0; k < pool->nthreads; k++) {
+        int victim = (id + k) % pool->nthreads;
+        WorkDeque* d = &pool->deques[victim];
+        long chunk = -1;
+        pthread_mutex_lock(&d->lock);
+        if (d->head < d->tail) {
+            chunk = k == 0 ? d->items[d->head++ % pool->window] : d->items[--d->tail % pool->window];
+        }
+        pthread_mutex_unlock(&d->lock);
+        if (chunk >= 0) return chunk;
+    }
+    return -1;
+}
+
+// Cut chunk id from the input at pool->pos and queue it on a worker.
+// Writer thread only.
+void deal_chunk(BatchPool* pool, long id) {
+    BatchChunk* chunk = &pool->chunks[id % pool->window];
+    size_t end = chunk_end(pool->buf, pool->len, pool->pos, BATCH_CHUNK_BYTES);
+    chunk->begin = pool->buf + pool->pos;
+    chunk->end = pool->buf + end;
+    chunk->out.len = 0;
+    chunk->lines = 0;
+    chunk->failed = 0;
+    chunk->done = 0;
+    pool->pos = end;
+
+    WorkDeque* d = &pool->deques[id % pool->nthreads];
+    pthread_mutex_lock(&d->lock);
+    d->items[d->tail++ % pool->window] = id;
+    pthread_mutex_unlock(&d->lock);
+
+    pthread_mutex_lock(&pool->done_lock);
+    pool->dealt++;
+    pool->finished = pool->pos >= pool->len;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->done_lock);
+}
+
+void* batch_thread_main(void* arg) {
+    BatchThread* self = (BatchThread*)arg;
+    BatchPool* pool = self->pool;
+    BatchWorker worker;
+    init_batch_worker(&worker, pool->opt);
+
+    for (;;) {
+        // Remember how much was dealt before looking, so a chunk dealt
+        // while the deques are being swept is not slept through
+        pthread_mutex_lock(&pool->done_lock);
+        long seen = pool->dealt;
+        int finished = pool->finished;
+        pthread_mutex_unlock(&pool->done_lock);
+
+        long index = take_chunk(pool, self->id);
+        if (index < 0) {
+            if (finished) break;
+            pthread_mutex_lock(&pool->done_lock);
+            while (pool->dealt == seen && !pool->finished) pthread_cond_wait(&pool->work_cond, &pool->done_lock);
+            pthread_mutex_unlock(&pool->done_lock);
+            continue;
+        }
+        BatchChunk* chunk = &pool->chunks[index % pool->window];
+        chunk->lines = batch_span(pool->opt, &worker, chunk->begin, chunk->end, &chunk->out, &chunk->failed);
+        INSTRUMENT_FOLD();
+        pthread_mutex_lock(&pool->done_lock);
+        chunk->done = 1;
+        pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->done_lock);
+    }
+
+    pthread_mutex_lock(&pool->done_lock);
+    free_batch_worker(&worker, pool->totals);
+    pthread_mutex_unlock(&pool->done_lock);
+    arena_free(&thread_arena);
+    return NULL;
+}
+
+// Evaluate every line of input on nthreads workers with work stealing,
+// writing outputs to fp in input order. Chunks are cut at line boundaries
+// as the writer catches up, and mapped input is released behind it, so
+// memory use does not grow with the input. Returns the number of failed
+// lines; *lines_out receives the line count, and the workers' counters are
+// added to totals.
+long run_batch_parallel(const BatchOptions* opt, BatchInput* input, int nthreads, FILE* fp,
+                        long* lines_out, long* totals) {
+    BatchPool pool;
+    pool.opt = opt;
+    memset(pool.totals, 0, sizeof(pool.totals));
+    pool.buf = input->data;
+    pool.len = input->len;
+    pool.pos = 0;
+    pool.nthreads = nthreads;
+    pool.window = nthreads * BATCH_CHUNKS_PER_THREAD;
+    pool.chunks = (BatchChunk*)checked_realloc(NULL, (size_t)pool.window * sizeof(BatchChunk));
+    memset(pool.chunks, 0, (size_t)pool.window * sizeof(BatchChunk));
+    pool.dealt = 0;
+    pool.finished = input->len == 0;
+
+    pool.deques = (WorkDeque*)checked_realloc(NULL, (size_t)nthreads * sizeof(WorkDeque));
+    for (int t = 0; t < nthreads; t++) {
+        WorkDeque* d = &pool.deques[t];
+        pthread_mutex_init(&d->lock, NULL);
+        d->items = (long*)checked_realloc(NULL, (size_t)pool.window * sizeof(long));
+        d->head = 0;
+        d->tail = 0;
+    }
+    pthread_mutex_init(&pool.done_lock, NULL);
+    pthread_cond_init(&pool.done_cond, NULL);
+    pthread_cond_init(&pool.work_cond, NULL);
+
+    long carved = 0;
+    while (carved < pool.window && pool.pos < pool.len) deal_chunk(&pool, carved++);
+
+    BatchThread* threads = (BatchThread*)checked_realloc(NULL, (size_t)nthreads * sizeof(BatchThread));
+    for (int t = 0; t < nthreads; t++) {
+        threads[t].pool = &pool;
+        threads[t].id = t;
+        pthread_create(&threads[t].thread, NULL, batch_thread_main, &threads[t]);
+    }
+
+    // Write chunk outputs in input order as they complete, refilling each
+    // slot with the next chunk once its output is out
+    long failed = 0, lines = 0;
+    for (long c = 0; c < carved; c++) {
+        BatchChunk* chunk = &pool.chunks[c % pool.window];
+        pthread_mutex_lock(&pool.done_lock);
+        while (!chunk->done) pthread_cond_wait(&pool.done_cond, &pool.done_lock);
+        pthread_mutex_unlock(&pool.done_lock);
+        if (fp) fwrite(chunk->out.data, 1, chunk->out.len, fp);
+        failed += chunk->failed;
+        lines += chunk->lines;
+        release_batch_input(input, (size_t)(chunk->end - pool.buf));
+        if (pool.pos < pool.len) deal_chunk(&pool, carved++);
+        INSTRUMENT_LOG(0);
+    }
+
+    for (int t = 0; t < nthreads; t++) pthread_join(threads[t].thread, NULL);
+    for (int t = 0; t < nthreads; t++) {
+        pthread_mutex_destroy(&pool.deques[t].lock);
+        free(pool.deques[t].items);
+    }
+    for (int c = 0; c < pool.window; c++) free(pool.chunks[c].out.data);
+    pthread_mutex_destroy(&pool.done_lock);
+    pthread_cond_destroy(&pool.done_cond);
+    pthread_cond_destroy(&pool.work_cond);
+    free(threads);
+    free(pool.deques);
+    free(pool.chunks);
+    *lines_out = lines;
+    for (int k = 0; k < TOTAL_COUNT; k++) totals[k] += pool.totals[k];
+    return failed;
+}
+
+// Headless mode: evaluate or convert newline-delimited expressions without
+// ncurses. Output is one line per input line so results stay aligned; the
+// exit status is 1 if any line failed.
+int run_batch(int argc, char** argv) {
+    BatchOptions opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.threads = 1;
+    opt.var_names = (const char**)checked_realloc(NULL, (size_t)argc * sizeof(char*));
+    opt.var_name_len = (size_t*)checked_realloc(NULL, (size_t)argc * sizeof(size_t));
+    opt.var_values = (double*)checked_realloc(NULL, (size_t)argc * sizeof(double));
+#ifdef SM_INSTRUMENT
+    const char* stats_path = NULL;
+    instrument_log.interval = 1.0;
+#endif
+
+    for (int a = 2; a < argc; a++) {
+        if (strcmp(argv[a], "--postfix") == 0) opt.postfix_input = 1;
+        else if (strcmp(argv[a], "--convert") == 0) opt.convert = 1;
+        else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc && atoi(argv[a + 1]) > 0) {
+            opt.threads = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--cache") == 0 && a + 1 < argc && atol(argv[a + 1]) > 0) {
+            opt.cache_bytes = (size_t)atol(argv[++a]);
+        } else if (strcmp(argv[a], "--optimize") == 0) {
+            if (opt.opt_level < OPT_EXACT) opt.opt_level = OPT_EXACT;
+        } else if (strcmp(argv[a], "--relaxed") == 0) {
+            opt.opt_level = OPT_RELAXED;
+        } else if (strcmp(argv[a], "--opt-report") == 0) {
+            opt.opt_report = 1;
+        } else if (strcmp(argv[a], "--registers") == 0) {
+            opt.registers = 1;
+        } else if (strcmp(argv[a], "--var") == 0 && a + 1 < argc && strchr(argv[a + 1], '=')) {
+            a++;
+            opt.var_names[opt.nvars] = argv[a];
+            opt.var_name_len[opt.nvars] = (size_t)(strchr(argv[a], '=') - argv[a]);
+            opt.var_values[opt.nvars] = atof(argv[a] + opt.var_name_len[opt.nvars] + 1);
+            opt.nvars++;
+#ifdef SM_INSTRUMENT
+        } else if (strcmp(argv[a], "--stats") == 0 && a + 1 < argc) {
+            stats_path = argv[++a];
+        } else if (strcmp(argv[a], "--stats-format") == 0 && a + 1 < argc) {
+            instrument_log.csv = strcmp(argv[++a], "csv") == 0;
+        } else if (strcmp(argv[a], "--stats-interval") == 0 && a + 1 < argc) {
+            instrument_log.interval = atof(argv[++a]);
+#endif
+        } else if (argv[a][0] == '-' && argv[a][1] != '\0') {
+            batch_usage();
+            return 2;
+        } else opt.path = argv[a];
+    }
+
+#ifdef SM_INSTRUMENT
+    if (stats_path) {
+        instrument_log.fp = strcmp(stats_path, "-") == 0 ? stderr : fopen(stats_path, "w");
+        if (instrument_log.fp == NULL) {
+            perror(stats_path);
+            return 2;
+        }
+        if (instrument_log.csv) fprintf(instrument_log.fp, "elapsed_s,name,count,ticks\n");
+        instrument_log.start = instrument_log.last = now_seconds();
+    }
+#endif
+
+    FILE* in = stdin;
+    if (opt.path && strcmp(opt.path, "-") != 0) {
+        in = fopen(opt.path, "r");
+        if (in == NULL) {
+            perror(opt.path);
+            return 2;
+        }
+    }
+
+    long lines = 0, failed = 0;
+    long totals[TOTAL_COUNT] = { 0 };
+    BatchInput input;
+    int mapped = map_batch_input(in, &input);
+    if (opt.threads > 1) {
+        if (!mapped) input.data = read_all(in, &input.len);
+        failed = run_batch_parallel(&opt, &input, opt.threads, stdout, &lines, totals);
+    } else if (mapped) {
+        // Single thread over the mapping, a chunk at a time, releasing
+        // pages behind it
+        TextBuf out = { NULL, 0, 0, stdout };
+        BatchWorker worker;
+        init_batch_worker(&worker, &opt);
+        for (size_t pos = 0, end; pos < input.len; pos = end) {
+            end = chunk_end(input.data, input.len, pos, BATCH_CHUNK_BYTES);
+            lines += batch_span(&opt, &worker, input.data + pos, input.data + end, &out, &failed);
+            text_flush(&out);
+            release_batch_input(&input, end);
+            INSTRUMENT_LOG(0);
+        }
+        free(out.data);
+        free_batch_worker(&worker, totals);
+    } else {
+        // Single thread: stream line by line so pipelines see output early
+        TextBuf out = { NULL, 0, 0, stdout };
+        BatchWorker worker;
+        init_batch_worker(&worker, &opt);
+        char* line = NULL;
+        size_t line_cap = 0;
+        ssize_t n;
+        while ((n = getline(&line, &line_cap, in)) != -1) {
+            lines++;
+            while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) line[--n] = '\0';
+            if (!batch_line(&opt, &worker, line, (size_t)n, &out)) failed++;
+            if (out.len >= 1 << 16) text_flush(&out);
+            if ((lines & 1023) == 0) INSTRUMENT_LOG(0);
+        }
+        text_flush(&out);
+        free(line);
+        free(out.data);
+        free_batch_worker(&worker, totals);
+    }
+    fflush(stdout);
+#ifdef SM_INSTRUMENT
+    if (instrument_log.fp) {
+        instrument_log_tick(1);
+        if (instrument_log.fp != stderr) fclose(instrument_log.fp);
+    }
+#endif
+
+    free_batch_input(&input);
+    if (in != stdin) fclose(in);
+    free(opt.var_names);
+    free(opt.var_name_len);
+    free(opt.var_values);
+    if (opt.cache_bytes) {
+        fprintf(stderr, "cache: %ld hits, %ld misses, %ld evictions\n",
+                totals[TOTAL_HITS], totals[TOTAL_MISSES], totals[TOTAL_EVICTIONS]);
+    }
+    if (opt.opt_level && totals[TOTAL_OPS_BEFORE]) {
+        fprintf(stderr, "optimizer: %ld -> %ld instructions evaluated (%.1f%% fewer)\n",
+                totals[TOTAL_OPS_BEFORE], totals[TOTAL_OPS_AFTER],
+                100.0 * (totals[TOTAL_OPS_BEFORE] - totals[TOTAL_OPS_AFTER]) / totals[TOTAL_OPS_BEFORE]);
+    }
+    if (opt.registers && totals[TOTAL_REG_STACK_OPS]) {
+        fprintf(stderr, "registers: %ld -> %ld instructions dispatched (%.1f%% fewer)",
+                totals[TOTAL_REG_STACK_OPS], totals[TOTAL_REG_OPS],
+                100.0 * (totals[TOTAL_REG_STACK_OPS] - totals[TOTAL_REG_OPS]) / totals[TOTAL_REG_STACK_OPS]);
+        if (opt.cache_bytes) fprintf(stderr, ", %ld expressions tiered up", totals[TOTAL_TIERED]);
+        fputc('\n', stderr);
+    }
+    if (failed) fprintf(stderr, "%ld of %ld lines failed\n", failed, lines);
+    return failed ? 1 : 0;
+}
+
+// Precompiled expression libraries. --compile-lib compiles one expression
+// per line into a binary file that load_library maps read-only; programs
+// are executed in place as views into the mapping, so loading costs one
+// checksum pass over the file however many programs it holds. The file
+// is native-endian, with every section 8-byte aligned:
+//   LibHeader
+//   LibProgram programs[nprograms]
+//   unsigned int index[index_size]    names hashed with hash_text: program + 1, 0 empty
+//   unsigned int symbols[nsymbols]    string offset of each variable name
+//   Instr code[ninstrs]               LOAD_VAR args are symbol numbers
+//   double consts[nconsts]            PUSH args index the program's own slice
+//   char strings[strings_bytes]       NUL-terminated names
+#define LIB_MAGIC "SMLIB\r\n\032"
+#define LIB_VERSION 1
+#define LIB_BYTE_ORDER 0x01020304u
+
+typedef struct LibHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int byte_order;        // LIB_BYTE_ORDER as the writer stored it
+    unsigned int nprograms;
+    unsigned int nsymbols;
+    unsigned int index_size;        // a power of two
+    unsigned int reserved;
+    unsigned long long ninstrs;
+    unsigned long long nconsts;
+    unsigned long long strings_bytes;
+    unsigned long long checksum;    // of the whole file, with this field zero
+} LibHeader;
+
+typedef struct LibProgram {
+    unsigned long long code;        // first instruction
+    unsigned long long consts;      // first constant
+    unsigned int len;
+    unsigned int nconsts;
+    unsigned int depth;             // deepest stack, as verified when compiled
+    unsigned int name;              // string offset
+    unsigned int name_len;          // 0 for an unnamed program
+    unsigned int reserved;
+} LibProgram;
+
+enum { LIB_PROGRAMS, LIB_INDEX, LIB_SYMBOLS, LIB_CODE, LIB_CONSTS, LIB_STRINGS, LIB_SECTIONS };
+
+// Offset of each section of a file with header h; off[LIB_SECTIONS] is
+// the file size. Counts must be bounded by the caller so this cannot
+// overflow.
+void lib_layout(const LibHeader* h, unsigned long long off[LIB_SECTIONS + 1]) {
+    unsigned long long size[LIB_SECTIONS] = {
+        h->nprograms * (unsigned long long)sizeof(LibProgram),
+        h->index_size * (unsigned long long)sizeof(unsigned int),
+        h->nsymbols * (unsigned long long)sizeof(unsigned int),
+        h->ninstrs * sizeof(Instr),
+        h->nconsts * sizeof(double),
+        h->strings_bytes,
+    };
+    off[0] = sizeof(LibHeader);
+    for (int s = 0; s < LIB_SECTIONS; s++) off[s + 1] = off[s] + ((size[s] + 7) & ~7ULL);
+}
+
+// Running 64-bit checksum of data[0..len), a word at a time: every
+// single-bit change alters the result, which is all a corruption check
+// needs
+unsigned long long lib_checksum(unsigned long long h, const void* data, size_t len) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        unsigned long long w;
+        memcpy(&w, bytes + i, 8);
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    for (; i < len; i++) h = (h ^ bytes[i]) * 1099511628211ULL;
+    return h;
+}
+
+// Checksum of a whole file image whose header is at data
+unsigned long long lib_file_checksum(const char* data, size_t size) {
+    LibHeader h;
+    memcpy(&h, data, sizeof(h));
+    h.checksum = 0;
+    unsigned long long sum = lib_checksum(14695981039346656037ULL, &h, sizeof(h));
+    return lib_checksum(sum, data + sizeof(h), size - sizeof(h));
+}
+
+// Library being built: sections accumulate in byte buffers, variable
+// names are interned into symbols through an open-addressing table
+typedef struct LibWriter {
+    TextBuf programs, code, consts, symbols, strings;
+    unsigned int nprograms, nsymbols;
+    unsigned int* symbol_slots;     // symbol + 1, 0 empty
+    unsigned int symbol_slots_size; // a power of two
+} LibWriter;
+
+void lib_writer_init(LibWriter* w) {
+    memset(w, 0, sizeof(*w));
+}
+
+void lib_writer_free(LibWriter* w) {
+    free(w->programs.data);
+    free(w->code.data);
+    free(w->consts.data);
+    free(w->symbols.data);
+    free(w->strings.data);
+    free(w->symbol_slots);
+    lib_writer_init(w);
+}
+
+unsigned int lib_string(LibWriter* w, const char* s, size_t len) {
+    unsigned int off = (unsigned int)w->strings.len;
+    text_append(&w->strings, s, len);
+    text_putc(&w->strings, '\0');
+    return off;
+}
+
+// Slot of name in the symbol table: the one holding it, or the empty one
+// where it belongs
+unsigned int lib_symbol_slot(const LibWriter* w, const char* name, size_t len) {
+    const unsigned int* offs = (const unsigned int*)w->symbols.data;
+    unsigned int mask = w->symbol_slots_size - 1;
+    unsigned int s = hash_text(name, len) & mask;
+    while (w->symbol_slots[s]) {
+        const char* other = w->strings.data + offs[w->symbol_slots[s] - 1];
+        if (strncmp(other, name, len) == 0 && other[len] == '\0') break;
+        s = (s + 1) & mask;
+    }
+    return s;
+}
+
+// Symbol number of name, interning it on first sight
+unsigned int lib_symbol(LibWriter* w, const char* name) {
+    size_t len = strlen(name);
+    if ((w->nsymbols + 1) * 4 > w->symbol_slots_size * 3) {
+        unsigned int* old = w->symbol_slots;
+        unsigned int old_size = w->symbol_slots_size;
+        w->symbol_slots_size = old_size ? old_size * 2 : 64;
+        w->symbol_slots = (unsigned int*)calloc(w->symbol_slots_size, sizeof(unsigned int));
+        if (w->symbol_slots == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        const unsigned int* offs = (const unsigned int*)w->symbols.data;
+        for (unsigned int s = 0; s < old_size; s++) {
+            if (old[s] == 0) continue;
+            const char* other = w->strings.data + offs[old[s] - 1];
+            w->symbol_slots[lib_symbol_slot(w, other, strlen(other))] = old[s];
+        }
+        free(old);
+    }
+    unsigned int s = lib_symbol_slot(w, name, len);
+    if (w->symbol_slots[s] == 0) {
+        unsigned int off = lib_string(w, name, len);
+        text_append(&w->symbols, (const char*)&off, sizeof(off));
+        w->symbol_slots[s] = ++w->nsymbols;
+    }
+    return w->symbol_slots[s] - 1;
+}
+
+// Append a verified program p named name[0..name_len) (name_len 0 for
+// none). Variables are renumbered to library symbols.
+void lib_add_program(LibWriter* w, const Program* p, const char* name, size_t name_len) {
+    LibProgram e;
+    memset(&e, 0, sizeof(e));
+    e.code = w->code.len / sizeof(Instr);
+    e.consts = w->consts.len / sizeof(double);
+    e.len = (unsigned int)p->len;
+    e.nconsts = (unsigned int)p->nconsts;
+    e.depth = (unsigned int)program_max_depth(p);
+    if (name_len) {
+        e.name = lib_string(w, name, name_len);
+        e.name_len = (unsigned int)name_len;
+    }
+    for (int pc = 0; pc < p->len; pc++) {
+        // Built field by field so the padding bytes are zero and the
+        // checksum depends only on the program
+        Instr in;
+        memset(&in, 0, sizeof(in));
+        in.op = p->code[pc].op;
+        in.arg = in.op == OP_LOAD_VAR ? (int)lib_symbol(w, p->vars[p->code[pc].arg]) : p->code[pc].arg;
+        text_append(&w->code, (const char*)&in, sizeof(in));
+    }
+    text_append(&w->consts, (const char*)p->consts, (size_t)p->nconsts * sizeof(double));
+    text_append(&w->programs, (const char*)&e, sizeof(e));
+    w->nprograms++;
+}
+
+void text_pad8(TextBuf* t) {
+    while (t->len & 7) text_putc(t, '\0');
+}
+
+// Write the library to path, through a temporary file renamed into
+// place so a reader never maps a half-written file. Returns 1 on
+// success, else 0 with *error_msg set: "duplicate name" with *duplicate
+// at the second program of that name, otherwise an I/O error in errno.
+int lib_write(LibWriter* w, const char* path, const char** error_msg, unsigned int* duplicate) {
+    LibHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, LIB_MAGIC, sizeof(h.magic));
+    h.version = LIB_VERSION;
+    h.byte_order = LIB_BYTE_ORDER;
+    h.nprograms = w->nprograms;
+    h.nsymbols = w->nsymbols;
+    h.index_size = 1;
+    while (h.index_size < 2 * w->nprograms) h.index_size *= 2;
+    h.ninstrs = w->code.len / sizeof(Instr);
+    h.nconsts = w->consts.len / sizeof(double);
+    h.strings_bytes = w->strings.len;
+
+    // Name index, catching duplicates on the way
+    unsigned int* index = (unsigned int*)calloc(h.index_size, sizeof(unsigned int));
+    if (index == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    const LibProgram* programs = (const LibProgram*)w->programs.data;
+    for (unsigned int i = 0; i < w->nprograms; i++) {
+        const LibProgram* e = &programs[i];
+        if (e->name_len == 0) continue;
+        const char* name = w->strings.data + e->name;
+        unsigned int s = hash_text(name, e->name_len) & (h.index_size - 1);
+        for (; index[s]; s = (s + 1) & (h.index_size - 1)) {
+            const LibProgram* other = &programs[index[s] - 1];
+            if (other->name_len == e->name_len && memcmp(w->strings.data + other->name, name, e->name_len) == 0) {
+                free(index);
+                *error_msg = "duplicate name";
+                *duplicate = i;
+                return 0;
+            }
+        }
+        index[s] = i + 1;
+    }
+
+    TextBuf file = { NULL, 0, 0, NULL };
+    text_append(&file, (const char*)&h, sizeof(h));
+    text_append(&file, w->programs.data, w->programs.len);
+    text_pad8(&file);
+    text_append(&file, (const char*)index, h.index_size * sizeof(unsigned int));
+    text_pad8(&file);
+    text_append(&file, w->symbols.data, w->symbols.len);
+    text_pad8(&file);
+    text_append(&file, w->code.data, w->code.len);
+    text_append(&file, w->consts.data, w->consts.len);
+    text_append(&file, w->strings.data, w->strings.len);
+    text_pad8(&file);
+    free(index);
+    h.checksum = lib_file_checksum(file.data, file.len);
+    memcpy(file.data, &h, sizeof(h));
+
+    size_t tmp_len = strlen(path) + 5;
+    char* tmp = (char*)checked_realloc(NULL, tmp_len);
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+    FILE* fp = fopen(tmp, "wb");
+    int ok = fp != NULL && fwrite(file.data, 1, file.len, fp) == file.len;
+    if (fp && fclose(fp) != 0) ok = 0;
+    if (ok && rename(tmp, path) != 0) ok = 0;
+    if (!ok) {
+        *error_msg = "cannot write library";
+        if (fp) remove(tmp);
+    }
+    free(tmp);
+    free(file.data);
+    return ok;
+}
+
+// A loaded library: pointers into the read-only mapping
+typedef struct Library {
+    const char* data;
+    size_t size;
+    const LibProgram* programs;
+    const unsigned int* index;
+    const Instr* code;
+    const double* consts;
+    const unsigned int* symbols;
+    const char* strings;
+    char** names;                   // symbol names, pointing into strings
+    unsigned int nprograms;
+    unsigned int nsymbols;
+    unsigned int index_size;
+} Library;
+
+// Header checks that come before any section is touched; fills off with
+// the section offsets. Returns NULL or what is wrong.
+const char* lib_check_header(const LibHeader* h, size_t size, unsigned long long off[LIB_SECTIONS + 1]) {
+    if (memcmp(h->magic, LIB_MAGIC, sizeof(h->magic)) != 0) return "not a library";
+    if (h->version != LIB_VERSION) return "unsupported library version";
+    if (h->byte_order != LIB_BYTE_ORDER) return "library written with the other byte order";
+    // Every count is at most the file size, so the layout cannot overflow
+    if (h->nprograms > size || h->nsymbols > size || h->index_size > size ||
+        h->ninstrs > size || h->nconsts > size || h->strings_bytes > size) {
+        return "library size does not match its header";
+    }
+    lib_layout(h, off);
+    if (off[LIB_SECTIONS] != size) return "library size does not match its header";
+    if (h->index_size == 0 || (h->index_size & (h->index_size - 1)) != 0) return "corrupt library index";
+    return NULL;
+}
+
+// Program i of lib as a read-only view: code and constants point into the
+// mapping and vars are the library's symbols, so run_program takes
+// bindings indexed by symbol. Never pass a view to anything that modifies
+// or frees a Program.
+void library_program(const Library* lib, int i, Program* view) {
+    const LibProgram* e = &lib->programs[i];
+    memset(view, 0, sizeof(*view));
+    view->code = (Instr*)(lib->code + e->code);
+    view->len = (int)e->len;
+    view->consts = (double*)(lib->consts + e->consts);
+    view->nconsts = (int)e->nconsts;
+    view->vars = lib->names;
+    view->nvars = (int)lib->nsymbols;
+    view->verified_depth = (int)e->depth;
+}
+
+// Operands in range and the recorded depth the one verify_program finds
+// (which also rejects unknown opcodes): run_program sizes its stack from
+// that depth, so it is checked rather than trusted
+int library_program_valid(const Program* view) {
+    for (int pc = 0; pc < view->len; pc++) {
+        Instr in = view->code[pc];
+        if ((in.op == OP_PUSH && (in.arg < 0 || in.arg >= view->nconsts)) ||
+            (in.op == OP_LOAD_VAR && (in.arg < 0 || in.arg >= view->nvars))) {
+            return 0;
+        }
+    }
+    return verify_program(view, NULL) == view->verified_depth;
+}
+
+// Checks everything views and lookups index with, so a program taken from
+// a loaded library runs without further checks: one pass over the file
+// for the checksum, one over the program, index and symbol tables, and
+// one over every program's instructions. lib's counts must be set.
+const char* lib_check(const Library* lib, const LibHeader* h) {
+    if (lib_file_checksum(lib->data, lib->size) != h->checksum) return "library checksum mismatch";
+    if (h->strings_bytes && lib->strings[h->strings_bytes - 1] != '\0') return "corrupt library strings";
+    for (unsigned int i = 0; i < h->nprograms; i++) {
+        const LibProgram* e = &lib->programs[i];
+        if (e->code > h->ninstrs || e->len > h->ninstrs - e->code || e->len == 0 ||
+            e->consts > h->nconsts || e->nconsts > h->nconsts - e->consts || e->depth == 0 ||
+            (e->name_len && (e->name >= h->strings_bytes || e->name_len >= h->strings_bytes - e->name))) {
+            return "corrupt library program table";
+        }
+    }
+    // Lookups probe until an empty slot, so there must be one; each entry
+    // names a distinct, named program
+    ArenaMark mark = arena_mark(&thread_arena);
+    unsigned char* seen = (unsigned char*)arena_alloc(&thread_arena, (size_t)h->nprograms + 1);
+    memset(seen, 0, (size_t)h->nprograms + 1);
+    unsigned int empty = 0, s = 0;
+    for (; s < h->index_size; s++) {
+        unsigned int entry = lib->index[s];
+        if (entry == 0) {
+            empty++;
+            continue;
+        }
+        if (entry > h->nprograms || seen[entry] || lib->programs[entry - 1].name_len == 0) break;
+        seen[entry] = 1;
+    }
+    arena_rewind(&thread_arena, mark);
+    if (s < h->index_size || empty == 0) return "corrupt library index";
+    for (unsigned int s = 0; s < h->nsymbols; s++) {
+        if (lib->symbols[s] >= h->strings_bytes) return "corrupt library symbols";
+    }
+    for (unsigned int i = 0; i < h->nprograms; i++) {
+        Program view;
+        library_program(lib, (int)i, &view);
+        if (!library_program_valid(&view)) return "library program fails verification";
+    }
+    return NULL;
+}
+
+void free_library(Library* lib) {
+    if (lib->data) munmap((void*)lib->data, lib->size);
+    free(lib->names);
+    memset(lib, 0, sizeof(*lib));
+}
+
+// Map the library at path. Returns 1 with lib filled, else 0 with
+// *error_msg set; a message starting "cannot" means errno holds the cause.
+int load_library(const char* path, Library* lib, const char** error_msg) {
+    memset(lib, 0, sizeof(*lib));
+    FILE* fp = fopen(path, "rb");
+    struct stat st;
+    if (fp == NULL || fstat(fileno(fp), &st) != 0) {
+        if (fp) fclose(fp);
+        *error_msg = "cannot open library";
+        return 0;
+    }
+    if (!S_ISREG(st.st_mode) || (size_t)st.st_size < sizeof(LibHeader)) {
+        fclose(fp);
+        *error_msg = "not a library";
+        return 0;
+    }
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    fclose(fp);
+    if (data == MAP_FAILED) {
+        *error_msg = "cannot map library";
+        return 0;
+    }
+    lib->data = (const char*)data;
+    lib->size = (size_t)st.st_size;
+
+    LibHeader h;
+    unsigned long long off[LIB_SECTIONS + 1];
+    memcpy(&h, lib->data, sizeof(h));
+    *error_msg = lib_check_header(&h, lib->size, off);
+    if (*error_msg == NULL) {
+        lib->programs = (const LibProgram*)(lib->data + off[LIB_PROGRAMS]);
+        lib->index = (const unsigned int*)(lib->data + off[LIB_INDEX]);
+        lib->symbols = (const unsigned int*)(lib->data + off[LIB_SYMBOLS]);
+        lib->code = (const Instr*)(lib->data + off[LIB_CODE]);
+        lib->consts = (const double*)(lib->data + off[LIB_CONSTS]);
+        lib->strings = lib->data + off[LIB_STRINGS];
+        lib->nprograms = h.nprograms;
+        lib->nsymbols = h.nsymbols;
+        lib->index_size = h.index_size;
+        *error_msg = lib_check(lib, &h);
+    }
+    if (*error_msg) {
+        free_library(lib);
+        return 0;
+    }
+
+    lib->names = (char**)checked_realloc(NULL, (h.nsymbols ? h.nsymbols : 1) * sizeof(char*));
+    for (unsigned int s = 0; s < h.nsymbols; s++) lib->names[s] = (char*)lib->strings + lib->symbols[s];
+    return 1;
+}
+
+// Program number of the one named name[0..len), or -1
+int library_find(const Library* lib, const char* name, size_t len) {
+    unsigned int mask = lib->index_size - 1;
+    unsigned int s = hash_text(name, len) & mask;
+    for (unsigned int probes = 0; probes < lib->index_size && lib->index[s]; probes++, s = (s + 1) & mask) {
+        const LibProgram* e = &lib->programs[lib->index[s] - 1];
+        if (e->name_len == len && memcmp(lib->strings + e->name, name, len) == 0) return (int)lib->index[s] - 1;
+    }
+    return -1;
+}
+
+// Symbol number of a variable name, or -1
+int library_find_symbol(const Library* lib, const char* name) {
+    for (unsigned int s = 0; s < lib->nsymbols; s++) {
+        if (strcmp(lib->names[s], name) == 0) return (int)s;
+    }
+    return -1;
+}
+
+// Split a library source line "name = expression": returns the length of
+// the name starting at line + *name_start, with *expr_start after the
+// '=', or 0 with *expr_start 0 when the line is just an expression
+size_t lib_line_name(const char* line, size_t len, size_t* name_start, size_t* expr_start) {
+    size_t i = 0;
+    *expr_start = 0;
+    while (i < len && (line[i] == ' ' || line[i] == '\t')) i++;
+    size_t start = i;
+    if (i == len || !(isalpha((unsigned char)line[i]) || line[i] == '_')) return 0;
+    while (i < len && (isalnum((unsigned char)line[i]) || line[i] == '_' || line[i] == '.')) i++;
+    size_t end = i;
+    while (i < len && (line[i] == ' ' || line[i] == '\t')) i++;
+    if (i == len || line[i] != '=') return 0;
+    *name_start = start;
+    *expr_start = i + 1;
+    return end - start;
+}
+
+void lib_usage(void) {
+    fprintf(stderr,
+        "usage: stack_machine --compile-lib [--postfix] [--optimize] [--relaxed] -o LIBRARY [file]\n"
+        "       stack_machine --run-lib [--list] [--name NAME]... [--var NAME=VALUE]... LIBRARY\n"
+        "  --compile-lib compiles one expression per line of file (default stdin), each\n"
+        "  optionally named as \"name = expression\"; blank lines are skipped. Nothing is\n"
+        "  written if any line fails. --run-lib maps LIBRARY and evaluates every program,\n"
+        "  or the named ones, printing \"name = value\" or the value per line.\n"
+        "  --list    print the programs as postfix instead of evaluating them\n");
+}
+
+// Compile a text file of expressions into a library
+int run_compile_lib(int argc, char** argv) {
+    int postfix = 0, opt_level = OPT_NONE;
+    const char* path = NULL;
+    const char* out_path = NULL;
+    for (int a = 2; a < argc; a++) {
+        if (strcmp(argv[a], "--postfix") == 0) postfix = 1;
+        else if (strcmp(argv[a], "--optimize") == 0) {
+            if (opt_level < OPT_EXACT) opt_level = OPT_EXACT;
+        } else if (strcmp(argv[a], "--relaxed") == 0) opt_level = OPT_RELAXED;
+        else if (strcmp(argv[a], "-o") == 0 && a + 1 < argc) out_path = argv[++a];
+        else if (argv[a][0] == '-' && argv[a][1] != '\0') {
+            lib_usage();
+            return 2;
+        } else path = argv[a];
+    }
+    if (out_path == NULL) {
+        lib_usage();
+        return 2;
+    }
+
+    FILE* in = stdin;
+    if (path && strcmp(path, "-") != 0) {
+        in = fopen(path, "r");
+        if (in == NULL) {
+            perror(path);
+            return 2;
+        }
+    }
+    BatchInput input;
+    if (!map_batch_input(in, &input)) input.data = read_all(in, &input.len);
+
+    LibWriter w;
+    Program p;
+    TextBuf text = { NULL, 0, 0, NULL };
+    long lineno = 0, failed = 0;
+    lib_writer_init(&w);
+    init_program(&p);
+    for (size_t pos = 0; pos < input.len; ) {
+        const char* line = input.data + pos;
+        const char* nl = (const char*)memchr(line, '\n', input.len - pos);
+        size_t len = nl ? (size_t)(nl - line) : input.len - pos;
+        pos += len + (nl != NULL);
+        lineno++;
+        while (len > 0 && line[len - 1] == '\r') len--;
+
+        size_t name_start = 0, expr_start;
+        size_t name_len = lib_line_name(line, len, &name_start, &expr_start);
+        const char* expr = line + expr_start;
+        size_t expr_len = len - expr_start;
+        size_t blank = 0;
+        while (blank < len && (line[blank] == ' ' || line[blank] == '\t')) blank++;
+        if (blank == len) continue;
+
+        const char* error_msg = NULL;
+        if (needs_normalizing(expr, expr_len)) {
+            normalize_expression(expr, expr_len, postfix, &text);
+            expr = text.data + 1;
+            expr_len = text.len - 1;
+        }
+        int ok = postfix ? compile_postfix_span(expr, expr_len, &p, &error_msg, NULL)
+                         : compile_infix_span(expr, expr_len, &p, &error_msg);
+        if (ok && p.len == 0) {
+            ok = 0;
+            error_msg = "empty expression";
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%ld: %s\n", path ? path : "-", lineno, error_msg);
+            failed++;
+            continue;
+        }
+        optimize_program(&p, opt_level);
+        lib_add_program(&w, &p, line + name_start, name_len);
+    }
+
+    const char* error_msg = NULL;
+    unsigned int duplicate;
+    int status = 0;
+    if (failed) {
+        fprintf(stderr, "%ld of %ld lines failed, %s not written\n", failed, lineno, out_path);
+        status = 1;
+    } else if (!lib_write(&w, out_path, &error_msg, &duplicate)) {
+        if (strcmp(error_msg, "duplicate name") == 0) {
+            const LibProgram* e = (const LibProgram*)w.programs.data + duplicate;
+            fprintf(stderr, "%s: duplicate name '%.*s', %s not written\n", path ? path : "-",
+                    (int)e->name_len, w.strings.data + e->name, out_path);
+        } else {
+            perror(out_path);
+        }
+        status = 1;
+    } else {
+        fprintf(stderr, "%u programs, %u variables, %zu instructions -> %s\n",
+                w.nprograms, w.nsymbols, w.code.len / sizeof(Instr), out_path);
+    }
+    free(text.data);
+    free_program(&p);
+    lib_writer_free(&w);
+    free_batch_input(&input);
+    if (in != stdin) fclose(in);
+    return status;
+}
+
+// 1 if view loads a symbol that is not bound
+int library_unbound(const Program* view, const unsigned char* bound) {
+    for (int pc = 0; pc < view->len; pc++) {
+        if (view->code[pc].op == OP_LOAD_VAR && !bound[view->code[pc].arg]) return 1;
+    }
+    return 0;
+}
+
+// Evaluate (or list) the programs of a library
+int run_lib(int argc, char** argv) {
+    const char** names = (const char**)checked_realloc(NULL, (size_t)argc * sizeof(char*));
+    int nnames = 0, list = 0;
+    const char* path = NULL;
+    Library lib;
+    const char* error_msg = NULL;
+    for (int a = 2; a < argc; a++) {
+        if (strcmp(argv[a], "--list") == 0) list = 1;
+        else if (strcmp(argv[a], "--name") == 0 && a + 1 < argc) names[nnames++] = argv[++a];
+        else if (strcmp(argv[a], "--var") == 0 && a + 1 < argc && strchr(argv[a + 1], '=')) a++;
+        else if (argv[a][0] == '-' && argv[a][1] != '\0') {
+            free(names);
+            lib_usage();
+            return 2;
+        } else path = argv[a];
+    }
+    if (path == NULL) {
+        free(names);
+        lib_usage();
+        return 2;
+    }
+    if (!load_library(path, &lib, &error_msg)) {
+        if (strncmp(error_msg, "cannot", 6) == 0) perror(path);
+        else fprintf(stderr, "%s: %s\n", path, error_msg);
+        free(names);
+        return 2;
+    }
+    // Bind --var values to symbols once; later --var of a name wins
+    double* bindings = (double*)checked_realloc(NULL, (lib.nsymbols ? lib.nsymbols : 1) * sizeof(double));
+    unsigned char* bound = (unsigned char*)calloc(lib.nsymbols ? lib.nsymbols : 1, 1);
+    int all_bound = 1;
+    for (unsigned int s = 0; s < lib.nsymbols; s++) {
+        for (int a = 2; a + 1 < argc; a++) {
+            if (strcmp(argv[a], "--var") != 0) continue;
+            const char* eq = strchr(argv[++a], '=');
+            size_t len = eq ? (size_t)(eq - argv[a]) : 0;
+            if (eq && strncmp(argv[a], lib.names[s], len) == 0 && lib.names[s][len] == '\0') {
+                bindings[s] = atof(eq + 1);
+                bound[s] = 1;
+            }
+        }
+        if (!bound[s]) all_bound = 0;
+    }
+
+    TextBuf out = { NULL, 0, 0, stdout };
+    long failed = 0;
+    int count = nnames ? nnames : (int)lib.nprograms;
+    for (int k = 0; k < count; k++) {
+        int i = nnames ? library_find(&lib, names[k], strlen(names[k])) : k;
+        const char* err = NULL;
+        Program view;
+        double value;
+        if (i < 0) {
+            text_append(&out, names[k], strlen(names[k]));
+            text_append(&out, " = ", 3);
+            err = "no such program";
+        } else {
+            const LibProgram* e = &lib.programs[i];
+            library_program(&lib, i, &view);
+            if (e->name_len) {
+                text_append(&out, lib.strings + e->name, e->name_len);
+                text_append(&out, " = ", 3);
+            }
+            if (list) program_to_postfix(&view, &out);
+            else if (!all_bound && library_unbound(&view, bound)) err = "unbound variable";
+            else if (run_program(&view, bindings, &value)) text_number(&out, value);
+            else err = "insufficient operands";
+        }
+        if (err) {
+            text_append(&out, "error: ", 7);
+            text_append(&out, err, strlen(err));
+            failed++;
+        }
+        text_putc(&out, '\n');
+        if (out.len >= 1 << 16) text_flush(&out);
+    }
+    text_flush(&out);
+    fflush(stdout);
+
+    free(out.data);
+    free(bindings);
+    free(bound);
+    free(names);
+    free_library(&lib);
+    if (failed) fprintf(stderr, "%ld of %d programs failed\n", failed, count);
+    return failed ? 1 : 0;
+}
+
+void asm_usage(void) {
+    fprintf(stderr,
+        "usage: stack_machine --run-asm [--var NAME=VALUE]... [--array V,V,...] [--array-file FILE]\n"
+        "                               [--max-jumps N] [--uncached] [--list] [file]\n"
+        "  Assembles the kernel in file (default stdin), verifies it and runs it,\n"
+        "  printing the value it returns. Text after ; or # is a comment.\n"
+        "  --array       memory read by LOAD_IDX, comma-separated\n"
+        "  --array-file  memory read by LOAD_IDX, numbers separated by blanks\n"
+        "  --max-jumps   stop after N taken jumps and calls (default 1000000000)\n"
+        "  --uncached    run on the interpreter without top-of-stack caching\n"
+        "  --list        print the assembled kernel instead of running it\n");
+}
+
+// Append the numbers in text[0..len), separated by commas or blanks, to
+// mem; 0 at the first one that does not parse
+int read_numbers(const char* text, size_t len, double** mem, size_t* n, size_t* cap) {
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (text[i] == ',' || isspace((unsigned char)text[i]))) i++;
+        if (i == len) break;
+        size_t start = i;
+        while (i < len && text[i] != ',' && !isspace((unsigned char)text[i])) i++;
+        int negative = text[start] == '-' && i - start > 1;
+        double num;
+        if (!parse_number(text + start + negative, i - start - negative, &num)) return 0;
+        if (*n == *cap) {
+            *cap = *cap ? *cap * 2 : 64;
+            *mem = (double*)checked_realloc(*mem, *cap * sizeof(double));
+        }
+        (*mem)[(*n)++] = negative ? -num : num;
+    }
+    return 1;
+}
+
+// Assemble, verify and run one kernel
+int run_asm(int argc, char** argv) {
+    const char* path = NULL;
+    double* memory = NULL;
+    size_t nmem = 0, mem_cap = 0;
+    long max_jumps = 1000000000L;
+    int uncached = 0, list = 0;
+    for (int a = 2; a < argc; a++) {
+        if (strcmp(argv[a], "--var") == 0 && a + 1 < argc && strchr(argv[a + 1], '=')) a++;
+        else if (strcmp(argv[a], "--array") == 0 && a + 1 < argc) {
+            a++;
+            if (!read_numbers(argv[a], strlen(argv[a]), &memory, &nmem, &mem_cap)) {
+                fprintf(stderr, "--array: malformed number\n");
+                free(memory);
+                return 2;
+            }
+        } else if (strcmp(argv[a], "--array-file") == 0 && a + 1 < argc) {
+            FILE* fp = fopen(argv[++a], "r");
+            if (fp == NULL) {
+                perror(argv[a]);
+                free(memory);
+                return 2;
+            }
+            size_t len;
+            char* text = read_all(fp, &len);
+            fclose(fp);
+            int ok = read_numbers(text, len, &memory, &nmem, &mem_cap);
+            free(text);
+            if (!ok) {
+                fprintf(stderr, "%s: malformed number\n", argv[a]);
+                free(memory);
+                return 2;
+            }
+        } else if (strcmp(argv[a], "--max-jumps") == 0 && a + 1 < argc) max_jumps = atol(argv[++a]);
+        else if (strcmp(argv[a], "--uncached") == 0) uncached = 1;
+        else if (strcmp(argv[a], "--list") == 0) list = 1;
+        else if (argv[a][0] == '-' && argv[a][1] != '\0') {
+            free(memory);
+            asm_usage();
+            return 2;
+        } else path = argv[a];
+    }
+
+    FILE* in = stdin;
+    if (path && strcmp(path, "-") != 0) {
+        in = fopen(path, "r");
+        if (in == NULL) {
+            perror(path);
+            free(memory);
+            return 2;
+        }
+    }
+    size_t len;
+    char* src = read_all(in, &len);
+    if (in != stdin) fclose(in);
+
+    Program p;
+    KernelInfo info;
+    const char* error_msg;
+    int error_line, error_pc, status = 0;
+    init_program(&p);
+    if (!assemble_kernel(src, len, &p, &error_msg, &error_line)) {
+        fprintf(stderr, "%s:%d: %s\n", path ? path : "-", error_line, error_msg);
+        status = 2;
+    } else if (list) {
+        TextBuf out = { NULL, 0, 0, stdout };
+        kernel_to_text(&p, &out);
+        text_flush(&out);
+        free(out.data);
+    } else if (!verify_kernel(&p, &info, &error_pc, &error_msg)) {
+        fprintf(stderr, "%s: instruction %d (%s): %s\n", path ? path : "-", error_pc,
+                opcode_names[p.code[error_pc].op], error_msg);
+        status = 2;
+    } else {
+        double* bindings = (double*)checked_realloc(NULL, (size_t)(p.nvars ? p.nvars : 1) * sizeof(double));
+        for (int v = 0; v < p.nvars && status == 0; v++) {
+            int bound = 0;
+            for (int a = 2; a + 1 < argc; a++) {
+                if (strcmp(argv[a], "--var") != 0) continue;
+                const char* eq = strchr(argv[++a], '=');
+                size_t name_len = eq ? (size_t)(eq - argv[a]) : 0;
+                if (eq && strncmp(argv[a], p.vars[v], name_len) == 0 && p.vars[v][name_len] == '\0') {
+                    bindings[v] = atof(eq + 1);
+                    bound = 1;
+                }
+            }
+            if (!bound) {
+                fprintf(stderr, "error: unbound variable %s\n", p.vars[v]);
+                status = 1;
+            }
+        }
+        double value;
+        if (status == 0) {
+            int ok = uncached ? run_kernel_uncached(&p, &info, bindings, memory, nmem, max_jumps, &value, &error_msg)
+                              : run_kernel(&p, &info, bindings, memory, nmem, max_jumps, &value, &error_msg);
+            TextBuf out = { NULL, 0, 0, stdout };
+            if (ok) {
+                text_number(&out, value);
+                text_putc(&out, '\n');
+            } else {
+                fprintf(stderr, "error: %s\n", error_msg);
+                status = 1;
+            }
+            text_flush(&out);
+            free(out.data);
+        }
+        free(bindings);
+    }
+    free_program(&p);
+    free(src);
+    free(memory);
+    return status;
+}
+
+// Named-expression sheet: formulas "name = expression" that read input
+// variables and each other's results, kept with their last results like
+// the cells of a spreadsheet. Changing inputs re-evaluates only the
+// formulas downstream of them, in topological order, and a formula whose
+// result comes out bit-identical does not pass the change on. Formulas
+// are lowered to registers once, since each is evaluated many times.
+typedef struct SheetNode {
+    int symbol;             // interned name
+    int formula;            // 0 for an input
+    double value;
+    const char* error;      // why value is missing (inputs start unbound), else NULL
+    int rank;               // formulas: position in topological order, -1 on a cycle
+    int queued;
+    int line;               // formulas: source line, for messages and output order
+    RegProgram code;        // formulas only
+    int deps;               // formulas: code's variables are deps[deps..+code.nvars) of the Sheet
+    int users;              // nodes reading this one are users[users..+nusers) of the Sheet
+    int nusers;
+} SheetNode;
+
+typedef struct Sheet {
+    SheetNode* nodes;
+    int count;
+    int capacity;
+    int* node_of;           // symbol id -> node index, -1 if none
+    int node_of_capacity;
+    int* deps;              // node index of every formula variable
+    int ndeps;
+    int deps_capacity;
+    int* users;             // formulas reading each node (CSR, see SheetNode)
+    int* order;             // formulas by rank
+    int nformulas;
+    int nranked;            // formulas not on or behind a cycle
+    int* heap;              // ranks of queued formulas, smallest first
+    int heap_len;
+    int* changed;           // formulas whose result changed in the last recalculation
+    int nchanged;
+    double* bindings;
+    int bindings_capacity;
+} Sheet;
+
+void init_sheet(Sheet* s) {
+    memset(s, 0, sizeof(*s));
+}
+
+void free_sheet(Sheet* s) {
+    for (int i = 0; i < s->count; i++) free_registers(&s->nodes[i].code);
+    free(s->nodes);
+    free(s->node_of);
+    free(s->deps);
+    free(s->users);
+    free(s->order);
+    free(s->heap);
+    free(s->changed);
+    free(s->bindings);
+    init_sheet(s);
+}
+
+// Node of the name spelled by name[0..len), or -1; create adds an
+// unbound input when there is none
+int sheet_node(Sheet* s, const char* name, size_t len, int create) {
+    int symbol = intern_symbol(name, len);
+    if (symbol >= s->node_of_capacity) {
+        int capacity = s->node_of_capacity ? s->node_of_capacity : 64;
+        while (capacity <= symbol) capacity *= 2;
+        s->node_of = (int*)checked_realloc(s->node_of, (size_t)capacity * sizeof(int));
+        for (int i = s->node_of_capacity; i < capacity; i++) s->node_of[i] = -1;
+        s->node_of_capacity = capacity;
+    }
+    if (s->node_of[symbol] >= 0 || !create) return s->node_of[symbol];
+    if (s->count == s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : 64;
+        s->nodes = (SheetNode*)checked_realloc(s->nodes, (size_t)s->capacity * sizeof(SheetNode));
+    }
+    SheetNode* n = &s->nodes[s->count];
+    memset(n, 0, sizeof(*n));
+    n->symbol = symbol;
+    n->value = NAN;
+    n->error = "unbound variable";
+    n->rank = -1;
+    s->node_of[symbol] = s->count;
+    return s->count++;
+}
+
+// Define the formula name = p (already optimized). Returns 0 with
+// *error_msg set if name is already a formula or p is empty.
+int sheet_define(Sheet* s, const char* name, size_t len, const Program* p, int line, const char** error_msg) {
+    int id = sheet_node(s, name, len, 1);
+    if (s->nodes[id].formula) {
+        *error_msg = "duplicate name";
+        return 0;
+    }
+    if (!lower_program(p, &s->nodes[id].code)) {
+        *error_msg = "empty expression";
+        return 0;
+    }
+    if (s->ndeps + p->nvars > s->deps_capacity) {
+        while (s->ndeps + p->nvars > s->deps_capacity) s->deps_capacity = s->deps_capacity ? s->deps_capacity * 2 : 256;
+        s->deps = (int*)checked_realloc(s->deps, (size_t)s->deps_capacity * sizeof(int));
+    }
+    // sheet_node may move the nodes, so the formula is looked up again after
+    int deps = s->ndeps;
+    for (int v = 0; v < p->nvars; v++) s->deps[s->ndeps++] = sheet_node(s, p->vars[v], strlen(p->vars[v]), 1);
+    SheetNode* n = &s->nodes[id];
+    n->formula = 1;
+    n->deps = deps;
+    n->line = line;
+    n->error = NULL;
+    if (p->nvars > s->bindings_capacity) {
+        s->bindings_capacity = p->nvars;
+        s->bindings = (double*)checked_realloc(s->bindings, (size_t)s->bindings_capacity * sizeof(double));
+    }
+    s->nformulas++;
+    return 1;
+}
+
+// Once every formula is defined: link each node to the formulas reading
+// it and rank the formulas topologically (Kahn's algorithm). Formulas on
+// a cycle, or reading one, get no rank and fail with "circular reference".
+void sheet_link(Sheet* s) {
+    int* indegree = (int*)checked_realloc(NULL, ((size_t)s->count + 1) * sizeof(int));
+    for (int i = 0; i < s->count; i++) {
+        s->nodes[i].nusers = 0;
+        indegree[i] = 0;
+    }
+    for (int i = 0; i < s->count; i++) {
+        SheetNode* n = &s->nodes[i];
+        if (!n->formula) continue;
+        for (int v = 0; v < n->code.nvars; v++) {
+            int d = s->deps[n->deps + v];
+            s->nodes[d].nusers++;
+            if (s->nodes[d].formula) indegree[i]++;
+        }
+    }
+    int total = 0;
+    for (int i = 0; i < s->count; i++) {
+        s->nodes[i].users = total;
+        total += s->nodes[i].nusers;
+        s->nodes[i].nusers = 0;
+    }
+    s->users = (int*)checked_realloc(s->users, ((size_t)total + 1) * sizeof(int));
+    for (int i = 0; i < s->count; i++) {
+        SheetNode* n = &s->nodes[i];
+        if (!n->formula) continue;
+        for (int v = 0; v < n->code.nvars; v++) {
+            SheetNode* d = &s->nodes[s->deps[n->deps + v]];
+            s->users[d->users + d->nusers++] = i;
+        }
+    }
+
+    s->order = (int*)checked_realloc(s->order, ((size_t)s->nformulas + 1) * sizeof(int));
+    s->heap = (int*)checked_realloc(s->heap, ((size_t)s->nformulas + 1) * sizeof(int));
+    s->changed = (int*)checked_realloc(s->changed, ((size_t)s->nformulas + 1) * sizeof(int));
+    s->nranked = 0;
+    for (int i = 0; i < s->count; i++) {
+        if (s->nodes[i].formula && indegree[i] == 0) s->order[s->nranked++] = i;
+    }
+    for (int head = 0; head < s->nranked; head++) {
+        SheetNode* n = &s->nodes[s->order[head]];
+        n->rank = head;
+        for (int u = 0; u < n->nusers; u++) {
+            int user = s->users[n->users + u];
+            if (--indegree[user] == 0) s->order[s->nranked++] = user;
+        }
+    }
+    for (int i = 0; i < s->count; i++) {
+        if (s->nodes[i].formula && s->nodes[i].rank < 0) s->nodes[i].error = "circular reference";
+    }
+    free(indegree);
+}
+
+// Recompute formula n from its operands' current results. Returns 1 if
+// its result (or error) changed.
+int sheet_evaluate(Sheet* s, SheetNode* n) {
+    double value = NAN;
+    const char* error = NULL;
+    for (int v = 0; v < n->code.nvars && !error; v++) {
+        const SheetNode* d = &s->nodes[s->deps[n->deps + v]];
+        error = d->error;
+        s->bindings[v] = d->value;
+    }
+    if (!error) run_registers(&n->code, s->bindings, &value);
+    int changed = error != n->error || memcmp(&value, &n->value, sizeof(double)) != 0;
+    n->value = value;
+    n->error = error;
+    return changed;
+}
+
+void sheet_queue(Sheet* s, int rank) {
+    SheetNode* n = &s->nodes[s->order[rank]];
+    if (n->queued) return;
+    n->queued = 1;
+    int i = s->heap_len++;
+    while (i > 0 && s->heap[(i - 1) / 2] > rank) {
+        s->heap[i] = s->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    s->heap[i] = rank;
+}
+
+int sheet_pop(Sheet* s) {
+    int top = s->heap[0];
+    int last = s->heap[--s->heap_len];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= s->heap_len) break;
+        if (child + 1 < s->heap_len && s->heap[child + 1] < s->heap[child]) child++;
+        if (s->heap[child] >= last) break;
+        s->heap[i] = s->heap[child];
+        i = child;
+    }
+    if (s->heap_len > 0) s->heap[i] = last;
+    s->nodes[s->order[top]].queued = 0;
+    return top;
+}
+
+// Queue the ranked formulas reading node
+void sheet_queue_users(Sheet* s, const SheetNode* node) {
+    for (int u = 0; u < node->nusers; u++) {
+        int rank = s->nodes[s->users[node->users + u]].rank;
+        if (rank >= 0) sheet_queue(s, rank);
+    }
+}
+
+// Bind input id to value, queueing the formulas that read it when the
+// value changes. Returns 0 if id is a formula.
+int sheet_set(Sheet* s, int id, double value) {
+    SheetNode* n = &s->nodes[id];
+    if (n->formula) return 0;
+    if (n->error == NULL && memcmp(&value, &n->value, sizeof(double)) == 0) return 1;
+    n->value = value;
+    n->error = NULL;
+    sheet_queue_users(s, n);
+    return 1;
+}
+
+// Re-evaluate the queued formulas in rank order, so each runs once after
+// all of its operands; s->changed lists those whose result changed.
+// Returns the number re-evaluated.
+int sheet_recalculate(Sheet* s) {
+    int evaluated = 0;
+    s->nchanged = 0;
+    while (s->heap_len > 0) {
+        SheetNode* n = &s->nodes[s->order[sheet_pop(s)]];
+        evaluated++;
+        if (sheet_evaluate(s, n)) {
+            s->changed[s->nchanged++] = (int)(n - s->nodes);
+            sheet_queue_users(s, n);
+        }
+    }
+    return evaluated;
+}
+
+// Evaluate every ranked formula in order, as when the sheet is loaded
+void sheet_recalculate_all(Sheet* s) {
+    for (int r = 0; r < s->nranked; r++) sheet_evaluate(s, &s->nodes[s->order[r]]);
+    while (s->heap_len > 0) sheet_pop(s);
+}
+
+// Define the formulas in data[0..len), one "name = expression" per line
+// (blank lines and lines starting with '#' are skipped), then link and
+// evaluate them. Errors are reported against path; returns the number of
+// lines that failed.
+long sheet_load(Sheet* s, const char* data, size_t len, int opt_level, const char* path) {
+    Program p;
+    TextBuf text = { NULL, 0, 0, NULL };
+    long lineno = 0, failed = 0;
+    init_program(&p);
+    for (size_t pos = 0; pos < len; ) {
+        const char* line = data + pos;
+        const char* nl = (const char*)memchr(line, '\n', len - pos);
+        size_t line_len = nl ? (size_t)(nl - line) : len - pos;
+        pos += line_len + (nl != NULL);
+        lineno++;
+        while (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+        size_t blank = 0;
+        while (blank < line_len && (line[blank] == ' ' || line[blank] == '\t')) blank++;
+        if (blank == line_len || line[blank] == '#') continue;
+
+        size_t name_start = 0, expr_start;
+        size_t name_len = lib_line_name(line, line_len, &name_start, &expr_start);
+        const char* expr = line + expr_start;
+        size_t expr_len = line_len - expr_start;
+        const char* error_msg = "expected name = expression";
+        if (needs_normalizing(expr, expr_len)) {
+            normalize_expression(expr, expr_len, 0, &text);
+            expr = text.data + 1;
+            expr_len = text.len - 1;
+        }
+        int ok = name_len > 0 && compile_infix_span(expr, expr_len, &p, &error_msg);
+        if (ok) {
+            optimize_program(&p, opt_level);
+            ok = sheet_define(s, line + name_start, name_len, &p, (int)lineno, &error_msg);
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%ld: %s\n", path, lineno, error_msg);
+            failed++;
+        }
+    }
+    free(text.data);
+    free_program(&p);
+    sheet_link(s);
+    sheet_recalculate_all(s);
+    return failed;
+}
+
+// Append "name = value" (or "name = error: reason") and a newline
+void sheet_print(const Sheet* s, int id, TextBuf* out) {
+    const SheetNode* n = &s->nodes[id];
+    const char* name = symbol_name(n->symbol);
+    text_append(out, name, strlen(name));
+    text_append(out, " = ", 3);
+    if (n->error) {
+        text_append(out, "error: ", 7);
+        text_append(out, n->error, strlen(n->error));
+    } else {
+        text_number(out, n->value);
+    }
+    text_putc(out, '\n');
+}
+
+// Apply "NAME=VALUE ..." (blank- or comma-separated) from text[0..len) to
+// s's inputs without recalculating; returns the number of assignments, or
+// -1 with *error_msg set at the first bad one
+int sheet_parse_update(Sheet* s, const char* text, size_t len, const char** error_msg) {
+    int assigned = 0;
+    size_t i = 0;
+    for (;;) {
+        while (i < len && (text[i] == ' ' || text[i] == '\t' || text[i] == ',')) i++;
+        if (i == len) return assigned;
+        size_t start = i;
+        while (i < len && text[i] != '=' && text[i] != ' ' && text[i] != '\t' && text[i] != ',') i++;
+        if (i == len || text[i] != '=' || i == start) {
+            *error_msg = "expected NAME=VALUE";
+            return -1;
+        }
+        int id = sheet_node(s, text + start, i - start, 0);
+        size_t value_start = ++i;
+        while (i < len && text[i] != ' ' && text[i] != '\t' && text[i] != ',') i++;
+        char number[64];
+        char* end = number;
+        size_t n = i - value_start;
+        double value = 0;
+        if (n < sizeof(number)) {
+            memcpy(number, text + value_start, n);
+            number[n] = '\0';
+            value = strtod(number, &end);
+        }
+        if (n == 0 || n >= sizeof(number) || *end != '\0') {
+            *error_msg = "bad number";
+            return -1;
+        }
+        if (id < 0) {
+            *error_msg = "unknown input";
+            return -1;
+        }
+        if (!sheet_set(s, id, value)) {
+            *error_msg = "not an input";
+            return -1;
+        }
+        assigned++;
+    }
+}
+
+void sheet_usage(void) {
+    fprintf(stderr,
+        "usage: stack_machine --sheet [--optimize] [--relaxed] [--var NAME=VALUE]... [--updates FILE]\n"
+        "                             [--quiet] FORMULAS\n"
+        "  Loads FORMULAS, one \"name = expression\" per line; a formula may read other\n"
+        "  formulas by name in any order, and every other name is an input. Prints each\n"
+        "  formula's value in file order, then applies the lines of FILE (- for stdin)\n"
+        "  one at a time. A line sets some inputs, as \"NAME=VALUE ...\"; only the formulas\n"
+        "  that depend on them are recomputed, and those whose value changed are printed\n"
+        "  after a \"# update N: ...\" line with the number of formulas recomputed.\n"
+        "  --quiet  print only the \"# update\" lines\n");
+}
+
+int run_sheet(int argc, char** argv) {
+    int opt_level = OPT_NONE, quiet = 0;
+    const char* path = NULL;
+    const char* updates_path = NULL;
+    for (int a = 2; a < argc; a++) {
+        if (strcmp(argv[a], "--optimize") == 0) {
+            if (opt_level < OPT_EXACT) opt_level = OPT_EXACT;
+        } else if (strcmp(argv[a], "--relaxed") == 0) opt_level = OPT_RELAXED;
+        else if (strcmp(argv[a], "--quiet") == 0) quiet = 1;
+        else if (strcmp(argv[a], "--updates") == 0 && a + 1 < argc) updates_path = argv[++a];
+        else if (strcmp(argv[a], "--var") == 0 && a + 1 < argc && strchr(argv[a + 1], '=')) a++;
+        else if (argv[a][0] == '-' && argv[a][1] != '\0') {
+            sheet_usage();
+            return 2;
+        } else path = argv[a];
+    }
+    if (path == NULL) {
+        sheet_usage();
+        return 2;
+    }
+
+    FILE* in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        return 2;
+    }
+    BatchInput input;
+    if (!map_batch_input(in, &input)) input.data = read_all(in, &input.len);
+    fclose(in);
+    Sheet s;
+    init_sheet(&s);
+    long failed = sheet_load(&s, input.data, input.len, opt_level, path);
+    free_batch_input(&input);
+
+    // --var bindings are the first update, applied before anything prints
+    const char* error_msg;
+    for (int a = 2; a < argc; a++) {
+        if (strcmp(argv[a], "--var") == 0 && a + 1 < argc && strchr(argv[a + 1], '=')) {
+            a++;
+            if (sheet_parse_update(&s, argv[a], strlen(argv[a]), &error_msg) < 0) {
+                fprintf(stderr, "--var %s: %s\n", argv[a], error_msg);
+                failed++;
+            }
+        }
+    }
+    sheet_recalculate(&s);
+
+    TextBuf out = { NULL, 0, 0, stdout };
+    if (!quiet) {
+        // File order: nodes are created in it, except names used before
+        // their definition, so sort formulas by line
+        int* by_line = (int*)checked_realloc(NULL, ((size_t)s.nformulas + 1) * sizeof(int));
+        int n = 0;
+        for (int i = 0; i < s.count; i++) {
+            if (s.nodes[i].formula) by_line[n++] = i;
+        }
+        for (int i = 1; i < n; i++) {
+            int id = by_line[i], j = i;
+            while (j > 0 && s.nodes[by_line[j - 1]].line > s.nodes[id].line) {
+                by_line[j] = by_line[j - 1];
+                j--;
+            }
+            by_line[j] = id;
+        }
+        for (int i = 0; i < n; i++) sheet_print(&s, by_line[i], &out);
+        free(by_line);
+    }
+    text_flush(&out);
+
+    long updates = 0, recomputed = 0;
+    if (updates_path) {
+        FILE* fp = strcmp(updates_path, "-") == 0 ? stdin : fopen(updates_path, "r");
+        if (fp == NULL) {
+            perror(updates_path);
+            free_sheet(&s);
+            free(out.data);
+            return 2;
+        }
+        char* line = NULL;
+        size_t line_cap = 0;
+        ssize_t len;
+        while ((len = getline(&line, &line_cap, fp)) != -1) {
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+            size_t blank = 0;
+            while (blank < (size_t)len && (line[blank] == ' ' || line[blank] == '\t')) blank++;
+            if (blank == (size_t)len || line[blank] == '#') continue;
+            updates++;
+            // A bad assignment drops the rest of its line, but the ones
+            // before it stand and are recalculated
+            int assigned = sheet_parse_update(&s, line, (size_t)len, &error_msg);
+            if (assigned < 0) {
+                fprintf(stderr, "%s: update %ld: %s\n", updates_path, updates, error_msg);
+                failed++;
+            }
+            int evaluated = sheet_recalculate(&s);
+            recomputed += evaluated;
+            char header[96];
+            int n = snprintf(header, sizeof(header), "# update %ld: %d of %d formulas recomputed, %d changed\n",
+                             updates, evaluated, s.nformulas, s.nchanged);
+            text_append(&out, header, (size_t)n);
+            if (!quiet) {
+                for (int c = 0; c < s.nchanged; c++) sheet_print(&s, s.changed[c], &out);
+            }
+            if (out.len >= 1 << 16 || fp == stdin) text_flush(&out);
+        }
+        free(line);
+        if (fp != stdin) fclose(fp);
+    }
+    text_flush(&out);
+    fflush(stdout);
+    free(out.data);
+
+    int inputs = s.count - s.nformulas;
+    fprintf(stderr, "sheet: %d formulas, %d inputs", s.nformulas, inputs);
+    if (updates) {
+        fprintf(stderr, "; %ld updates recomputed %.1f formulas each on average", updates,
+                (double)recomputed / updates);
+    }
+    fputc('\n', stderr);
+    if (s.nranked < s.nformulas) fprintf(stderr, "%d formulas on or behind a circular reference\n", s.nformulas - s.nranked);
+    free_sheet(&s);
+    return failed ? 1 : 0;
+}
+
+// Deterministic xorshift generator for benchmark data
+unsigned long long bench_rng_state = 0x9E3779B97F4A7C15ULL;
+
+double bench_random(void) {
+    bench_rng_state ^= bench_rng_state << 13;
+    bench_rng_state ^= bench_rng_state >> 7;
+    bench_rng_state ^= bench_rng_state << 17;
+    return (double)(bench_rng_state >> 11) / 9007199254740992.0;
+}
+
+// Columnar vs per-row evaluation of one expression over random rows
+int bench_columns(const char* expr, size_t rows) {
+    Program p;
+    const char* error_msg;
+    init_program(&p);
+    if (!compile_infix(expr, &p, &error_msg)) {
+        fprintf(stderr, "bench: %s: %s\n", expr, error_msg);
+        free_program(&p);
+        return 2;
+    }
+
+    double** columns = (double**)checked_realloc(NULL, (size_t)(p.nvars + 1) * sizeof(double*));
+    for (int v = 0; v < p.nvars; v++) {
+        columns[v] = (double*)checked_realloc(NULL, rows * sizeof(double));
+        for (size_t r = 0; r < rows; r++) columns[v][r] = 1.0 + 99.0 * bench_random();
+    }
+    double* expected = (double*)checked_realloc(NULL, rows * sizeof(double));
+    double* got = (double*)checked_realloc(NULL, rows * sizeof(double));
+    double* bindings = (double*)checked_realloc(NULL, (size_t)(p.nvars + 1) * sizeof(double));
+
+    double t = now_seconds();
+    for (size_t r = 0; r < rows; r++) {
+        for (int v = 0; v < p.nvars; v++) bindings[v] = columns[v][r];
+        run_program(&p, bindings, &expected[r]);
+    }
+    double row_time = now_seconds() - t;
+    printf("%-16s %12.0f rows/s\n", "per-row", rows / row_time);
+
+    for (int pass = 0; pass < 2; pass++) {
+        select_column_kernels(pass == 0);
+        t = now_seconds();
+        run_program_columns(&p, (const double* const*)columns, rows, got);
+        double col_time = now_seconds() - t;
+        size_t mismatches = 0;
+        for (size_t r = 0; r < rows; r++) {
+            if (memcmp(&got[r], &expected[r], sizeof(double)) != 0) mismatches++;
+        }
+        char label[32];
+        snprintf(label, sizeof(label), "columns/%s", column_kernel_isa);
+        printf("%-16s %12.0f rows/s  %5.1fx  mismatches: %zu\n",
+               label, rows / col_time, row_time / col_time, mismatches);
+    }
+    select_column_kernels(0);
+
+    for (int v = 0; v < p.nvars; v++) free(columns[v]);
+    free(columns);
+    free(expected);
+    free(got);
+    free(bindings);
+    free_program(&p);
+    return 0;
+}
+
+// Parallel batch throughput for 1, 2, 4, ... max_threads workers over the
+// same in-memory input of random infix lines
+int bench_threads(long nlines, int max_threads) {
+    TextBuf input = { NULL, 0, 0, NULL };
+    static const char ops[] = "+-*/";
+    for (long l = 0; l < nlines; l++) {
+        int operands = 2 + (int)(bench_random() * 5);
+        for (int k = 0; k < operands; k++) {
+            if (k > 0) text_putc(&input, ops[(int)(bench_random() * 4)]);
+            text_number(&input, 1 + (int)(bench_random() * 99));
+        }
+        text_putc(&input, '\n');
+    }
+
+    BatchOptions opt;
+    memset(&opt, 0, sizeof(opt));
+    BatchInput buf = { input.data, input.len, 0, 0 };
+    double base = 0;
+    printf("%ld lines, %ld online CPUs\n", nlines, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %14s %8s %11s\n", "threads", "lines/s", "speedup", "efficiency");
+    for (int t = 1; t <= max_threads; t *= 2) {
+        long lines, totals[TOTAL_COUNT] = { 0 };
+        double start = now_seconds();
+        run_batch_parallel(&opt, &buf, t, NULL, &lines, totals);
+        double rate = lines / (now_seconds() - start);
+        if (t == 1) base = rate;
+        printf("%8d %14.0f %7.2fx %10.0f%%\n", t, rate, rate / base, 100.0 * rate / base / t);
+    }
+    free(input.data);
+    return 0;
+}
+
+// Time run_program (switch), run_threaded and run_threaded with
+// superinstructions on p; reports ns per source instruction
+void bench_dispatch_one(const char* name, const Program* p, const double* bindings) {
+    ThreadedProgram plain, fused;
+    JitProgram jp;
+    thread_program(p, &plain, 0);
+    thread_program(p, &fused, 1);
+    int have_jit = jit_compile(p, &jp);
+    long reps = 20000000L / p->len + 1;
+    double sink = 0, value = 0, ns[4] = { 0, 0, 0, 0 };
+
+    for (int mode = 0; mode < (have_jit ? 4 : 3); mode++) {
+        double t = now_seconds();
+        for (long r = 0; r < reps; r++) {
+            if (mode == 0) run_program(p, bindings, &value);
+            else if (mode == 3) run_jit(&jp, bindings, &value);
+            else run_threaded(mode == 1 ? &plain : &fused, bindings, &value);
+            sink += value;
+        }
+        ns[mode] = (now_seconds() - t) * 1e9 / ((double)reps * p->len);
+    }
+    printf("%-10s %6d %10.2f %10.2f %10.2f %10.2f %7d  %5.2fx %5.2fx %5.2fx\n", name, p->len,
+           ns[0], ns[1], ns[2], ns[3], fused.fused, ns[0] / ns[1], ns[0] / ns[2], have_jit ? ns[0] / ns[3] : 0.0);
+    if (sink == 42.4242) printf(" ");
+    free_threaded(&plain);
+    free_threaded(&fused);
+    jit_free(&jp);
+}
+
+// Per-opcode dispatch cost: each program repeats one instruction pattern
+int bench_dispatch(void) {
+    static const struct {
+        const char* name;
+        int lead;           // first operand: OP_PUSH or OP_LOAD_VAR
+        int body[4];        // repeated pattern, -1 terminated
+    } cases[] = {
+        { "push/pop", OP_PUSH, { OP_PUSH, OP_POP, -1 } },
+        { "load/pop", OP_LOAD_VAR, { OP_LOAD_VAR, OP_POP, -1 } },
+        { "add", OP_PUSH, { OP_PUSH, OP_ADD, -1 } },
+        { "sub", OP_PUSH, { OP_PUSH, OP_SUB, -1 } },
+        { "mul", OP_LOAD_VAR, { OP_LOAD_VAR, OP_MUL, -1 } },
+        { "div", OP_PUSH, { OP_PUSH, OP_DIV, -1 } },
+        { "pow", OP_PUSH, { OP_PUSH, OP_POW, -1 } },
+        { "mul+add", OP_PUSH, { OP_PUSH, OP_PUSH, OP_MUL, OP_ADD } },
+    };
+    double bindings[2] = { 1.000001, 0.999999 };
+
+    printf("%-10s %6s %10s %10s %10s %10s %7s  %6s %6s %6s\n", "pattern", "instrs", "switch", "threaded",
+           "fused", "jit", "fusions", "thr", "fused", "jit");
+    printf("%-10s %6s %10s %10s %10s %10s\n", "", "", "ns/instr", "ns/instr", "ns/instr", "ns/instr");
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        Program p;
+        init_program(&p);
+        p.consts = (double*)checked_realloc(NULL, 2 * sizeof(double));
+        p.consts[0] = 1.000001;
+        p.consts[1] = 0.999999;
+        p.nconsts = 2;
+        emit(&p, (OpCode)cases[c].lead, 0);
+        for (int k = 0; k < 32; k++) {
+            for (int b = 0; b < 4 && cases[c].body[b] >= 0; b++) emit(&p, (OpCode)cases[c].body[b], 1);
+        }
+        bench_dispatch_one(cases[c].name, &p, bindings);
+        free_program(&p);
+    }
+
+    const char* formula = "A*B+C*D-(E+2)*F/(G+1)+A*0.5";
+    Program p;
+    const char* error_msg;
+    double formula_bindings[7] = { 1, 2, 3, 4, 5, 6, 7 };
+    init_program(&p);
+    compile_infix(formula, &p, &error_msg);
+    bench_dispatch_one("formula", &p, formula_bindings);
+    printf("formula: %s\n", formula);
+    free_program(&p);
+    return 0;
+}
+
+// Random infix expression over variables A.. and small constants
+void bench_random_expr(TextBuf* out, int depth, int nvars) {
+    static const char ops[] = "+-*/^";
+    if (depth <= 0 || bench_random() < 0.25) {
+        if (nvars > 0 && bench_random() < 0.6) {
+            text_putc(out, (char)('A' + (int)(bench_random() * nvars)));
+        } else {
+            char buf[32];
+            int n = snprintf(buf, sizeof(buf), "%.3g", bench_random() * 10);
+            text_append(out, buf, (size_t)n);
+        }
+        return;
+    }
+    int parens = bench_random() < 0.5;
+    if (parens) text_putc(out, '(');
+    bench_random_expr(out, depth - 1, nvars);
+    text_putc(out, ops[(int)(bench_random() * 5)]);
+    bench_random_expr(out, depth - 1, nvars);
+    if (parens) text_putc(out, ')');
+}
+
+// Shape of generated benchmark expressions
+typedef struct CorpusOptions {
+    int size;               // operands per expression
+    int max_depth;          // operator nesting limit (raised if size needs it)
+    const char* ops;        // operator mix; repeat a character to weight it
+    int nvars;              // operands drawn from A.. with this many names
+    double paren_density;   // chance of redundant parentheses per subexpression
+} CorpusOptions;
+
+// Append one random well-formed infix expression with exactly `size`
+// operands. Parentheses are emitted wherever precedence or associativity
+// requires them, plus redundant ones at paren_density. parent_op is the
+// operator of the enclosing node (0 at the root) and right says which side
+// of it this subexpression is on.
+void gen_subexpr(TextBuf* out, const CorpusOptions* opt, int size, int depth, char parent_op, int right) {
+    if (size <= 1) {
+        if (opt->nvars > 0 && bench_random() < 0.5) {
+            text_putc(out, (char)('A' + (int)(bench_random() * opt->nvars)));
+        } else if (bench_random() < 0.7) {
+            text_number(out, 1 + (int)(bench_random() * 99));
+        } else {
+            char buf[32];
+            int n = snprintf(buf, sizeof(buf), "%.3g", 0.01 + bench_random() * 10);
+            text_append(out, buf, (size_t)n);
+        }
+        return;
+    }
+
+    char op = opt->ops[(int)(bench_random() * strlen(opt->ops))];
+    // Keep both sides within the remaining depth: each holds at most
+    // 2^(depth-1) operands
+    long cap = depth - 1 >= 30 ? 1L << 30 : 1L << (depth - 1);
+    int lo = size - cap > 1 ? (int)(size - cap) : 1;
+    int hi = size - 1 < cap ? size - 1 : (int)cap;
+    int left_size = lo + (int)(bench_random() * (hi - lo + 1));
+
+    int needed = 0;
+    if (parent_op) {
+        int outer = precedence(parent_op), inner = precedence(op);
+        needed = inner < outer ||
+                 (inner == outer && (parent_op == '^' ? !right : right));
+    }
+    int parens = needed || bench_random() < opt->paren_density;
+    if (parens) text_putc(out, '(');
+    gen_subexpr(out, opt, left_size, depth - 1, op, 0);
+    text_putc(out, op);
+    gen_subexpr(out, opt, size - left_size, depth - 1, op, 1);
+    if (parens) text_putc(out, ')');
+}
+
+void gen_expression(TextBuf* out, const CorpusOptions* opt) {
+    int depth = opt->max_depth;
+    while (depth < 31 && (1L << depth) < opt->size) depth++;
+    gen_subexpr(out, opt, opt->size < 1 ? 1 : opt->size, depth, 0, 0);
+}
+
+// Reads one corpus shape flag at argv[*a] (advancing past its value).
+// Returns 0 if argv[*a] is not one.
+int parse_corpus_flag(int argc, char** argv, int* a, CorpusOptions* opt) {
+    if (*a + 1 >= argc) return 0;
+    const char* flag = argv[*a];
+    const char* value = argv[*a + 1];
+    if (strcmp(flag, "--size") == 0) opt->size = atoi(value);
+    else if (strcmp(flag, "--depth") == 0) opt->max_depth = atoi(value);
+    else if (strcmp(flag, "--ops") == 0 && *value && strspn(value, "+-*/^") == strlen(value)) opt->ops = value;
+    else if (strcmp(flag, "--vars") == 0) opt->nvars = atoi(value) > 26 ? 26 : atoi(value);
+    else if (strcmp(flag, "--parens") == 0) opt->paren_density = atof(value);
+    else if (strcmp(flag, "--seed") == 0 && strtoull(value, NULL, 0)) bench_rng_state = strtoull(value, NULL, 0);
+    else return 0;
+    (*a)++;
+    return 1;
+}
+
+void default_corpus_options(CorpusOptions* opt) {
+    opt->size = 8;
+    opt->max_depth = 6;
+    opt->ops = "+-*/^";
+    opt->nvars = 4;
+    opt->paren_density = 0.1;
+}
+
+void gen_corpus_usage(void) {
+    fprintf(stderr,
+        "usage: stack_machine --gen-corpus [--count N] [--postfix] [--size N] [--depth N]\n"
+        "                                  [--ops CHARS] [--vars N] [--parens P] [--seed N]\n");
+}
+
+// Write random expressions, one per line, to stdout
+int run_gen_corpus(int argc, char** argv) {
+    CorpusOptions opt;
+    default_corpus_options(&opt);
+    long count = 1000;
+    int postfix = 0;
+    for (int a = 2; a < argc; a++) {
+        if (parse_corpus_flag(argc, argv, &a, &opt)) continue;
+        if (strcmp(argv[a], "--count") == 0 && a + 1 < argc) count = atol(argv[++a]);
+        else if (strcmp(argv[a], "--postfix") == 0) postfix = 1;
+        else {
+            gen_corpus_usage();
+            return 2;
+        }
+    }
+
+    TextBuf expr = { NULL, 0, 0, NULL };
+    TextBuf out = { NULL, 0, 0, stdout };
+    Program p;
+    init_program(&p);
+    for (long l = 0; l < count; l++) {
+        expr.len = 0;
+        gen_expression(&expr, &opt);
+        if (postfix) {
+            const char* error_msg;
+            text_putc(&expr, '\0');
+            compile_infix(expr.data, &p, &error_msg);
+            program_to_postfix(&p, &out);
+        } else {
+            text_append(&out, expr.data, expr.len);
+        }
+        text_putc(&out, '\n');
+        if (out.len >= 1 << 16) text_flush(&out);
+    }
+    text_flush(&out);
+    free_program(&p);
+    free(expr.data);
+    free(out.data);
+    return 0;
+}
+
+// Differential check of the JIT against run_program over a built-in
+// corpus, optional expressions from a file, and random expressions, each
+// with several binding sets including signed zeros, infinities and NaN.
+// Results must agree bit for bit. Each expression is also checked after
+// optimize_program: at OPT_EXACT against the unoptimized result, and at
+// OPT_RELAXED across run_program, run_threaded and the JIT.
+int run_jit_check(int argc, char** argv) {
+    static const char* corpus[] = {
+        "A", "2.5", "A+B", "A-B-C", "A/B/C", "A^B^C", "(A+B)*(C-D)", "A/0", "0/0", "A^0",
+        "A^0.5", "A*B+C*D-E/F", "(A-A)/(B-B)", "1/(A-A)", "A^B+C^D*E^F", "((A+B)*C)^(D-E)",
+        // optimizer identities and strength reductions
+        "A*1", "1*A", "A/1", "A-0", "A+0", "0+A", "A+(0-0)", "A*0", "0*A", "0/A", "A^1", "A^2", "1^A",
+        "A/4", "A/0.125", "A/3", "A^(0-1)", "A^(1/2)", "(2+3)*A", "2^10*A-0", "A^2^0.5",
+        "A+(B+(C+(D+(E+(F+(A+(B+(C+(D+(E+(F+(A+(B+(C+(D^2+E^0.5)))))))))))))))",
+    };
+    static const double specials[] = { 0.0, -0.0, 1.0, -1.0, 0.5, 3.0, 1e308, -1e308, 5e-324,
+                                       INFINITY, -INFINITY, NAN, -NAN };
+    enum { NSPECIALS = sizeof(specials) / sizeof(specials[0]) };
+    long count = 20000;
+    const char* path = NULL;
+    for (int a = 2; a < argc; a++) {
+        if (strcmp(argv[a], "--count") == 0 && a + 1 < argc) count = atol(argv[++a]);
+        else path = argv[a];
+    }
+
+    if (!jit_available()) {
+        printf("JIT unavailable on this build or disabled; interpreters are used instead\n");
+        return 0;
+    }
+
+    // Corpus, then nested chains deep enough to spill past the register
+    // slots (with pow calls in between), then file lines, then random
+    TextBuf exprs = { NULL, 0, 0, NULL };
+    for (size_t c = 0; c < sizeof(corpus) / sizeof(corpus[0]); c++) {
+        text_append(&exprs, corpus[c], strlen(corpus[c]));
+        text_putc(&exprs, '\n');
+    }
+    for (int chain = 14; chain <= 40; chain += 13) {
+        for (int i = 0; i < chain; i++) {
+            text_putc(&exprs, (char)('A' + i % 6));
+            text_append(&exprs, i % 5 == 4 ? "^(" : i % 2 ? "*(" : "+(", 2);
+        }
+        text_putc(&exprs, 'B');
+        for (int i = 0; i < chain; i++) text_putc(&exprs, ')');
+        text_putc(&exprs, '\n');
+    }
+    if (path) {
+        FILE* fp = fopen(path, "r");
+        if (fp == NULL) {
+            perror(path);
+            free(exprs.data);
+            return 2;
+        }
+        size_t len;
+        char* data = read_all(fp, &len);
+        fclose(fp);
+        text_append(&exprs, data, len);
+        text_putc(&exprs, '\n');
+        free(data);
+    }
+    for (long r = 0; r < count; r++) {
+        bench_random_expr(&exprs, 1 + (int)(bench_random() * 6), 6);
+        text_putc(&exprs, '\n');
+    }
+    text_putc(&exprs, '\0');
+
+    Program p, exact, relaxed;
+    RegProgram rp, relaxed_rp;
+    init_program(&p);
+    init_program(&exact);
+    init_program(&relaxed);
+    init_registers(&rp);
+    init_registers(&relaxed_rp);
+    long checked = 0, mismatches = 0, skipped = 0, opt_mismatches = 0, reg_mismatches = 0;
+    char* line = exprs.data;
+    while (*line) {
+        char* nl = strchr(line, '\n');
+        *nl = '\0';
+        const char* error_msg;
+        JitProgram jp, relaxed_jp;
+        ThreadedProgram relaxed_tp;
+        if (compile_infix(line, &p, &error_msg) && p.len > 0 && jit_compile(&p, &jp)) {
+            compile_infix(line, &exact, &error_msg);
+            compile_infix(line, &relaxed, &error_msg);
+            optimize_program(&exact, OPT_EXACT);
+            optimize_program(&relaxed, OPT_RELAXED);
+            jit_compile(&relaxed, &relaxed_jp);
+            thread_program(&relaxed, &relaxed_tp, 1);
+            lower_program(&p, &rp);
+            lower_program(&relaxed, &relaxed_rp);
+            for (int set = 0; set < 8; set++) {
+                double bindings[26];
+                for (int v = 0; v < p.nvars; v++) {
+                    bindings[v] = set < 4 ? specials[(int)(bench_random() * NSPECIALS)] : bench_random() * 20 - 10;
+                }
+                double expected, got, folded, r[3], lowered[2];
+                run_program(&p, bindings, &expected);
+                run_jit(&jp, bindings, &got);
+                run_program(&exact, bindings, &folded);
+                run_program(&relaxed, bindings, &r[0]);
+                run_threaded(&relaxed_tp, bindings, &r[1]);
+                run_jit(&relaxed_jp, bindings, &r[2]);
+                run_registers(&rp, bindings, &lowered[0]);
+                run_registers(&relaxed_rp, bindings, &lowered[1]);
+                checked++;
+                if (memcmp(&expected, &got, sizeof(double)) != 0) {
+                    if (mismatches++ < 10) printf("MISMATCH %s: interpreter %.17g, jit %.17g\n", line, expected, got);
+                }
+                // The threaded build lets the compiler commute operands, which
+                // can change which NaN propagates, so NaNs compare equal there
+                if (memcmp(&expected, &folded, sizeof(double)) != 0 ||
+                    !(memcmp(&r[0], &r[1], sizeof(double)) == 0 || (isnan(r[0]) && isnan(r[1]))) ||
+                    memcmp(&r[0], &r[2], sizeof(double)) != 0) {
+                    if (opt_mismatches++ < 10) {
+                        printf("OPTIMIZER MISMATCH %s: plain %.17g, exact %.17g, relaxed %.17g/%.17g/%.17g\n",
+                               line, expected, folded, r[0], r[1], r[2]);
+                    }
+                }
+                // Register code may see its operands commuted like the threaded build
+                if (!(memcmp(&expected, &lowered[0], sizeof(double)) == 0 || (isnan(expected) && isnan(lowered[0]))) ||
+                    !(memcmp(&r[0], &lowered[1], sizeof(double)) == 0 || (isnan(r[0]) && isnan(lowered[1])))) {
+                    if (reg_mismatches++ < 10) {
+                        printf("REGISTER MISMATCH %s: plain %.17g/%.17g, relaxed %.17g/%.17g\n",
+                               line, expected, lowered[0], r[0], lowered[1]);
+                    }
+                }
+            }
+            jit_free(&jp);
+            jit_free(&relaxed_jp);
+            free_threaded(&relaxed_tp);
+        } else if (*line) {
+            skipped++;
+        }
+        line = nl + 1;
+    }
+    printf("%ld evaluations compared, %ld mismatches, %ld optimizer mismatches, %ld register mismatches, "
+           "%ld lines not compiled\n", checked, mismatches, opt_mismatches, reg_mismatches, skipped);
+    free_program(&p);
+    free_program(&exact);
+    free_program(&relaxed);
+    free_registers(&rp);
+    free_registers(&relaxed_rp);
+    free(exprs.data);
+    return mismatches || opt_mismatches || reg_mismatches ? 1 : 0;
+}
+
+void bench_usage(void) {
+    fprintf(stderr,
+        "usage: stack_machine --bench columns [--rows N] [--expr INFIX]\n"
+        "       stack_machine --bench threads [--lines N] [--max-threads N]\n"
+        "       stack_machine --bench dispatch\n"
+        "       stack_machine --bench core [--count N] [--min-time SECONDS] [--format text|csv|json]\n"
+        "                                  [--size N] [--depth N] [--ops CHARS] [--vars N] [--parens P]\n"
+        "                                  [--seed N]\n"
+        "       stack_machine --bench lex [--count N] [--check N] [--min-time SECONDS] [corpus flags as core]\n"
+        "       stack_machine --bench lib [--count N] [corpus flags as core]\n"
+        "       stack_machine --bench kernels [--n N] [--min-time SECONDS]\n"
+        "       stack_machine --bench registers [--count N] [--min-time SECONDS] [--optimize]\n"
+        "                                       [corpus flags as core]\n"
+        "       stack_machine --bench sheet [--inputs N] [--formulas N] [--updates N] [--batch N]\n"
+        "       stack_machine --bench power [--count N] [--size N] [--ops CHARS] [--min-time SECONDS]\n");
+}
+
+long peak_rss_kb(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+typedef struct CoreResult {
+    const char* name;
+    long ops;
+    double ns_per_op;
+    double allocs_per_op;
+    double bytes_per_op;
+    double arena_per_op;    // thread_arena allocations (no malloc once warm)
+    long peak_rss_kb;
+} CoreResult;
+
+// State shared by the core routine benchmarks: a corpus of expressions in
+// both notations plus reusable buffers, as batch mode would hold them
+typedef struct CoreBench {
+    char** infix;
+    char** postfix;
+    char** numeric;         // postfix with variables replaced by constants
+    int count;
+    Program program;
+    TextBuf out;
+    ExprDag dag;
+    double bindings[26];
+    BatchOptions batch;     // binds A..Z to bindings, for core_batch_line
+    BatchWorker worker;
+    const char* var_names[26];
+    size_t var_name_len[26];
+    double sink;
+} CoreBench;
+
+// One pass over the routine; returns how many operations it performed
+long core_push_pop(CoreBench* b) {
+    Stack s;
+    init_stack(&s);
+    int error;
+    for (int round = 0; round < 1000; round++) {
+        for (int k = 0; k < 16; k++) push(&s, make_number(k));
+        for (int k = 0; k < 16; k++) b->sink += pop(&s, &error).as.num;
+    }
+    free_stack(&s);
+    return 16000;
+}
+
+long core_infix_to_postfix(CoreBench* b) {
+    InfixError err;
+    for (int e = 0; e < b->count; e++) {
+        b->out.len = 0;
+        infix_to_postfix(b->infix[e], strlen(b->infix[e]), &b->out, NULL, NULL, &err);
+    }
+    return b->count;
+}
+
+long core_evaluate_postfix(CoreBench* b) {
+    for (int e = 0; e < b->count; e++) {
+        double result = 0;
+        evaluate_postfix_numeric(b->numeric[e], &result);
+        b->sink += result;
+    }
+    return b->count;
+}
+
+long core_compiled_eval(CoreBench* b) {
+    const char* error_msg;
+    for (int e = 0; e < b->count; e++) {
+        double result = 0;
+        compile_infix(b->infix[e], &b->program, &error_msg);
+        run_program(&b->program, b->bindings, &result);
+        b->sink += result;
+    }
+    return b->count;
+}
+
+long core_postfix_to_infix(CoreBench* b) {
+    const char* error_msg;
+    for (int e = 0; e < b->count; e++) {
+        b->out.len = 0;
+        compile_postfix(b->postfix[e], &b->program, &error_msg, NULL);
+        program_to_infix(&b->program, &b->out, &b->dag);
+    }
+    return b->count;
+}
+
+// One input line of batch mode end to end, output discarded
+long core_batch_line(CoreBench* b) {
+    for (int e = 0; e < b->count; e++) {
+        b->out.len = 0;
+        batch_line(&b->batch, &b->worker, b->infix[e], strlen(b->infix[e]), &b->out);
+    }
+    return b->count;
+}
+
+// Repeat fn until min_time has passed (after one warm-up pass)
+CoreResult core_measure(const char* name, long (*fn)(CoreBench*), CoreBench* b, double min_time) {
+    CoreResult r;
+    fn(b);
+    unsigned long long calls = alloc_calls, bytes = alloc_bytes, arena = thread_arena.allocs;
+    long ops = 0;
+    double start = now_seconds(), elapsed;
+    do {
+        ops += fn(b);
+        elapsed = now_seconds() - start;
+    } while (elapsed < min_time);
+    r.name = name;
+    r.ops = ops;
+    r.ns_per_op = elapsed * 1e9 / ops;
+    r.allocs_per_op = (double)(alloc_calls - calls) / ops;
+    r.bytes_per_op = (double)(alloc_bytes - bytes) / ops;
+    r.arena_per_op = (double)(thread_arena.allocs - arena) / ops;
+    r.peak_rss_kb = peak_rss_kb();
+    return r;
+}
+
+// ns/op, allocations/op and peak RSS for the core routines over a
+// generated corpus, as text, csv or json
+int bench_core(int argc, char** argv) {
+    CorpusOptions opt;
+    default_corpus_options(&opt);
+    int count = 1000;
+    double min_time = 0.25;
+    const char* format = "text";
+    for (int a = 3; a < argc; a++) {
+        if (parse_corpus_flag(argc, argv, &a, &opt)) continue;
+        if (strcmp(argv[a], "--count") == 0 && a + 1 < argc) count = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--min-time") == 0 && a + 1 < argc) min_time = atof(argv[++a]);
+        else if (strcmp(argv[a], "--format") == 0 && a + 1 < argc) format = argv[++a];
+        else {
+            bench_usage();
+            return 2;
+        }
+    }
+    if (count < 1) count = 1;
+
+    CoreBench b;
+    memset(&b, 0, sizeof(b));
+    b.count = count;
+    b.infix = (char**)checked_realloc(NULL, (size_t)count * sizeof(char*));
+    b.postfix = (char**)checked_realloc(NULL, (size_t)count * sizeof(char*));
+    b.numeric = (char**)checked_realloc(NULL, (size_t)count * sizeof(char*));
+    init_program(&b.program);
+    static const char letters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    for (int v = 0; v < 26; v++) {
+        b.bindings[v] = 1.5 + v;
+        b.var_names[v] = letters + v;
+        b.var_name_len[v] = 1;
+    }
+    b.batch.var_names = b.var_names;
+    b.batch.var_name_len = b.var_name_len;
+    b.batch.var_values = b.bindings;
+    b.batch.nvars = 26;
+    init_batch_worker(&b.worker, &b.batch);
+
+    TextBuf t = { NULL, 0, 0, NULL };
+    double avg_len = 0;
+    for (int e = 0; e < count; e++) {
+        const char* error_msg;
+        t.len = 0;
+        gen_expression(&t, &opt);
+        text_putc(&t, '\0');
+        b.infix[e] = strdup(t.data);
+        avg_len += t.len - 1;
+
+        compile_infix(b.infix[e], &b.program, &error_msg);
+        t.len = 0;
+        program_to_postfix(&b.program, &t);
+        text_putc(&t, '\0');
+        b.postfix[e] = strdup(t.data);
+
+        for (int pc = 0; pc < b.program.len; pc++) {
+            if (b.program.code[pc].op == OP_LOAD_VAR) {
+                b.program.code[pc].op = OP_PUSH;
+                b.program.code[pc].arg = 0;
+                if (b.program.nconsts == 0) {
+                    b.program.consts = (double*)checked_realloc(b.program.consts, sizeof(double));
+                    b.program.consts_capacity = 1;
+                    b.program.nconsts = 1;
+                }
+                b.program.consts[0] = 3;
+            }
+        }
+        t.len = 0;
+        program_to_postfix(&b.program, &t);
+        text_putc(&t, '\0');
+        b.numeric[e] = strdup(t.data);
+    }
+    avg_len /= count;
+    free(t.data);
+
+    static const struct {
+        const char* name;
+        long (*fn)(CoreBench*);
+    } routines[] = {
+        { "push_pop", core_push_pop },
+        { "infix_to_postfix", core_infix_to_postfix },
+        { "evaluate_postfix_numeric", core_evaluate_postfix },
+        { "compile_and_run", core_compiled_eval },
+        { "postfix_to_infix", core_postfix_to_infix },
+        { "batch_line", core_batch_line },
+    };
+    enum { NROUTINES = sizeof(routines) / sizeof(routines[0]) };
+    CoreResult results[NROUTINES];
+    for (int r = 0; r < NROUTINES; r++) results[r] = core_measure(routines[r].name, routines[r].fn, &b, min_time);
+
+    if (strcmp(format, "json") == 0) {
+        printf("{\"corpus\": {\"count\": %d, \"size\": %d, \"max_depth\": %d, \"ops\": \"%s\", "
+               "\"vars\": %d, \"parens\": %g, \"avg_chars\": %.1f},\n \"results\": [\n",
+               count, opt.size, opt.max_depth, opt.ops, opt.nvars, opt.paren_density, avg_len);
+        for (int r = 0; r < NROUTINES; r++) {
+            printf("  {\"name\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.2f, \"allocs_per_op\": %.4f, "
+                   "\"bytes_per_op\": %.1f, \"arena_allocs_per_op\": %.4f, \"peak_rss_kb\": %ld}%s\n",
+                   results[r].name, results[r].ops, results[r].ns_per_op, results[r].allocs_per_op,
+                   results[r].bytes_per_op, results[r].arena_per_op, results[r].peak_rss_kb,
+                   r + 1 < NROUTINES ? "," : "");
+        }
+        printf(" ]}\n");
+    } else if (strcmp(format, "csv") == 0) {
+        printf("name,ops,ns_per_op,allocs_per_op,bytes_per_op,arena_allocs_per_op,peak_rss_kb,"
+               "size,max_depth,ops_mix,vars,parens\n");
+        for (int r = 0; r < NROUTINES; r++) {
+            printf("%s,%ld,%.2f,%.4f,%.1f,%.4f,%ld,%d,%d,%s,%d,%g\n", results[r].name, results[r].ops,
+                   results[r].ns_per_op, results[r].allocs_per_op, results[r].bytes_per_op,
+                   results[r].arena_per_op, results[r].peak_rss_kb, opt.size, opt.max_depth, opt.ops, opt.nvars, opt.paren_density);
+        }
+    } else {
+        printf("%d expressions, %d operands, depth <= %d, ops \"%s\", %d vars, parens %g, %.1f chars avg\n",
+               count, opt.size, opt.max_depth, opt.ops, opt.nvars, opt.paren_density, avg_len);
+        printf("%-26s %12s %12s %12s %12s %12s\n", "routine", "ns/op", "allocs/op", "bytes/op", "arena/op",
+               "peak RSS KB");
+        for (int r = 0; r < NROUTINES; r++) {
+            printf("%-26s %12.1f %12.4f %12.1f %12.4f %12ld\n", results[r].name, results[r].ns_per_op,
+                   results[r].allocs_per_op, results[r].bytes_per_op, results[r].arena_per_op,
+                   results[r].peak_rss_kb);
+        }
+    }
+    if (b.sink == 42.4242) printf(" ");
+
+    for (int e = 0; e < count; e++) {
+        free(b.infix[e]);
+        free(b.postfix[e]);
+        free(b.numeric[e]);
+    }
+    free(b.infix);
+    free(b.postfix);
+    free(b.numeric);
+    free_program(&b.program);
+    free(b.out.data);
+    dag_free(&b.dag);
+    long totals[TOTAL_COUNT] = { 0 };
+    free_batch_worker(&b.worker, totals);
+    return 0;
+}
+
+// Tokens in buf[0..len) the way the tokenizers used to find them: a ctype
+// call per byte
+long lex_count_ctype(const char* buf, size_t len) {
+    long tokens = 0;
+    size_t i = 0;
+    while (i < len) {
+        if (isspace((unsigned char)buf[i])) {
+            i++;
+            continue;
+        }
+        if (isalnum((unsigned char)buf[i]) || buf[i] == '.') {
+            while (i < len && (isalnum((unsigned char)buf[i]) || buf[i] == '.')) i++;
+        } else {
+            i++;
+        }
+        tokens++;
+    }
+    return tokens;
+}
+
+// The same count through the Lexer with the current classifier
+long lex_count(const char* buf, size_t len) {
+    long tokens = 0;
+    size_t start, end;
+    Lexer lx;
+    lex_init(&lx, buf, len);
+    while (lex_next(&lx, &start, &end) != TOKEN_END) tokens++;
+    return tokens;
+}
+
+// Random decimal literal: 1-25 significant digits, a decimal point
+// anywhere (or none) and sometimes an exponent reaching the subnormal and
+// overflow ranges
+void bench_random_literal(TextBuf* out) {
+    int ndigits = 1 + (int)(bench_random() * 25);
+    int point = (int)(bench_random() * (ndigits + 2)) - 1;
+    for (int d = 0; d < ndigits; d++) {
+        if (d == point) text_putc(out, '.');
+        text_putc(out, (char)('0' + (int)(bench_random() * 10)));
+    }
+    double kind = bench_random();
+    if (kind < 0.3) {
+        char buf[16];
+        int n = snprintf(buf, sizeof(buf), "e%d", (int)(bench_random() * 700) - 350);
+        text_append(out, buf, (size_t)n);
+    } else if (kind < 0.4) {
+        char buf[16];
+        int n = snprintf(buf, sizeof(buf), "e%d", (int)(bench_random() * 40) - 20);
+        text_append(out, buf, (size_t)n);
+    }
+}
+
+// Runs fn over the buffer until min_time has passed; returns seconds per run
+double lex_time(long (*fn)(const char*, size_t), const char* buf, size_t len, double min_time, long* result) {
+    long reps = 0;
+    double start = now_seconds(), elapsed;
+    do {
+        *result = fn(buf, len);
+        reps++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < min_time);
+    return elapsed / reps;
+}
+
+// Lexing throughput in GB/s (ctype loop, table classifier, SIMD
+// classifier) and number parsing in ns/literal (strtod, parse_number) over
+// a generated corpus, plus a bit-for-bit check of parse_number against
+// strtod on random literals. Returns 1 on any mismatch.
+int bench_lex(int argc, char** argv) {
+    CorpusOptions opt;
+    default_corpus_options(&opt);
+    long count = 20000, checks = 1000000;
+    double min_time = 0.25;
+    for (int a = 3; a < argc; a++) {
+        if (parse_corpus_flag(argc, argv, &a, &opt)) continue;
+        if (strcmp(argv[a], "--count") == 0 && a + 1 < argc) count = atol(argv[++a]);
+        else if (strcmp(argv[a], "--check") == 0 && a + 1 < argc) checks = atol(argv[++a]);
+        else if (strcmp(argv[a], "--min-time") == 0 && a + 1 < argc) min_time = atof(argv[++a]);
+        else {
+            bench_usage();
+            return 2;
+        }
+    }
+
+    TextBuf corpus = { NULL, 0, 0, NULL };
+    for (long l = 0; l < count; l++) {
+        gen_expression(&corpus, &opt);
+        text_putc(&corpus, '\n');
+    }
+    static const struct { const char* name; int force_scalar; } lexers[] = {
+        { "ctype loop", -1 }, { "lexer scalar", 1 }, { "lexer simd", 0 },
+    };
+    printf("%ld expressions, %.1f MB\n", count, corpus.len / 1e6);
+    printf("%-16s %10s %12s %10s\n", "lexer", "GB/s", "Mtokens/s", "tokens");
+    for (size_t k = 0; k < sizeof(lexers) / sizeof(lexers[0]); k++) {
+        long tokens;
+        double secs;
+        if (lexers[k].force_scalar < 0) {
+            secs = lex_time(lex_count_ctype, corpus.data, corpus.len, min_time, &tokens);
+        } else {
+            select_lexer(lexers[k].force_scalar);
+            secs = lex_time(lex_count, corpus.data, corpus.len, min_time, &tokens);
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%s%s%s", lexers[k].name, lexers[k].force_scalar == 0 ? " " : "",
+                 lexers[k].force_scalar == 0 ? lexer_isa : "");
+        printf("%-16s %10.2f %12.1f %10ld\n", name, corpus.len / secs / 1e9, tokens / secs / 1e6, tokens);
+    }
+    select_lexer(0);
+
+    // Literals separated by blanks, so strtod can read them in place too
+    TextBuf literals = { NULL, 0, 0, NULL };
+    long nliterals = checks > 0 ? checks : 1;
+    for (long n = 0; n < nliterals; n++) {
+        bench_random_literal(&literals);
+        text_putc(&literals, ' ');
+    }
+    text_putc(&literals, '\0');
+
+    long mismatches = 0;
+    double t_strtod = 0, t_parse = 0, sink = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        double start = now_seconds();
+        const char* p = literals.data;
+        for (long n = 0; n < nliterals; n++) {
+            const char* end = strchr(p, ' ');
+            double a, b;
+            if (pass == 0) {
+                a = strtod(p, NULL);
+                sink += a;
+            } else {
+                if (!parse_number(p, (size_t)(end - p), &b)) mismatches++;
+                sink += b;
+            }
+            p = end + 1;
+        }
+        if (pass == 0) t_strtod = now_seconds() - start;
+        else t_parse = now_seconds() - start;
+    }
+    for (const char* p = literals.data; *p; ) {
+        const char* end = strchr(p, ' ');
+        char* stop;
+        double a = strtod(p, &stop), b = 0;
+        if (!parse_number(p, (size_t)(end - p), &b) || memcmp(&a, &b, sizeof(a)) != 0) {
+            if (mismatches++ < 5) fprintf(stderr, "mismatch: %.*s strtod %.17g parse_number %.17g\n",
+                                          (int)(end - p), p, a, b);
+        }
+        p = end + 1;
+    }
+    printf("%-16s %10s %12s\n", "parser", "ns/number", "MB/s");
+    printf("%-16s %10.1f %12.1f\n", "strtod", t_strtod * 1e9 / nliterals, literals.len / t_strtod / 1e6);
+    printf("%-16s %10.1f %12.1f\n", "parse_number", t_parse * 1e9 / nliterals, literals.len / t_parse / 1e6);
+    printf("%ld literals checked against strtod, %ld mismatches\n", nliterals, mismatches);
+    if (sink == 42.4242) printf(" ");
+
+    free(corpus.data);
+    free(literals.data);
+    return mismatches ? 1 : 0;
+}
+
+// Startup cost of a formula set: compiling it from text, as every process
+// does without a library, against mapping a library of it and resolving
+// every program by name. The library was just written, so its pages are
+// in the page cache, as they are for every process after the first.
+int bench_lib(int argc, char** argv) {
+    CorpusOptions opt;
+    default_corpus_options(&opt);
+    long count = 100000;
+    for (int a = 3; a < argc; a++) {
+        if (parse_corpus_flag(argc, argv, &a, &opt)) continue;
+        if (strcmp(argv[a], "--count") == 0 && a + 1 < argc && atol(argv[a + 1]) > 0) count = atol(argv[++a]);
+        else {
+            bench_usage();
+            return 2;
+        }
+    }
+
+    TextBuf corpus = { NULL, 0, 0, NULL };
+    for (long l = 0; l < count; l++) {
+        char name[32];
+        int n = snprintf(name, sizeof(name), "f%ld = ", l);
+        text_append(&corpus, name, (size_t)n);
+        gen_expression(&corpus, &opt);
+        text_putc(&corpus, '\n');
+    }
+    char path[] = "/tmp/stack_machine_lib_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 2;
+    }
+    close(fd);
+
+    // From text: compile every line into its own Program
+    Program* programs = (Program*)checked_realloc(NULL, (size_t)count * sizeof(Program));
+    const char* error_msg;
+    double start = now_seconds();
+    size_t pos = 0;
+    for (long l = 0; l < count; l++) {
+        const char* line = corpus.data + pos;
+        size_t len = (size_t)((const char*)memchr(line, '\n', corpus.len - pos) - line);
+        size_t name_start, expr_start;
+        lib_line_name(line, len, &name_start, &expr_start);
+        init_program(&programs[l]);
+        compile_infix_span(line + expr_start, len - expr_start, &programs[l], &error_msg);
+        pos += len + 1;
+    }
+    double t_text = now_seconds() - start;
+
+    start = now_seconds();
+    LibWriter w;
+    lib_writer_init(&w);
+    for (long l = 0; l < count; l++) {
+        char name[32];
+        int n = snprintf(name, sizeof(name), "f%ld", l);
+        lib_add_program(&w, &programs[l], name, (size_t)n);
+    }
+    unsigned int duplicate;
+    int written = lib_write(&w, path, &error_msg, &duplicate);
+    double t_write = now_seconds() - start;
+    lib_writer_free(&w);
+    if (!written) {
+        perror(path);
+        return 2;
+    }
+
+    // From the library: map, check, and look every program up by name
+    Library lib;
+    long found = 0;
+    start = now_seconds();
+    if (!load_library(path, &lib, &error_msg)) {
+        fprintf(stderr, "%s: %s\n", path, error_msg);
+        return 2;
+    }
+    double t_load = now_seconds() - start;
+    for (long l = 0; l < count; l++) {
+        char name[32];
+        int n = snprintf(name, sizeof(name), "f%ld", l);
+        Program view;
+        int i = library_find(&lib, name, (size_t)n);
+        if (i >= 0) {
+            library_program(&lib, i, &view);
+            found += view.len > 0;
+        }
+    }
+    double t_lookup = now_seconds() - start;
+
+    // Both must compute the same values
+    long mismatches = 0;
+    double bindings[26];
+    for (int v = 0; v < 26; v++) bindings[v] = 1.5 + v;
+    for (long l = 0; l < count; l++) {
+        Program view;
+        double a, b, lib_bindings[26];
+        library_program(&lib, (int)l, &view);
+        for (int v = 0; v < programs[l].nvars; v++) {
+            lib_bindings[library_find_symbol(&lib, programs[l].vars[v])] = bindings[v];
+        }
+        run_program(&programs[l], bindings, &a);
+        run_program(&view, lib_bindings, &b);
+        if (memcmp(&a, &b, sizeof(a)) != 0) mismatches++;
+    }
+
+    printf("%ld formulas, %.1f MB of text, %.1f MB library\n", count, corpus.len / 1e6, lib.size / 1e6);
+    printf("%-28s %10s\n", "startup", "ms");
+    printf("%-28s %10.2f\n", "compile from text", t_text * 1e3);
+    printf("%-28s %10.2f\n", "load library", t_load * 1e3);
+    printf("%-28s %10.2f\n", "load library + find all", t_lookup * 1e3);
+    printf("%-28s %10.2f\n", "(write library)", t_write * 1e3);
+    printf("%ld of %ld found, %ld mismatches\n", found, count, mismatches);
+
+    free_library(&lib);
+    remove(path);
+    for (long l = 0; l < count; l++) free_program(&programs[l]);
+    free(programs);
+    free(corpus.data);
+    return mismatches || found != count ? 1 : 0;
+}
+
+// Looping kernels for --bench kernels, in the assembler's syntax
+const char* const bench_kernel_sources[] = {
+    // sum of memory[0..n)
+    "        push 0\n"
+    "        load n\n"
+    "loop:   dup\n"
+    "        jz done\n"
+    "        push 1\n"
+    "        sub\n"
+    "        dup\n"
+    "        load_idx\n"
+    "        rot\n"
+    "        add\n"
+    "        swap\n"
+    "        jmp loop\n"
+    "done:   pop\n",
+    // Horner's rule over the coefficients in memory[0..n)
+    "        push 0\n"
+    "        load n\n"
+    "loop:   dup\n"
+    "        jz done\n"
+    "        push 1\n"
+    "        sub\n"
+    "        swap\n"
+    "        load x\n"
+    "        mul\n"
+    "        over\n"
+    "        load_idx\n"
+    "        add\n"
+    "        swap\n"
+    "        jmp loop\n"
+    "done:   pop\n",
+    // square root of a by n Newton steps, each a CALL
+    "        load a\n"
+    "        load n\n"
+    "loop:   dup\n"
+    "        jz done\n"
+    "        push 1\n"
+    "        sub\n"
+    "        swap\n"
+    "        call step\n"
+    "        swap\n"
+    "        jmp loop\n"
+    "done:   pop\n"
+    "        ret\n"
+    "step:   dup\n"
+    "        load a\n"
+    "        swap\n"
+    "        div\n"
+    "        add\n"
+    "        push 0.5\n"
+    "        mul\n"
+    "        ret\n",
+};
+const char* const bench_kernel_names[] = { "array sum", "polynomial", "newton sqrt" };
+
+// One binary operation through the Stack API, as the menu's arithmetic
+// options perform it: pop both operands, check them, push the result
+void perop_binary(Stack* s, char op) {
+    int error;
+    Value a = pop(s, &error);
+    Value b = pop(s, &error);
+    if (a.type != VAL_NUM || b.type != VAL_NUM || (op == '/' && a.as.num == 0)) {
+        push(s, b);
+        push(s, a);
+        return;
+    }
+    double res = 0;
+    switch (op) {
+        case '+': res = b.as.num + a.as.num; break;
+        case '-': res = b.as.num - a.as.num; break;
+        case '*': res = b.as.num * a.as.num; break;
+        case '/': res = b.as.num / a.as.num; break;
+    }
+    push(s, make_number(res));
 }
 
-void handle_user_option(Stack* stack, int option, WINDOW* msg_win, WINDOW* stack_win, char* input, char* postfix) {
+// Kernel k driven from outside the machine: the loop is host code and
+// every arithmetic step is one Stack API operation
+double perop_kernel(int k, Stack* s, const double* memory, long n, double x, double a) {
     int error;
-    double res;
+    s->size = 0;
+    if (k == 0) {
+        push(s, make_number(0));
+        for (long i = n - 1; i >= 0; i--) {
+            push(s, make_number(memory[i]));
+            perop_binary(s, '+');
+        }
+    } else if (k == 1) {
+        push(s, make_number(0));
+        for (long i = n - 1; i >= 0; i--) {
+            push(s, make_number(x));
+            perop_binary(s, '*');
+            push(s, make_number(memory[i]));
+            perop_binary(s, '+');
+        }
+    } else {
+        push(s, make_number(a));
+        for (long i = 0; i < n; i++) {
+            Value g = peek(s, &error);
+            push(s, make_number(a));
+            push(s, g);
+            perop_binary(s, '/');
+            perop_binary(s, '+');
+            push(s, make_number(0.5));
+            perop_binary(s, '*');
+        }
+    }
+    return pop(s, &error).as.num;
+}
 
-    draw_msg_box(msg_win);
+// Looping kernels run three ways: driven per operation through the Stack
+// API, on the kernel interpreter with every slot in memory, and on
+// run_kernel with the top of the stack cached in a register
+int bench_kernels(int argc, char** argv) {
+    long n = 1000;
+    double min_time = 0.25;
+    for (int a = 3; a < argc; a++) {
+        if (strcmp(argv[a], "--n") == 0 && a + 1 < argc && atol(argv[a + 1]) > 0) n = atol(argv[++a]);
+        else if (strcmp(argv[a], "--min-time") == 0 && a + 1 < argc) min_time = atof(argv[++a]);
+        else {
+            bench_usage();
+            return 2;
+        }
+    }
 
-    switch(option) {
-        case 1: // Push Token (number or char)
-            werase(msg_win);
-            box(msg_win, 0, 0);
-            wattron(msg_win, COLOR_PAIR(3));
-            mvwprintw(msg_win, 1, 2, "Enter number or character token to push: ");
-            wattroff(msg_win, COLOR_PAIR(3));
-            wrefresh(msg_win);
+    double* memory = (double*)checked_realloc(NULL, (size_t)n * sizeof(double));
+    for (long i = 0; i < n; i++) memory[i] = bench_random() * 2 - 1;
+    double x = 0.999, a = 2;
+    Stack stack;
+    init_stack(&stack);
+    int status = 0;
 
-            wmove(msg_win, 2, 2);
-            wclrtoeol(msg_win);
-            wrefresh(msg_win);
+    printf("n = %ld; ns per loop iteration\n", n);
+    printf("%-12s %12s %12s %12s %10s\n", "kernel", "per-op", "vm memory", "vm cached", "vs per-op");
+    for (int k = 0; k < 3; k++) {
+        Program p;
+        KernelInfo info;
+        const char* error_msg;
+        int error_line, error_pc;
+        init_program(&p);
+        if (!assemble_kernel(bench_kernel_sources[k], strlen(bench_kernel_sources[k]), &p, &error_msg, &error_line) ||
+            !verify_kernel(&p, &info, &error_pc, &error_msg)) {
+            fprintf(stderr, "%s: %s\n", bench_kernel_names[k], error_msg);
+            return 2;
+        }
+        double bindings[3];
+        for (int v = 0; v < p.nvars; v++) {
+            char c = p.vars[v][0];
+            bindings[v] = c == 'n' ? (double)n : c == 'x' ? x : a;
+        }
 
-            echo();
-            wgetnstr(msg_win, input, 31);
-            noecho();
+        double ns[3], results[3];
+        for (int mode = 0; mode < 3; mode++) {
+            long runs = 0;
+            double start = now_seconds(), elapsed;
+            do {
+                if (mode == 0) results[mode] = perop_kernel(k, &stack, memory, n, x, a);
+                else if (mode == 1) run_kernel_uncached(&p, &info, bindings, memory, (size_t)n, LONG_MAX, &results[mode], &error_msg);
+                else run_kernel(&p, &info, bindings, memory, (size_t)n, LONG_MAX, &results[mode], &error_msg);
+                runs++;
+                elapsed = now_seconds() - start;
+            } while (elapsed < min_time);
+            ns[mode] = elapsed * 1e9 / runs / n;
+        }
+        int same = memcmp(&results[0], &results[1], sizeof(double)) == 0 &&
+                   memcmp(&results[0], &results[2], sizeof(double)) == 0;
+        printf("%-12s %12.2f %12.2f %12.2f %9.1fx%s\n", bench_kernel_names[k], ns[0], ns[1], ns[2],
+               ns[0] / ns[2], same ? "" : "  RESULTS DIFFER");
+        if (!same) status = 1;
+        free_program(&p);
+    }
+    free_stack(&stack);
+    free(memory);
+    return status;
+}
 
-            if (strlen(input) == 0) {
-                wattron(msg_win, COLOR_PAIR(4));
-                print_centered(msg_win, 3, "Empty input! Nothing pushed.", 4);
-                wattroff(msg_win, COLOR_PAIR(4));
-                wrefresh(msg_win);
-                break;
-            }
+// Incremental recalculation against evaluating every formula, on a
+// generated sheet: each formula reads two to four inputs or recent
+// formulas, so a change to one input reaches a local part of the graph
+int bench_sheet(int argc, char** argv) {
+    int ninputs = 300, nformulas = 5000, batch = 1;
+    long nupdates = 2000;
+    for (int a = 3; a < argc; a++) {
+        if (strcmp(argv[a], "--inputs") == 0 && a + 1 < argc && atoi(argv[a + 1]) > 0) ninputs = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--formulas") == 0 && a + 1 < argc && atoi(argv[a + 1]) > 0) nformulas = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--updates") == 0 && a + 1 < argc && atol(argv[a + 1]) > 0) nupdates = atol(argv[++a]);
+        else if (strcmp(argv[a], "--batch") == 0 && a + 1 < argc && atoi(argv[a + 1]) > 0) batch = atoi(argv[++a]);
+        else {
+            bench_usage();
+            return 2;
+        }
+    }
 
-            int valid = 1;
-            for (int i = 0; input[i]; i++) {
-                if (!isalnum(input[i]) && input[i] != '.') {
-                    valid = 0;
-                    break;
-                }
-            }
-            if (!valid) {
-                wattron(msg_win, COLOR_PAIR(4));
-                print_centered(msg_win, 3, "Invalid token! Use alphanumeric chars only.", 4);
-                wattroff(msg_win, COLOR_PAIR(4));
-                wrefresh(msg_win);
-                break;
-            }
+    static const char ops[] = "+-*/";
+    TextBuf text = { NULL, 0, 0, NULL };
+    for (int f = 0; f < nformulas; f++) {
+        char buf[64];
+        int n = snprintf(buf, sizeof(buf), "f%d =", f);
+        text_append(&text, buf, (size_t)n);
+        int operands = 2 + (int)(bench_random() * 3);
+        for (int k = 0; k < operands; k++) {
+            if (k > 0) text_putc(&text, ops[(int)(bench_random() * 4)]);
+            if (f < 8 || bench_random() < 0.3) n = snprintf(buf, sizeof(buf), " x%d", (int)(bench_random() * ninputs));
+            else n = snprintf(buf, sizeof(buf), " f%d", f - 1 - (int)(bench_random() * (f < 64 ? f : 64)));
+            text_append(&text, buf, (size_t)n);
+        }
+        text_putc(&text, '\n');
+    }
 
-            push(stack, input);
-            wattron(msg_win, COLOR_PAIR(3));
-            mvwprintw(msg_win, 3, 2, "Successfully pushed: %s", input);
-            wattroff(msg_win, COLOR_PAIR(3));
-            wrefresh(msg_win);
-            break;
+    Sheet s;
+    init_sheet(&s);
+    double start = now_seconds();
+    sheet_load(&s, text.data, text.len, OPT_NONE, "bench");
+    double t_load = now_seconds() - start;
+    free(text.data);
+    int* inputs = (int*)checked_realloc(NULL, (size_t)s.count * sizeof(int));
+    int ninput_nodes = 0;
+    for (int i = 0; i < s.count; i++) {
+        if (!s.nodes[i].formula) {
+            inputs[ninput_nodes++] = i;
+            sheet_set(&s, i, 1 + bench_random());
+        }
+    }
+    sheet_recalculate(&s);
 
-        case 2: // Pop Token
-            {
-                char* val = pop(stack, &error);
-                if (error) {
-                    wattron(msg_win, COLOR_PAIR(4));
-                    print_centered(msg_win, 2, "Stack is empty. Cannot pop.", 4);
-                    wattroff(msg_win, COLOR_PAIR(4));
-                } else {
-                    wattron(msg_win, COLOR_PAIR(3));
-                    mvwprintw(msg_win, 2, 2, "Popped from stack: %s", val);
-                    wattroff(msg_win, COLOR_PAIR(3));
-                }
-                wrefresh(msg_win);
-                if(val) free(val);
-            }
-            break;
+    long recomputed = 0;
+    start = now_seconds();
+    for (long u = 0; u < nupdates; u++) {
+        for (int b = 0; b < batch; b++) {
+            sheet_set(&s, inputs[(int)(bench_random() * ninput_nodes)], 1 + bench_random());
+        }
+        recomputed += sheet_recalculate(&s);
+    }
+    double t_incremental = (now_seconds() - start) / nupdates;
 
-        case 3: // Add (Top two)
-        case 4: // Subtract (Top two)
-        case 5: // Multiply (Top two)
-        case 6: // Divide (Top two)
-            {
-                if (stack->size < 2) {
-                    wattron(msg_win, COLOR_PAIR(4));
-                    print_centered(msg_win, 2, "Need at least 2 elements in stack!", 4);
-                    wattroff(msg_win, COLOR_PAIR(4));
-                    wrefresh(msg_win);
-                    break;
-                }
-                char* a = pop(stack, &error);
-                char* b = pop(stack, &error);
-                if (error) {
-                    wattron(msg_win, COLOR_PAIR(4));
-                    print_centered(msg_win, 2, "Error performing operation.", 4);
-                    wattroff(msg_win, COLOR_PAIR(4));
-                    wrefresh(msg_win);
-                    if(a) free(a);
-                    if(b) free(b);
-                    break;
-                }
-                double valA = atof(a);
-                double valB = atof(b);
-                int aIsNum = (strlen(a) > 0 && (isdigit(a[0]) || a[0] == '.'));
-                int bIsNum = (strlen(b) > 0 && (isdigit(b[0]) || b[0] == '.'));
+    double* values = (double*)checked_realloc(NULL, (size_t)s.count * sizeof(double));
+    for (int i = 0; i < s.count; i++) values[i] = s.nodes[i].value;
+    long full_runs = 0;
+    start = now_seconds();
+    do {
+        sheet_recalculate_all(&s);
+        full_runs++;
+    } while (now_seconds() - start < 0.2);
+    double t_full = (now_seconds() - start) / full_runs;
+    int same = 1;
+    for (int i = 0; i < s.count; i++) {
+        if (memcmp(&values[i], &s.nodes[i].value, sizeof(double)) != 0) same = 0;
+    }
 
-                if (!aIsNum || !bIsNum) {
-                    char resStr[64];
-                    switch(option) {
-                        case 3: snprintf(resStr, sizeof(resStr), "(%s+%s)", b, a); break;
-                        case 4: snprintf(resStr, sizeof(resStr), "(%s-%s)", b, a); break;
-                        case 5: snprintf(resStr, sizeof(resStr), "(%s*%s)", b, a); break;
-                        case 6: snprintf(resStr, sizeof(resStr), "(%s/%s)", b, a); break;
-                        default: strcpy(resStr, "UNK"); break;
-                    }
-                    push(stack, resStr);
-                    wattron(msg_win, COLOR_PAIR(3));
-                    mvwprintw(msg_win, 2, 2, "Symbolic operation result: %s", resStr);
-                    wattroff(msg_win, COLOR_PAIR(3));
-                } else {
-                    double res = 0;
-                    switch(option) {
-                        case 3: res = valB + valA; break;
-                        case 4: res = valB - valA; break;
-                        case 5: res = valB * valA; break;
-                        case 6:
-                            if(valA == 0) {
-                                wattron(msg_win, COLOR_PAIR(4));
-                                print_centered(msg_win, 2, "Error: Division by zero!", 4);
-                                wattroff(msg_win, COLOR_PAIR(4));
-                                push(stack, b);
-                                push(stack, a);
-                                free(a); free(b);
-                                wrefresh(msg_win);
-                                return;
-                            }
-                            res = valB / valA;
-                            break;
-                    }
-                    char buf[32];
-                    snprintf(buf, sizeof(buf), "%.2lf", res);
-                    push(stack, buf);
-                    wattron(msg_win, COLOR_PAIR(3));
-                    mvwprintw(msg_win, 2, 2, "Operation result: %.2lf", res);
-                    wattroff(msg_win, COLOR_PAIR(3));
-                }
-                free(a); free(b);
-                wrefresh(msg_win);
+    printf("%d formulas over %d inputs, %d input%s changed per update, built in %.1f ms\n", s.nformulas,
+           ninput_nodes, batch, batch == 1 ? "" : "s", t_load * 1e3);
+    printf("%-12s %12s %14s\n", "", "us/update", "formulas run");
+    printf("%-12s %12.2f %14d\n", "full", t_full * 1e6, s.nranked);
+    printf("%-12s %12.2f %14.1f\n", "incremental", t_incremental * 1e6, (double)recomputed / nupdates);
+    printf("speedup %.1fx%s\n", t_full / t_incremental, same ? "" : "  RESULTS DIFFER");
+    free(values);
+    free(inputs);
+    free_sheet(&s);
+    return same ? 0 : 1;
+}
+
+// Stack tier against register tier over a generated corpus: instructions
+// dispatched per expression and time per evaluation for run_program, the
+// fused threaded code and run_registers
+int bench_registers(int argc, char** argv) {
+    CorpusOptions opt;
+    default_corpus_options(&opt);
+    long count = 10000;
+    double min_time = 0.5;
+    int opt_level = OPT_NONE;
+    for (int a = 3; a < argc; a++) {
+        if (parse_corpus_flag(argc, argv, &a, &opt)) continue;
+        if (strcmp(argv[a], "--count") == 0 && a + 1 < argc && atol(argv[a + 1]) > 0) count = atol(argv[++a]);
+        else if (strcmp(argv[a], "--min-time") == 0 && a + 1 < argc) min_time = atof(argv[++a]);
+        else if (strcmp(argv[a], "--optimize") == 0) opt_level = OPT_EXACT;
+        else {
+            bench_usage();
+            return 2;
+        }
+    }
+
+    Program* programs = (Program*)checked_realloc(NULL, (size_t)count * sizeof(Program));
+    ThreadedProgram* threaded = (ThreadedProgram*)checked_realloc(NULL, (size_t)count * sizeof(ThreadedProgram));
+    RegProgram* lowered = (RegProgram*)checked_realloc(NULL, (size_t)count * sizeof(RegProgram));
+    double* bindings = (double*)checked_realloc(NULL, (size_t)opt.nvars * sizeof(double) + 1);
+    for (int v = 0; v < opt.nvars; v++) bindings[v] = 1 + bench_random();
+    TextBuf expr = { NULL, 0, 0, NULL };
+    long stack_ops = 0, reg_ops = 0, n = 0;
+    while (n < count) {
+        const char* error_msg;
+        expr.len = 0;
+        gen_expression(&expr, &opt);
+        text_putc(&expr, '\0');
+        init_program(&programs[n]);
+        init_registers(&lowered[n]);
+        if (!compile_infix(expr.data, &programs[n], &error_msg) || programs[n].len == 0) {
+            free_program(&programs[n]);
+            continue;
+        }
+        optimize_program(&programs[n], opt_level);
+        thread_program(&programs[n], &threaded[n], 1);
+        lower_program(&programs[n], &lowered[n]);
+        stack_ops += programs[n].len;
+        reg_ops += lowered[n].len;
+        n++;
+    }
+    free(expr.data);
+
+    static const char* const names[3] = { "stack", "threaded", "registers" };
+    double ns[3], sums[3];
+    for (int mode = 0; mode < 3; mode++) {
+        long runs = 0;
+        double start = now_seconds(), elapsed, value;
+        do {
+            sums[mode] = 0;
+            for (long i = 0; i < count; i++) {
+                if (mode == 0) run_program(&programs[i], bindings, &value);
+                else if (mode == 1) run_threaded(&threaded[i], bindings, &value);
+                else run_registers(&lowered[i], bindings, &value);
+                sums[mode] += value;
             }
-            break;
+            runs++;
+            elapsed = now_seconds() - start;
+        } while (elapsed < min_time);
+        ns[mode] = elapsed * 1e9 / runs / count;
+    }
 
-        case 7: // Infix to Postfix Conversion with stepwise trace
-            werase(msg_win);
-            box(msg_win, 0, 0);
-            wattron(msg_win, COLOR_PAIR(3));
-            mvwprintw(msg_win, 1, 2, "Enter infix expression (e.g. A+B*C): ");
-            wattroff(msg_win, COLOR_PAIR(3));
-            wrefresh(msg_win);
+    printf("%ld expressions, %.1f stack and %.1f register instructions each (%.1f%% fewer)\n", count,
+           (double)stack_ops / count, (double)reg_ops / count, 100.0 * (stack_ops - reg_ops) / stack_ops);
+    printf("%-10s %12s %8s\n", "tier", "ns/eval", "speedup");
+    for (int mode = 0; mode < 3; mode++) printf("%-10s %12.1f %7.2fx\n", names[mode], ns[mode], ns[0] / ns[mode]);
+    int same = memcmp(&sums[0], &sums[2], sizeof(double)) == 0 || (isnan(sums[0]) && isnan(sums[2]));
+    if (!same) printf("RESULTS DIFFER: stack %.17g, registers %.17g\n", sums[0], sums[2]);
 
-            wmove(msg_win, 2, 2);
-            wclrtoeol(msg_win);
-            wrefresh(msg_win);
+    for (long i = 0; i < count; i++) {
+        free_program(&programs[i]);
+        free_threaded(&threaded[i]);
+        free_registers(&lowered[i]);
+    }
+    free(programs);
+    free(threaded);
+    free(lowered);
+    free(bindings);
+    return same ? 0 : 1;
+}
 
-            echo();
-            wgetnstr(msg_win, input, 255);
-            noecho();
+// Time libm pow against power on n operand pairs; ns per call in ns[0..1]
+int bench_pow_pair(const double* a, const double* b, long n, double min_time, double* ns) {
+    double sums[2];
+    for (int mode = 0; mode < 2; mode++) {
+        long runs = 0;
+        double start = now_seconds(), elapsed;
+        do {
+            sums[mode] = 0;
+            for (long i = 0; i < n; i++) sums[mode] += mode == 0 ? pow(a[i], b[i]) : power(a[i], b[i]);
+            runs++;
+            elapsed = now_seconds() - start;
+        } while (elapsed < min_time);
+        ns[mode] = elapsed * 1e9 / runs / n;
+    }
+    return memcmp(&sums[0], &sums[1], sizeof(double)) == 0 || (isnan(sums[0]) && isnan(sums[1]));
+}
 
-            werase(msg_win);
-            wrefresh(msg_win);
-            infix_to_postfix_stepwise(input, msg_win);
-            break;
+// Random postfix over integer literals, left-deep: a b op c op ...; powers
+// take an exponent of 0..4 so a few stay in range
+void bench_integer_postfix(TextBuf* out, int size, const char* ops) {
+    text_number(out, 1 + (int)(bench_random() * 99));
+    for (int k = 1; k < size; k++) {
+        char op = ops[(int)(bench_random() * strlen(ops))];
+        text_putc(out, ' ');
+        text_number(out, op == '^' ? (int)(bench_random() * 5) : 1 + (int)(bench_random() * 99));
+        text_putc(out, ' ');
+        text_putc(out, op);
+    }
+}
 
-        case 8: // Evaluate Postfix Numeric Only
-            werase(msg_win);
-            box(msg_win, 0, 0);
-            wattron(msg_win, COLOR_PAIR(3));
-            mvwprintw(msg_win, 1, 2, "Enter postfix expression (numbers only): ");
-            wattroff(msg_win, COLOR_PAIR(3));
-            wrefresh(msg_win);
+int bench_power(int argc, char** argv) {
+    long count = 10000;
+    int size = 8;
+    double min_time = 0.25;
+    const char* ops = "+-*^";
+    for (int a = 3; a < argc; a++) {
+        if (strcmp(argv[a], "--count") == 0 && a + 1 < argc && atol(argv[a + 1]) > 0) count = atol(argv[++a]);
+        else if (strcmp(argv[a], "--size") == 0 && a + 1 < argc && atoi(argv[a + 1]) > 0) size = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--ops") == 0 && a + 1 < argc) ops = argv[++a];
+        else if (strcmp(argv[a], "--min-time") == 0 && a + 1 < argc) min_time = atof(argv[++a]);
+        else {
+            bench_usage();
+            return 2;
+        }
+    }
+    int status = 0;
 
-            wmove(msg_win, 2, 2);
-            wclrtoeol(msg_win);
-            wrefresh(msg_win);
+    // power must give pow's bits wherever it takes the integer path
+    long compared = 0, differ = 0;
+    for (int base = -1000; base <= 1000; base++) {
+        for (int exp = 0; exp <= 64; exp++, compared++) {
+            double x = pow(base, exp), y = power(base, exp);
+            if (memcmp(&x, &y, sizeof(double)) != 0) differ++;
+        }
+    }
+    printf("power vs pow: %ld integer pairs compared, %ld differ\n", compared, differ);
+    if (differ) status = 1;
 
-            echo();
-            wgetnstr(msg_win, input, 255);
-            noecho();
+    enum { PAIRS = 4096 };
+    double a[PAIRS], b[PAIRS], ns[2];
+    printf("%-22s %10s %10s %8s\n", "operands", "pow ns", "power ns", "speedup");
+    for (int kind = 0; kind < 2; kind++) {
+        for (int i = 0; i < PAIRS; i++) {
+            a[i] = kind == 0 ? 2 + (int)(bench_random() * 98) : 0.5 + bench_random() * 10;
+            b[i] = kind == 0 ? (int)(bench_random() * 6) : bench_random() * 4;
+        }
+        int same = bench_pow_pair(a, b, PAIRS, min_time, ns);
+        printf("%-22s %10.1f %10.1f %7.2fx%s\n", kind == 0 ? "integer (2..99)^(0..5)" : "fractional", ns[0], ns[1],
+               ns[0] / ns[1], same ? "" : "  RESULTS DIFFER");
+        if (!same) status = 1;
+    }
 
-            double eval_res;
-            if (evaluate_postfix_numeric(input, &eval_res)) {
-                wattron(msg_win, COLOR_PAIR(3));
-                mvwprintw(msg_win, 3, 2, "Evaluation result: %.2lf", eval_res);
-                wattroff(msg_win, COLOR_PAIR(3));
-            } else {
-                wattron(msg_win, COLOR_PAIR(4));
-                print_centered(msg_win, 3, "Invalid expression or contains variables.", 4);
-                wattroff(msg_win, COLOR_PAIR(4));
-            }
-            wrefresh(msg_win);
-            break;
+    // Integer corpus: exact evaluation against compiled double evaluation
+    char** exprs = (char**)checked_realloc(NULL, (size_t)count * sizeof(char*));
+    TextBuf t = { NULL, 0, 0, NULL };
+    for (long e = 0; e < count; e++) {
+        t.len = 0;
+        bench_integer_postfix(&t, size, ops);
+        text_putc(&t, '\0');
+        exprs[e] = strdup(t.data);
+    }
+    free(t.data);
+    long integers = 0, inexact = 0, failed = 0;
+    Program p;
+    init_program(&p);
+    for (long e = 0; e < count; e++) {
+        ExactNum num;
+        double value;
+        const char* error_msg;
+        if (!evaluate_postfix_exact(exprs[e], &num)) {
+            failed++;
+            continue;
+        }
+        if (!num.is_int) continue;
+        integers++;
+        if (compile_postfix(exprs[e], &p, &error_msg, NULL) && run_program(&p, NULL, &value) &&
+            (isnan(value) || fabs(value) >= 0x1p63 || (long long)value != num.i)) inexact++;
+    }
+    free_program(&p);
+    long runs = 0;
+    double start = now_seconds(), elapsed;
+    volatile double sink = 0;
+    do {
+        for (long e = 0; e < count; e++) {
+            double value = 0;
+            evaluate_postfix_numeric(exprs[e], &value);
+            sink = value;
+        }
+        runs++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < min_time);
+    (void)sink;
+    printf("integer corpus: %ld expressions of %d operands (%s): %ld exact integers, %ld promoted to double, "
+           "%ld failed\n", count, size, ops, integers, count - integers - failed, failed);
+    printf("  %ld of the integers come out different in double arithmetic; %.1f ns per exact evaluation\n",
+           inexact, elapsed * 1e9 / runs / count);
+    for (long e = 0; e < count; e++) free(exprs[e]);
+    free(exprs);
+    return status;
+}
 
-        case 9: // Postfix to Infix Stepwise
-            postfix_to_infix_stepwise(msg_win);
-            break;
+int run_bench(int argc, char** argv) {
+    const char* which = argc > 2 ? argv[2] : "";
+    if (strcmp(which, "core") == 0) return bench_core(argc, argv);
+    if (strcmp(which, "lex") == 0) return bench_lex(argc, argv);
+    if (strcmp(which, "lib") == 0) return bench_lib(argc, argv);
+    if (strcmp(which, "kernels") == 0) return bench_kernels(argc, argv);
+    if (strcmp(which, "registers") == 0) return bench_registers(argc, argv);
+    if (strcmp(which, "sheet") == 0) return bench_sheet(argc, argv);
+    if (strcmp(which, "power") == 0) return bench_power(argc, argv);
+    const char* expr = "A*B+C/(A+1)-B*B";
+    size_t rows = 1000000;
+    long lines = 4000000;
+    int max_threads = 16;
 
-        case 10: // Exit
-            endwin();
-            exit(0);
+    for (int a = 3; a + 1 < argc; a += 2) {
+        if (strcmp(argv[a], "--rows") == 0) rows = (size_t)atol(argv[a + 1]);
+        else if (strcmp(argv[a], "--expr") == 0) expr = argv[a + 1];
+        else if (strcmp(argv[a], "--lines") == 0) lines = atol(argv[a + 1]);
+        else if (strcmp(argv[a], "--max-threads") == 0) max_threads = atoi(argv[a + 1]);
+    }
 
-        default:
-            wattron(msg_win, COLOR_PAIR(4));
-            print_centered(msg_win, 2, "Invalid option! Select (1-10).", 4);
-            wattroff(msg_win, COLOR_PAIR(4));
-            wrefresh(msg_win);
-            break;
+    if (strcmp(which, "columns") == 0) {
+        printf("expression: %s, %zu rows\n", expr, rows);
+        return bench_columns(expr, rows);
     }
-    display_stack(stack, stack_win, 1, 2);
-    wrefresh(msg_win);
+    if (strcmp(which, "threads") == 0) {
+        return bench_threads(lines, max_threads);
+    }
+    if (strcmp(which, "dispatch") == 0) {
+        return bench_dispatch();
+    }
+    bench_usage();
+    return 2;
 }
 
-int main() {
+void trace_usage(void) {
+    fprintf(stderr,
+        "usage: stack_machine --trace-dump [--postfix] [--events N] [file]\n"
+        "       stack_machine --replay [--postfix] [--events N] [file]\n"
+        "  Converts the expression on the first line of file (default stdin), infix\n"
+        "  to postfix or, with --postfix, postfix to infix, recording every step.\n"
+        "  --trace-dump prints the steps as text; --replay steps through them in the\n"
+        "  TUI. --events keeps only the last N steps (default %d).\n", TRACE_DEFAULT_EVENTS);
+}
+
+// ncurses setup shared by the menu and the trace viewer; exits if the
+// terminal has no colors
+void start_tui(void) {
     initscr();
+    tui_active = 1;
     cbreak();
     noecho();
     keypad(stdscr, TRUE);
@@ -819,6 +8506,119 @@ int main() {
     init_pair(5, COLOR_MAGENTA, COLOR_BLACK); // Section titles
     init_pair(6, COLOR_BLUE, COLOR_BLACK);    // Top stack element highlight
     init_pair(8, COLOR_BLACK, COLOR_GREEN);   // Alternate stack rows
+}
+
+// --trace-dump and --replay: record a conversion trace of one expression
+// from a file, then dump it as text or open the viewer on it. Unlike the
+// menu, the input has no length limit.
+int run_trace(int argc, char** argv) {
+    int replay = strcmp(argv[1], "--replay") == 0;
+    int postfix = 0;
+    unsigned int events = TRACE_DEFAULT_EVENTS;
+    const char* path = NULL;
+    for (int a = 2; a < argc; a++) {
+        if (strcmp(argv[a], "--postfix") == 0) postfix = 1;
+        else if (strcmp(argv[a], "--events") == 0 && a + 1 < argc) events = (unsigned int)atol(argv[++a]);
+        else if (argv[a][0] == '-' && argv[a][1] != '\0') {
+            trace_usage();
+            return 2;
+        } else path = argv[a];
+    }
+
+    FILE* in = stdin;
+    if (path && strcmp(path, "-") != 0) {
+        in = fopen(path, "r");
+        if (in == NULL) {
+            perror(path);
+            return 2;
+        }
+    }
+    size_t len;
+    char* src = read_all(in, &len);
+    if (in != stdin) fclose(in);
+    char* newline = memchr(src, '\n', len);
+    if (newline) len = (size_t)(newline - src);
+    if (len > 0 && src[len - 1] == '\r') len--;
+    if (len > 0xffffffffu) {
+        fprintf(stderr, "expression too long to trace\n");
+        free(src);
+        return 2;
+    }
+    src[len] = '\0';
+
+    Trace trace;
+    TextBuf out = { NULL, 0, 0, NULL };
+    ExprDag dag;
+    memset(&dag, 0, sizeof(dag));
+    trace_init(&trace, events, postfix, src, len);
+    trace.out = &out;
+    trace.dag = &dag;
+    int ok;
+    if (postfix) {
+        Value result;
+        size_t err_pos;
+        ok = postfix_to_expr(src, len, &dag, &trace, &result, &err_pos);
+        if (ok) render_value(&dag, result, NULL, &out, (size_t)-1);
+        else if (err_pos < len) fprintf(stderr, "error: insufficient operands at column %zu\n", err_pos + 1);
+        else fprintf(stderr, "error: stack does not end with exactly one value\n");
+    } else {
+        InfixError err;
+        ok = infix_to_postfix(src, len, &out, trace_infix_step, &trace, &err);
+        if (!ok) fprintf(stderr, "error: %s at column %zu\n", infix_status_text(err.status), err.pos + 1);
+    }
+
+    if (postfix && !ok) {
+        // rejected by verification before any step was recorded
+    } else if (replay) {
+        start_tui();
+        WINDOW* win = newwin(LINES - 2, COLS - 2, 1, 1);
+        replay_trace(&trace, win, postfix ? " Postfix to Infix Trace " : " Infix to Postfix Trace ");
+        delwin(win);
+        endwin();
+        tui_active = 0;
+    } else {
+        dump_trace(&trace, stdout);
+    }
+    if (ok) printf("%.*s\n", (int)out.len, out.data);
+
+    trace_free(&trace);
+    dag_free(&dag);
+    free(out.data);
+    free(src);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    select_lexer(0);
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+        return run_batch(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        return run_bench(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--gen-corpus") == 0) {
+        return run_gen_corpus(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--jit-check") == 0) {
+        return run_jit_check(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--sheet") == 0) {
+        return run_sheet(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--compile-lib") == 0) {
+        return run_compile_lib(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--run-lib") == 0) {
+        return run_lib(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--run-asm") == 0) {
+        return run_asm(argc, argv);
+    }
+    if (argc > 1 && (strcmp(argv[1], "--trace-dump") == 0 || strcmp(argv[1], "--replay") == 0)) {
+        return run_trace(argc, argv);
+    }
+
+    start_tui();
 
     Stack stack;
     init_stack(&stack);
@@ -826,36 +8626,43 @@ int main() {
     char input[256], postfix[256];
 
     // Windows sizes setup
-    int menu_height = 17, menu_width = 45;
-    int stack_height = 17, stack_width = 27;
+    int menu_height = 18, menu_width = 45;
+    int stack_height = 18, stack_width = 27;
     int msg_height = 16, msg_width = 74;
 
     WINDOW* menu_win = newwin(menu_height, menu_width, 1, 1);
     WINDOW* stack_win = newwin(stack_height, stack_width, 1, menu_width + 2);
     WINDOW* msg_win = newwin(msg_height, msg_width, menu_height + 2, 1);
+    StackView view;
+    init_stack_view(&view, stack_win);
+    keypad(menu_win, TRUE);
+    draw_menu(menu_win);
 
+    // The menu is static: only the prompt and the stack view are redrawn
     while (1) {
-        draw_menu(menu_win);
-        display_stack(&stack, stack_win, 1, 2);
-
-        wmove(menu_win, 15, 22);
-        wclrtoeol(menu_win);
-        wrefresh(menu_win);
-        int option = wgetch(menu_win) - '0';
+        stack_view_draw(&view, &stack);
+        mvwhline(menu_win, 16, 22, ' ', menu_width - 23);
+        wmove(menu_win, 16, 22);
+        wnoutrefresh(menu_win);
+        doupdate();
+        int c = wgetch(menu_win);
+        if (stack_view_key(&view, c)) continue;
+        int option = c - '0';
 
-        // Support two digit input for 10
+        // Support two digit input for 10 and up
         if (option == 1) {
             int c2 = wgetch(menu_win);
-            if (c2 == '0') {
-                option = 10;
+            if (c2 >= '0' && c2 <= '0' + MENU_OPTIONS - 10) {
+                option = 10 + (c2 - '0');
             } else {
                 ungetch(c2);
             }
         }
 
-        handle_user_option(&stack, option, msg_win, stack_win, input, postfix);
+        handle_user_option(&stack, option, msg_win, &view, input, postfix);
     }
 
+    free_stack_view(&view);
     endwin();
     return 0;
 }